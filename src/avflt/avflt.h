@@ -35,41 +35,178 @@
 #endif
 #include <linux/fs.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/idr.h>
+#include <linux/hash.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/ctype.h>
+#include <linux/xattr.h>
 #include <redirfs.h>
 
 #define AVFLT_VERSION	"0.6"
 
 #define AVFLT_EVENT_OPEN	1
 #define AVFLT_EVENT_CLOSE	2
+#define AVFLT_EVENT_MAX		AVFLT_EVENT_CLOSE
+
+/*
+ * Requests are scheduled by class: opens by interactive tasks go first,
+ * opens by nice'd tasks or of huge files and closes follow. Each class gets
+ * weight requests per round and a request older than age ms is taken
+ * regardless of its class.
+ */
+#define AVFLT_CLASS_OPEN	0
+#define AVFLT_CLASS_BULK	1
+#define AVFLT_CLASS_CLOSE	2
+#define AVFLT_CLASS_NR		3
+
+/*
+ * What happens to a request when the queue is over its high-water mark or
+ * the estimated wait exceeds the reply timeout. With block the request is
+ * queued and waits as usual unless it would time out anyway.
+ */
+#define AVFLT_OVERLOAD_BLOCK	'b'
+#define AVFLT_OVERLOAD_ALLOW	'a'
+#define AVFLT_OVERLOAD_DENY	'd'
+
+struct avflt_qos {
+	int weight[AVFLT_CLASS_NR];
+	int age;
+	loff_t huge;
+};
 
 #define AVFLT_FILE_CLEAN	1
 #define AVFLT_FILE_INFECTED	2
 
+/*
+ * The text protocol (v0, v1) is used until "ver:2" is written to the
+ * device or the AVFLT_IOC_SET_VER ioctl selects it. After that each read
+ * returns as many struct avflt_msg_event as fit into the buffer and each
+ * write takes an array of struct avflt_msg_reply. In the binary protocols
+ * the version and queue are set only with the AVFLT_IOC_SET_VER and
+ * AVFLT_IOC_SET_QUEUE ioctls taking the value as the argument.
+ */
+#define AVFLT_PROTO_TEXT	1
+#define AVFLT_PROTO_BIN		2
+#define AVFLT_PROTO_RING	3
+#define AVFLT_PROTO_PATH	4
+
+struct avflt_msg_event {
+	__s32 id;
+	__s32 type;
+	__s32 fd;
+	__s32 pid;
+	__s32 tgid;
+};
+
+/*
+ * With AVFLT_PROTO_PATH no fd is installed for the events. Each read
+ * returns as many records as fit into the buffer, a record is struct
+ * avflt_msg_path followed by the NUL terminated pathname and padded to size
+ * bytes. The daemon gets an fd for a pending event only when it asks for it
+ * with the AVFLT_IOC_GET_FD ioctl taking the event id. Replies are struct
+ * avflt_msg_reply as with AVFLT_PROTO_BIN.
+ */
+struct avflt_msg_path {
+	__s32 id;
+	__s32 type;
+	__s32 pid;
+	__s32 tgid;
+	__u32 size;
+};
+
+#define AVFLT_IOC_GET_FD	_IO('v', 1)
+#define AVFLT_IOC_SET_VER	_IO('v', 2)
+#define AVFLT_IOC_SET_QUEUE	_IO('v', 3)
+
+struct avflt_msg_reply {
+	__s32 id;
+	__s32 res;
+	__s32 cache;
+};
+
+/*
+ * A registered process can mmap the device. The first page contains the
+ * header followed by the request ring (avflt_msg_event entries) at req_off
+ * and the reply ring (avflt_msg_reply entries) at rep_off. The kernel
+ * produces requests and consumes replies, the daemon the other way round.
+ * Heads and tails are free running counters, entries is a power of two.
+ * After the mmap each read() consumes all the replies and fills the
+ * request ring with pending events, returning the number of new events.
+ */
+struct avflt_ring_hdr {
+	__u32 req_head;
+	__u32 req_tail;
+	__u32 rep_head;
+	__u32 rep_tail;
+	__u32 entries;
+	__u32 req_off;
+	__u32 rep_off;
+};
+
+struct avflt_ring;
+struct avflt_proc;
+struct avflt_prefilter;
+
+struct avflt_conn {
+	int proto;
+	int queue;
+	struct avflt_ring *ring;
+};
+
+int avflt_ring_mmap(struct avflt_conn *conn, struct vm_area_struct *vma);
+void avflt_ring_free(struct avflt_ring *ring);
+ssize_t avflt_ring_enter(struct avflt_ring *ring, int queue);
+
 struct avflt_event {
 	struct list_head req_list;
 	struct list_head proc_list;
 	struct avflt_root_data *root_data;
 	struct completion wait;
+	struct completion done;
 	atomic_t count;
 	int type;
 	int id;
 	int result;
+	int rv;
 	struct vfsmount *mnt;
 	struct dentry *dentry;
 	unsigned int flags;
 	struct file *file;
 	int fd;
+	int queue;
+	int class;
+	unsigned long queued;
+	unsigned long taken;
+	u64 queued_us;
+	u64 taken_us;
 	int root_cache_ver;
 	int cache_ver;
 	int cache;
 	pid_t pid;
 	pid_t tgid;
+	loff_t size;
+	struct timespec ctime;
+	struct avflt_inode_data *inode_data;
+	struct work_struct work;
+	struct timer_list timer;
+	int async;
+	int expired;
 };
 
 struct avflt_event *avflt_event_get(struct avflt_event *event);
 void avflt_event_put(struct avflt_event *event);
 void avflt_readd_request(struct avflt_event *event);
-struct avflt_event *avflt_get_request(void);
+struct avflt_event *avflt_get_request(int cpu);
+struct avflt_event *avflt_wait_request(int cpu);
+int avflt_queue_valid(int cpu);
+void avflt_get_qos(struct avflt_qos *qos);
+int avflt_set_qos(struct avflt_qos *qos);
+ssize_t avflt_get_queue_info(char *buf, int size);
 int avflt_process_request(struct file *file, int type);
 void avflt_event_done(struct avflt_event *event);
 int avflt_get_file(struct avflt_event *event);
@@ -77,18 +214,28 @@ void avflt_put_file(struct avflt_event *event);
 void avflt_install_fd(struct avflt_event *event);
 ssize_t avflt_copy_cmd(char __user *buf, size_t size,
 		struct avflt_event *event);
+int avflt_copy_msg(char __user *buf, struct avflt_event *event);
+ssize_t avflt_copy_path(char __user *buf, size_t size,
+		struct avflt_event *event, char *path);
+int avflt_get_fd(int id);
 int avflt_add_reply(struct avflt_event *event);
+void avflt_rem_reply(struct avflt_event *event);
 int avflt_request_empty(void);
 void avflt_start_accept(void);
 void avflt_stop_accept(void);
 int avflt_is_stopped(void);
 void avflt_rem_requests(void);
 struct avflt_event *avflt_get_reply(const char __user *buf, size_t size);
+struct avflt_event *avflt_set_reply(struct avflt_proc *proc, int id,
+		int result, int cache);
+ssize_t avflt_get_replies(const char __user *buf, size_t size);
+int avflt_get_ctl(const char __user *buf, size_t size, int *ver, int *queue);
 int avflt_check_init(void);
 void avflt_check_exit(void);
 
 struct avflt_trusted {
-	struct list_head list;
+	struct hlist_node hash;
+	struct rcu_head rcu;
 	pid_t tgid;
 	int open;
 };
@@ -99,11 +246,14 @@ int avflt_trusted_allow(pid_t tgid);
 ssize_t avflt_trusted_get_info(char *buf, int size);
 
 struct avflt_proc {
-	struct list_head list;
+	struct hlist_node hash;
 	struct list_head events; 
+	struct idr idr;
+	struct rcu_head rcu;
 	spinlock_t lock;
 	atomic_t count;
 	pid_t tgid;
+	int next_id;
 	int open;
 };
 
@@ -114,18 +264,33 @@ struct avflt_proc *avflt_proc_add(pid_t tgid);
 void avflt_proc_rem(pid_t tgid);
 int avflt_proc_allow(pid_t tgid);
 int avflt_proc_empty(void);
-void avflt_proc_add_event(struct avflt_proc *proc, struct avflt_event *event);
+int avflt_conn_count(void);
+int avflt_proc_add_event(struct avflt_proc *proc, struct avflt_event *event);
 void avflt_proc_rem_event(struct avflt_proc *proc, struct avflt_event *event);
 struct avflt_event *avflt_proc_get_event(struct avflt_proc *proc, int id);
+struct avflt_event *avflt_proc_find_event(struct avflt_proc *proc, int id);
 ssize_t avflt_proc_get_info(char *buf, int size);
 
 #define rfs_to_root_data(ptr) \
 	container_of(ptr, struct avflt_root_data, rfs_data)
 
+#define AVFLT_STAT_HITS		0
+#define AVFLT_STAT_MISSES	1
+#define AVFLT_STAT_INVALIDATIONS	2
+#define AVFLT_STAT_QUEUED	3
+#define AVFLT_STAT_TIMEOUTS	4
+#define AVFLT_STAT_READDS	5
+#define AVFLT_STAT_NR		6
+
+#define AVFLT_HIST_NR		24
+
 struct avflt_root_data {
 	struct redirfs_data rfs_data;
 	atomic_t cache_enabled;
 	atomic_t cache_ver;
+	atomic_t overload;
+	struct avflt_prefilter *prefilter;
+	atomic_t stats[AVFLT_STAT_NR];
 };
 
 struct avflt_root_data *avflt_get_root_data_root(redirfs_root root);
@@ -144,6 +309,7 @@ struct avflt_inode_data {
 	int inode_cache_ver;
 	int cache_ver;
 	int state;
+	struct avflt_event *events[AVFLT_EVENT_MAX + 1];
 	spinlock_t lock;
 };
 
@@ -157,6 +323,22 @@ void avflt_data_exit(void);
 void avflt_invalidate_cache_root(redirfs_root root);
 void avflt_invalidate_cache(void);
 
+int avflt_prefilter_check(struct file *file);
+int avflt_prefilter_set(struct avflt_root_data *root_data, const char *cmd);
+ssize_t avflt_prefilter_get_info(struct avflt_root_data *root_data, int id,
+		char *buf, int size);
+void avflt_prefilter_free(struct avflt_root_data *root_data);
+
+u64 avflt_stats_now(void);
+void avflt_stats_wait(struct avflt_event *event);
+void avflt_stats_service(struct avflt_event *event);
+void avflt_stats_inc(struct avflt_root_data *data, int stat);
+ssize_t avflt_stats_get_info(char *buf, int size);
+
+int avflt_persist_check(struct file *file);
+void avflt_persist_store(struct avflt_event *event);
+void avflt_persist_invalidate(struct file *file);
+
 int avflt_dev_init(void);
 void avflt_dev_exit(void);
 
@@ -168,6 +350,10 @@ void avflt_sys_exit(void);
 
 extern atomic_t avflt_reply_timeout;
 extern atomic_t avflt_cache_enabled;
+extern atomic_t avflt_persist_ver;
+extern atomic_t avflt_async_close;
+extern atomic_t avflt_async_nr;
+extern atomic_t avflt_request_max;
 extern redirfs_filter avflt;
 extern wait_queue_head_t avflt_request_available;
 
@@ -23,13 +23,90 @@
 
 #include "avflt.h"
 
+/*
+ * Requests are queued on the queue of the cpu the file was opened on. A
+ * scanner bound to a queue (see avflt_wait_request) sleeps exclusively on
+ * its queue and steals requests from other queues when its own is empty.
+ * avflt_request_available wakes all the pollers. Each queue keeps a list
+ * and the remaining credit of the current round per class.
+ */
+struct avflt_queue {
+	spinlock_t lock;
+	struct list_head list[AVFLT_CLASS_NR];
+	int credit[AVFLT_CLASS_NR];
+	wait_queue_head_t wait;
+};
+
+static DEFINE_PER_CPU(struct avflt_queue, avflt_queues);
+
+static DEFINE_SPINLOCK(avflt_qos_lock);
+static struct avflt_qos avflt_qos = {
+	.weight = {8, 2, 1},
+	.age = 1000,
+	.huge = 64 * 1024 * 1024,
+};
+
 DECLARE_WAIT_QUEUE_HEAD(avflt_request_available);
 static DEFINE_SPINLOCK(avflt_request_lock);
-static LIST_HEAD(avflt_request_list);
 static int avflt_request_accept = 0;
 static struct kmem_cache *avflt_event_cache = NULL;
+static struct workqueue_struct *avflt_async_wq = NULL;
 atomic_t avflt_cache_ver = ATOMIC_INIT(0);
-atomic_t avflt_event_ids = ATOMIC_INIT(0);
+atomic_t avflt_async_close = ATOMIC_INIT(0);
+atomic_t avflt_async_nr = ATOMIC_INIT(0);
+atomic_t avflt_request_max = ATOMIC_INIT(0);
+static atomic_t avflt_request_nr = ATOMIC_INIT(0);
+static atomic_t avflt_overload_allowed = ATOMIC_INIT(0);
+static atomic_t avflt_overload_denied = ATOMIC_INIT(0);
+static atomic_t avflt_overload_expired = ATOMIC_INIT(0);
+/* moving average of the time a scanner needs for a request, jiffies << 3 */
+static DEFINE_SPINLOCK(avflt_service_lock);
+static unsigned long avflt_service_time = 0;
+
+static void avflt_async_done(struct avflt_event *event);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void avflt_async_work_fn(void *data)
+{
+	avflt_async_done(data);
+}
+#else
+static void avflt_async_work_fn(struct work_struct *work)
+{
+	avflt_async_done(container_of(work, struct avflt_event, work));
+}
+#endif
+
+static void avflt_async_timeout(unsigned long data)
+{
+	struct avflt_event *event = (struct avflt_event *)data;
+
+	if (!xchg(&event->async, 0))
+		return;
+
+	event->expired = 1;
+	queue_work(avflt_async_wq, &event->work);
+}
+
+static int avflt_event_class(struct avflt_event *event)
+{
+	loff_t huge;
+
+	if (event->type == AVFLT_EVENT_CLOSE)
+		return AVFLT_CLASS_CLOSE;
+
+	if (task_nice(current) > 0)
+		return AVFLT_CLASS_BULK;
+
+	spin_lock(&avflt_qos_lock);
+	huge = avflt_qos.huge;
+	spin_unlock(&avflt_qos_lock);
+
+	if (huge && event->size >= huge)
+		return AVFLT_CLASS_BULK;
+
+	return AVFLT_CLASS_OPEN;
+}
 
 static struct avflt_event *avflt_event_alloc(struct file *file, int type)
 {
@@ -44,6 +121,7 @@ static struct avflt_event *avflt_event_alloc(struct file *file, int type)
 	INIT_LIST_HEAD(&event->req_list);
 	INIT_LIST_HEAD(&event->proc_list);
 	init_completion(&event->wait);
+	init_completion(&event->done);
 	atomic_set(&event->count, 1);
 	event->type = type;
 	event->id = -1;
@@ -51,9 +129,21 @@ static struct avflt_event *avflt_event_alloc(struct file *file, int type)
 	event->dentry = dget(file->f_dentry);
 	event->flags = file->f_flags;
 	event->fd = -1;
+	event->queue = -1;
 	event->pid = current->pid;
 	event->tgid = current->tgid;
 	event->cache = 1;
+	event->size = i_size_read(file->f_dentry->d_inode);
+	event->ctime = file->f_dentry->d_inode->i_ctime;
+	event->class = avflt_event_class(event);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+	INIT_WORK(&event->work, avflt_async_work_fn, event);
+#else
+	INIT_WORK(&event->work, avflt_async_work_fn);
+#endif
+	init_timer(&event->timer);
+	event->timer.function = avflt_async_timeout;
+	event->timer.data = (unsigned long)event;
 
 	root_data = avflt_get_root_data_inode(file->f_dentry->d_inode);
 	inode_data = avflt_get_inode_data_inode(file->f_dentry->d_inode);
@@ -102,69 +192,283 @@ void avflt_event_put(struct avflt_event *event)
 	kmem_cache_free(avflt_event_cache, event);
 }
 
+static void avflt_wake_queue(int cpu)
+{
+	struct avflt_queue *queue;
+	int i;
+
+	/*
+	 * Pairs with the barrier in prepare_to_wait of the scanner. The request
+	 * has to be visible before the wait queues are checked, otherwise a
+	 * scanner which just started waiting could be missed.
+	 */
+	smp_mb();
+
+	queue = &per_cpu(avflt_queues, cpu);
+	if (waitqueue_active(&queue->wait)) {
+		wake_up_interruptible(&queue->wait);
+		return;
+	}
+
+	for_each_possible_cpu(i) {
+		queue = &per_cpu(avflt_queues, i);
+		if (!waitqueue_active(&queue->wait))
+			continue;
+
+		wake_up_interruptible(&queue->wait);
+		return;
+	}
+}
+
 static int avflt_add_request(struct avflt_event *event, int tail)
 {
-	spin_lock(&avflt_request_lock);
+	struct avflt_queue *queue;
+	int cpu;
 
-	if (avflt_request_accept == 0) {
-		spin_unlock(&avflt_request_lock);
+	cpu = raw_smp_processor_id();
+	queue = &per_cpu(avflt_queues, cpu);
+
+	spin_lock(&queue->lock);
+
+	if (ACCESS_ONCE(avflt_request_accept) == 0) {
+		spin_unlock(&queue->lock);
 		return 1;
 	}
 
 	if (tail)
-		list_add_tail(&event->req_list, &avflt_request_list);
+		list_add_tail(&event->req_list, &queue->list[event->class]);
 	else
-		list_add(&event->req_list, &avflt_request_list);
+		list_add(&event->req_list, &queue->list[event->class]);
+
+	/*
+	 * A readded event keeps the time it was queued first, so its age
+	 * and the wait statistics include the time spent with the scanner
+	 * that gave it up.
+	 */
+	if (event->queue < 0) {
+		event->queued = jiffies;
+		event->queued_us = avflt_stats_now();
+	}
 
+	event->queue = cpu;
 	avflt_event_get(event);
-	
-	wake_up_interruptible(&avflt_request_available);
+	atomic_inc(&avflt_request_nr);
+	avflt_stats_inc(event->root_data, AVFLT_STAT_QUEUED);
 
-	spin_unlock(&avflt_request_lock);
+	spin_unlock(&queue->lock);
+
+	avflt_wake_queue(cpu);
+	wake_up_interruptible(&avflt_request_available);
 
 	return 0;
 }
 
 void avflt_readd_request(struct avflt_event *event)
 {
+	avflt_stats_inc(event->root_data, AVFLT_STAT_READDS);
+
 	if (avflt_add_request(event, 0))
 		avflt_event_done(event);
 }
 
 static void avflt_rem_request(struct avflt_event *event)
 {
-	spin_lock(&avflt_request_lock);
+	struct avflt_queue *queue;
+
+	if (event->queue < 0)
+		return;
+
+	queue = &per_cpu(avflt_queues, event->queue);
+
+	spin_lock(&queue->lock);
 	if (list_empty(&event->req_list)) {
-		spin_unlock(&avflt_request_lock);
+		spin_unlock(&queue->lock);
 		return;
 	}
 	list_del_init(&event->req_list);
-	spin_unlock(&avflt_request_lock);
+	spin_unlock(&queue->lock);
+	atomic_dec(&avflt_request_nr);
 	avflt_event_put(event);
 }
 
-struct avflt_event *avflt_get_request(void)
+static int avflt_queue_empty(struct avflt_queue *queue)
+{
+	int i;
+
+	for (i = 0; i < AVFLT_CLASS_NR; i++) {
+		if (!list_empty(&queue->list[i]))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * The oldest request which waits longer than the age limit is taken first.
+ * Otherwise classes are served in order while they have credit and the
+ * credits are refilled from the weights once no non-empty class has any.
+ */
+static struct avflt_event *avflt_pick_request(struct avflt_queue *queue)
 {
+	struct avflt_event *oldest = NULL;
 	struct avflt_event *event;
+	unsigned long age;
+	int round;
+	int i;
 
-	spin_lock(&avflt_request_lock);
+	age = msecs_to_jiffies(ACCESS_ONCE(avflt_qos.age));
 
-	if (list_empty(&avflt_request_list)) {
-		spin_unlock(&avflt_request_lock);
+	for (i = 0; age && i < AVFLT_CLASS_NR; i++) {
+		if (list_empty(&queue->list[i]))
+			continue;
+
+		event = list_entry(queue->list[i].next, struct avflt_event,
+				req_list);
+
+		if (!time_after(jiffies, event->queued + age))
+			continue;
+
+		if (!oldest || time_before(event->queued, oldest->queued))
+			oldest = event;
+	}
+
+	if (oldest)
+		return oldest;
+
+	for (round = 0; round < 2; round++) {
+		for (i = 0; i < AVFLT_CLASS_NR; i++) {
+			if (list_empty(&queue->list[i]) || !queue->credit[i])
+				continue;
+
+			queue->credit[i]--;
+			return list_entry(queue->list[i].next,
+					struct avflt_event, req_list);
+		}
+
+		for (i = 0; i < AVFLT_CLASS_NR; i++)
+			queue->credit[i] = ACCESS_ONCE(avflt_qos.weight[i]);
+	}
+
+	return NULL;
+}
+
+static struct avflt_event *avflt_get_request_queue(int cpu)
+{
+	struct avflt_queue *queue;
+	struct avflt_event *event;
+
+	queue = &per_cpu(avflt_queues, cpu);
+
+	if (avflt_queue_empty(queue))
+		return NULL;
+
+	spin_lock(&queue->lock);
+
+	event = avflt_pick_request(queue);
+	if (!event) {
+		spin_unlock(&queue->lock);
 		return NULL;
 	}
 
-	event = list_entry(avflt_request_list.next, struct avflt_event,
-			req_list);
 	list_del_init(&event->req_list);
+	atomic_dec(&avflt_request_nr);
+	event->taken = jiffies;
+	event->taken_us = avflt_stats_now();
+	avflt_stats_wait(event);
 
-	spin_unlock(&avflt_request_lock);
+	spin_unlock(&queue->lock);
 
-	event->id = atomic_inc_return(&avflt_event_ids);
 	return event;
 }
 
-static int avflt_wait_for_reply(struct avflt_event *event)
+/*
+ * Takes a request from the given queue (the current cpu's one for -1) or
+ * steals it from other queues.
+ */
+struct avflt_event *avflt_get_request(int cpu)
+{
+	struct avflt_event *event;
+	int i;
+
+	if (cpu < 0)
+		cpu = raw_smp_processor_id();
+
+	event = avflt_get_request_queue(cpu);
+	if (event)
+		return event;
+
+	for_each_possible_cpu(i) {
+		if (i == cpu)
+			continue;
+
+		event = avflt_get_request_queue(i);
+		if (event)
+			return event;
+	}
+
+	return NULL;
+}
+
+/*
+ * Blocks till there is a request or the filter stops accepting requests.
+ * The scanner sleeps exclusively on its queue, so each request wakes just
+ * one of the scanners bound to it.
+ */
+struct avflt_event *avflt_wait_request(int cpu)
+{
+	struct avflt_queue *queue;
+	struct avflt_event *event;
+	int rv;
+
+	queue = &per_cpu(avflt_queues, cpu);
+
+	for (;;) {
+		event = avflt_get_request(cpu);
+		if (event)
+			return event;
+
+		rv = wait_event_interruptible_exclusive(queue->wait,
+				!avflt_request_empty() || avflt_is_stopped());
+		if (rv)
+			return ERR_PTR(rv);
+
+		if (avflt_is_stopped())
+			return NULL;
+	}
+}
+
+int avflt_queue_valid(int cpu)
+{
+	return cpu >= 0 && cpu < NR_CPUS && cpu_possible(cpu);
+}
+
+void avflt_get_qos(struct avflt_qos *qos)
+{
+	spin_lock(&avflt_qos_lock);
+	*qos = avflt_qos;
+	spin_unlock(&avflt_qos_lock);
+}
+
+int avflt_set_qos(struct avflt_qos *qos)
+{
+	int i;
+
+	for (i = 0; i < AVFLT_CLASS_NR; i++) {
+		if (qos->weight[i] < 1)
+			return -EINVAL;
+	}
+
+	if (qos->age < 0 || qos->huge < 0)
+		return -EINVAL;
+
+	spin_lock(&avflt_qos_lock);
+	avflt_qos = *qos;
+	spin_unlock(&avflt_qos_lock);
+
+	return 0;
+}
+
+static int avflt_wait_completion(struct completion *wait)
 {
 	long jiffies;
 	int timeout;
@@ -175,8 +479,7 @@ static int avflt_wait_for_reply(struct avflt_event *event)
 	else
 		jiffies = MAX_SCHEDULE_TIMEOUT;
 
-	jiffies = wait_for_completion_interruptible_timeout(&event->wait,
-			jiffies);
+	jiffies = wait_for_completion_interruptible_timeout(wait, jiffies);
 
 	if (jiffies < 0)
 		return (int)jiffies;
@@ -189,6 +492,29 @@ static int avflt_wait_for_reply(struct avflt_event *event)
 	return 0;
 }
 
+static int avflt_wait_for_reply(struct avflt_event *event)
+{
+	return avflt_wait_completion(&event->wait);
+}
+
+/*
+ * Returns the owner's result or error, -EAGAIN if the owner was interrupted
+ * and the caller should retry as the new owner.
+ */
+static int avflt_wait_for_owner(struct avflt_event *owner)
+{
+	int rv;
+
+	rv = avflt_wait_completion(&owner->done);
+	if (rv)
+		return rv;
+
+	if (owner->rv == -ERESTARTSYS || owner->rv == -EINTR)
+		return -EAGAIN;
+
+	return owner->rv;
+}
+
 static void avflt_update_cache(struct avflt_event *event)
 {
 	struct avflt_inode_data *inode_data;
@@ -225,25 +551,292 @@ static void avflt_update_cache(struct avflt_event *event)
 	avflt_put_inode_data(inode_data);
 }
 
+static int avflt_same_content(struct avflt_event *owner,
+		struct avflt_event *event)
+{
+	return owner->root_data == event->root_data &&
+		owner->root_cache_ver == event->root_cache_ver &&
+		owner->cache_ver == event->cache_ver;
+}
+
+/*
+ * Concurrent checks of the same inode content are coalesced. The first
+ * event is registered in the inode data and later checks of the same inode
+ * with the same cache versions wait for its result instead of queueing
+ * their own request. There is one slot per event type, so an async close
+ * does not keep opens from coalescing. An open also waits for a pending
+ * close of the same content, a close never waits for an open, the file
+ * could have been written since the open was queued. The owner always
+ * passes its result or error to the joiners when it leaves the slot.
+ */
+static struct avflt_event *avflt_join_request(struct avflt_inode_data *data,
+		struct avflt_event *event)
+{
+	struct avflt_event *owner = NULL;
+	struct avflt_event *close;
+
+	if (!data)
+		return NULL;
+
+	spin_lock(&data->lock);
+
+	close = data->events[AVFLT_EVENT_CLOSE];
+	if (event->type == AVFLT_EVENT_OPEN && close &&
+	    avflt_same_content(close, event)) {
+		owner = avflt_event_get(close);
+		goto exit;
+	}
+
+	if (!data->events[event->type]) {
+		data->events[event->type] = event;
+		goto exit;
+	}
+
+	if (!avflt_same_content(data->events[event->type], event))
+		goto exit;
+
+	owner = avflt_event_get(data->events[event->type]);
+exit:
+	spin_unlock(&data->lock);
+	return owner;
+}
+
+static void avflt_leave_request(struct avflt_inode_data *data,
+		struct avflt_event *event, int rv)
+{
+	int owner = 0;
+
+	if (!data)
+		return;
+
+	spin_lock(&data->lock);
+	if (data->events[event->type] == event) {
+		data->events[event->type] = NULL;
+		owner = 1;
+	}
+	spin_unlock(&data->lock);
+
+	if (!owner)
+		return;
+
+	event->rv = rv;
+	complete_all(&event->done);
+}
+
+/*
+ * The expected wait is the number of queued requests times the average
+ * service time divided among the open scanner connections. The request is
+ * handled according to the root's overload policy when it would not fit
+ * under the high-water mark or would not be answered before the timeout.
+ */
+static int avflt_overload(struct avflt_event *event)
+{
+	unsigned long wait;
+	int expired = 0;
+	int timeout;
+	int policy;
+	int depth;
+	int max;
+	int nr;
+
+	depth = atomic_read(&avflt_request_nr);
+	max = atomic_read(&avflt_request_max);
+	timeout = atomic_read(&avflt_reply_timeout);
+
+	if (timeout) {
+		nr = avflt_conn_count();
+		if (!nr)
+			nr = 1;
+
+		wait = ACCESS_ONCE(avflt_service_time) >> 3;
+		wait = wait * (depth + 1) / nr;
+		expired = wait > msecs_to_jiffies(timeout);
+	}
+
+	if (!expired && (!max || depth < max))
+		return 0;
+
+	policy = AVFLT_OVERLOAD_BLOCK;
+	if (event->root_data)
+		policy = atomic_read(&event->root_data->overload);
+
+	switch (policy) {
+	case AVFLT_OVERLOAD_ALLOW:
+		atomic_inc(&avflt_overload_allowed);
+		return 1;
+
+	case AVFLT_OVERLOAD_DENY:
+		atomic_inc(&avflt_overload_denied);
+		return -EBUSY;
+	}
+
+	if (!expired)
+		return 0;
+
+	atomic_inc(&avflt_overload_expired);
+	return -ETIMEDOUT;
+}
+
+ssize_t avflt_get_queue_info(char *buf, int size)
+{
+	unsigned long wait;
+
+	wait = ACCESS_ONCE(avflt_service_time) >> 3;
+
+	return snprintf(buf, size, "depth:%d,max:%d,wait:%u,allowed:%d,"
+			"denied:%d,expired:%d", atomic_read(&avflt_request_nr),
+			atomic_read(&avflt_request_max),
+			jiffies_to_msecs(wait),
+			atomic_read(&avflt_overload_allowed),
+			atomic_read(&avflt_overload_denied),
+			atomic_read(&avflt_overload_expired));
+}
+
+/*
+ * Up to avflt_async_close close events are scanned asynchronously, above
+ * the limit closes wait for the verdict again. The event stays in the close
+ * slot of the inode data till the reply arrives, so a close of the file
+ * does not queue another scan while one is pending and opens of the same
+ * content wait for its verdict. The reply timeout applies to the async
+ * events too, whichever of the reply and the timer comes first clears
+ * event->async and queues the completion work.
+ */
+static int avflt_async_get(int type)
+{
+	int limit;
+
+	if (type != AVFLT_EVENT_CLOSE)
+		return 0;
+
+	limit = atomic_read(&avflt_async_close);
+	if (!limit)
+		return 0;
+
+	if (atomic_inc_return(&avflt_async_nr) > limit) {
+		atomic_dec(&avflt_async_nr);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void avflt_async_done(struct avflt_event *event)
+{
+	del_timer_sync(&event->timer);
+
+	if (event->expired) {
+		printk(KERN_WARNING "avflt: wait for reply timeout\n");
+		avflt_stats_inc(event->root_data, AVFLT_STAT_TIMEOUTS);
+		avflt_rem_request(event);
+		avflt_leave_request(event->inode_data, event, -ETIMEDOUT);
+	} else {
+		avflt_update_cache(event);
+		if (event->cache)
+			avflt_persist_store(event);
+
+		avflt_leave_request(event->inode_data, event, event->result);
+	}
+
+	avflt_put_inode_data(event->inode_data);
+	event->inode_data = NULL;
+	avflt_event_put(event);
+	atomic_dec(&avflt_async_nr);
+}
+
+static void avflt_async_request(struct avflt_event *event,
+		struct avflt_inode_data *inode_data)
+{
+	int timeout;
+
+	event->inode_data = inode_data;
+	event->async = 1;
+
+	timeout = atomic_read(&avflt_reply_timeout);
+	if (timeout)
+		mod_timer(&event->timer, jiffies + msecs_to_jiffies(timeout));
+
+	if (!avflt_add_request(event, 1))
+		return;
+
+	/* the timer fired already and owns the event */
+	if (!xchg(&event->async, 0))
+		return;
+
+	del_timer_sync(&event->timer);
+	avflt_leave_request(inode_data, event, 0);
+	avflt_put_inode_data(inode_data);
+	event->inode_data = NULL;
+	avflt_event_put(event);
+	atomic_dec(&avflt_async_nr);
+}
+
 int avflt_process_request(struct file *file, int type)
 {
+	struct avflt_inode_data *inode_data;
 	struct avflt_event *event;
+	struct avflt_event *owner;
+	int async;
 	int rv = 0;
 
 	event = avflt_event_alloc(file, type);
 	if (IS_ERR(event))
 		return PTR_ERR(event);
 
-	if (avflt_add_request(event, 1))
+	inode_data = avflt_attach_inode_data(file->f_dentry->d_inode);
+	async = avflt_async_get(type);
+
+again:
+	owner = avflt_join_request(inode_data, event);
+	if (owner && async) {
+		atomic_dec(&avflt_async_nr);
+		avflt_event_put(owner);
 		goto exit;
+	}
+
+	if (owner) {
+		rv = avflt_wait_for_owner(owner);
+		avflt_event_put(owner);
+		if (rv == -EAGAIN)
+			goto again;
+
+		goto exit;
+	}
+
+	rv = avflt_overload(event);
+	if (rv) {
+		if (async)
+			atomic_dec(&avflt_async_nr);
+
+		if (rv > 0)
+			rv = 0;
+
+		goto exit_leave;
+	}
+
+	if (async) {
+		avflt_async_request(event, inode_data);
+		return 0;
+	}
+
+	if (avflt_add_request(event, 1))
+		goto exit_leave;
 
 	rv = avflt_wait_for_reply(event);
+	if (rv == -ETIMEDOUT)
+		avflt_stats_inc(event->root_data, AVFLT_STAT_TIMEOUTS);
+
 	if (rv)
-		goto exit;
+		goto exit_leave;
 
 	avflt_update_cache(event);
+	if (event->cache)
+		avflt_persist_store(event);
+
 	rv = event->result;
+exit_leave:
+	avflt_leave_request(inode_data, event, rv);
 exit:
+	avflt_put_inode_data(inode_data);
 	avflt_rem_request(event);
 	avflt_event_put(event);
 	return rv;
@@ -251,7 +844,10 @@ exit:
 
 void avflt_event_done(struct avflt_event *event)
 {
-	complete(&event->wait);
+	complete_all(&event->wait);
+
+	if (xchg(&event->async, 0))
+		queue_work(avflt_async_wq, &event->work);
 }
 
 int avflt_get_file(struct avflt_event *event)
@@ -323,36 +919,133 @@ ssize_t avflt_copy_cmd(char __user *buf, size_t size, struct avflt_event *event)
 	return len;
 }
 
-int avflt_add_reply(struct avflt_event *event)
+int avflt_copy_msg(char __user *buf, struct avflt_event *event)
+{
+	struct avflt_msg_event msg;
+
+	msg.id = event->id;
+	msg.type = event->type;
+	msg.fd = event->fd;
+	msg.pid = event->pid;
+	msg.tgid = event->tgid;
+
+	if (copy_to_user(buf, &msg, sizeof(msg)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Returns -ENOSPC if the record does not fit into the buffer.
+ */
+ssize_t avflt_copy_path(char __user *buf, size_t size,
+		struct avflt_event *event, char *path)
+{
+	struct avflt_msg_path msg;
+	size_t len;
+	int rv;
+
+	rv = redirfs_get_filename(event->mnt, event->dentry, path, PAGE_SIZE);
+	if (rv)
+		return rv;
+
+	len = strlen(path) + 1;
+	msg.id = event->id;
+	msg.type = event->type;
+	msg.pid = event->pid;
+	msg.tgid = event->tgid;
+	msg.size = ALIGN(sizeof(msg) + len, sizeof(__u32));
+
+	if (msg.size > size)
+		return -ENOSPC;
+
+	if (copy_to_user(buf, &msg, sizeof(msg)))
+		return -EFAULT;
+
+	if (copy_to_user(buf + sizeof(msg), path, len))
+		return -EFAULT;
+
+	return msg.size;
+}
+
+/*
+ * Installs an fd for a pending event of the current process. There is at
+ * most one fd per event and the daemon is responsible for closing it.
+ */
+int avflt_get_fd(int id)
 {
+	struct avflt_event *event;
 	struct avflt_proc *proc;
+	int fd;
+	int rv;
 
 	proc = avflt_proc_find(current->tgid);
 	if (!proc)
 		return -ENOENT;
 
-	avflt_proc_add_event(proc, event);
+	event = avflt_proc_find_event(proc, id);
 	avflt_proc_put(proc);
+	if (!event)
+		return -ENOENT;
 
-	return 0;
+	if (cmpxchg(&event->fd, -1, -2) != -1) {
+		avflt_event_put(event);
+		return -EEXIST;
+	}
+
+	rv = avflt_get_file(event);
+	if (rv) {
+		event->fd = -1;
+		avflt_event_put(event);
+		return rv;
+	}
+
+	fd = event->fd;
+	avflt_install_fd(event);
+	avflt_event_put(event);
+
+	return fd;
 }
 
-int avflt_request_empty(void)
+int avflt_add_reply(struct avflt_event *event)
 {
+	struct avflt_proc *proc;
 	int rv;
 
-	spin_lock(&avflt_request_lock);
-
-	if (list_empty(&avflt_request_list))
-		rv = 1;
-	else
-		rv = 0;
+	proc = avflt_proc_find(current->tgid);
+	if (!proc)
+		return -ENOENT;
 
-	spin_unlock(&avflt_request_lock);
+	rv = avflt_proc_add_event(proc, event);
+	avflt_proc_put(proc);
 
 	return rv;
 }
 
+void avflt_rem_reply(struct avflt_event *event)
+{
+	struct avflt_proc *proc;
+
+	proc = avflt_proc_find(current->tgid);
+	if (!proc)
+		return;
+
+	avflt_proc_rem_event(proc, event);
+	avflt_proc_put(proc);
+}
+
+int avflt_request_empty(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (!avflt_queue_empty(&per_cpu(avflt_queues, cpu)))
+			return 0;
+	}
+
+	return 1;
+}
+
 void avflt_start_accept(void)
 {
 	spin_lock(&avflt_request_lock);
@@ -362,10 +1055,18 @@ void avflt_start_accept(void)
 
 void avflt_stop_accept(void)
 {
+	struct avflt_queue *queue;
+	int cpu;
+
 	spin_lock(&avflt_request_lock);
 	if (avflt_proc_empty())
 		avflt_request_accept = 0;
 	spin_unlock(&avflt_request_lock);
+
+	for_each_possible_cpu(cpu) {
+		queue = &per_cpu(avflt_queues, cpu);
+		wake_up_interruptible_all(&queue->wait);
+	}
 }
 
 int avflt_is_stopped(void)
@@ -382,20 +1083,33 @@ int avflt_is_stopped(void)
 void avflt_rem_requests(void)
 {
 	LIST_HEAD(list);
+	struct avflt_queue *queue;
 	struct avflt_event *event;
 	struct avflt_event *tmp;
+	int cpu;
+	int i;
 
 	spin_lock(&avflt_request_lock);
 
 	if (avflt_request_accept == 1) {
 		spin_unlock(&avflt_request_lock);
 		return;
-
 	}
 
-	list_for_each_entry_safe(event, tmp, &avflt_request_list, req_list) {
-		list_move_tail(&event->req_list, &list);
-		avflt_event_done(event);
+	for_each_possible_cpu(cpu) {
+		queue = &per_cpu(avflt_queues, cpu);
+		spin_lock(&queue->lock);
+
+		for (i = 0; i < AVFLT_CLASS_NR; i++) {
+			list_for_each_entry_safe(event, tmp, &queue->list[i],
+					req_list) {
+				list_move_tail(&event->req_list, &list);
+				atomic_dec(&avflt_request_nr);
+				avflt_event_done(event);
+			}
+		}
+
+		spin_unlock(&queue->lock);
 	}
 
 	spin_unlock(&avflt_request_lock);
@@ -406,6 +1120,42 @@ void avflt_rem_requests(void)
 	}
 }
 
+struct avflt_event *avflt_set_reply(struct avflt_proc *proc, int id,
+		int result, int cache)
+{
+	struct avflt_event *event;
+
+	event = avflt_proc_get_event(proc, id);
+	if (!event)
+		return NULL;
+
+	spin_lock(&avflt_service_lock);
+	avflt_service_time += (jiffies - event->taken) -
+		(avflt_service_time >> 3);
+	spin_unlock(&avflt_service_lock);
+
+	avflt_stats_service(event);
+	event->result = result;
+
+	if (cache != -1)
+		event->cache = cache;
+
+	return event;
+}
+
+static int avflt_get_text(char *cmd, const char __user *buf, size_t size)
+{
+	if (size >= 256)
+		return -EINVAL;
+
+	if (copy_from_user(cmd, buf, size))
+		return -EFAULT;
+
+	cmd[size] = 0;
+
+	return 0;
+}
+
 struct avflt_event *avflt_get_reply(const char __user *buf, size_t size)
 {
 	struct avflt_proc *proc;
@@ -416,18 +1166,16 @@ struct avflt_event *avflt_get_reply(const char __user *buf, size_t size)
 	int cache;
 	int rv;
 
-	if (size > 256)
-		return ERR_PTR(-EINVAL);
-
-	if (copy_from_user(cmd, buf, size))
-		return ERR_PTR(-EFAULT);
+	rv = avflt_get_text(cmd, buf, size);
+	if (rv)
+		return ERR_PTR(rv);
 
 	cache = -1;
 	/*
 	 * v0: id:%d,res:%d
 	 * v1: id:%d,res:%d,cache:%d
 	 */
-	rv = sscanf(buf, "id:%d,res:%d,cache:%d", &id, &result, &cache);
+	rv = sscanf(cmd, "id:%d,res:%d,cache:%d", &id, &result, &cache);
 	if (rv != 2 && rv != 3)
 		return ERR_PTR(-EINVAL);
 
@@ -435,19 +1183,79 @@ struct avflt_event *avflt_get_reply(const char __user *buf, size_t size)
 	if (!proc)
 		return ERR_PTR(-ENOENT);
 
-	event = avflt_proc_get_event(proc, id);
+	event = avflt_set_reply(proc, id, result, cache);
 	avflt_proc_put(proc);
 	if (!event)
 		return ERR_PTR(-ENOENT);
 
-	event->result = result;
-	
-	if (cache != -1)
-		event->cache = cache;
-
 	return event;
 }
 
+/*
+ * Replies for events which are not waiting anymore (e.g. timed out) are
+ * skipped. -ENOENT is returned only if none of the replies matched.
+ */
+ssize_t avflt_get_replies(const char __user *buf, size_t size)
+{
+	struct avflt_msg_reply reply;
+	struct avflt_event *event;
+	struct avflt_proc *proc;
+	ssize_t rv = -ENOENT;
+	size_t len;
+
+	if (!size || size % sizeof(reply))
+		return -EINVAL;
+
+	proc = avflt_proc_find(current->tgid);
+	if (!proc)
+		return -ENOENT;
+
+	for (len = 0; len < size; len += sizeof(reply)) {
+		if (copy_from_user(&reply, buf + len, sizeof(reply))) {
+			rv = -EFAULT;
+			break;
+		}
+
+		event = avflt_set_reply(proc, reply.id, reply.res,
+				reply.cache);
+		if (!event)
+			continue;
+
+		avflt_event_done(event);
+		avflt_event_put(event);
+		rv = size;
+	}
+
+	avflt_proc_put(proc);
+	return rv;
+}
+
+/*
+ * ver:%d selects the protocol, queue:%d binds the scanner to a queue
+ */
+int avflt_get_ctl(const char __user *buf, size_t size, int *ver, int *queue)
+{
+	char cmd[256];
+	int val;
+	int rv;
+
+	rv = avflt_get_text(cmd, buf, size);
+	if (rv)
+		return rv;
+
+	if (sscanf(cmd, "ver:%d", &val) == 1) {
+		*ver = val;
+		return 0;
+	}
+
+	if (sscanf(cmd, "queue:%d", &val) == 1) {
+		*queue = val;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
 void avflt_invalidate_cache_root(redirfs_root root)
 {
 	struct avflt_root_data *data;
@@ -459,6 +1267,7 @@ void avflt_invalidate_cache_root(redirfs_root root)
 	if (!data)
 		return;
 
+	avflt_stats_inc(data, AVFLT_STAT_INVALIDATIONS);
 	atomic_inc(&data->cache_ver);
 	avflt_put_root_data(data);
 }
@@ -485,6 +1294,24 @@ void avflt_invalidate_cache(void)
 
 int avflt_check_init(void)
 {
+	struct avflt_queue *queue;
+	int cpu;
+	int i;
+
+	avflt_async_wq = create_workqueue("avflt");
+	if (!avflt_async_wq)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		queue = &per_cpu(avflt_queues, cpu);
+		spin_lock_init(&queue->lock);
+		for (i = 0; i < AVFLT_CLASS_NR; i++) {
+			INIT_LIST_HEAD(&queue->list[i]);
+			queue->credit[i] = avflt_qos.weight[i];
+		}
+		init_waitqueue_head(&queue->wait);
+	}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
 	avflt_event_cache = kmem_cache_create("avflt_event_cache",
 			sizeof(struct avflt_event),
@@ -495,14 +1322,17 @@ int avflt_check_init(void)
 			0, SLAB_RECLAIM_ACCOUNT, NULL);
 #endif
 
-	if (!avflt_event_cache)
+	if (!avflt_event_cache) {
+		destroy_workqueue(avflt_async_wq);
 		return -ENOMEM;
+	}
 
 	return 0;
 }
 
 void avflt_check_exit(void)
 {
+	destroy_workqueue(avflt_async_wq);
 	kmem_cache_destroy(avflt_event_cache);
 }
 
@@ -29,6 +29,7 @@ static void avflt_root_data_free(struct redirfs_data *rfs_data)
 {
 	struct avflt_root_data *data = rfs_to_root_data(rfs_data);
 
+	avflt_prefilter_free(data);
 	kfree(data);
 }
 
@@ -50,6 +51,7 @@ static struct avflt_root_data *avflt_root_data_alloc(void)
 
 	atomic_set(&data->cache_enabled, 1);
 	atomic_set(&data->cache_ver, 0);
+	atomic_set(&data->overload, AVFLT_OVERLOAD_BLOCK);
 
 	return data;
 }
@@ -201,8 +203,8 @@ struct avflt_inode_data *avflt_attach_inode_data(struct inode *inode)
 		return data;
 
 	data = avflt_inode_data_alloc();
-	if (!data) 
-		return data;
+	if (IS_ERR(data))
+		return NULL;
 
 	rfs_data = redirfs_attach_data_inode(avflt, inode,
 			&data->rfs_data);
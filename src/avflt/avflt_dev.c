@@ -30,14 +30,25 @@ static dev_t avflt_dev;
 static int avflt_dev_open_registered(struct inode *inode, struct file *file)
 {
 	struct avflt_proc *proc;
+	struct avflt_conn *conn;
+
+	conn = kzalloc(sizeof(struct avflt_conn), GFP_KERNEL);
+	if (!conn)
+		return -ENOMEM;
+
+	conn->proto = AVFLT_PROTO_TEXT;
+	conn->queue = -1;
 
 	if (avflt_proc_empty())
 		avflt_invalidate_cache();
 
 	proc = avflt_proc_add(current->tgid);
-	if (IS_ERR(proc))
+	if (IS_ERR(proc)) {
+		kfree(conn);
 		return PTR_ERR(proc);
+	}
 
+	file->private_data = conn;
 	avflt_proc_put(proc);
 	avflt_start_accept();
 	return 0;
@@ -58,6 +69,11 @@ static int avflt_dev_open(struct inode *inode, struct file *file)
 
 static int avflt_dev_release_registered(struct inode *inode, struct file *file)
 {
+	struct avflt_conn *conn = file->private_data;
+
+	avflt_ring_free(conn->ring);
+	kfree(conn);
+
 	avflt_proc_rem(current->tgid);
 	if (!avflt_proc_empty())
 		return 0;
@@ -81,17 +97,32 @@ static int avflt_dev_release(struct inode *inode, struct file *file)
 	return avflt_dev_release_trusted(inode, file);
 }
 
-static ssize_t avflt_dev_read(struct file *file, char __user *buf,
-		size_t size, loff_t *pos)
+#define avflt_dev_conn(file) ((struct avflt_conn *)(file)->private_data)
+
+/*
+ * A blocking read on a scanner bound to a queue waits for a request.
+ */
+static struct avflt_event *avflt_dev_get_request(struct file *file)
+{
+	int queue = avflt_dev_conn(file)->queue;
+
+	if (queue < 0 || file->f_flags & O_NONBLOCK)
+		return avflt_get_request(queue);
+
+	return avflt_wait_request(queue);
+}
+
+static ssize_t avflt_dev_read_text(struct file *file, char __user *buf,
+		size_t size)
 {
 	struct avflt_event *event;
 	ssize_t len;
 	ssize_t rv;
 
-	if (!(file->f_mode & FMODE_WRITE))
-		return -EINVAL;
+	event = avflt_dev_get_request(file);
+	if (IS_ERR(event))
+		return PTR_ERR(event);
 
-	event = avflt_get_request();
 	if (!event)
 		return 0;
 
@@ -99,17 +130,19 @@ static ssize_t avflt_dev_read(struct file *file, char __user *buf,
 	if (rv)
 		goto error;
 
-	rv = len = avflt_copy_cmd(buf, size, event);
-	if (rv < 0)
-		goto error;
-
 	rv = avflt_add_reply(event);
 	if (rv)
 		goto error;
 
+	rv = len = avflt_copy_cmd(buf, size, event);
+	if (rv < 0)
+		goto error_reply;
+
 	avflt_install_fd(event);
 	avflt_event_put(event);
 	return len;
+error_reply:
+	avflt_rem_reply(event);
 error:
 	avflt_put_file(event);
 	avflt_readd_request(event);
@@ -117,12 +150,191 @@ error:
 	return rv;
 }
 
+static ssize_t avflt_dev_read_bin(struct file *file, char __user *buf,
+		size_t size)
+{
+	struct avflt_event *event;
+	ssize_t len = 0;
+	int rv;
+
+	if (size < sizeof(struct avflt_msg_event))
+		return -EINVAL;
+
+	while (size - len >= sizeof(struct avflt_msg_event)) {
+		if (len)
+			event = avflt_get_request(avflt_dev_conn(file)->queue);
+		else
+			event = avflt_dev_get_request(file);
+
+		if (IS_ERR(event))
+			return PTR_ERR(event);
+
+		if (!event)
+			break;
+
+		rv = avflt_get_file(event);
+		if (rv)
+			goto error;
+
+		rv = avflt_add_reply(event);
+		if (rv)
+			goto error;
+
+		rv = avflt_copy_msg(buf + len, event);
+		if (rv)
+			goto error_reply;
+
+		avflt_install_fd(event);
+		avflt_event_put(event);
+		len += sizeof(struct avflt_msg_event);
+	}
+
+	return len;
+error_reply:
+	avflt_rem_reply(event);
+error:
+	avflt_put_file(event);
+	avflt_readd_request(event);
+	avflt_event_put(event);
+	return len ? len : rv;
+}
+
+static ssize_t avflt_dev_read_path(struct file *file, char __user *buf,
+		size_t size)
+{
+	struct avflt_event *event;
+	ssize_t len = 0;
+	char *path;
+	ssize_t rv;
+
+	path = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!path)
+		return -ENOMEM;
+
+	while (size - len > sizeof(struct avflt_msg_path)) {
+		if (len)
+			event = avflt_get_request(avflt_dev_conn(file)->queue);
+		else
+			event = avflt_dev_get_request(file);
+
+		if (IS_ERR(event)) {
+			rv = PTR_ERR(event);
+			goto exit;
+		}
+
+		if (!event)
+			break;
+
+		rv = avflt_add_reply(event);
+		if (rv)
+			goto error;
+
+		rv = avflt_copy_path(buf + len, size - len, event, path);
+		if (rv < 0)
+			goto error_reply;
+
+		avflt_event_put(event);
+		len += rv;
+	}
+
+	kfree(path);
+	return len;
+error_reply:
+	avflt_rem_reply(event);
+error:
+	avflt_readd_request(event);
+	avflt_event_put(event);
+	if (rv == -ENOSPC && !len)
+		rv = -EINVAL;
+exit:
+	kfree(path);
+	return len ? len : rv;
+}
+
+static ssize_t avflt_dev_read(struct file *file, char __user *buf,
+		size_t size, loff_t *pos)
+{
+	if (!(file->f_mode & FMODE_WRITE))
+		return -EINVAL;
+
+	switch (avflt_dev_conn(file)->proto) {
+	case AVFLT_PROTO_RING:
+		return avflt_ring_enter(avflt_dev_conn(file)->ring,
+				avflt_dev_conn(file)->queue);
+
+	case AVFLT_PROTO_BIN:
+		return avflt_dev_read_bin(file, buf, size);
+
+	case AVFLT_PROTO_PATH:
+		return avflt_dev_read_path(file, buf, size);
+
+	default:
+		return avflt_dev_read_text(file, buf, size);
+	}
+}
+
+static int avflt_dev_set_ver(struct avflt_conn *conn, int ver)
+{
+	if (ver != AVFLT_PROTO_TEXT && ver != AVFLT_PROTO_BIN &&
+	    ver != AVFLT_PROTO_PATH)
+		return -EPROTONOSUPPORT;
+
+	if (ver != conn->proto && conn->ring)
+		return -EBUSY;
+
+	conn->proto = ver;
+	return 0;
+}
+
+static int avflt_dev_set_queue(struct avflt_conn *conn, int queue)
+{
+	if (queue != -1 && !avflt_queue_valid(queue))
+		return -EINVAL;
+
+	conn->queue = queue;
+	return 0;
+}
+
+static ssize_t avflt_dev_ctl(struct file *file, const char __user *buf,
+		size_t size)
+{
+	struct avflt_conn *conn = avflt_dev_conn(file);
+	int ver = conn->proto;
+	int queue = conn->queue;
+	int rv;
+
+	rv = avflt_get_ctl(buf, size, &ver, &queue);
+	if (rv)
+		return rv;
+
+	rv = avflt_dev_set_ver(conn, ver);
+	if (rv)
+		return rv;
+
+	rv = avflt_dev_set_queue(conn, queue);
+	if (rv)
+		return rv;
+
+	return size;
+}
+
+/*
+ * Control strings are accepted only with the text protocol, the other
+ * protocols take the AVFLT_IOC_SET_VER and AVFLT_IOC_SET_QUEUE ioctls and
+ * each write is an array of replies.
+ */
 static ssize_t avflt_dev_write(struct file *file, const char __user *buf,
 		size_t size, loff_t *pos)
 {
 	struct avflt_event *event;
 
+	if (avflt_dev_conn(file)->proto != AVFLT_PROTO_TEXT)
+		return avflt_get_replies(buf, size);
+
 	event = avflt_get_reply(buf, size);
+	if (PTR_ERR(event) == -EINVAL)
+		return avflt_dev_ctl(file, buf, size);
+
 	if (IS_ERR(event))
 		return PTR_ERR(event);
 
@@ -131,6 +343,35 @@ static ssize_t avflt_dev_write(struct file *file, const char __user *buf,
 	return size;
 }
 
+static int avflt_dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	if (!(file->f_mode & FMODE_WRITE))
+		return -EINVAL;
+
+	return avflt_ring_mmap(avflt_dev_conn(file), vma);
+}
+
+static long avflt_dev_ioctl(struct file *file, unsigned int cmd,
+		unsigned long arg)
+{
+	if (!(file->f_mode & FMODE_WRITE))
+		return -EINVAL;
+
+	switch (cmd) {
+	case AVFLT_IOC_GET_FD:
+		return avflt_get_fd((int)arg);
+
+	case AVFLT_IOC_SET_VER:
+		return avflt_dev_set_ver(avflt_dev_conn(file), (int)arg);
+
+	case AVFLT_IOC_SET_QUEUE:
+		return avflt_dev_set_queue(avflt_dev_conn(file), (int)arg);
+
+	default:
+		return -ENOTTY;
+	}
+}
+
 static unsigned int avflt_poll(struct file *file, poll_table *wait)
 {
 	unsigned int mask;
@@ -151,6 +392,11 @@ static struct file_operations avflt_fops = {
 	.release = avflt_dev_release,
 	.read = avflt_dev_read,
 	.write = avflt_dev_write,
+	.mmap = avflt_dev_mmap,
+	.unlocked_ioctl = avflt_dev_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = avflt_dev_ioctl,
+#endif
 	.poll = avflt_poll
 };
 
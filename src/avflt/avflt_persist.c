@@ -0,0 +1,194 @@
+/*
+ * AVFlt: Anti-Virus Filter
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "avflt.h"
+
+#define AVFLT_PERSIST_XATTR "trusted.avflt"
+#define AVFLT_PERSIST_MAGIC 0x61766632
+
+/*
+ * The verdict is stored in a trusted xattr of the scanned file itself. The
+ * record is valid only for the same signature database version (0 disables
+ * the persistent cache), the same inode number, generation, size and
+ * ctime. Unlike the mtime, the ctime cannot be set from userspace and any
+ * change of the file moves it. Storing the xattr moves the ctime as well,
+ * so the record carries the ctime expected after the store and it is kept
+ * only if the inode really has it afterwards. The xattr is changed through
+ * the VFS, so read-only mounts and the xattr permissions are respected.
+ */
+struct avflt_persist_rec {
+	__u32 magic;
+	__u32 sig_ver;
+	__u32 state;
+	__u32 generation;
+	__u64 ino;
+	__u64 size;
+	__s64 ctime_sec;
+	__u32 ctime_nsec;
+	__u32 pad;
+};
+
+atomic_t avflt_persist_ver = ATOMIC_INIT(0);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
+static int avflt_persist_want_write(struct vfsmount *mnt, struct inode *inode)
+{
+	return mnt_want_write(mnt);
+}
+
+static void avflt_persist_drop_write(struct vfsmount *mnt)
+{
+	mnt_drop_write(mnt);
+}
+#else
+static int avflt_persist_want_write(struct vfsmount *mnt, struct inode *inode)
+{
+	if (IS_RDONLY(inode))
+		return -EROFS;
+
+	return 0;
+}
+
+static void avflt_persist_drop_write(struct vfsmount *mnt)
+{
+}
+#endif
+
+static void avflt_persist_fill(struct avflt_persist_rec *rec,
+		struct inode *inode, loff_t size, struct timespec *ctime)
+{
+	memset(rec, 0, sizeof(struct avflt_persist_rec));
+	rec->magic = AVFLT_PERSIST_MAGIC;
+	rec->sig_ver = atomic_read(&avflt_persist_ver);
+	rec->generation = inode->i_generation;
+	rec->ino = inode->i_ino;
+	rec->size = size;
+	rec->ctime_sec = ctime->tv_sec;
+	rec->ctime_nsec = ctime->tv_nsec;
+}
+
+static int avflt_persist_match(struct inode *inode,
+		struct avflt_persist_rec *stored)
+{
+	struct avflt_persist_rec rec;
+
+	avflt_persist_fill(&rec, inode, i_size_read(inode), &inode->i_ctime);
+	rec.state = stored->state;
+
+	return !memcmp(&rec, stored, sizeof(rec));
+}
+
+int avflt_persist_check(struct file *file)
+{
+	struct dentry *dentry = file->f_dentry;
+	struct inode *inode = dentry->d_inode;
+	struct avflt_persist_rec stored;
+	ssize_t rv;
+
+	if (!atomic_read(&avflt_persist_ver))
+		return 0;
+
+	if (file->f_mode & FMODE_WRITE) {
+		avflt_persist_invalidate(file);
+		return 0;
+	}
+
+	if (!inode->i_op || !inode->i_op->getxattr)
+		return 0;
+
+	rv = inode->i_op->getxattr(dentry, AVFLT_PERSIST_XATTR, &stored,
+			sizeof(stored));
+	if (rv != sizeof(stored))
+		return 0;
+
+	if (!avflt_persist_match(inode, &stored))
+		return 0;
+
+	if (stored.state != AVFLT_FILE_CLEAN &&
+	    stored.state != AVFLT_FILE_INFECTED)
+		return 0;
+
+	return stored.state;
+}
+
+/*
+ * The size and ctime sampled before the scan have to be still valid, so a
+ * file modified during the scan does not get a record.
+ */
+void avflt_persist_store(struct avflt_event *event)
+{
+	struct dentry *dentry = event->dentry;
+	struct inode *inode = dentry->d_inode;
+	struct avflt_persist_rec rec;
+	struct timespec ctime;
+
+	if (!atomic_read(&avflt_persist_ver))
+		return;
+
+	if (event->result != AVFLT_FILE_CLEAN &&
+	    event->result != AVFLT_FILE_INFECTED)
+		return;
+
+	if (!inode->i_op || !inode->i_op->setxattr)
+		return;
+
+	if (atomic_read(&inode->i_writecount) > 0)
+		return;
+
+	if (!timespec_equal(&inode->i_ctime, &event->ctime) ||
+	    i_size_read(inode) != event->size)
+		return;
+
+	if (avflt_persist_want_write(event->mnt, inode))
+		return;
+
+	ctime = current_fs_time(inode->i_sb);
+	avflt_persist_fill(&rec, inode, event->size, &ctime);
+	rec.state = event->result;
+
+	if (vfs_setxattr(dentry, AVFLT_PERSIST_XATTR, &rec, sizeof(rec), 0))
+		goto exit;
+
+	if (!avflt_persist_match(inode, &rec))
+		vfs_removexattr(dentry, AVFLT_PERSIST_XATTR);
+exit:
+	avflt_persist_drop_write(event->mnt);
+}
+
+void avflt_persist_invalidate(struct file *file)
+{
+	struct dentry *dentry = file->f_dentry;
+	struct inode *inode = dentry->d_inode;
+
+	if (!inode->i_op || !inode->i_op->getxattr)
+		return;
+
+	if (inode->i_op->getxattr(dentry, AVFLT_PERSIST_XATTR, NULL, 0) <= 0)
+		return;
+
+	if (avflt_persist_want_write(file->f_vfsmnt, inode))
+		return;
+
+	vfs_removexattr(dentry, AVFLT_PERSIST_XATTR);
+	avflt_persist_drop_write(file->f_vfsmnt);
+}
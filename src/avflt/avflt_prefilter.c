@@ -0,0 +1,418 @@
+/*
+ * AVFlt: Anti-Virus Filter
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "avflt.h"
+
+/*
+ * Per root rules evaluated before a request is queued. Files smaller than
+ * min or bigger than max (0 means no limit) are not scanned. Extensions
+ * are kept in a small open addressed table, an allowed extension is not
+ * scanned and a denied one is refused without a scan. If there are any
+ * magics, only files starting with one of them are scanned. The rules are
+ * replaced as a whole under RCU, so the lookups do not take any lock.
+ */
+#define AVFLT_EXT_NR	64
+#define AVFLT_EXT_LEN	16
+#define AVFLT_MAGIC_NR	8
+#define AVFLT_MAGIC_LEN	16
+
+#define AVFLT_EXT_ALLOW	'a'
+#define AVFLT_EXT_DENY	'd'
+
+struct avflt_ext {
+	unsigned int hash;
+	char policy;
+	char name[AVFLT_EXT_LEN];
+};
+
+struct avflt_magic {
+	int len;
+	unsigned char bytes[AVFLT_MAGIC_LEN];
+};
+
+struct avflt_prefilter {
+	struct rcu_head rcu;
+	loff_t min_size;
+	loff_t max_size;
+	int ext_nr;
+	struct avflt_ext ext[AVFLT_EXT_NR];
+	int magic_nr;
+	struct avflt_magic magic[AVFLT_MAGIC_NR];
+};
+
+static DEFINE_MUTEX(avflt_prefilter_mutex);
+
+static int avflt_ext_get(const char *name, int len, char *ext)
+{
+	int i;
+
+	if (!len || len >= AVFLT_EXT_LEN)
+		return -EINVAL;
+
+	for (i = 0; i < len; i++)
+		ext[i] = tolower(name[i]);
+
+	ext[len] = 0;
+
+	return 0;
+}
+
+static struct avflt_ext *avflt_ext_find(struct avflt_prefilter *pf,
+		const char *ext, unsigned int hash)
+{
+	struct avflt_ext *slot;
+	int i;
+
+	for (i = 0; i < AVFLT_EXT_NR; i++) {
+		slot = &pf->ext[(hash + i) & (AVFLT_EXT_NR - 1)];
+
+		if (!slot->policy)
+			return slot;
+
+		if (slot->hash == hash && !strcmp(slot->name, ext))
+			return slot;
+	}
+
+	return NULL;
+}
+
+static int avflt_prefilter_ext(struct avflt_prefilter *pf,
+		struct dentry *dentry)
+{
+	struct avflt_ext *slot;
+	char ext[AVFLT_EXT_LEN];
+	const char *dot;
+	int rv = 0;
+
+	if (!pf->ext_nr)
+		return 0;
+
+	spin_lock(&dentry->d_lock);
+	dot = strrchr((const char *)dentry->d_name.name, '.');
+	if (dot)
+		rv = avflt_ext_get(dot + 1, strlen(dot + 1), ext);
+	spin_unlock(&dentry->d_lock);
+
+	if (!dot || rv)
+		return 0;
+
+	slot = avflt_ext_find(pf, ext,
+			full_name_hash((unsigned char *)ext, strlen(ext)));
+	if (!slot || !slot->policy)
+		return 0;
+
+	if (slot->policy == AVFLT_EXT_DENY)
+		return -EPERM;
+
+	return 1;
+}
+
+static struct page *avflt_read_page(struct address_space *mapping)
+{
+	if (!mapping->a_ops || !mapping->a_ops->readpage)
+		return ERR_PTR(-EINVAL);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,21)
+	return read_cache_page(mapping, 0,
+			(filler_t *)mapping->a_ops->readpage, NULL);
+#else
+	return read_mapping_page(mapping, 0, NULL);
+#endif
+}
+
+static int avflt_prefilter_magic(struct avflt_magic *magic, int nr,
+		struct inode *inode)
+{
+	struct page *page;
+	char *addr;
+	loff_t size;
+	int match = 0;
+	int i;
+
+	page = avflt_read_page(inode->i_mapping);
+	if (IS_ERR(page))
+		return 0;
+
+	size = i_size_read(inode);
+	addr = kmap(page);
+
+	for (i = 0; i < nr && !match; i++) {
+		if (size < magic[i].len)
+			continue;
+
+		match = !memcmp(addr, magic[i].bytes, magic[i].len);
+	}
+
+	kunmap(page);
+	page_cache_release(page);
+
+	return !match;
+}
+
+/*
+ * Returns 0 if the file should be scanned, 1 if it can be skipped and
+ * -EPERM if it is denied.
+ */
+int avflt_prefilter_check(struct file *file)
+{
+	struct avflt_magic magic[AVFLT_MAGIC_NR];
+	struct avflt_root_data *root_data;
+	struct avflt_prefilter *pf;
+	struct inode *inode = file->f_dentry->d_inode;
+	int magic_nr = 0;
+	loff_t size;
+	int rv = 0;
+
+	root_data = avflt_get_root_data_inode(inode);
+	if (!root_data)
+		return 0;
+
+	rcu_read_lock();
+
+	pf = rcu_dereference(root_data->prefilter);
+	if (!pf)
+		goto exit;
+
+	size = i_size_read(inode);
+
+	if (pf->min_size && size < pf->min_size) {
+		rv = 1;
+		goto exit;
+	}
+
+	if (pf->max_size && size > pf->max_size) {
+		rv = 1;
+		goto exit;
+	}
+
+	rv = avflt_prefilter_ext(pf, file->f_dentry);
+	if (rv || !pf->magic_nr)
+		goto exit;
+
+	/*
+	 * Reading the page may sleep, so the magics are copied.
+	 */
+	magic_nr = pf->magic_nr;
+	memcpy(magic, pf->magic, sizeof(struct avflt_magic) * magic_nr);
+exit:
+	rcu_read_unlock();
+	avflt_put_root_data(root_data);
+
+	if (!magic_nr)
+		return rv;
+
+	return avflt_prefilter_magic(magic, magic_nr, inode);
+}
+
+static void avflt_prefilter_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct avflt_prefilter, rcu));
+}
+
+static void avflt_prefilter_replace(struct avflt_root_data *root_data,
+		struct avflt_prefilter *pf)
+{
+	struct avflt_prefilter *old;
+
+	old = root_data->prefilter;
+	rcu_assign_pointer(root_data->prefilter, pf);
+
+	if (!old)
+		return;
+
+	call_rcu(&old->rcu, avflt_prefilter_free_rcu);
+}
+
+static int avflt_prefilter_set_ext(struct avflt_prefilter *pf,
+		const char *name, char policy)
+{
+	struct avflt_ext *slot;
+	char ext[AVFLT_EXT_LEN];
+	unsigned int hash;
+
+	if (avflt_ext_get(name, strlen(name), ext))
+		return -EINVAL;
+
+	hash = full_name_hash((unsigned char *)ext, strlen(ext));
+
+	slot = avflt_ext_find(pf, ext, hash);
+	if (!slot)
+		return -ENOSPC;
+
+	if (!slot->policy)
+		pf->ext_nr++;
+
+	slot->hash = hash;
+	slot->policy = policy;
+	strcpy(slot->name, ext);
+
+	return 0;
+}
+
+static int avflt_prefilter_set_magic(struct avflt_prefilter *pf,
+		const char *hex)
+{
+	struct avflt_magic *magic;
+	int len = strlen(hex);
+	unsigned int byte;
+	int i;
+
+	if (!len || len % 2 || len / 2 > AVFLT_MAGIC_LEN)
+		return -EINVAL;
+
+	if (pf->magic_nr == AVFLT_MAGIC_NR)
+		return -ENOSPC;
+
+	magic = &pf->magic[pf->magic_nr];
+
+	for (i = 0; i < len / 2; i++) {
+		if (!isxdigit(hex[2 * i]) || !isxdigit(hex[2 * i + 1]))
+			return -EINVAL;
+
+		if (sscanf(hex + 2 * i, "%2x", &byte) != 1)
+			return -EINVAL;
+
+		magic->bytes[i] = byte;
+	}
+
+	magic->len = len / 2;
+	pf->magic_nr++;
+
+	return 0;
+}
+
+/*
+ * min:%lld, max:%lld, allow:ext, deny:ext, magic:hex or clear
+ */
+int avflt_prefilter_set(struct avflt_root_data *root_data, const char *cmd)
+{
+	struct avflt_prefilter *pf;
+	char arg[2 * AVFLT_MAGIC_LEN + 1];
+	long long size;
+	int rv = 0;
+
+	pf = kzalloc(sizeof(struct avflt_prefilter), GFP_KERNEL);
+	if (!pf)
+		return -ENOMEM;
+
+	mutex_lock(&avflt_prefilter_mutex);
+
+	if (root_data->prefilter)
+		memcpy(pf, root_data->prefilter,
+				sizeof(struct avflt_prefilter));
+
+	if (sscanf(cmd, "min:%lld", &size) == 1 && size >= 0)
+		pf->min_size = size;
+
+	else if (sscanf(cmd, "max:%lld", &size) == 1 && size >= 0)
+		pf->max_size = size;
+
+	else if (sscanf(cmd, "allow:%32s", arg) == 1)
+		rv = avflt_prefilter_set_ext(pf, arg, AVFLT_EXT_ALLOW);
+
+	else if (sscanf(cmd, "deny:%32s", arg) == 1)
+		rv = avflt_prefilter_set_ext(pf, arg, AVFLT_EXT_DENY);
+
+	else if (sscanf(cmd, "magic:%32s", arg) == 1)
+		rv = avflt_prefilter_set_magic(pf, arg);
+
+	else if (!strncmp(cmd, "clear", 5)) {
+		kfree(pf);
+		pf = NULL;
+
+	} else
+		rv = -EINVAL;
+
+	if (rv) {
+		mutex_unlock(&avflt_prefilter_mutex);
+		kfree(pf);
+		return rv;
+	}
+
+	avflt_prefilter_replace(root_data, pf);
+	mutex_unlock(&avflt_prefilter_mutex);
+
+	return 0;
+}
+
+ssize_t avflt_prefilter_get_info(struct avflt_root_data *root_data, int id,
+		char *buf, int size)
+{
+	struct avflt_prefilter *pf;
+	struct avflt_magic *magic;
+	ssize_t len = 0;
+	int i, j;
+
+	mutex_lock(&avflt_prefilter_mutex);
+
+	pf = root_data->prefilter;
+	if (!pf)
+		goto exit;
+
+	len += snprintf(buf + len, size - len, "%d:min:%lld", id,
+			(long long)pf->min_size) + 1;
+	if (len >= size)
+		goto exit;
+
+	len += snprintf(buf + len, size - len, "%d:max:%lld", id,
+			(long long)pf->max_size) + 1;
+	if (len >= size)
+		goto exit;
+
+	for (i = 0; i < AVFLT_EXT_NR; i++) {
+		if (!pf->ext[i].policy)
+			continue;
+
+		len += snprintf(buf + len, size - len, "%d:%s:%s", id,
+				pf->ext[i].policy == AVFLT_EXT_DENY ?
+				"deny" : "allow", pf->ext[i].name) + 1;
+		if (len >= size)
+			goto exit;
+	}
+
+	for (i = 0; i < pf->magic_nr; i++) {
+		magic = &pf->magic[i];
+
+		len += snprintf(buf + len, size - len, "%d:magic:", id);
+		for (j = 0; j < magic->len && len < size; j++)
+			len += snprintf(buf + len, size - len, "%02x",
+					magic->bytes[j]);
+
+		len++;
+		if (len >= size)
+			goto exit;
+	}
+exit:
+	mutex_unlock(&avflt_prefilter_mutex);
+
+	if (len > size)
+		len = size;
+
+	return len;
+}
+
+void avflt_prefilter_free(struct avflt_root_data *root_data)
+{
+	kfree(root_data->prefilter);
+	root_data->prefilter = NULL;
+}
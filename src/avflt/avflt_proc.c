@@ -23,10 +23,22 @@
 
 #include "avflt.h"
 
-static LIST_HEAD(avflt_proc_list);
+#define AVFLT_HASH_BITS 6
+#define AVFLT_HASH_SIZE (1 << AVFLT_HASH_BITS)
+
+#define avflt_hash(table, tgid) (&(table)[hash_long(tgid, AVFLT_HASH_BITS)])
+
+/*
+ * Both registries are hashed by tgid. Writers hold the lock, lookups done
+ * for each checked open run under rcu.
+ */
+static struct hlist_head avflt_proc_hash[AVFLT_HASH_SIZE];
 static DEFINE_SPINLOCK(avflt_proc_lock);
+static int avflt_proc_nr;
+/* open scanner connections, a process may scan from several threads */
+static int avflt_conn_nr;
 
-static LIST_HEAD(avflt_trusted_list);
+static struct hlist_head avflt_trusted_hash[AVFLT_HASH_SIZE];
 static DEFINE_SPINLOCK(avflt_trusted_lock);
 
 static struct avflt_trusted *avflt_trusted_alloc(pid_t tgid)
@@ -37,22 +49,30 @@ static struct avflt_trusted *avflt_trusted_alloc(pid_t tgid)
 	if (!trusted)
 		return ERR_PTR(-ENOMEM);
 
+	INIT_HLIST_NODE(&trusted->hash);
 	trusted->tgid = tgid;
 	trusted->open = 1;
 
 	return trusted;
 }
 
+static void avflt_trusted_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct avflt_trusted, rcu));
+}
+
 static void avflt_trusted_free(struct avflt_trusted *trusted)
 {
-	kfree(trusted);
+	call_rcu(&trusted->rcu, avflt_trusted_free_rcu);
 }
 
 static struct avflt_trusted *avflt_trusted_find(pid_t tgid)
 {
 	struct avflt_trusted *trusted;
+	struct hlist_node *pos;
 
-	list_for_each_entry(trusted, &avflt_trusted_list, list) {
+	hlist_for_each_entry_rcu(trusted, pos,
+			avflt_hash(avflt_trusted_hash, tgid), hash) {
 		if (trusted->tgid == tgid)
 			return trusted;
 	}
@@ -74,10 +94,11 @@ int avflt_trusted_add(pid_t tgid)
 	found = avflt_trusted_find(tgid);
 	if (found) {
 		found->open++;
-		avflt_trusted_free(trusted);
+		kfree(trusted);
 
 	} else
-		list_add_tail(&trusted->list, &avflt_trusted_list);
+		hlist_add_head_rcu(&trusted->hash,
+				avflt_hash(avflt_trusted_hash, tgid));
 
 	spin_unlock(&avflt_trusted_lock);
 
@@ -97,7 +118,7 @@ void avflt_trusted_rem(pid_t tgid)
 	if (--found->open)
 		goto exit;
 
-	list_del_init(&found->list);
+	hlist_del_rcu(&found->hash);
 
 	avflt_trusted_free(found);
 exit:
@@ -108,9 +129,9 @@ int avflt_trusted_allow(pid_t tgid)
 {
 	struct avflt_trusted *found;
 
-	spin_lock(&avflt_trusted_lock);
+	rcu_read_lock();
 	found = avflt_trusted_find(tgid);
-	spin_unlock(&avflt_trusted_lock);
+	rcu_read_unlock();
 
 	if (found)
 		return 1;
@@ -126,8 +147,9 @@ static struct avflt_proc *avflt_proc_alloc(pid_t tgid)
 	if (!proc)
 		return ERR_PTR(-ENOMEM);
 
-	INIT_LIST_HEAD(&proc->list);
+	INIT_HLIST_NODE(&proc->hash);
 	INIT_LIST_HEAD(&proc->events);
+	idr_init(&proc->idr);
 	spin_lock_init(&proc->lock);
 	atomic_set(&proc->count, 1);
 	proc->tgid = tgid;
@@ -136,6 +158,11 @@ static struct avflt_proc *avflt_proc_alloc(pid_t tgid)
 	return proc;
 }
 
+static void avflt_proc_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct avflt_proc, rcu));
+}
+
 struct avflt_proc *avflt_proc_get(struct avflt_proc *proc)
 {
 	if (!proc || IS_ERR(proc))
@@ -165,31 +192,41 @@ void avflt_proc_put(struct avflt_proc *proc)
 		avflt_event_put(event);
 	}
 
-	kfree(proc);
+	idr_remove_all(&proc->idr);
+	idr_destroy(&proc->idr);
+	call_rcu(&proc->rcu, avflt_proc_free_rcu);
 }
 
-static struct avflt_proc *avflt_proc_find_nolock(pid_t tgid)
+static struct avflt_proc *avflt_proc_lookup(pid_t tgid)
 {
-	struct avflt_proc *found = NULL;
 	struct avflt_proc *proc;
+	struct hlist_node *pos;
 
-	list_for_each_entry(proc, &avflt_proc_list, list) {
-		if (proc->tgid == tgid) {
-			found = avflt_proc_get(proc);
-			break;
-		}
+	hlist_for_each_entry_rcu(proc, pos,
+			avflt_hash(avflt_proc_hash, tgid), hash) {
+		if (proc->tgid == tgid)
+			return proc;
 	}
 
-	return found;
+	return NULL;
+}
+
+static struct avflt_proc *avflt_proc_find_nolock(pid_t tgid)
+{
+	return avflt_proc_get(avflt_proc_lookup(tgid));
 }
 
 struct avflt_proc *avflt_proc_find(pid_t tgid)
 {
 	struct avflt_proc *proc;
 
-	spin_lock(&avflt_proc_lock);
-	proc = avflt_proc_find_nolock(tgid);
-	spin_unlock(&avflt_proc_lock);
+	rcu_read_lock();
+
+	proc = avflt_proc_lookup(tgid);
+	if (proc && !atomic_inc_not_zero(&proc->count))
+		proc = NULL;
+
+	rcu_read_unlock();
 
 	return proc;
 }
@@ -208,12 +245,15 @@ struct avflt_proc *avflt_proc_add(pid_t tgid)
 	found = avflt_proc_find_nolock(tgid);
 	if (found) {
 		found->open++;
+		avflt_conn_nr++;
 		spin_unlock(&avflt_proc_lock);
 		avflt_proc_put(proc);
 		return found;
 	}
 
-	list_add_tail(&proc->list, &avflt_proc_list);
+	hlist_add_head_rcu(&proc->hash, avflt_hash(avflt_proc_hash, tgid));
+	avflt_proc_nr++;
+	avflt_conn_nr++;
 	avflt_proc_get(proc);
 
 	spin_unlock(&avflt_proc_lock);
@@ -233,12 +273,16 @@ void avflt_proc_rem(pid_t tgid)
 		return;
 	}
 
+	avflt_conn_nr--;
+
 	if (--proc->open) {
 		spin_unlock(&avflt_proc_lock);
+		avflt_proc_put(proc);
 		return;
 	}
 
-	list_del(&proc->list);
+	hlist_del_rcu(&proc->hash);
+	avflt_proc_nr--;
 	spin_unlock(&avflt_proc_lock);
 	avflt_proc_put(proc);
 	avflt_proc_put(proc);
@@ -248,11 +292,12 @@ int avflt_proc_allow(pid_t tgid)
 {
 	struct avflt_proc *proc;
 
-	proc = avflt_proc_find(tgid);
-	if (proc) {
-		avflt_proc_put(proc);
+	rcu_read_lock();
+	proc = avflt_proc_lookup(tgid);
+	rcu_read_unlock();
+
+	if (proc)
 		return 1;
-	}
 
 	return 0;
 }
@@ -262,20 +307,57 @@ int avflt_proc_empty(void)
 	int empty;
 
 	spin_lock(&avflt_proc_lock);
-	empty = list_empty(&avflt_proc_list);
+	empty = !avflt_proc_nr;
 	spin_unlock(&avflt_proc_lock);
 
 	return empty;
 }
 
-void avflt_proc_add_event(struct avflt_proc *proc, struct avflt_event *event)
+int avflt_conn_count(void)
 {
-	spin_lock(&proc->lock);
+	int nr;
 
-	list_add_tail(&event->proc_list, &proc->events);
-	avflt_event_get(event);
+	spin_lock(&avflt_proc_lock);
+	nr = avflt_conn_nr;
+	spin_unlock(&avflt_proc_lock);
 
-	spin_unlock(&proc->lock);
+	return nr;
+}
+
+/*
+ * Event ids are allocated from the per process idr. They are allocated
+ * cyclically so a late reply for a timed out event does not match a new
+ * event reusing its id.
+ */
+int avflt_proc_add_event(struct avflt_proc *proc, struct avflt_event *event)
+{
+	int id;
+	int rv;
+
+	do {
+		if (!idr_pre_get(&proc->idr, GFP_KERNEL))
+			return -ENOMEM;
+
+		spin_lock(&proc->lock);
+
+		rv = idr_get_new_above(&proc->idr, event, proc->next_id, &id);
+		if (rv == -ENOSPC && proc->next_id) {
+			proc->next_id = 0;
+			rv = idr_get_new_above(&proc->idr, event, 0, &id);
+		}
+
+		if (!rv) {
+			proc->next_id = id + 1;
+			event->id = id;
+			list_add_tail(&event->proc_list, &proc->events);
+			avflt_event_get(event);
+		}
+
+		spin_unlock(&proc->lock);
+
+	} while (rv == -EAGAIN);
+
+	return rv;
 }
 
 void avflt_proc_rem_event(struct avflt_proc *proc, struct avflt_event *event)
@@ -287,6 +369,7 @@ void avflt_proc_rem_event(struct avflt_proc *proc, struct avflt_event *event)
 		return;
 	}
 
+	idr_remove(&proc->idr, event->id);
 	list_del_init(&event->proc_list);
 
 	spin_unlock(&proc->lock);
@@ -297,20 +380,35 @@ void avflt_proc_rem_event(struct avflt_proc *proc, struct avflt_event *event)
 struct avflt_event *avflt_proc_get_event(struct avflt_proc *proc, int id)
 {
 	struct avflt_event *found = NULL;
-	struct avflt_event *event;
+
+	if (id < 0)
+		return NULL;
 
 	spin_lock(&proc->lock);
 
-	list_for_each_entry(event, &proc->events, proc_list) {
-		if (event->id == id) {
-			found = event;
-			break;
-		}
+	found = idr_find(&proc->idr, id);
+	if (found) {
+		idr_remove(&proc->idr, id);
+		list_del_init(&found->proc_list);
 	}
 
-	if (found)
-		list_del_init(&event->proc_list);
+	spin_unlock(&proc->lock);
+
+	return found;
+}
 
+/*
+ * Returns a reference to a pending event without taking it
+ */
+struct avflt_event *avflt_proc_find_event(struct avflt_proc *proc, int id)
+{
+	struct avflt_event *found = NULL;
+
+	if (id < 0)
+		return NULL;
+
+	spin_lock(&proc->lock);
+	found = avflt_event_get(idr_find(&proc->idr, id));
 	spin_unlock(&proc->lock);
 
 	return found;
@@ -319,15 +417,20 @@ struct avflt_event *avflt_proc_get_event(struct avflt_proc *proc, int id)
 ssize_t avflt_proc_get_info(char *buf, int size)
 {
 	struct avflt_proc *proc;
+	struct hlist_node *pos;
 	ssize_t len = 0;
+	int i;
 
 	spin_lock(&avflt_proc_lock);
 
-	list_for_each_entry(proc, &avflt_proc_list, list) {
-		len += snprintf(buf + len, size - len, "%d", proc->tgid) + 1;
-		if (len >= size) {
-			len = size;
-			break;
+	for (i = 0; i < AVFLT_HASH_SIZE && len < size; i++) {
+		hlist_for_each_entry(proc, pos, &avflt_proc_hash[i], hash) {
+			len += snprintf(buf + len, size - len, "%d",
+					proc->tgid) + 1;
+			if (len >= size) {
+				len = size;
+				break;
+			}
 		}
 	}
 
@@ -339,15 +442,21 @@ ssize_t avflt_proc_get_info(char *buf, int size)
 ssize_t avflt_trusted_get_info(char *buf, int size)
 {
 	struct avflt_trusted *trusted;
+	struct hlist_node *pos;
 	ssize_t len = 0;
+	int i;
 
 	spin_lock(&avflt_trusted_lock);
 
-	list_for_each_entry(trusted, &avflt_trusted_list, list) {
-		len += snprintf(buf + len, size - len, "%d", trusted->tgid) + 1;
-		if (len >= size) {
-			len = size;
-			break;
+	for (i = 0; i < AVFLT_HASH_SIZE && len < size; i++) {
+		hlist_for_each_entry(trusted, pos, &avflt_trusted_hash[i],
+				hash) {
+			len += snprintf(buf + len, size - len, "%d",
+					trusted->tgid) + 1;
+			if (len >= size) {
+				len = size;
+				break;
+			}
 		}
 	}
 
@@ -64,6 +64,7 @@ static int avflt_check_cache(struct file *file, int type)
 
 	inode_data = avflt_get_inode_data_inode(file->f_dentry->d_inode);
 	if (!inode_data) {
+		avflt_stats_inc(root_data, AVFLT_STAT_MISSES);
 		avflt_put_root_data(root_data);
 		return 0;
 	}
@@ -94,6 +95,8 @@ static int avflt_check_cache(struct file *file, int type)
 	state = inode_data->state;
 exit:
 	spin_unlock(&inode_data->lock);
+	avflt_stats_inc(root_data, state ? AVFLT_STAT_HITS :
+			AVFLT_STAT_MISSES);
 	avflt_put_inode_data(inode_data);
 	avflt_put_root_data(root_data);
 	return state;
@@ -122,10 +125,21 @@ static enum redirfs_rv avflt_check_file(struct file *file, int type,
 	if (!avflt_should_check(file))
 		return REDIRFS_CONTINUE;
 
+	rv = avflt_prefilter_check(file);
+	if (rv > 0)
+		return REDIRFS_CONTINUE;
+
+	if (rv)
+		return avflt_eval_res(rv, args);
+
 	rv = avflt_check_cache(file, type);
 	if (rv)
 		return avflt_eval_res(rv, args);
 
+	rv = avflt_persist_check(file);
+	if (rv)
+		return avflt_eval_res(rv, args);
+
 	rv = avflt_process_request(file, type);
 	if (rv)
 		return avflt_eval_res(rv, args);
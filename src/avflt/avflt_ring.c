@@ -0,0 +1,206 @@
+/*
+ * AVFlt: Anti-Virus Filter
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "avflt.h"
+
+#define AVFLT_RING_ENTRIES 256
+
+struct avflt_ring {
+	struct avflt_ring_hdr *hdr;
+	struct avflt_msg_event *req;
+	struct avflt_msg_reply *rep;
+	struct mutex lock;
+};
+
+static struct avflt_ring *avflt_ring_alloc(unsigned long size)
+{
+	struct avflt_ring *ring;
+	unsigned long req_size;
+	unsigned long rep_size;
+
+	req_size = sizeof(struct avflt_msg_event) * AVFLT_RING_ENTRIES;
+	rep_size = sizeof(struct avflt_msg_reply) * AVFLT_RING_ENTRIES;
+
+	if (size != PAGE_ALIGN(PAGE_SIZE + req_size + rep_size))
+		return ERR_PTR(-EINVAL);
+
+	ring = kzalloc(sizeof(struct avflt_ring), GFP_KERNEL);
+	if (!ring)
+		return ERR_PTR(-ENOMEM);
+
+	ring->hdr = vmalloc_user(size);
+	if (!ring->hdr) {
+		kfree(ring);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	ring->hdr->entries = AVFLT_RING_ENTRIES;
+	ring->hdr->req_off = PAGE_SIZE;
+	ring->hdr->rep_off = PAGE_SIZE + req_size;
+	ring->req = (void *)ring->hdr + ring->hdr->req_off;
+	ring->rep = (void *)ring->hdr + ring->hdr->rep_off;
+	mutex_init(&ring->lock);
+
+	return ring;
+}
+
+void avflt_ring_free(struct avflt_ring *ring)
+{
+	if (!ring)
+		return;
+
+	vfree(ring->hdr);
+	kfree(ring);
+}
+
+int avflt_ring_mmap(struct avflt_conn *conn, struct vm_area_struct *vma)
+{
+	struct avflt_ring *ring;
+	int rv;
+
+	if (vma->vm_pgoff)
+		return -EINVAL;
+
+	ring = avflt_ring_alloc(vma->vm_end - vma->vm_start);
+	if (IS_ERR(ring))
+		return PTR_ERR(ring);
+
+	rv = remap_vmalloc_range(vma, ring->hdr, 0);
+	if (rv) {
+		avflt_ring_free(ring);
+		return rv;
+	}
+
+	if (cmpxchg(&conn->ring, NULL, ring)) {
+		avflt_ring_free(ring);
+		return -EBUSY;
+	}
+
+	conn->proto = AVFLT_PROTO_RING;
+
+	return 0;
+}
+
+static void avflt_ring_get_replies(struct avflt_ring *ring,
+		struct avflt_proc *proc)
+{
+	struct avflt_msg_reply reply;
+	struct avflt_event *event;
+	u32 head;
+	u32 tail;
+
+	tail = ring->hdr->rep_tail;
+	head = ACCESS_ONCE(ring->hdr->rep_head);
+	smp_rmb();
+
+	if (head - tail > AVFLT_RING_ENTRIES)
+		head = tail + AVFLT_RING_ENTRIES;
+
+	for (; tail != head; tail++) {
+		reply = ring->rep[tail & (AVFLT_RING_ENTRIES - 1)];
+
+		event = avflt_set_reply(proc, reply.id, reply.res,
+				reply.cache);
+		if (!event)
+			continue;
+
+		avflt_event_done(event);
+		avflt_event_put(event);
+	}
+
+	smp_mb();
+	ring->hdr->rep_tail = tail;
+}
+
+static int avflt_ring_add_request(struct avflt_ring *ring,
+		struct avflt_proc *proc, u32 head, int queue)
+{
+	struct avflt_msg_event *msg;
+	struct avflt_event *event;
+	int rv;
+
+	event = avflt_get_request(queue);
+	if (!event)
+		return -ENOENT;
+
+	rv = avflt_get_file(event);
+	if (rv)
+		goto error;
+
+	rv = avflt_proc_add_event(proc, event);
+	if (rv)
+		goto error;
+
+	avflt_install_fd(event);
+
+	msg = &ring->req[head & (AVFLT_RING_ENTRIES - 1)];
+	msg->id = event->id;
+	msg->type = event->type;
+	msg->fd = event->fd;
+	msg->pid = event->pid;
+	msg->tgid = event->tgid;
+
+	avflt_event_put(event);
+	return 0;
+error:
+	avflt_put_file(event);
+	avflt_readd_request(event);
+	avflt_event_put(event);
+	return rv;
+}
+
+ssize_t avflt_ring_enter(struct avflt_ring *ring, int queue)
+{
+	struct avflt_proc *proc;
+	ssize_t nr = 0;
+	u32 head;
+	u32 tail;
+
+	proc = avflt_proc_find(current->tgid);
+	if (!proc)
+		return -ENOENT;
+
+	mutex_lock(&ring->lock);
+
+	avflt_ring_get_replies(ring, proc);
+
+	head = ring->hdr->req_head;
+	tail = ACCESS_ONCE(ring->hdr->req_tail);
+	smp_mb();
+
+	while (head - tail < AVFLT_RING_ENTRIES) {
+		if (avflt_ring_add_request(ring, proc, head, queue))
+			break;
+
+		head++;
+		nr++;
+	}
+
+	smp_wmb();
+	ring->hdr->req_head = head;
+
+	mutex_unlock(&ring->lock);
+	avflt_proc_put(proc);
+
+	return nr;
+}
@@ -0,0 +1,184 @@
+/*
+ * AVFlt: Anti-Virus Filter
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "avflt.h"
+
+/*
+ * Histograms of the time a request waits in the queue (from its adding to
+ * its taking by a scanner) and of the time a scanner needs for it (from
+ * its taking to the reply). Bucket i counts times in [2^i, 2^(i+1)) us,
+ * the last one everything longer.
+ */
+static atomic_t avflt_wait_hist[AVFLT_HIST_NR];
+static atomic_t avflt_service_hist[AVFLT_HIST_NR];
+
+static const char *avflt_stat_names[AVFLT_STAT_NR] = {
+	"hits",
+	"misses",
+	"invalidations",
+	"queued",
+	"timeouts",
+	"readds"
+};
+
+/*
+ * The wall clock may step while a request waits, the latencies are taken
+ * from the monotonic clock where ktime_to_us is available.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+u64 avflt_stats_now(void)
+{
+	return ktime_to_us(ktime_get());
+}
+#else
+u64 avflt_stats_now(void)
+{
+	struct timeval tv;
+
+	do_gettimeofday(&tv);
+
+	return (u64)tv.tv_sec * USEC_PER_SEC + tv.tv_usec;
+}
+#endif
+
+static void avflt_stats_hist(atomic_t *hist, u64 start)
+{
+	u64 now = avflt_stats_now();
+	u64 us;
+	int i;
+
+	if (!start)
+		return;
+
+	us = now > start ? now - start : 0;
+	if (us >> AVFLT_HIST_NR)
+		i = AVFLT_HIST_NR - 1;
+	else
+		i = us ? fls((u32)us) - 1 : 0;
+
+	if (i >= AVFLT_HIST_NR)
+		i = AVFLT_HIST_NR - 1;
+
+	atomic_inc(&hist[i]);
+}
+
+void avflt_stats_wait(struct avflt_event *event)
+{
+	avflt_stats_hist(avflt_wait_hist, event->queued_us);
+}
+
+void avflt_stats_service(struct avflt_event *event)
+{
+	avflt_stats_hist(avflt_service_hist, event->taken_us);
+}
+
+void avflt_stats_inc(struct avflt_root_data *data, int stat)
+{
+	if (!data)
+		return;
+
+	atomic_inc(&data->stats[stat]);
+}
+
+static ssize_t avflt_stats_get_hist(const char *name, atomic_t *hist,
+		char *buf, int size)
+{
+	ssize_t len;
+	int i;
+
+	len = snprintf(buf, size, "%s:", name);
+
+	for (i = 0; i < AVFLT_HIST_NR && len < size; i++)
+		len += snprintf(buf + len, size - len, i ? ",%d" : "%d",
+				atomic_read(&hist[i]));
+
+	return len + 1;
+}
+
+static ssize_t avflt_stats_get_root(struct avflt_root_data *data, int id,
+		char *buf, int size)
+{
+	ssize_t len;
+	int i;
+
+	len = snprintf(buf, size, "%d:", id);
+
+	for (i = 0; i < AVFLT_STAT_NR && len < size; i++)
+		len += snprintf(buf + len, size - len, i ? ",%s:%d" : "%s:%d",
+				avflt_stat_names[i],
+				atomic_read(&data->stats[i]));
+
+	return len + 1;
+}
+
+/*
+ * wait:%d,...  service:%d,...  and %d:<stat>:%d,... for each path
+ */
+ssize_t avflt_stats_get_info(char *buf, int size)
+{
+	struct avflt_root_data *data;
+	redirfs_path *paths;
+	redirfs_root root;
+	ssize_t len;
+	int i = 0;
+
+	len = avflt_stats_get_hist("wait", avflt_wait_hist, buf, size);
+	if (len >= size)
+		return size;
+
+	len += avflt_stats_get_hist("service", avflt_service_hist, buf + len,
+			size - len);
+	if (len >= size)
+		return size;
+
+	paths = redirfs_get_paths(avflt);
+	if (IS_ERR(paths))
+		return len;
+
+	while (paths[i]) {
+		root = redirfs_get_root_path(paths[i]);
+		if (!root)
+			goto next;
+
+		data = avflt_get_root_data_root(root);
+		redirfs_put_root(root);
+		if (!data)
+			goto next;
+
+		len += avflt_stats_get_root(data,
+				redirfs_get_id_path(paths[i]), buf + len,
+				size - len);
+
+		avflt_put_root_data(data);
+
+		if (len >= size) {
+			len = size;
+			break;
+		}
+next:
+		i++;
+	}
+
+	redirfs_put_paths(paths);
+	return len;
+}
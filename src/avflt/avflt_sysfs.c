@@ -93,6 +93,107 @@ static ssize_t avflt_cache_store(redirfs_filter filter,
 	return count;
 }
 
+static ssize_t avflt_async_close_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%d:%d",
+			atomic_read(&avflt_async_close),
+			atomic_read(&avflt_async_nr));
+}
+
+/*
+ * Maximal number of close events scanned asynchronously, 0 makes all
+ * closes wait for the verdict.
+ */
+static ssize_t avflt_async_close_store(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, const char *buf,
+		size_t count)
+{
+	int limit;
+
+	if (sscanf(buf, "%d", &limit) != 1)
+		return -EINVAL;
+
+	if (limit < 0)
+		return -EINVAL;
+
+	atomic_set(&avflt_async_close, limit);
+
+	return count;
+}
+
+static ssize_t avflt_qos_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	struct avflt_qos qos;
+
+	avflt_get_qos(&qos);
+
+	return snprintf(buf, PAGE_SIZE, "open:%d,bulk:%d,close:%d,age:%d,"
+			"huge:%lld", qos.weight[AVFLT_CLASS_OPEN],
+			qos.weight[AVFLT_CLASS_BULK],
+			qos.weight[AVFLT_CLASS_CLOSE], qos.age,
+			(long long)qos.huge);
+}
+
+/*
+ * open, bulk and close are the class weights, age is the time in ms after
+ * which a request is taken regardless of its class (0 disables aging) and
+ * huge is the size in bytes from which opens go to the bulk class (0
+ * disables it).
+ */
+static ssize_t avflt_qos_store(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, const char *buf,
+		size_t count)
+{
+	struct avflt_qos qos;
+	long long huge;
+	int rv;
+
+	if (sscanf(buf, "open:%d,bulk:%d,close:%d,age:%d,huge:%lld",
+				&qos.weight[AVFLT_CLASS_OPEN],
+				&qos.weight[AVFLT_CLASS_BULK],
+				&qos.weight[AVFLT_CLASS_CLOSE], &qos.age,
+				&huge) != 5)
+		return -EINVAL;
+
+	qos.huge = huge;
+
+	rv = avflt_set_qos(&qos);
+	if (rv)
+		return rv;
+
+	return count;
+}
+
+static ssize_t avflt_persist_ver_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%d",
+			atomic_read(&avflt_persist_ver));
+}
+
+/*
+ * Signature database version for the persistent cache, bumping it makes
+ * all stored verdicts stale, 0 disables the persistent cache.
+ */
+static ssize_t avflt_persist_ver_store(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, const char *buf,
+		size_t count)
+{
+	int ver;
+
+	if (sscanf(buf, "%d", &ver) != 1)
+		return -EINVAL;
+
+	if (ver < 0)
+		return -EINVAL;
+
+	atomic_set(&avflt_persist_ver, ver);
+
+	return count;
+}
+
 static ssize_t avflt_cache_paths_show(redirfs_filter filter,
 		struct redirfs_filter_attribute *attr, char *buf)
 {
@@ -187,12 +288,200 @@ static ssize_t avflt_cache_paths_store(redirfs_filter filter,
 	return count;
 }
 
+static ssize_t avflt_overload_paths_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	struct avflt_root_data *data;
+	redirfs_path *paths;
+	redirfs_root root;
+	ssize_t size = 0;
+	char policy;
+	int i = 0;
+
+	paths = redirfs_get_paths(avflt);
+	if (IS_ERR(paths))
+		return PTR_ERR(paths);
+
+	while (paths[i]) {
+		root = redirfs_get_root_path(paths[i]);
+		if (!root)
+			goto next;
+
+		data = avflt_get_root_data_root(root);
+		redirfs_put_root(root);
+		if (!data)
+			goto next;
+
+		policy = atomic_read(&data->overload);
+		avflt_put_root_data(data);
+
+		size += snprintf(buf + size, PAGE_SIZE - size, "%d:%c",
+				redirfs_get_id_path(paths[i]), policy) + 1;
+
+		if (size >= PAGE_SIZE)
+			break;
+next:
+		i++;
+	}
+
+	redirfs_put_paths(paths);
+	return size;
+}
+
+static ssize_t avflt_overload_paths_store(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, const char *buf,
+		size_t count)
+{
+	struct avflt_root_data *data;
+	redirfs_path path;
+	redirfs_root root;
+	char policy;
+	int id;
+
+	if (sscanf(buf, "%c:%d", &policy, &id) != 2)
+		return -EINVAL;
+
+	if (policy != AVFLT_OVERLOAD_BLOCK && policy != AVFLT_OVERLOAD_ALLOW &&
+	    policy != AVFLT_OVERLOAD_DENY)
+		return -EINVAL;
+
+	path = redirfs_get_path_id(id);
+	if (!path)
+		return -ENOENT;
+
+	root = redirfs_get_root_path(path);
+	redirfs_put_path(path);
+	if (!root)
+		return -ENOENT;
+
+	data = avflt_get_root_data_root(root);
+	redirfs_put_root(root);
+	if (!data)
+		return -ENOENT;
+
+	atomic_set(&data->overload, policy);
+	avflt_put_root_data(data);
+
+	return count;
+}
+
+static ssize_t avflt_prefilter_paths_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	struct avflt_root_data *data;
+	redirfs_path *paths;
+	redirfs_root root;
+	ssize_t size = 0;
+	int i = 0;
+
+	paths = redirfs_get_paths(avflt);
+	if (IS_ERR(paths))
+		return PTR_ERR(paths);
+
+	while (paths[i]) {
+		root = redirfs_get_root_path(paths[i]);
+		if (!root)
+			goto next;
+
+		data = avflt_get_root_data_root(root);
+		redirfs_put_root(root);
+		if (!data)
+			goto next;
+
+		size += avflt_prefilter_get_info(data,
+				redirfs_get_id_path(paths[i]), buf + size,
+				PAGE_SIZE - size);
+
+		avflt_put_root_data(data);
+
+		if (size >= PAGE_SIZE)
+			break;
+next:
+		i++;
+	}
+
+	redirfs_put_paths(paths);
+	return size;
+}
+
+/*
+ * %d:min:%lld, %d:max:%lld, %d:allow:ext, %d:deny:ext, %d:magic:hex or
+ * %d:clear where %d is the path id
+ */
+static ssize_t avflt_prefilter_paths_store(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, const char *buf,
+		size_t count)
+{
+	struct avflt_root_data *data;
+	redirfs_path path;
+	redirfs_root root;
+	int len;
+	int id;
+	int rv;
+
+	if (sscanf(buf, "%d:%n", &id, &len) != 1)
+		return -EINVAL;
+
+	path = redirfs_get_path_id(id);
+	if (!path)
+		return -ENOENT;
+
+	root = redirfs_get_root_path(path);
+	redirfs_put_path(path);
+	if (!root)
+		return -ENOENT;
+
+	data = avflt_get_root_data_root(root);
+	redirfs_put_root(root);
+	if (!data)
+		return -ENOENT;
+
+	rv = avflt_prefilter_set(data, buf + len);
+	avflt_put_root_data(data);
+	if (rv)
+		return rv;
+
+	return count;
+}
+
+static ssize_t avflt_queue_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	return avflt_get_queue_info(buf, PAGE_SIZE);
+}
+
+/*
+ * max:%d sets the high-water mark of queued requests, 0 means unlimited
+ */
+static ssize_t avflt_queue_store(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, const char *buf,
+		size_t count)
+{
+	int max;
+
+	if (sscanf(buf, "max:%d", &max) != 1)
+		return -EINVAL;
+
+	if (max < 0)
+		return -EINVAL;
+
+	atomic_set(&avflt_request_max, max);
+
+	return count;
+}
+
 static ssize_t avflt_registered_show(redirfs_filter filter,
 		struct redirfs_filter_attribute *attr, char *buf)
 {
 	return avflt_proc_get_info(buf, PAGE_SIZE);
 }
 
+static ssize_t avflt_stats_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	return avflt_stats_get_info(buf, PAGE_SIZE);
+}
+
 static ssize_t avflt_trusted_show(redirfs_filter filter,
 		struct redirfs_filter_attribute *attr, char *buf)
 {
@@ -211,12 +500,39 @@ static struct redirfs_filter_attribute avflt_pathcache_attr =
 	REDIRFS_FILTER_ATTRIBUTE(cache_paths, 0644, avflt_cache_paths_show,
 			avflt_cache_paths_store);
 
+static struct redirfs_filter_attribute avflt_persist_attr = 
+	REDIRFS_FILTER_ATTRIBUTE(persist, 0644, avflt_persist_ver_show,
+			avflt_persist_ver_store);
+
+static struct redirfs_filter_attribute avflt_qos_attr = 
+	REDIRFS_FILTER_ATTRIBUTE(qos, 0644, avflt_qos_show, avflt_qos_store);
+
+static struct redirfs_filter_attribute avflt_async_close_attr = 
+	REDIRFS_FILTER_ATTRIBUTE(async_close, 0644, avflt_async_close_show,
+			avflt_async_close_store);
+
+static struct redirfs_filter_attribute avflt_overload_paths_attr = 
+	REDIRFS_FILTER_ATTRIBUTE(overload_paths, 0644,
+			avflt_overload_paths_show, avflt_overload_paths_store);
+
+static struct redirfs_filter_attribute avflt_prefilter_paths_attr = 
+	REDIRFS_FILTER_ATTRIBUTE(prefilter_paths, 0644,
+			avflt_prefilter_paths_show,
+			avflt_prefilter_paths_store);
+
+static struct redirfs_filter_attribute avflt_queue_attr = 
+	REDIRFS_FILTER_ATTRIBUTE(queue, 0644, avflt_queue_show,
+			avflt_queue_store);
+
 static struct redirfs_filter_attribute avflt_registered_attr = 
 	REDIRFS_FILTER_ATTRIBUTE(registered, 0444, avflt_registered_show, NULL);
 
 static struct redirfs_filter_attribute avflt_trusted_attr = 
 	REDIRFS_FILTER_ATTRIBUTE(trusted, 0444, avflt_trusted_show, NULL);
 
+static struct redirfs_filter_attribute avflt_stats_attr = 
+	REDIRFS_FILTER_ATTRIBUTE(stats, 0444, avflt_stats_show, NULL);
+
 int avflt_sys_init(void)
 {
 	int rv;
@@ -241,8 +557,50 @@ int avflt_sys_init(void)
 	if (rv)
 		goto err_trusted;
 
+	rv = redirfs_create_attribute(avflt, &avflt_persist_attr);
+	if (rv)
+		goto err_persist;
+
+	rv = redirfs_create_attribute(avflt, &avflt_qos_attr);
+	if (rv)
+		goto err_qos;
+
+	rv = redirfs_create_attribute(avflt, &avflt_async_close_attr);
+	if (rv)
+		goto err_async_close;
+
+	rv = redirfs_create_attribute(avflt, &avflt_overload_paths_attr);
+	if (rv)
+		goto err_overload_paths;
+
+	rv = redirfs_create_attribute(avflt, &avflt_queue_attr);
+	if (rv)
+		goto err_queue;
+
+	rv = redirfs_create_attribute(avflt, &avflt_prefilter_paths_attr);
+	if (rv)
+		goto err_prefilter_paths;
+
+	rv = redirfs_create_attribute(avflt, &avflt_stats_attr);
+	if (rv)
+		goto err_stats;
+
 	return 0;
 
+err_stats:
+	redirfs_remove_attribute(avflt, &avflt_prefilter_paths_attr);
+err_prefilter_paths:
+	redirfs_remove_attribute(avflt, &avflt_queue_attr);
+err_queue:
+	redirfs_remove_attribute(avflt, &avflt_overload_paths_attr);
+err_overload_paths:
+	redirfs_remove_attribute(avflt, &avflt_async_close_attr);
+err_async_close:
+	redirfs_remove_attribute(avflt, &avflt_qos_attr);
+err_qos:
+	redirfs_remove_attribute(avflt, &avflt_persist_attr);
+err_persist:
+	redirfs_remove_attribute(avflt, &avflt_trusted_attr);
 err_trusted:
 	redirfs_remove_attribute(avflt, &avflt_registered_attr);
 err_registered:
@@ -261,5 +619,12 @@ void avflt_sys_exit(void)
 	redirfs_remove_attribute(avflt, &avflt_pathcache_attr);
 	redirfs_remove_attribute(avflt, &avflt_registered_attr);
 	redirfs_remove_attribute(avflt, &avflt_trusted_attr);
+	redirfs_remove_attribute(avflt, &avflt_persist_attr);
+	redirfs_remove_attribute(avflt, &avflt_qos_attr);
+	redirfs_remove_attribute(avflt, &avflt_async_close_attr);
+	redirfs_remove_attribute(avflt, &avflt_overload_paths_attr);
+	redirfs_remove_attribute(avflt, &avflt_queue_attr);
+	redirfs_remove_attribute(avflt, &avflt_prefilter_paths_attr);
+	redirfs_remove_attribute(avflt, &avflt_stats_attr);
 }
 
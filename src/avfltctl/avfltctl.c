@@ -190,6 +190,20 @@ static int check_cmdl(void)
 	return rv;
 }
 
+static void show_hist(const char *name, int *hist)
+{
+	int i;
+
+	printf("%s:", name);
+
+	for (i = 0; i < AVFLTCTL_HIST_NR; i++) {
+		if (hist[i])
+			printf(" %dus:%d", 1 << i, hist[i]);
+	}
+
+	printf("\n");
+}
+
 static int cmd_show(void)
 {
 	struct avfltctl_filter *flt;
@@ -217,6 +231,9 @@ static int cmd_show(void)
 	}
 	printf("\n");
 
+	show_hist("wait       ", flt->wait_hist);
+	show_hist("service    ", flt->service_hist);
+
 	printf("paths      :\n");
 
 	for (i = 0; flt->paths[i]; i++) {
@@ -229,7 +246,17 @@ static int cmd_show(void)
 
 		printf("             type : %s\n", type);
 		type = flt->paths[i]->cache ? "active" : "inactive";
-		printf("             cache: %s\n\n", type);
+		printf("             cache: %s\n", type);
+		printf("             stats: hits %d, misses %d, "
+				"invalidations %d\n",
+				flt->paths[i]->stats.hits,
+				flt->paths[i]->stats.misses,
+				flt->paths[i]->stats.invalidations);
+		printf("                    queued %d, timeouts %d, "
+				"readds %d\n\n",
+				flt->paths[i]->stats.queued,
+				flt->paths[i]->stats.timeouts,
+				flt->paths[i]->stats.readds);
 	}
 
 	avfltctl_put_filter(flt);
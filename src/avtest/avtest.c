@@ -14,6 +14,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <av.h>
+#include "avtest.h"
 
 #define THREADS_COUNT 10
 
@@ -91,6 +92,21 @@ int main(int argc, char *argv[])
 	int rv;
 
 	printf("avtest: version %s\n", version);
+
+	if (argc > 1 && !strcmp(argv[1], "-r")) {
+		if (race(argc, argv))
+			exit(EXIT_FAILURE);
+
+		exit(EXIT_SUCCESS);
+	}
+
+	if (argc > 1) {
+		if (bench(argc, argv))
+			exit(EXIT_FAILURE);
+
+		exit(EXIT_SUCCESS);
+	}
+
 	memset(&sa, 0, sizeof(struct sigaction));
 	sa.sa_handler = sighandler;
 	sigemptyset(&sa.sa_mask);
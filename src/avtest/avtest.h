@@ -0,0 +1,14 @@
+/*
+ *          Copyright Frantisek Hrbata 2008 - 2010.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#ifndef __AVTEST_H__
+#define __AVTEST_H__
+
+int bench(int argc, char *argv[]);
+int race(int argc, char *argv[]);
+
+#endif
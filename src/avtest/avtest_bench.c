@@ -0,0 +1,479 @@
+/*
+ *          Copyright Frantisek Hrbata 2008 - 2010.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <av.h>
+#include "avtest.h"
+
+/*
+ * The load runs in a forked child, since avflt does not check files opened
+ * by the registered process. Before each measured open of a miss the first
+ * byte of the file is rewritten, which invalidates its avflt cache entry.
+ * A write open makes avflt scan the file on close as well. Open latencies
+ * are collected in a log-linear histogram with 64 buckets per power of two
+ * in ns, so the percentiles are within 2%.
+ */
+
+#define BENCH_SUB 64
+#define BENCH_BUCKETS (BENCH_SUB + 58 * BENCH_SUB)
+#define BENCH_QUEUE "/sys/fs/redirfs/filters/avflt/queue"
+
+struct bench_stats {
+	volatile int start;
+	volatile int stop;
+	unsigned long opens;
+	unsigned long errors;
+	unsigned long hist[BENCH_BUCKETS];
+};
+
+struct bench_conf {
+	const char *dir;
+	int threads;
+	int scanners;
+	int files;
+	int size;
+	int miss;
+	int write;
+	int service;
+	int duration;
+	int interval;
+	int affine;
+};
+
+static struct bench_conf conf = {
+	.dir = NULL,
+	.threads = 4,
+	.scanners = 4,
+	.files = 100,
+	.size = 4096,
+	.miss = 0,
+	.write = 0,
+	.service = 0,
+	.duration = 10,
+	.interval = 1,
+	.affine = 0
+};
+
+static struct bench_stats *stats;
+static unsigned long events[3];
+static volatile int bench_stop = 0;
+
+static void bench_sighandler(int sig)
+{
+	bench_stop = 1;
+}
+
+static int bench_bucket(uint64_t val)
+{
+	int msb;
+
+	if (val < BENCH_SUB)
+		return val;
+
+	msb = 63 - __builtin_clzll(val);
+
+	return BENCH_SUB + (msb - 6) * BENCH_SUB +
+		((val >> (msb - 6)) & (BENCH_SUB - 1));
+}
+
+static uint64_t bench_value(int bucket)
+{
+	int msb;
+
+	if (bucket < BENCH_SUB)
+		return bucket;
+
+	msb = (bucket - BENCH_SUB) / BENCH_SUB + 6;
+
+	return (uint64_t)(BENCH_SUB + (bucket - BENCH_SUB) % BENCH_SUB) <<
+		(msb - 6);
+}
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_filename(char *fn, int i)
+{
+	snprintf(fn, PATH_MAX, "%s/avtest.%d", conf.dir, i);
+}
+
+static int bench_create(void)
+{
+	char fn[PATH_MAX];
+	char *buf;
+	int fd;
+	int i;
+
+	buf = malloc(conf.size);
+	if (!buf)
+		return -1;
+
+	memset(buf, 'a', conf.size);
+
+	for (i = 0; i < conf.files; i++) {
+		bench_filename(fn, i);
+
+		fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1)
+			goto error;
+
+		if (write(fd, buf, conf.size) != conf.size) {
+			close(fd);
+			goto error;
+		}
+
+		close(fd);
+	}
+
+	free(buf);
+	return 0;
+error:
+	free(buf);
+	return -1;
+}
+
+static void bench_remove(void)
+{
+	char fn[PATH_MAX];
+	int i;
+
+	for (i = 0; i < conf.files; i++) {
+		bench_filename(fn, i);
+		unlink(fn);
+	}
+}
+
+static int bench_miss(const char *fn)
+{
+	int fd;
+
+	fd = open(fn, O_WRONLY);
+	if (fd == -1)
+		return -1;
+
+	if (pwrite(fd, "a", 1, 0) != 1) {
+		close(fd);
+		return -1;
+	}
+
+	return close(fd);
+}
+
+static void *bench_load(void *data)
+{
+	unsigned long hist[BENCH_BUCKETS];
+	unsigned int seed = (unsigned long)data;
+	char fn[PATH_MAX];
+	uint64_t start;
+	int flags;
+	int fd;
+	int i;
+
+	memset(hist, 0, sizeof(hist));
+
+	while (!stats->stop) {
+		bench_filename(fn, rand_r(&seed) % conf.files);
+
+		if (rand_r(&seed) % 100 < conf.miss && bench_miss(fn))
+			__sync_fetch_and_add(&stats->errors, 1);
+
+		flags = O_RDONLY;
+		if (rand_r(&seed) % 100 < conf.write)
+			flags = O_RDWR;
+
+		start = bench_now();
+		fd = open(fn, flags);
+		hist[bench_bucket(bench_now() - start)]++;
+
+		if (fd == -1) {
+			__sync_fetch_and_add(&stats->errors, 1);
+			continue;
+		}
+
+		close(fd);
+		__sync_fetch_and_add(&stats->opens, 1);
+	}
+
+	for (i = 0; i < BENCH_BUCKETS; i++) {
+		if (hist[i])
+			__sync_fetch_and_add(&stats->hist[i], hist[i]);
+	}
+
+	return NULL;
+}
+
+static void bench_child(void)
+{
+	pthread_t *threads;
+	int i;
+
+	threads = calloc(conf.threads, sizeof(pthread_t));
+	if (!threads)
+		exit(EXIT_FAILURE);
+
+	while (!stats->start && !stats->stop)
+		usleep(1000);
+
+	for (i = 0; i < conf.threads; i++) {
+		if (pthread_create(&threads[i], NULL, bench_load,
+					(void *)(unsigned long)(i + 1))) {
+			stats->stop = 1;
+			break;
+		}
+	}
+
+	while (i--)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	exit(EXIT_SUCCESS);
+}
+
+static int bench_scan(struct av_event *event, void *data)
+{
+	if (conf.service)
+		usleep(conf.service);
+
+	if (event->type == AV_EVENT_OPEN || event->type == AV_EVENT_CLOSE)
+		__sync_fetch_and_add(&events[event->type], 1);
+
+	return av_set_result(event, AV_ACCESS_ALLOW);
+}
+
+static int bench_depth(void)
+{
+	FILE *file;
+	int depth;
+
+	file = fopen(BENCH_QUEUE, "r");
+	if (!file)
+		return -1;
+
+	if (fscanf(file, "depth:%d", &depth) != 1)
+		depth = -1;
+
+	fclose(file);
+	return depth;
+}
+
+static void bench_report(double secs)
+{
+	unsigned long total = 0;
+	unsigned long sum = 0;
+	double pcts[] = {50.0, 90.0, 99.0, 99.9};
+	int pct = 0;
+	unsigned long opens;
+	unsigned long nr;
+	int i;
+
+	for (i = 0; i < BENCH_BUCKETS; i++)
+		total += stats->hist[i];
+
+	nr = events[AV_EVENT_OPEN] + events[AV_EVENT_CLOSE];
+	opens = stats->opens + stats->opens * conf.miss / 100;
+
+	printf("opens: %lu (%.0f/s), errors: %lu\n", stats->opens,
+			stats->opens / secs, stats->errors);
+	printf("events: %lu (%.0f/s), open: %lu, close: %lu\n", nr,
+			nr / secs, events[AV_EVENT_OPEN],
+			events[AV_EVENT_CLOSE]);
+
+	if (opens)
+		printf("cache hit ratio: %.2f%%\n", 100.0 -
+				100.0 * events[AV_EVENT_OPEN] / opens);
+
+	if (!total)
+		return;
+
+	printf("open latency:");
+
+	for (i = 0; i < BENCH_BUCKETS && pct < 4; i++) {
+		sum += stats->hist[i];
+
+		while (pct < 4 && sum >= total * pcts[pct] / 100.0) {
+			printf(" p%g: %.1fus", pcts[pct],
+					bench_value(i) / 1000.0);
+			pct++;
+		}
+	}
+
+	for (i = BENCH_BUCKETS - 1; i > 0 && !stats->hist[i]; i--)
+		;
+
+	printf(" max: %.1fus\n", bench_value(i) / 1000.0);
+}
+
+static void bench_usage(void)
+{
+	fprintf(stderr, "usage: avtest -b -d dir [-t threads] "
+			"[-s scanners] [-f files] [-S size] [-m miss%%]\n"
+			"\t[-w write%%] [-l service_us] [-T duration] "
+			"[-i interval] [-a]\n");
+}
+
+static int bench_args(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "bd:t:s:f:S:m:w:l:T:i:a")) != -1) {
+		switch (opt) {
+			case 'b':
+				break;
+			case 'd':
+				conf.dir = optarg;
+				break;
+			case 't':
+				conf.threads = atoi(optarg);
+				break;
+			case 's':
+				conf.scanners = atoi(optarg);
+				break;
+			case 'f':
+				conf.files = atoi(optarg);
+				break;
+			case 'S':
+				conf.size = atoi(optarg);
+				break;
+			case 'm':
+				conf.miss = atoi(optarg);
+				break;
+			case 'w':
+				conf.write = atoi(optarg);
+				break;
+			case 'l':
+				conf.service = atoi(optarg);
+				break;
+			case 'T':
+				conf.duration = atoi(optarg);
+				break;
+			case 'i':
+				conf.interval = atoi(optarg);
+				break;
+			case 'a':
+				conf.affine = 1;
+				break;
+			default:
+				return -1;
+		}
+	}
+
+	if (!conf.dir || conf.threads < 1 || conf.scanners < 0 ||
+	    conf.files < 1 || conf.size < 1 || conf.duration < 1 ||
+	    conf.interval < 1)
+		return -1;
+
+	return 0;
+}
+
+int bench(int argc, char *argv[])
+{
+	unsigned long opens = 0;
+	unsigned long nr = 0;
+	unsigned long cur;
+	struct av_pool *pool;
+	struct sigaction sa;
+	uint64_t start;
+	double secs;
+	pid_t pid;
+	int t;
+
+	if (bench_args(argc, argv)) {
+		bench_usage();
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(struct sigaction));
+	sa.sa_handler = bench_sighandler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	stats = mmap(NULL, sizeof(struct bench_stats), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED) {
+		perror("mmap failed");
+		return -1;
+	}
+
+	memset(stats, 0, sizeof(struct bench_stats));
+
+	if (bench_create()) {
+		perror("creating files failed");
+		bench_remove();
+		return -1;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		perror("fork failed");
+		bench_remove();
+		return -1;
+	}
+
+	if (!pid)
+		bench_child();
+
+	pool = av_pool_create(conf.scanners, conf.affine ? AV_POOL_AFFINE : 0,
+			bench_scan, NULL);
+	if (!pool) {
+		perror("av_pool_create failed");
+		stats->stop = 1;
+		waitpid(pid, NULL, 0);
+		bench_remove();
+		return -1;
+	}
+
+	printf("time\topens/s\tevents/s\tdepth\n");
+
+	start = bench_now();
+	stats->start = 1;
+
+	for (t = conf.interval; t <= conf.duration && !bench_stop;
+			t += conf.interval) {
+		sleep(conf.interval);
+
+		cur = events[AV_EVENT_OPEN] + events[AV_EVENT_CLOSE];
+		printf("%d\t%lu\t%lu\t\t%d\n", t,
+				(stats->opens - opens) / conf.interval,
+				(cur - nr) / conf.interval, bench_depth());
+
+		opens = stats->opens;
+		nr = cur;
+	}
+
+	stats->stop = 1;
+	waitpid(pid, NULL, 0);
+	secs = (bench_now() - start) / 1000000000.0;
+
+	if (av_pool_destroy(pool))
+		perror("av_pool_destroy failed");
+
+	bench_report(secs);
+	bench_remove();
+	munmap(stats, sizeof(struct bench_stats));
+
+	return 0;
+}
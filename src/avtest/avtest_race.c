@@ -0,0 +1,321 @@
+/*
+ *          Copyright Frantisek Hrbata 2008 - 2010.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <av.h>
+#include "avtest.h"
+
+/*
+ * Opens racing unfinished scans of the same file. The scanner holds the
+ * events of one type for hold ms while threads of a forked child open the
+ * file. In the first step a written file is closed, its close is scanned
+ * asynchronously and the following opens of the same content have to wait
+ * for the close verdict without queueing own scans. In the second step the
+ * avflt cache is invalidated, the opens are held and the concurrent opens
+ * have to coalesce into one scan. Persistent verdicts have to be off, they
+ * would answer the opens without a scan.
+ */
+
+#define RACE_THREADS 8
+#define RACE_ASYNC "/sys/fs/redirfs/filters/avflt/async_close"
+#define RACE_CACHE "/sys/fs/redirfs/filters/avflt/cache"
+#define RACE_STEPS 2
+
+struct race_stats {
+	volatile int hold;
+	volatile int start;
+	unsigned long events[AV_EVENT_CLOSE + 1];
+	uint64_t begin;
+	uint64_t lat[RACE_STEPS][RACE_THREADS];
+	unsigned long opens[RACE_STEPS];
+	int step;
+	int errors;
+};
+
+static struct race_stats *stats;
+static char race_fn[PATH_MAX];
+static int race_hold = 500;
+
+static uint64_t race_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int race_scan(struct av_event *event, void *data)
+{
+	if (event->type == AV_EVENT_OPEN || event->type == AV_EVENT_CLOSE)
+		__sync_fetch_and_add(&stats->events[event->type], 1);
+
+	if (event->type == stats->hold)
+		usleep(race_hold * 1000);
+
+	return av_set_result(event, AV_ACCESS_ALLOW);
+}
+
+static int race_write(void)
+{
+	int fd;
+
+	fd = open(race_fn, O_WRONLY | O_CREAT, 0644);
+	if (fd == -1)
+		return -1;
+
+	if (pwrite(fd, "a", 1, 0) != 1) {
+		close(fd);
+		return -1;
+	}
+
+	return close(fd);
+}
+
+static void *race_open(void *data)
+{
+	unsigned long i = (unsigned long)data;
+	int fd;
+
+	while (!stats->start)
+		;
+
+	fd = open(race_fn, O_RDONLY);
+	stats->lat[stats->step][i] = race_now() - stats->begin;
+
+	if (fd == -1)
+		__sync_fetch_and_add(&stats->errors, 1);
+	else
+		close(fd);
+
+	return NULL;
+}
+
+static int race_opens(int step)
+{
+	pthread_t threads[RACE_THREADS];
+	unsigned long opens;
+	int i;
+
+	stats->step = step;
+	stats->start = 0;
+
+	for (i = 0; i < RACE_THREADS; i++) {
+		if (pthread_create(&threads[i], NULL, race_open,
+					(void *)(unsigned long)i))
+			break;
+	}
+
+	opens = stats->events[AV_EVENT_OPEN];
+
+	if (!stats->begin)
+		stats->begin = race_now();
+
+	stats->start = 1;
+
+	if (i != RACE_THREADS)
+		__sync_fetch_and_add(&stats->errors, 1);
+
+	while (i--)
+		pthread_join(threads[i], NULL);
+
+	stats->opens[step] = stats->events[AV_EVENT_OPEN] - opens;
+
+	return stats->errors ? -1 : 0;
+}
+
+static int race_invalidate(void)
+{
+	FILE *file;
+
+	file = fopen(RACE_CACHE, "w");
+	if (!file)
+		return -1;
+
+	fprintf(file, "i\n");
+
+	return fclose(file);
+}
+
+static void race_child(void)
+{
+	/* the close of the written file is held, opens of its content wait */
+	stats->hold = AV_EVENT_CLOSE;
+
+	if (race_write())
+		exit(EXIT_FAILURE);
+
+	stats->begin = race_now();
+
+	if (race_opens(0))
+		exit(EXIT_FAILURE);
+
+	/* no close pending, the held opens of the same content coalesce */
+	stats->hold = AV_EVENT_OPEN;
+	stats->begin = 0;
+
+	if (race_invalidate())
+		exit(EXIT_FAILURE);
+
+	if (race_opens(1))
+		exit(EXIT_FAILURE);
+
+	exit(EXIT_SUCCESS);
+}
+
+static int race_check(int step, const char *name, unsigned long expected)
+{
+	uint64_t min = (uint64_t)race_hold * 1000000ULL * 9 / 10;
+	uint64_t lat = UINT64_MAX;
+	unsigned long opens = stats->opens[step];
+	int rv = 0;
+	int i;
+
+	for (i = 0; i < RACE_THREADS; i++) {
+		if (stats->lat[step][i] < lat)
+			lat = stats->lat[step][i];
+	}
+
+	printf("%s: open events: %lu, expected: %lu, min open latency: "
+			"%.1fms\n", name, opens, expected, lat / 1000000.0);
+
+	if (opens != expected) {
+		fprintf(stderr, "%s: opens were not coalesced\n", name);
+		rv = -1;
+	}
+
+	if (lat < min) {
+		fprintf(stderr, "%s: opens did not wait for the pending "
+				"scan\n", name);
+		rv = -1;
+	}
+
+	return rv;
+}
+
+static int race_async(int limit)
+{
+	FILE *file;
+	int old;
+	int nr;
+
+	file = fopen(RACE_ASYNC, "r+");
+	if (!file)
+		return -1;
+
+	if (fscanf(file, "%d:%d", &old, &nr) != 2) {
+		fclose(file);
+		return -1;
+	}
+
+	rewind(file);
+	fprintf(file, "%d\n", limit);
+	fclose(file);
+
+	return old;
+}
+
+static void race_usage(void)
+{
+	fprintf(stderr, "usage: avtest -r -d dir [-l hold_ms]\n");
+}
+
+int race(int argc, char *argv[])
+{
+	const char *dir = NULL;
+	struct av_pool *pool;
+	int status;
+	int async;
+	pid_t pid;
+	int opt;
+	int rv = -1;
+
+	while ((opt = getopt(argc, argv, "rd:l:")) != -1) {
+		switch (opt) {
+			case 'r':
+				break;
+			case 'd':
+				dir = optarg;
+				break;
+			case 'l':
+				race_hold = atoi(optarg);
+				break;
+			default:
+				race_usage();
+				return -1;
+		}
+	}
+
+	if (!dir || race_hold < 1) {
+		race_usage();
+		return -1;
+	}
+
+	snprintf(race_fn, PATH_MAX, "%s/avtest.race", dir);
+
+	stats = mmap(NULL, sizeof(struct race_stats), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED) {
+		perror("mmap failed");
+		return -1;
+	}
+
+	memset(stats, 0, sizeof(struct race_stats));
+
+	async = race_async(1);
+	if (async < 0) {
+		perror("enabling async close scans failed");
+		goto exit;
+	}
+
+	pool = av_pool_create(1, 0, race_scan, NULL);
+	if (!pool) {
+		perror("av_pool_create failed");
+		goto restore;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		perror("fork failed");
+		goto destroy;
+	}
+
+	if (!pid)
+		race_child();
+
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		fprintf(stderr, "race child failed\n");
+		goto destroy;
+	}
+
+	rv = race_check(0, "open vs. pending close", 0);
+	if (race_check(1, "concurrent opens", 1))
+		rv = -1;
+
+destroy:
+	if (av_pool_destroy(pool))
+		perror("av_pool_destroy failed");
+restore:
+	race_async(async);
+exit:
+	unlink(race_fn);
+	munmap(stats, sizeof(struct race_stats));
+	return rv;
+}
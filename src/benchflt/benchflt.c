@@ -0,0 +1,173 @@
+/*
+ * BenchFlt: Benchmark Filter
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2012 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <redirfs.h>
+#include <linux/moduleparam.h>
+
+#define BENCHFLT_VERSION "0.1"
+
+#define BENCHFLT_MAX 32
+
+static int nr = 1;
+static char *mode = "both";
+
+static redirfs_filter benchflt[BENCHFLT_MAX];
+static char benchflt_names[BENCHFLT_MAX][16];
+static int benchflt_nr;
+
+static enum redirfs_rv benchflt_cb(redirfs_context context,
+		struct redirfs_args *args)
+{
+	return REDIRFS_CONTINUE;
+}
+
+static struct redirfs_op_info benchflt_op_info[] = {
+	{REDIRFS_REG_FOP_OPEN, NULL, NULL},
+	{REDIRFS_REG_FOP_RELEASE, NULL, NULL},
+	{REDIRFS_DIR_FOP_OPEN, NULL, NULL},
+	{REDIRFS_DIR_FOP_RELEASE, NULL, NULL},
+	{REDIRFS_DIR_FOP_READDIR, NULL, NULL},
+	{REDIRFS_REG_IOP_PERMISSION, NULL, NULL},
+	{REDIRFS_DIR_IOP_PERMISSION, NULL, NULL},
+	{REDIRFS_DIR_IOP_LOOKUP, NULL, NULL},
+	{REDIRFS_DIR_IOP_RENAME, NULL, NULL},
+	{REDIRFS_OP_END, NULL, NULL}
+};
+
+static int benchflt_set_mode(void)
+{
+	int pre;
+	int post;
+	int i;
+
+	if (!strcmp(mode, "pre")) {
+		pre = 1;
+		post = 0;
+
+	} else if (!strcmp(mode, "post")) {
+		pre = 0;
+		post = 1;
+
+	} else if (!strcmp(mode, "both")) {
+		pre = 1;
+		post = 1;
+
+	} else
+		return -EINVAL;
+
+	for (i = 0; benchflt_op_info[i].op_id != REDIRFS_OP_END; i++) {
+		benchflt_op_info[i].pre_cb = pre ? benchflt_cb : NULL;
+		benchflt_op_info[i].post_cb = post ? benchflt_cb : NULL;
+	}
+
+	return 0;
+}
+
+static void benchflt_unregister(void)
+{
+	int err;
+
+	while (benchflt_nr--) {
+		err = redirfs_unregister_filter(benchflt[benchflt_nr]);
+		if (err) {
+			printk(KERN_ERR "benchflt: unregister filter "
+					"failed(%d)\n", err);
+			continue;
+		}
+
+		redirfs_delete_filter(benchflt[benchflt_nr]);
+	}
+}
+
+static int __init benchflt_init(void)
+{
+	struct redirfs_filter_info info = {
+		.owner = THIS_MODULE,
+		.active = 1
+	};
+	int rv;
+
+	if (nr < 0 || nr > BENCHFLT_MAX) {
+		printk(KERN_ERR "benchflt: nr has to be in <0, %d>\n",
+				BENCHFLT_MAX);
+		return -EINVAL;
+	}
+
+	rv = benchflt_set_mode();
+	if (rv) {
+		printk(KERN_ERR "benchflt: unknown mode %s\n", mode);
+		return rv;
+	}
+
+	for (benchflt_nr = 0; benchflt_nr < nr; benchflt_nr++) {
+		snprintf(benchflt_names[benchflt_nr], 16, "benchflt%d",
+				benchflt_nr);
+		info.name = benchflt_names[benchflt_nr];
+		info.priority = 500000000 + benchflt_nr;
+
+		benchflt[benchflt_nr] = redirfs_register_filter(&info);
+		if (IS_ERR(benchflt[benchflt_nr])) {
+			rv = PTR_ERR(benchflt[benchflt_nr]);
+			printk(KERN_ERR "benchflt: register filter "
+					"failed(%d)\n", rv);
+			goto error;
+		}
+
+		rv = redirfs_set_operations(benchflt[benchflt_nr],
+				benchflt_op_info);
+		if (rv) {
+			printk(KERN_ERR "benchflt: set operations "
+					"failed(%d)\n", rv);
+			benchflt_nr++;
+			goto error;
+		}
+	}
+
+	printk(KERN_INFO "Benchmark Filter Version " BENCHFLT_VERSION
+			" <www.redirfs.org>, %d filter(s), mode %s\n", nr,
+			mode);
+	return 0;
+error:
+	benchflt_unregister();
+	return rv;
+}
+
+static void __exit benchflt_exit(void)
+{
+	int i;
+
+	for (i = 0; i < benchflt_nr; i++)
+		redirfs_delete_filter(benchflt[i]);
+}
+
+module_init(benchflt_init);
+module_exit(benchflt_exit);
+
+module_param(nr, int, 0000);
+MODULE_PARM_DESC(nr, "number of no-op filters to register");
+module_param(mode, charp, 0000);
+MODULE_PARM_DESC(mode, "callbacks to register: pre, post or both");
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Frantisek Hrbata <frantisek.hrbata@redirfs.org>");
+MODULE_DESCRIPTION("Benchmark Filter Version " BENCHFLT_VERSION "<www.redirfs.org>");
@@ -2,9 +2,7 @@
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/mutex.h>
-#include "../redirfs/redirfs.h"
 #include "compflt.h"
-#include "path.h"
 
 char version[] = "0";
 
@@ -16,7 +14,7 @@ static int in_blksize = CFLT_DEFAULT_BLKSIZE;
 module_param(in_blksize, int, 0000);
 MODULE_PARM_DESC(in_blksize, "Initial block size to use");
 
-static enum rfs_retv cflt_f_pre_llseek(rfs_context context, struct rfs_args *args)
+static enum redirfs_rv cflt_f_pre_llseek(redirfs_context context, struct redirfs_args *args)
 {
         struct file *f = args->args.f_llseek.file;
         struct cflt_file *fh;
@@ -26,7 +24,7 @@ static enum rfs_retv cflt_f_pre_llseek(rfs_context context, struct rfs_args *arg
 
         fh = cflt_file_get(f->f_dentry->d_inode, f);
         if (!fh)
-                return RFS_CONTINUE;
+                return REDIRFS_CONTINUE;
 
         cflt_debug_file_header(fh);
 
@@ -40,10 +38,10 @@ static enum rfs_retv cflt_f_pre_llseek(rfs_context context, struct rfs_args *arg
 
 end:
         cflt_file_put(fh);
-        return RFS_CONTINUE;
+        return REDIRFS_CONTINUE;
 }
 
-static enum rfs_retv cflt_f_pre_open(rfs_context context, struct rfs_args *args)
+static enum redirfs_rv cflt_f_pre_open(redirfs_context context, struct redirfs_args *args)
 {
         struct file *f = args->args.f_open.file;
         struct inode *inode = args->args.f_open.inode;
@@ -54,16 +52,99 @@ static enum rfs_retv cflt_f_pre_open(rfs_context context, struct rfs_args *args)
         if (f->f_flags & O_TRUNC) {
                 fh = cflt_file_get(inode, NULL);
                 if (fh) {
+                        down_write(&fh->sem);
                         cflt_file_clr_blks(fh);
                         cflt_file_truncate(fh);
+                        up_write(&fh->sem);
                         cflt_file_put(fh);
                 }
         }
 
-        return RFS_CONTINUE;
+        return REDIRFS_CONTINUE;
 }
 
-static enum rfs_retv cflt_f_post_release(rfs_context context, struct rfs_args *args)
+// The lower file pages hold the compressed data and compflt reads them
+// through the same mapping, so decompressed pages can not be presented
+// there. Refuse to map compressed files instead of exposing their raw
+// contents.
+static enum redirfs_rv cflt_f_pre_mmap(redirfs_context context, struct redirfs_args *args)
+{
+        struct file *f = args->args.f_mmap.file;
+        struct cflt_file *fh;
+        enum redirfs_rv rv = REDIRFS_CONTINUE;
+
+        cflt_debug_printk("compflt: [pre_mmap] i=%li\n", f->f_dentry->d_inode->i_ino);
+
+        fh = cflt_file_get(f->f_dentry->d_inode, f);
+        if (!fh)
+                return REDIRFS_CONTINUE;
+
+        if (atomic_read(&fh->compressed)) {
+                if (printk_ratelimit())
+                        printk(KERN_INFO "compflt: mmap of compressed files not supported\n");
+                args->rv.rv_int = -ENODEV;
+                rv = REDIRFS_STOP;
+        }
+
+        cflt_file_put(fh);
+        return rv;
+}
+
+// splice and sendfile move the lower file's pages, i.e. the compressed data,
+// so they are refused for the files compflt would read or write itself
+static enum redirfs_rv cflt_refuse_pages(struct file *f, ssize_t *op_rv, int write)
+{
+        struct cflt_file *fh;
+        enum redirfs_rv rv = REDIRFS_CONTINUE;
+
+        fh = cflt_file_get(f->f_dentry->d_inode, f);
+        if (!fh)
+                return REDIRFS_CONTINUE;
+
+        if (atomic_read(&fh->compressed) ||
+            (write && cflt_cmethod && fh->size_u == 0)) {
+                if (printk_ratelimit())
+                        printk(KERN_INFO "compflt: splice of compressed files not supported\n");
+                *op_rv = -EINVAL;
+                rv = REDIRFS_STOP;
+        }
+
+        cflt_file_put(fh);
+        return rv;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,17)
+static enum redirfs_rv cflt_f_pre_splice_read(redirfs_context context, struct redirfs_args *args)
+{
+        struct file *f = args->args.f_splice_read.file;
+
+        cflt_debug_printk("compflt: [pre_splice_read] i=%li\n", f->f_dentry->d_inode->i_ino);
+
+        return cflt_refuse_pages(f, &args->rv.rv_ssize, 0);
+}
+
+static enum redirfs_rv cflt_f_pre_splice_write(redirfs_context context, struct redirfs_args *args)
+{
+        struct file *f = args->args.f_splice_write.file;
+
+        cflt_debug_printk("compflt: [pre_splice_write] i=%li\n", f->f_dentry->d_inode->i_ino);
+
+        return cflt_refuse_pages(f, &args->rv.rv_ssize, 1);
+}
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
+static enum redirfs_rv cflt_f_pre_sendfile(redirfs_context context, struct redirfs_args *args)
+{
+        struct file *f = args->args.f_sendfile.file;
+
+        cflt_debug_printk("compflt: [pre_sendfile] i=%li\n", f->f_dentry->d_inode->i_ino);
+
+        return cflt_refuse_pages(f, &args->rv.rv_ssize, 0);
+}
+#endif
+
+static enum redirfs_rv cflt_f_post_release(redirfs_context context, struct redirfs_args *args)
 {
         struct inode *inode = args->args.f_release.inode;
         struct file *f = args->args.f_release.file;
@@ -73,47 +154,117 @@ static enum rfs_retv cflt_f_post_release(rfs_context context, struct rfs_args *a
 
         fh = cflt_file_get(inode, NULL);
         if (!fh)
-                return RFS_CONTINUE;
+                return REDIRFS_CONTINUE;
 
         if (atomic_read(&fh->compressed)) {
-                cflt_file_write(f, fh);
-                cflt_file_write_block_headers(f, fh);
+                down_write(&fh->sem);
+                if (cflt_wb_sync(f, fh))
+                        printk(KERN_ERR "compflt: i=%li lost pending blocks on release\n", inode->i_ino);
+                up_write(&fh->sem);
         }
 
         cflt_file_put(fh);
 
-        return RFS_CONTINUE;
+        return REDIRFS_CONTINUE;
+}
+
+// write back the pending blocks before the lower file is synced, so the
+// data reported as synced is on the disk
+static enum redirfs_rv cflt_f_pre_fsync(redirfs_context context, struct redirfs_args *args)
+{
+        struct file *f = args->args.f_fsync.file;
+        struct cflt_file *fh;
+        enum redirfs_rv rv = REDIRFS_CONTINUE;
+        int err = 0;
+
+        cflt_debug_printk("compflt: [pre_fsync] i=%li\n", f->f_dentry->d_inode->i_ino);
+
+        fh = cflt_file_get(f->f_dentry->d_inode, f);
+        if (!fh)
+                return REDIRFS_CONTINUE;
+
+        if (atomic_read(&fh->compressed)) {
+                down_write(&fh->sem);
+                err = cflt_wb_sync(f, fh);
+                up_write(&fh->sem);
+        }
+
+        if (err) {
+                args->rv.rv_int = err;
+                rv = REDIRFS_STOP;
+        }
+
+        cflt_file_put(fh);
+        return rv;
 }
 
-static enum rfs_retv cflt_f_pre_read(rfs_context context, struct rfs_args *args)
+// close(2) reports the error of the flush, the release can not
+static enum redirfs_rv cflt_f_pre_flush(redirfs_context context, struct redirfs_args *args)
+{
+        struct file *f = args->args.f_flush.file;
+        struct cflt_file *fh;
+        enum redirfs_rv rv = REDIRFS_CONTINUE;
+        int err = 0;
+
+        cflt_debug_printk("compflt: [pre_flush] i=%li\n", f->f_dentry->d_inode->i_ino);
+
+        if (!(f->f_mode & FMODE_WRITE))
+                return REDIRFS_CONTINUE;
+
+        fh = cflt_file_get(f->f_dentry->d_inode, f);
+        if (!fh)
+                return REDIRFS_CONTINUE;
+
+        if (atomic_read(&fh->compressed)) {
+                down_write(&fh->sem);
+                err = cflt_wb_sync(f, fh);
+                up_write(&fh->sem);
+        }
+
+        if (err) {
+                args->rv.rv_int = err;
+                rv = REDIRFS_STOP;
+        }
+
+        cflt_file_put(fh);
+        return rv;
+}
+
+static enum redirfs_rv cflt_f_pre_read(redirfs_context context, struct redirfs_args *args)
 {
         struct file *f = args->args.f_read.file;
         size_t count = args->args.f_read.count;
         loff_t *pos = args->args.f_read.pos;
         char __user *dst = args->args.f_read.buf;
-        size_t *op_rv = &args->retv.rv_ssize;
+        ssize_t *op_rv = &args->rv.rv_ssize;
         struct cflt_file *fh;
-        enum rfs_retv rv = RFS_CONTINUE;
+        enum redirfs_rv rv = REDIRFS_CONTINUE;
+        int err;
 
         cflt_debug_printk("compflt: [pre_read] i=%li | pos=%i len=%i\n", f->f_dentry->d_inode->i_ino, (int)*pos, count);
 
         fh = cflt_file_get(f->f_dentry->d_inode, f);
         if (!fh)
-                return RFS_CONTINUE;
+                return REDIRFS_CONTINUE;
 
         cflt_debug_file(fh);
 
         if (!atomic_read(&fh->compressed)) {
-                printk(KERN_INFO "compflt: file not compressed\n");
+                cflt_debug_printk("compflt: file not compressed\n");
                 goto end;
         }
 
         if (!cflt_cmethod) {
-                printk(KERN_ERR "compflt: no compression method set\n");
+                if (printk_ratelimit())
+                        printk(KERN_ERR "compflt: no compression method set\n");
                 goto end;
         }
 
-        if (cflt_read(f, fh, *pos, &count, dst)) {
+        // the lower file holds the compressed data, it must not be read
+        err = cflt_read(f, fh, *pos, &count, dst);
+        if (err) {
+                *op_rv = err;
+                rv = REDIRFS_STOP;
                 goto end;
         }
 
@@ -122,37 +273,39 @@ static enum rfs_retv cflt_f_pre_read(rfs_context context, struct rfs_args *args)
 
         cflt_debug_printk("compflt: [pre_read] returning: count=%i pos=%i\n", *op_rv, (int)*pos);
 
-        rv = RFS_STOP;
+        rv = REDIRFS_STOP;
 end:
         cflt_file_put(fh);
         return rv;
 }
 
-static enum rfs_retv cflt_f_pre_write(rfs_context context, struct rfs_args *args)
+static enum redirfs_rv cflt_f_pre_write(redirfs_context context, struct redirfs_args *args)
 {
         struct file *f = args->args.f_write.file;
-        unsigned char *src = (unsigned char *) args->args.f_write.buf;
+        const char __user *src = args->args.f_write.buf;
         size_t count = args->args.f_write.count;
         loff_t *pos = args->args.f_write.pos;
-        size_t *op_rv = &args->retv.rv_ssize;
+        ssize_t *op_rv = &args->rv.rv_ssize;
         struct cflt_file *fh;
-        enum rfs_retv rv = RFS_CONTINUE;
+        enum redirfs_rv rv = REDIRFS_CONTINUE;
+        int err;
 
         cflt_debug_printk("compflt: [pre_write] i=%li | pos=%i len=%i\n", f->f_dentry->d_inode->i_ino, (int)*pos, count);
 
         fh = cflt_file_get(f->f_dentry->d_inode, f);
         if (!fh)
-                return RFS_CONTINUE;
+                return REDIRFS_CONTINUE;
 
         cflt_debug_file_header(fh);
 
         if (!atomic_read(&fh->compressed) && fh->size_u != 0) {
-                printk(KERN_INFO "compflt: file not compressed\n");
+                cflt_debug_printk("compflt: file not compressed\n");
                 goto end;
         }
 
         if (!cflt_cmethod) {
-                printk(KERN_ERR "compflt: no compression method set\n");
+                if (printk_ratelimit())
+                        printk(KERN_ERR "compflt: no compression method set\n");
                 goto end;
         }
 
@@ -162,17 +315,29 @@ static enum rfs_retv cflt_f_pre_write(rfs_context context, struct rfs_args *args
                 f->f_flags &= ~O_APPEND;
         }
 
-        if (cflt_write(f, fh, *pos, &count, src)) {
-                return RFS_CONTINUE;
+        err = cflt_write(f, fh, *pos, &count, src);
+        if (err) {
+                *op_rv = err;
+                rv = REDIRFS_STOP;
+                goto end;
         }
 
         *op_rv = count;
         *pos += *op_rv;
 
+        // O_DSYNC is a part of O_SYNC on kernels that tell them apart
+        if (f->f_flags & O_SYNC || IS_SYNC(f->f_dentry->d_inode)) {
+                down_write(&fh->sem);
+                err = cflt_wb_sync(f, fh);
+                up_write(&fh->sem);
+                if (err)
+                        *op_rv = err;
+        }
+
         cflt_debug_file(fh);
         cflt_debug_printk("compflt: [pre_write] returning: count=%i pos=%i\n", *op_rv, (int)*pos);
 
-        rv = RFS_STOP;
+        rv = REDIRFS_STOP;
 end:
         cflt_file_put(fh);
         return rv;
@@ -180,102 +345,135 @@ end:
 
 // ====================================
 
-rfs_filter compflt;
-static struct rfs_path_info path_info = {CFLT_INC_DIR, RFS_PATH_INCLUDE|RFS_PATH_SUBTREE};
-static struct rfs_filter_info flt_info = {"compflt", 999, 0};
-static struct rfs_op_info ops_info[] = {
-        {RFS_REG_FOP_OPEN, cflt_f_pre_open, NULL},
-        {RFS_REG_FOP_RELEASE, NULL, cflt_f_post_release},
-        {RFS_REG_FOP_LLSEEK, cflt_f_pre_llseek, NULL},
-        {RFS_REG_FOP_READ, cflt_f_pre_read, NULL},
-        {RFS_REG_FOP_WRITE, cflt_f_pre_write, NULL},
-        {RFS_OP_END, NULL, NULL}
+redirfs_filter compflt;
+
+static struct redirfs_filter_info cflt_info = {
+        .owner = THIS_MODULE,
+        .name = "compflt",
+        .priority = 999,
+        .active = 1
+};
+
+static struct redirfs_op_info cflt_op_info[] = {
+        {REDIRFS_REG_FOP_OPEN, cflt_f_pre_open, NULL},
+        {REDIRFS_REG_FOP_RELEASE, NULL, cflt_f_post_release},
+        {REDIRFS_REG_FOP_LLSEEK, cflt_f_pre_llseek, NULL},
+        {REDIRFS_REG_FOP_READ, cflt_f_pre_read, NULL},
+        {REDIRFS_REG_FOP_WRITE, cflt_f_pre_write, NULL},
+        {REDIRFS_REG_FOP_MMAP, cflt_f_pre_mmap, NULL},
+        {REDIRFS_REG_FOP_FLUSH, cflt_f_pre_flush, NULL},
+        {REDIRFS_REG_FOP_FSYNC, cflt_f_pre_fsync, NULL},
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,17)
+        {REDIRFS_REG_FOP_SPLICE_READ, cflt_f_pre_splice_read, NULL},
+        {REDIRFS_REG_FOP_SPLICE_WRITE, cflt_f_pre_splice_write, NULL},
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
+        {REDIRFS_REG_FOP_SENDFILE, cflt_f_pre_sendfile, NULL},
+#endif
+        {REDIRFS_OP_END, NULL, NULL}
 };
 
+// The filter is not attached to any path by the module, paths are added
+// with rfsctl like for the other filters. Everything the callbacks use is
+// set up before the filter is registered.
 static int __init compflt_init(void)
 {
         int err;
+        int rv;
 
-        err = rfs_register_filter(&compflt, &flt_info);
-        if (err) {
-                printk(KERN_ERR "compflt: registration failed: error %d\n", err);
-                goto error;
+        rv = cflt_privd_cache_init();
+        if (rv) {
+                printk(KERN_ERR "compflt: private data cache initialization failed: error %d\n", rv);
+                return rv;
         }
 
-        err = cflt_privd_cache_init();
-        if (err) {
-                printk(KERN_ERR "compflt: private data cache initialization failed: error %d\n", err);
-                goto error;
+        rv = cflt_block_cache_init();
+        if (rv) {
+                printk(KERN_ERR "compflt: block cache initialization failed: error %d\n", rv);
+                goto err_privd;
         }
 
-        err = cflt_block_cache_init();
-        if (err) {
-                printk(KERN_ERR "compflt: block cache initialization failed: error %d\n", err);
-                goto error;
+        rv = cflt_file_cache_init();
+        if (rv) {
+                printk(KERN_ERR "compflt: cflt_file cache initialization failed: error %d\n", rv);
+                goto err_block;
         }
 
-        err = cflt_file_cache_init();
-        if (err) {
-                printk(KERN_ERR "compflt: cflt_file cache initialization failed: error %d\n", err);
-                goto error;
-        }
+        cflt_comp_pool_init();
+        cflt_cache_init();
 
-        err = cflt_sysfs_init();
-        if (err) {
-                printk(KERN_ERR "compflt: /sys initialization failed: error %d\n", err);
-                goto error;
+        rv = cflt_wb_init();
+        if (rv) {
+                printk(KERN_ERR "compflt: write-back initialization failed: error %d\n", rv);
+                goto err_pool;
         }
 
-        err = rfs_set_operations(compflt, ops_info);
-        if (err) {
-                printk(KERN_ERR "compflt: set operations failed: error %d\n", err);
-                goto error;
+        cflt_comp_method_set(in_cmethod);
+        if (!cflt_cmethod)
+                cflt_comp_method_set(CFLT_DEFAULT_METHOD);
+        if (!cflt_cmethod)
+                printk(KERN_WARNING "compflt: failed to set initial compress method\n");
+
+        cflt_file_blksize_set(in_blksize);
+
+        compflt = redirfs_register_filter(&cflt_info);
+        if (IS_ERR(compflt)) {
+                rv = PTR_ERR(compflt);
+                printk(KERN_ERR "compflt: registration failed: error %d\n", rv);
+                goto err_wb;
         }
 
-        err = rfs_set_path(compflt, &path_info);
-        if (err) {
-                printk(KERN_ERR "compflt: include path failed: error %d\n", err);
+        rv = redirfs_set_operations(compflt, cflt_op_info);
+        if (rv) {
+                printk(KERN_ERR "compflt: set operations failed: error %d\n", rv);
                 goto error;
         }
 
-        err = rfs_activate_filter(compflt);
-        if (err) {
-                printk(KERN_ERR "compflt: filter activation failed: error %d\n", err);
+        rv = cflt_sysfs_init();
+        if (rv) {
+                printk(KERN_ERR "compflt: /sys initialization failed: error %d\n", rv);
                 goto error;
         }
 
         printk(KERN_INFO "compflt: loaded version %s\n", version);
 
-        cflt_comp_method_set(in_cmethod);
-        if (!cflt_cmethod)
-                cflt_comp_method_set(CFLT_DEFAULT_METHOD);
-        if (!cflt_cmethod)
-                printk(KERN_WARNING "compflt: failed to set initial compress method\n");
-
-        cflt_file_blksize_set(in_blksize);
-
         return 0;
 
 error:
-        if (rfs_unregister_filter(compflt))
+        err = redirfs_unregister_filter(compflt);
+        if (err) {
                 printk(KERN_ERR "compflt: unregistration failed: error %d\n", err);
+                return 0;
+        }
 
-        return err;
+        redirfs_delete_filter(compflt);
+err_wb:
+        cflt_wb_deinit();
+err_pool:
+        cflt_cache_deinit();
+        cflt_comp_pool_deinit();
+        cflt_file_cache_deinit();
+err_block:
+        cflt_block_cache_deinit();
+err_privd:
+        cflt_privd_cache_deinit();
+
+        return rv;
 }
 
+// the module can be unloaded only after the filter was unregistered, by
+// then redirfs has freed all private data of the filter
 static void __exit compflt_exit(void)
 {
-        int err;
-
         cflt_sysfs_deinit();
-
-	err = rfs_unregister_filter(compflt);
-	if (err)
-                printk(KERN_ERR "compflt: unregistration failed: error %d\n", err);
+        redirfs_delete_filter(compflt);
 
         cflt_privd_cache_deinit();
         cflt_file_cache_deinit();
         cflt_block_cache_deinit();
+        cflt_wb_deinit();
+        cflt_cache_deinit();
+        cflt_comp_pool_deinit();
 }
 
 module_init(compflt_init);
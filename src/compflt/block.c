@@ -56,8 +56,14 @@ struct cflt_block* cflt_block_init(void)
         atomic_set(&blk->dirty, 0);
         blk->off_u = blk->off_c = 0;
         blk->size_u = blk->size_c = 0;
+        blk->cache = NULL;
+        blk->gen = 0;
+        blk->data_p = NULL;
 
         INIT_LIST_HEAD(&blk->file);
+        INIT_LIST_HEAD(&blk->lru);
+        INIT_LIST_HEAD(&blk->lru_f);
+        INIT_LIST_HEAD(&blk->wb);
 
         return blk;
 }
@@ -69,10 +75,11 @@ void cflt_block_deinit(struct cflt_block *blk)
         kmem_cache_free(cflt_block_cache, blk);
 }
 
-// sets 'off' to the start of the next header (or 0 if last)
+// sets 'off' to the start of the next header, returns 1 at the end of the
+// file and an error for a truncated or corrupted header
 int cflt_block_read_header(struct file *f, struct cflt_block *blk, loff_t *off)
 {
-        int rv = 0;
+        ssize_t rv = 0;
         int boff = 0;
         char buf[CFLT_BH_SIZE]; // max size
 
@@ -82,9 +89,10 @@ int cflt_block_read_header(struct file *f, struct cflt_block *blk, loff_t *off)
         blk->off_c = *off;
 
         rv = cflt_orig_read(f, buf, sizeof(buf), off);
-        if (!rv) {
-                return -1;
-        }
+        if (!rv)
+                return 1;
+        if (rv != sizeof(buf))
+                return rv < 0 ? rv : -EINVAL;
 
         memcpy((char*)&blk->type, buf+boff, sizeof(u8));
         boff += sizeof(u8);
@@ -101,6 +109,7 @@ int cflt_block_read_header(struct file *f, struct cflt_block *blk, loff_t *off)
                 blk->size_u = 0;
                 break;
         case CFLT_BLK_NORM:
+        case CFLT_BLK_RAW: // data stored uncompressed, SC == SU
                 // +--------------------+
                 // | T | OFFU | SC | SU |
                 // +--------------------+
@@ -109,10 +118,11 @@ int cflt_block_read_header(struct file *f, struct cflt_block *blk, loff_t *off)
                 memcpy(&blk->size_c, buf+boff, sizeof(u16));
                 boff += sizeof(u16);
                 memcpy(&blk->size_u, buf+boff, sizeof(u16));
+                if (blk->type == CFLT_BLK_RAW && blk->size_c != blk->size_u)
+                        return -EINVAL;
                 break;
         default:
-                BUG();
-                break;
+                return -EINVAL;
         }
 
         cflt_debug_block(blk);
@@ -121,17 +131,10 @@ int cflt_block_read_header(struct file *f, struct cflt_block *blk, loff_t *off)
         return 0;
 }
 
-int cflt_block_write_header(struct file *f, struct cflt_block *blk)
+// serialize the header of @blk to @buf (CFLT_BH_SIZE bytes)
+void cflt_block_pack_header(struct cflt_block *blk, char *buf)
 {
-        loff_t off;
-        char buf[CFLT_BH_SIZE]; // max size
         int boff = 0;
-        int rv = 0;
-
-        cflt_debug_printk("compflt: [f:cflt_block_write_header]\n");
-
-        if (!atomic_read(&blk->dirty))
-                return 0;
 
         memcpy(buf+boff, &blk->type, sizeof(u8));
         boff += sizeof(u8);
@@ -149,6 +152,7 @@ int cflt_block_write_header(struct file *f, struct cflt_block *blk)
                 memset(buf+boff, 0, sizeof(u16));
                 break;
         case CFLT_BLK_NORM:
+        case CFLT_BLK_RAW: // data stored uncompressed, SC == SU
                 // +--------------------+
                 // | T | OFFU | SC | SU |
                 // +--------------------+
@@ -162,70 +166,71 @@ int cflt_block_write_header(struct file *f, struct cflt_block *blk)
                 BUG();
                 break;
         }
+}
+
+int cflt_block_write_header(struct file *f, struct cflt_block *blk)
+{
+        loff_t off;
+        char buf[CFLT_BH_SIZE]; // max size
+
+        cflt_debug_printk("compflt: [f:cflt_block_write_header]\n");
+
+        if (!atomic_read(&blk->dirty))
+                return 0;
+
+        cflt_block_pack_header(blk, buf);
 
         off = blk->off_c;
-        rv = cflt_orig_write(f, buf, sizeof(buf), &off);
-        if (!rv) {
+        if (cflt_orig_write(f, buf, sizeof(buf), &off) != sizeof(buf)) {
                 printk(KERN_ERR "compflt: failed to write header\n");
-                return -1;
+                return -EIO;
         }
         atomic_set(&blk->dirty, 0);
 
         return 0;
 }
 
-static int cflt_block_read_c(struct file *f, struct cflt_block *blk)
+static int cflt_block_read_c(struct file *f, struct cflt_block *blk, char *buf)
 {
         loff_t off_data = blk->off_c + CFLT_BH_SIZE;
+        ssize_t rv;
 
         cflt_debug_printk("compflt: [f:cflt_block_read_c]\n");
 
-        cflt_orig_read(f, blk->data_c, blk->size_c, &off_data);
+        rv = cflt_orig_read(f, buf, blk->size_c, &off_data);
+        if (rv < 0)
+                return rv;
+        if (rv != blk->size_c)
+                return -EIO;
 
         return 0;
 }
 
-int cflt_block_read(struct file *f, struct cflt_block *blk, struct crypto_comp *tfm)
+// read and decompress the data of @blk into @data (blksize bytes), the
+// compressed data is read to the buffer of @ws
+int cflt_block_read(struct file *f, struct cflt_block *blk, struct cflt_comp_ws *ws, char *data)
 {
         int err = 0;
 
         cflt_debug_printk("compflt: [f:cflt_block_read]\n");
 
-        blk->data_c = kmalloc(blk->size_c, GFP_KERNEL);
-        if (!blk->data_c)
-                return -ENOMEM;
-
-        if ((err = cflt_block_read_c(f, blk))) {
-                printk(KERN_ERR "compflt: failed to read block error: %i\n", err);
-                return err;
+        if (blk->size_c > CFLT_COMP_BUFSIZE) {
+                if (printk_ratelimit())
+                        printk(KERN_ERR "compflt: block too big: %i\n", blk->size_c);
+                return -EINVAL;
         }
 
-        if ((err = cflt_decomp_block(tfm, blk))) {
-                printk(KERN_ERR "compflt: failed to decompress block error: %i\n", err);
+        if ((err = cflt_block_read_c(f, blk, ws->buf))) {
+                if (printk_ratelimit())
+                        printk(KERN_ERR "compflt: failed to read block error: %i\n", err);
                 return err;
         }
 
-        kfree(blk->data_c);
-        return err;
-}
-
-int cflt_block_write(struct file *f, struct cflt_block *blk, struct crypto_comp *tfm)
-{
-        int err = 0;
-        loff_t off_data;
-        size_t old = blk->size_c;
-
-        cflt_debug_printk("compflt: [f:cflt_block_write]\n");
-
-        err = cflt_comp_block(tfm, blk);
-        if (err)
+        if ((err = cflt_decomp_block(ws, blk, data))) {
+                if (printk_ratelimit())
+                        printk(KERN_ERR "compflt: failed to decompress block error: %i\n", err);
                 return err;
+        }
 
-        cflt_file_place_block(blk, old);
-
-        off_data = blk->off_c + CFLT_BH_SIZE;
-        cflt_orig_write(f, blk->data_c, blk->size_c, &off_data);
-
-        kfree(blk->data_c);
         return err;
 }
@@ -0,0 +1,228 @@
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/mm.h>
+#include "compflt.h"
+
+// Decompressed data of normal blocks is kept in a global LRU list and in
+// a LRU list of each file. A reader takes the data out of the cache while it
+// copies it (cflt_cache_get) and puts it back when done (cflt_cache_put), so
+// nothing is freed under its hands. A write bumps the block generation
+// (cflt_cache_inval) so that data taken out before it is not put back.
+// Under memory pressure the VM shrinks the global list from its tail.
+
+static unsigned int cflt_cache_max = CFLT_DEFAULT_CACHE_MAX;
+static unsigned int cflt_cache_file_max = CFLT_DEFAULT_CACHE_FILE_MAX;
+static unsigned int cflt_cache_nr = 0;
+static LIST_HEAD(cflt_cache_lru);
+static DEFINE_SPINLOCK(cflt_cache_l);
+
+// called with cflt_cache_l held, returns the detached data
+static char *cflt_cache_unlink(struct cflt_block *blk)
+{
+        char *data = blk->cache;
+
+        if (!data)
+                return NULL;
+
+        list_del_init(&blk->lru);
+        list_del_init(&blk->lru_f);
+        blk->cache = NULL;
+        blk->par->cached--;
+        cflt_cache_nr--;
+
+        return data;
+}
+
+// called with cflt_cache_l held
+static void cflt_cache_shrink(struct cflt_file *fh)
+{
+        struct cflt_block *blk;
+
+        while (fh->cached > cflt_cache_file_max) {
+                blk = list_entry(fh->lru.prev, struct cflt_block, lru_f);
+                kfree(cflt_cache_unlink(blk));
+        }
+
+        while (cflt_cache_nr > cflt_cache_max) {
+                blk = list_entry(cflt_cache_lru.prev, struct cflt_block, lru);
+                kfree(cflt_cache_unlink(blk));
+        }
+}
+
+// take the decompressed data of @blk out of the cache
+// @blk: normal block
+// @gen: set to the block generation the data belongs to
+char *cflt_cache_get(struct cflt_block *blk, unsigned int *gen)
+{
+        char *data;
+
+        spin_lock(&cflt_cache_l);
+        *gen = blk->gen;
+        data = cflt_cache_unlink(blk);
+        spin_unlock(&cflt_cache_l);
+
+        return data;
+}
+
+// put @data (fh->blksize bytes) back to the cache, the cache owns it then
+// @blk: normal block added to its file
+// @data: decompressed data of @blk
+// @gen: block generation from cflt_cache_get or cflt_cache_inval
+void cflt_cache_put(struct cflt_block *blk, char *data, unsigned int gen)
+{
+        struct cflt_file *fh = blk->par;
+
+        spin_lock(&cflt_cache_l);
+
+        if (blk->gen != gen || blk->cache || !cflt_cache_max ||
+            !cflt_cache_file_max) {
+                spin_unlock(&cflt_cache_l);
+                kfree(data);
+                return;
+        }
+
+        blk->cache = data;
+        list_add(&blk->lru, &cflt_cache_lru);
+        list_add(&blk->lru_f, &fh->lru);
+        fh->cached++;
+        cflt_cache_nr++;
+
+        cflt_cache_shrink(fh);
+
+        spin_unlock(&cflt_cache_l);
+}
+
+// drop the cached data of @blk, returns the new block generation
+unsigned int cflt_cache_inval(struct cflt_block *blk)
+{
+        unsigned int gen;
+        char *data;
+
+        spin_lock(&cflt_cache_l);
+        gen = ++blk->gen;
+        data = cflt_cache_unlink(blk);
+        spin_unlock(&cflt_cache_l);
+
+        kfree(data);
+
+        return gen;
+}
+
+// drop all cached data of @fh
+void cflt_cache_inval_file(struct cflt_file *fh)
+{
+        struct cflt_block *blk;
+
+        spin_lock(&cflt_cache_l);
+        while (!list_empty(&fh->lru)) {
+                blk = list_entry(fh->lru.next, struct cflt_block, lru_f);
+                blk->gen++;
+                kfree(cflt_cache_unlink(blk));
+        }
+        spin_unlock(&cflt_cache_l);
+}
+
+static void cflt_cache_shrink_all(void)
+{
+        struct cflt_block *blk;
+
+        spin_lock(&cflt_cache_l);
+        while (cflt_cache_nr > cflt_cache_max) {
+                blk = list_entry(cflt_cache_lru.prev, struct cflt_block, lru);
+                kfree(cflt_cache_unlink(blk));
+        }
+        // per-file limits are applied on the next put to the file
+        spin_unlock(&cflt_cache_l);
+}
+
+// nothing is allocated with cflt_cache_l held, so the data can be freed
+// right away whatever the gfp mask is
+static int cflt_cache_shrink_count(int nr_scan)
+{
+        struct cflt_block *blk;
+        int nr;
+
+        spin_lock(&cflt_cache_l);
+        while (nr_scan-- > 0 && cflt_cache_nr) {
+                blk = list_entry(cflt_cache_lru.prev, struct cflt_block, lru);
+                kfree(cflt_cache_unlink(blk));
+        }
+        nr = cflt_cache_nr;
+        spin_unlock(&cflt_cache_l);
+
+        return nr;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0)
+static int cflt_cache_shrinker_fn(struct shrinker *shrink, struct shrink_control *sc)
+{
+        return cflt_cache_shrink_count(sc->nr_to_scan);
+}
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+static int cflt_cache_shrinker_fn(struct shrinker *shrink, int nr_to_scan, gfp_t gfp_mask)
+{
+        return cflt_cache_shrink_count(nr_to_scan);
+}
+#else
+static int cflt_cache_shrinker_fn(int nr_to_scan, gfp_t gfp_mask)
+{
+        return cflt_cache_shrink_count(nr_to_scan);
+}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,23)
+static struct shrinker cflt_cache_shrinker = {
+        .shrink = cflt_cache_shrinker_fn,
+        .seeks = DEFAULT_SEEKS
+};
+
+void cflt_cache_init(void)
+{
+        register_shrinker(&cflt_cache_shrinker);
+}
+
+void cflt_cache_deinit(void)
+{
+        unregister_shrinker(&cflt_cache_shrinker);
+}
+#else
+static struct shrinker *cflt_cache_shrinker;
+
+void cflt_cache_init(void)
+{
+        cflt_cache_shrinker = set_shrinker(DEFAULT_SEEKS, cflt_cache_shrinker_fn);
+}
+
+void cflt_cache_deinit(void)
+{
+        if (cflt_cache_shrinker)
+                remove_shrinker(cflt_cache_shrinker);
+}
+#endif
+
+int cflt_cache_max_set(unsigned long int new)
+{
+        cflt_cache_max = new;
+        cflt_cache_shrink_all();
+        printk(KERN_INFO "compflt: cache size set to %li blocks\n", new);
+
+        return 0;
+}
+
+int cflt_cache_max_get(char *buf, int bsize)
+{
+        return sprintf(buf, "%u\n", cflt_cache_max);
+}
+
+int cflt_cache_file_max_set(unsigned long int new)
+{
+        cflt_cache_file_max = new;
+        printk(KERN_INFO "compflt: per-file cache size set to %li blocks\n", new);
+
+        return 0;
+}
+
+int cflt_cache_file_max_get(char *buf, int bsize)
+{
+        return sprintf(buf, "%u\n", cflt_cache_file_max);
+}
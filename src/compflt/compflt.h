@@ -1,9 +1,11 @@
 #include <linux/crypto.h>
 #include <linux/list.h>
+#include <linux/rbtree.h>
 #include <linux/fs.h>
 #include <linux/sched.h>
 #include <linux/version.h>
-#include "../redirfs/redirfs.h"
+#include <linux/rwsem.h>
+#include <redirfs.h>
 
 #define CFLT_MAGIC "\x06\x10\x19\x82"
 #define CFLT_FH_SIZE 9
@@ -13,10 +15,23 @@
 #define CFLT_BLKSIZE_MOD 512
 #define CFLT_DEFAULT_BLKSIZE 4096
 #define CFLT_DEFAULT_METHOD "deflate"
-enum { CFLT_BLK_NORM, CFLT_BLK_FREE }; // block types
+#define CFLT_DEFAULT_CACHE_MAX 256 // blocks
+#define CFLT_DEFAULT_CACHE_FILE_MAX 64 // blocks
+#define CFLT_WB_MAX 64 // pending blocks of a file before they are written
+#define CFLT_WB_BUFSIZE (256*1024)
+#define CFLT_METHOD_NR 7 // entries in cflt_method_known
+#define CFLT_COMP_BUFSIZE (2*CFLT_BLKSIZE_MAX)
+#define CFLT_DEFAULT_MIN_SAVING 10 // percent
+#define CFLT_DEFAULT_HOT_REWRITES 64
+#define CFLT_ENTROPY_SAMPLES 1024
+#define CFLT_ENTROPY_MAX (7 << 8) // bits per byte << 8
+enum { CFLT_BLK_NORM, CFLT_BLK_FREE, CFLT_BLK_RAW }; // block types
+enum { CFLT_STAT_COMPRESSED, CFLT_STAT_RAW, CFLT_STAT_SKIPPED, CFLT_STAT_NR };
 
 struct cflt_block {
 	struct list_head file;
+        struct rb_node node_c; // in cflt_file->blks_c (by off_c)
+        struct rb_node idx; // in cflt_file->blks_u (normal) or blks_f (free)
         unsigned int type; // u8 (0 == free , 1 == normal)
 	unsigned int off_u; // u32
 	unsigned int off_c; // not written to file
@@ -26,41 +41,69 @@ struct cflt_block {
         char *data_u;
         char *data_c;
         atomic_t dirty;
+        char *cache; // cached data_u (protected by cflt_cache_l)
+        unsigned int gen; // bumped on every write of the block
+        struct list_head lru; // in the global cache lru list
+        struct list_head lru_f; // in cflt_file->lru
+        char *data_p; // pending data_u waiting for write-back
+        struct list_head wb; // in cflt_file->wb
 };
 
 struct cflt_file {
 	struct list_head all;
         // ===
-	struct list_head blks;
+	struct list_head blks; // in order of off_c
+        struct rb_root blks_c; // all blocks by off_c
+        struct rb_root blks_u; // normal blocks by off_u
+        struct rb_root blks_f; // free blocks by size_c
 	struct inode *inode;
 	unsigned int method; // u8
         unsigned int blksize; // u32
         unsigned int size_u; // whole uncompressed size
+        unsigned int rewrites; // writes to existing blocks since truncation
         atomic_t compressed;
         atomic_t dirty;
         atomic_t cnt;
+        struct list_head lru; // cached blocks, most recently used first
+        unsigned int cached;
+        struct list_head wb; // blocks with pending data in write order
+        unsigned int wb_nr;
+        struct rw_semaphore sem; // readers vs. writers and write-back
         wait_queue_head_t ref_w;
         spinlock_t lock;
 };
 
+// preallocated transform and compression buffer
+struct cflt_comp_ws {
+        struct list_head list;
+        struct crypto_comp *tfm;
+        unsigned int method;
+        char *buf; // CFLT_COMP_BUFSIZE bytes for data_c
+};
+
+// attached to the inode, the cflt_file is freed together with it
 struct cflt_privd {
-	struct list_head all;
-        struct rfs_priv_data rfs_data;
+        struct redirfs_data rfs_data;
         struct cflt_file *fh;
 };
 
 // base.c
-extern rfs_filter compflt;
+extern redirfs_filter compflt;
 
 // file.c
 struct cflt_file *cflt_file_get(struct inode*, struct file*);
 void cflt_file_put(struct cflt_file*);
+void cflt_file_deinit(struct cflt_file*);
 
 int cflt_file_read_block_headers(struct file*, struct cflt_file*);
-void cflt_file_write_block_headers(struct file*, struct cflt_file*);
+int cflt_file_write_block_headers(struct file*, struct cflt_file*);
 
 void cflt_file_add_blk(struct cflt_file*, struct cflt_block*);
+void cflt_file_index_blk(struct cflt_file*, struct cflt_block*);
+void cflt_file_link_blk(struct cflt_file*, struct cflt_block*);
 void cflt_file_del_blk(struct cflt_block *blk);
+struct cflt_block *cflt_file_find_blk(struct cflt_file*, loff_t);
+struct cflt_block *cflt_file_next_blk(struct cflt_block*);
 
 int cflt_file_place_block(struct cflt_block*, unsigned int);
 
@@ -70,9 +113,11 @@ int cflt_file_cache_init(void);
 void cflt_file_cache_deinit(void);
 struct cflt_file *cflt_file_find(struct inode*);
 int cflt_file_read(struct file*, struct cflt_file*);
-void cflt_file_write(struct file*, struct cflt_file*);
+int cflt_file_write(struct file*, struct cflt_file*);
 int cflt_file_blksize_set(unsigned long int);
 int cflt_file_blksize_get(char*, int);
+int cflt_file_hot_rewrites_set(unsigned long int);
+int cflt_file_hot_rewrites_get(char*, int);
 
 // block.c
 int cflt_block_read_headers(struct file*, struct cflt_file*);
@@ -81,25 +126,54 @@ void cflt_block_cache_deinit(void);
 struct cflt_block* cflt_block_init(void);
 void cflt_block_deinit(struct cflt_block*);
 int cflt_block_read_header(struct file*, struct cflt_block*, loff_t*);
+void cflt_block_pack_header(struct cflt_block*, char*);
 int cflt_block_write_header(struct file*, struct cflt_block*);
-int cflt_block_read(struct file*, struct cflt_block*, struct crypto_comp*);
-int cflt_block_write(struct file*, struct cflt_block*, struct crypto_comp*);
+int cflt_block_read(struct file*, struct cflt_block*, struct cflt_comp_ws*, char*);
 
 // read_write.c
 ssize_t cflt_orig_read(struct file*, char __user*, size_t, loff_t*);
 ssize_t cflt_orig_write(struct file*, const char __user*, size_t, loff_t*);
-int cflt_read(struct file*, struct cflt_file*, loff_t, size_t*, char*);
-int cflt_write(struct file*, struct cflt_file*, loff_t, size_t*, char*);
+int cflt_read(struct file*, struct cflt_file*, loff_t, size_t*, char __user*);
+int cflt_write(struct file*, struct cflt_file*, loff_t, size_t*, const char __user*);
+
+// cache.c
+void cflt_cache_init(void);
+void cflt_cache_deinit(void);
+char *cflt_cache_get(struct cflt_block*, unsigned int*);
+void cflt_cache_put(struct cflt_block*, char*, unsigned int);
+unsigned int cflt_cache_inval(struct cflt_block*);
+void cflt_cache_inval_file(struct cflt_file*);
+int cflt_cache_max_set(unsigned long int);
+int cflt_cache_max_get(char*, int);
+int cflt_cache_file_max_set(unsigned long int);
+int cflt_cache_file_max_get(char*, int);
+
+// writeback.c
+int cflt_wb_init(void);
+void cflt_wb_deinit(void);
+int cflt_wb_flush(struct file*, struct cflt_file*);
+int cflt_wb_sync(struct file*, struct cflt_file*);
 
 // compress.c
 extern char *cflt_method_known[];
 extern unsigned int cflt_cmethod;
+extern unsigned int cflt_hmethod;
+extern atomic_t cflt_stats[];
+extern atomic_long_t cflt_stats_bytes[];
 struct crypto_comp *cflt_comp_init(unsigned int);
 void cflt_comp_deinit(struct crypto_comp*);
-int cflt_decomp_block(struct crypto_comp*, struct cflt_block*);
-int cflt_comp_block(struct crypto_comp*, struct cflt_block*);
+void cflt_comp_pool_init(void);
+void cflt_comp_pool_deinit(void);
+struct cflt_comp_ws *cflt_comp_get(unsigned int);
+void cflt_comp_put(struct cflt_comp_ws*);
+int cflt_decomp_block(struct cflt_comp_ws*, struct cflt_block*, char*);
+int cflt_comp_block(struct cflt_comp_ws*, struct cflt_block*);
 int cflt_comp_method_set(const char*);
 int cflt_comp_method_get(char*, int);
+int cflt_comp_hot_method_set(const char*);
+int cflt_comp_hot_method_get(char*, int);
+int cflt_comp_min_saving_set(unsigned long int);
+int cflt_comp_min_saving_get(char*, int);
 
 // sysfs.c
 int cflt_sysfs_init(void);
@@ -109,7 +183,7 @@ void cflt_sysfs_deinit(void);
 int cflt_privd_cache_init(void);
 void cflt_privd_cache_deinit(void);
 struct cflt_privd *cflt_privd_init(struct cflt_file*);
-struct cflt_privd *cflt_privd_from_rfs(struct rfs_priv_data*);
+struct cflt_privd *cflt_privd_from_rfs(struct redirfs_data*);
 
 // debug.c
 #ifdef CFLT_DEBUG
@@ -1,9 +1,32 @@
 #include <linux/crypto.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 #include "compflt.h"
 
 // cryptoapi doesnt provide a way to iterate over all registered methods.
-char *cflt_method_known[] = { "", "deflate", "lzf", "bzip2", "rle", "null", NULL };
+char *cflt_method_known[CFLT_METHOD_NR+1] = { "", "deflate", "lzf", "bzip2", "rle", "null", "lzo", NULL };
 unsigned int cflt_cmethod = 0;
+unsigned int cflt_hmethod = 0; // method for hot files, 0 if not used
+static unsigned int cflt_min_saving = CFLT_DEFAULT_MIN_SAVING;
+
+atomic_t cflt_stats[CFLT_STAT_NR];
+atomic_long_t cflt_stats_bytes[2]; // uncompressed and stored bytes
+
+// Each method has a pool of transforms with compression buffers. A pool
+// grows up to one entry per online cpu on demand and the entries are kept
+// until the module is unloaded. Entries can be held over the lower file
+// system I/O, so they are not bound to a cpu and callers wait for an idle
+// one when all of them are in use.
+struct cflt_comp_pool {
+        spinlock_t lock;
+        struct list_head idle;
+        int nr;
+        wait_queue_head_t wait;
+};
+
+static struct cflt_comp_pool cflt_comp_pools[CFLT_METHOD_NR];
 
 struct crypto_comp *cflt_comp_init(unsigned int mid)
 {
@@ -12,16 +35,19 @@ struct crypto_comp *cflt_comp_init(unsigned int mid)
         cflt_debug_printk("compflt: [f:comp_init]\n");
 
         // initialize compression method
+        // files keep their method, it can be missing each time they are read
         if (!crypto_has_alg(cflt_method_known[mid], 0, 0)) {
-                printk(KERN_ERR "compflt: compression method %s "
-                                "unavailable\n", cflt_method_known[mid]);
+                if (printk_ratelimit())
+                        printk(KERN_ERR "compflt: compression method %s "
+                                        "unavailable\n", cflt_method_known[mid]);
                 return NULL;
         }
 
         tfm = crypto_alloc_comp(cflt_method_known[mid], 0, 0);
-        if (tfm == NULL) {
-                printk(KERN_ERR "compflt: failed to alloc %s "
-                                "compression method\n", cflt_method_known[mid]);
+        if (!tfm || IS_ERR(tfm)) {
+                if (printk_ratelimit())
+                        printk(KERN_ERR "compflt: failed to alloc %s "
+                                        "compression method\n", cflt_method_known[mid]);
                 return NULL;
         }
 
@@ -33,26 +59,206 @@ inline void cflt_comp_deinit(struct crypto_comp *tfm)
         crypto_free_comp(tfm);
 }
 
-int cflt_decomp_block(struct crypto_comp *tfm, struct cflt_block *blk)
+static struct cflt_comp_ws *cflt_comp_ws_init(unsigned int mid)
+{
+        struct cflt_comp_ws *ws;
+
+        cflt_debug_printk("compflt: [f:comp_ws_init]\n");
+
+        ws = kmalloc(sizeof(struct cflt_comp_ws), GFP_KERNEL);
+        if (!ws)
+                return NULL;
+
+        ws->buf = vmalloc(CFLT_COMP_BUFSIZE);
+        if (!ws->buf) {
+                kfree(ws);
+                return NULL;
+        }
+
+        ws->tfm = cflt_comp_init(mid);
+        if (!ws->tfm) {
+                vfree(ws->buf);
+                kfree(ws);
+                return NULL;
+        }
+
+        ws->method = mid;
+        INIT_LIST_HEAD(&ws->list);
+
+        return ws;
+}
+
+static void cflt_comp_ws_deinit(struct cflt_comp_ws *ws)
+{
+        cflt_comp_deinit(ws->tfm);
+        vfree(ws->buf);
+        kfree(ws);
+}
+
+void cflt_comp_pool_init(void)
+{
+        int i;
+
+        for (i = 0; i < CFLT_STAT_NR; i++)
+                atomic_set(&cflt_stats[i], 0);
+        atomic_long_set(&cflt_stats_bytes[0], 0);
+        atomic_long_set(&cflt_stats_bytes[1], 0);
+
+        for (i = 0; i < CFLT_METHOD_NR; i++) {
+                spin_lock_init(&cflt_comp_pools[i].lock);
+                INIT_LIST_HEAD(&cflt_comp_pools[i].idle);
+                cflt_comp_pools[i].nr = 0;
+                init_waitqueue_head(&cflt_comp_pools[i].wait);
+        }
+}
+
+// all entries have to be idle at this point
+void cflt_comp_pool_deinit(void)
+{
+        struct cflt_comp_ws *ws;
+        struct cflt_comp_ws *tmp;
+        int i;
+
+        for (i = 0; i < CFLT_METHOD_NR; i++) {
+                list_for_each_entry_safe(ws, tmp, &cflt_comp_pools[i].idle, list) {
+                        list_del(&ws->list);
+                        cflt_comp_ws_deinit(ws);
+                }
+                cflt_comp_pools[i].nr = 0;
+        }
+}
+
+// get an idle transform for method @mid, release it with cflt_comp_put
+struct cflt_comp_ws *cflt_comp_get(unsigned int mid)
 {
+        struct cflt_comp_pool *pool;
+        struct cflt_comp_ws *ws;
+
+        if (!mid || mid >= CFLT_METHOD_NR)
+                return NULL;
+
+        pool = &cflt_comp_pools[mid];
+again:
+        spin_lock(&pool->lock);
+        if (!list_empty(&pool->idle)) {
+                ws = list_entry(pool->idle.next, struct cflt_comp_ws, list);
+                list_del(&ws->list);
+                spin_unlock(&pool->lock);
+                return ws;
+        }
+
+        if (pool->nr >= num_online_cpus()) {
+                spin_unlock(&pool->lock);
+                wait_event(pool->wait, !list_empty(&pool->idle) ||
+                                ACCESS_ONCE(pool->nr) < num_online_cpus());
+                goto again;
+        }
+        pool->nr++;
+        spin_unlock(&pool->lock);
+
+        ws = cflt_comp_ws_init(mid);
+        if (!ws) {
+                spin_lock(&pool->lock);
+                pool->nr--;
+                spin_unlock(&pool->lock);
+                // the freed slot lets a waiter try the allocation itself
+                wake_up(&pool->wait);
+                if (printk_ratelimit())
+                        printk(KERN_ERR "compflt: failed to alloc %s transform\n",
+                                        cflt_method_known[mid]);
+        }
+
+        return ws;
+}
+
+void cflt_comp_put(struct cflt_comp_ws *ws)
+{
+        struct cflt_comp_pool *pool = &cflt_comp_pools[ws->method];
+
+        spin_lock(&pool->lock);
+        list_add(&ws->list, &pool->idle);
+        spin_unlock(&pool->lock);
+
+        wake_up(&pool->wait);
+}
+
+// Estimate the entropy of @size bytes at @data in bits per byte << 8 from
+// up to CFLT_ENTROPY_SAMPLES bytes spread evenly over the data.
+static unsigned int cflt_log2_fp(unsigned int x)
+{
+        unsigned int r = (fls(x) - 1) << 8;
+        u64 y = (u64)x << (16 - (fls(x) - 1)); // [1, 2) << 16
+        int i;
+
+        for (i = 7; i >= 0; i--) {
+                y = (y * y) >> 16;
+                if (y >= (2 << 16)) {
+                        y >>= 1;
+                        r |= 1 << i;
+                }
+        }
+
+        return r;
+}
+
+static unsigned int cflt_comp_entropy(const unsigned char *data, unsigned int size)
+{
+        unsigned short hist[256];
+        unsigned int step = 1;
+        unsigned int n = 0;
+        unsigned int sum = 0;
+        unsigned int i;
+
+        if (size > CFLT_ENTROPY_SAMPLES)
+                step = size / CFLT_ENTROPY_SAMPLES;
+
+        memset(hist, 0, sizeof(hist));
+        for (i = 0; i < size && n < CFLT_ENTROPY_SAMPLES; i += step, n++)
+                hist[data[i]]++;
+
+        if (!n)
+                return 0;
+
+        for (i = 0; i < 256; i++) {
+                if (hist[i])
+                        sum += hist[i] * cflt_log2_fp(hist[i]);
+        }
+
+        return cflt_log2_fp(n) - sum / n;
+}
+
+// Decompress the data of @blk read to ws->buf into @data (blksize bytes).
+// The block itself is not changed, readers share it under fh->sem.
+int cflt_decomp_block(struct cflt_comp_ws *ws, struct cflt_block *blk, char *data)
+{
+        unsigned int size_u = blk->par->blksize;
         int rv = 0;
 
         cflt_debug_printk("compflt: [f:decomp_block]\n");
 
-	memset(blk->data_u, 0, blk->par->blksize);
+        memset(data, 0, blk->par->blksize);
+
+        if (blk->type == CFLT_BLK_RAW) {
+                if (blk->size_c > blk->par->blksize)
+                        return -EINVAL;
+                memcpy(data, ws->buf, blk->size_c);
+                return 0;
+        }
 
-	if ((rv = crypto_comp_decompress(tfm, blk->data_c, blk->size_c, blk->data_u, &blk->size_u))) {
-                printk(KERN_ERR "compflt: failed to decompress data block error: %i\n", rv);
-                kfree(blk->data_u);
+        if ((rv = crypto_comp_decompress(ws->tfm, ws->buf, blk->size_c, data, &size_u))) {
+                if (printk_ratelimit())
+                        printk(KERN_ERR "compflt: failed to decompress data block error: %i\n", rv);
                 return rv;
         }
 
-        cflt_debug_printk("compflt: [f:decomp_block] decompressed %i bytes | ratio=%i:%i\n", blk->size_c, blk->size_c, blk->size_u);
+        cflt_debug_printk("compflt: [f:decomp_block] decompressed %i bytes | ratio=%i:%i\n", blk->size_c, blk->size_c, size_u);
 
         return rv;
 }
 
-int cflt_comp_block(struct crypto_comp *tfm, struct cflt_block *blk)
+// Compress the block, it is stored raw if the data looks random or if the
+// compression does not save at least cflt_min_saving percent.
+int cflt_comp_block(struct cflt_comp_ws *ws, struct cflt_block *blk)
 {
         int rv = 0;
         unsigned int size_c;
@@ -60,20 +266,37 @@ int cflt_comp_block(struct crypto_comp *tfm, struct cflt_block *blk)
         cflt_debug_printk("compflt: [f:comp_block]\n");
 
         size_c = 2*blk->par->blksize;
-        blk->data_c = kmalloc(size_c, GFP_KERNEL);
-        if (!blk->data_c)
-                return -ENOMEM;
+        blk->data_c = ws->buf;
+
+        if (cflt_comp_entropy(blk->data_u, blk->size_u) >= CFLT_ENTROPY_MAX) {
+                atomic_inc(&cflt_stats[CFLT_STAT_SKIPPED]);
+                goto raw;
+        }
 
 	memset(blk->data_c, 0, size_c);
-        if ((rv = crypto_comp_compress(tfm, blk->data_u, blk->size_u, blk->data_c, &size_c))) {
+        if ((rv = crypto_comp_compress(ws->tfm, blk->data_u, blk->size_u, blk->data_c, &size_c))) {
                 printk(KERN_ERR "compflt: failed to compress data block error: %i\n", rv);
-                kfree(blk->data_c);
                 return rv;
         }
 
         cflt_debug_printk("compflt: [f:comp_block] compressed %i bytes | ratio=%i:%i\n", blk->size_u, size_c, blk->size_u);
 
+        if (size_c * 100 > blk->size_u * (100 - cflt_min_saving))
+                goto raw;
+
+        blk->type = CFLT_BLK_NORM;
         blk->size_c = size_c;
+        atomic_inc(&cflt_stats[CFLT_STAT_COMPRESSED]);
+        goto end;
+
+raw:
+        memcpy(blk->data_c, blk->data_u, blk->size_u);
+        blk->type = CFLT_BLK_RAW;
+        blk->size_c = blk->size_u;
+        atomic_inc(&cflt_stats[CFLT_STAT_RAW]);
+end:
+        atomic_long_add(blk->size_u, &cflt_stats_bytes[0]);
+        atomic_long_add(blk->size_c, &cflt_stats_bytes[1]);
 
         return rv;
 }
@@ -89,7 +312,8 @@ int cflt_comp_method_get(char* buf, int bsize)
         return len;
 }
 
-int cflt_comp_method_set(const char* buf)
+// returns the index of an available method called @buf or 0
+static unsigned int cflt_comp_method_find(const char *buf)
 {
         char **p = cflt_method_known;
         int i = 1;
@@ -97,18 +321,68 @@ int cflt_comp_method_set(const char* buf)
         p++; // skip 1st 'dummy' entry
         while (*p) {
                 if (!strcmp(*p, buf) && strlen(*p) == strlen(buf)) {
-                        if (crypto_has_alg(*p, 0, 0)) {
-                                cflt_cmethod = i;
-                                printk(KERN_INFO "compflt: compression method set to '%s'\n", *p);
-                                return 0;
-                        }
-                        else {
-                                printk(KERN_INFO "compflt: compression method '%s' unavailable\n", *p);
-                        }
+                        if (crypto_has_alg(*p, 0, 0))
+                                return i;
+
+                        printk(KERN_INFO "compflt: compression method '%s' unavailable\n", *p);
                         break;
                 }
                 p++; i++;
         }
 
-        return -1;
+        return 0;
+}
+
+int cflt_comp_method_set(const char* buf)
+{
+        unsigned int mid = cflt_comp_method_find(buf);
+
+        if (!mid)
+                return -1;
+
+        cflt_cmethod = mid;
+        printk(KERN_INFO "compflt: compression method set to '%s'\n", cflt_method_known[mid]);
+        return 0;
+}
+
+int cflt_comp_hot_method_get(char* buf, int bsize)
+{
+        if (!cflt_hmethod)
+                return sprintf(buf, "none\n");
+
+        return sprintf(buf, "%s\n", cflt_method_known[cflt_hmethod]);
+}
+
+// "none" turns the hot method off
+int cflt_comp_hot_method_set(const char* buf)
+{
+        unsigned int mid = 0;
+
+        if (strcmp(buf, "none")) {
+                mid = cflt_comp_method_find(buf);
+                if (!mid)
+                        return -1;
+        }
+
+        cflt_hmethod = mid;
+        printk(KERN_INFO "compflt: hot file compression method set to '%s'\n",
+                        mid ? cflt_method_known[mid] : "none");
+        return 0;
+}
+
+int cflt_comp_min_saving_set(unsigned long int new)
+{
+        if (new > 100) {
+                printk(KERN_INFO "compflt: minimal saving %li%% is out of the permitted range\n", new);
+                return -1;
+        }
+
+        cflt_min_saving = new;
+        printk(KERN_INFO "compflt: minimal saving set to %li%%\n", new);
+        return 0;
+}
+
+int cflt_comp_min_saving_get(char* buf, int bsize)
+{
+        return sprintf(buf, "%u\n", cflt_min_saving);
 }
@@ -1,7 +1,6 @@
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/wait.h>
-#include "../redirfs/redirfs.h"
 #include "compflt.h"
 
 #define CACHE_NAME "cflt_file"
@@ -11,19 +10,28 @@ atomic_t file_cache_cnt;
 wait_queue_head_t file_cache_w;
 
 struct list_head cflt_file_list;
-spinlock_t cflt_file_list_l = SPIN_LOCK_UNLOCKED;
+DEFINE_SPINLOCK(cflt_file_list_l);
 
 static unsigned int cflt_blksize = CFLT_DEFAULT_BLKSIZE;
+static unsigned int cflt_hot_rewrites = CFLT_DEFAULT_HOT_REWRITES;
 
 
 void cflt_file_truncate(struct cflt_file *fh)
 {
         cflt_debug_printk("compflt: [f:cflt_file_truncate] i=%li\n", fh->inode->i_ino);
 
+        // a file that was rewritten a lot keeps the hot method until it is
+        // truncated again, the method is stored in the file header
+        if (cflt_hmethod && fh->rewrites >= cflt_hot_rewrites)
+                fh->method = cflt_hmethod;
+        else
+                fh->method = cflt_cmethod;
+
         fh->size_u = 0;
-        fh->method = cflt_cmethod;
+        fh->rewrites = 0;
         fh->blksize = cflt_blksize;
-        atomic_set(&fh->dirty, 0);
+        // the header is gone with the lower file data
+        atomic_set(&fh->dirty, 1);
         atomic_set(&fh->compressed, 0);
 }
 
@@ -35,10 +43,27 @@ inline void cflt_file_clr_blks(struct cflt_file *fh)
 
         cflt_debug_printk("compflt: [f:cflt_file_clr_blks]\n");
 
+        cflt_cache_inval_file(fh);
+
+        // pending new blocks are not in the blks list yet
+        list_for_each_entry_safe(blk, tmp, &fh->wb, wb) {
+                list_del(&blk->wb);
+                kfree(blk->data_p);
+                if (list_empty(&blk->file))
+                        cflt_block_deinit(blk);
+                else
+                        blk->data_p = NULL;
+        }
+        fh->wb_nr = 0;
+
         list_for_each_entry_safe(blk, tmp, &fh->blks, file) {
                 list_del(&blk->file);
                 cflt_block_deinit(blk);
         }
+
+        fh->blks_c = RB_ROOT;
+        fh->blks_u = RB_ROOT;
+        fh->blks_f = RB_ROOT;
 }
 
 // alloc and initialize a (struct cflt_file)
@@ -56,6 +81,14 @@ static struct cflt_file* cflt_file_init(struct inode *inode)
         atomic_inc(&file_cache_cnt);
 
         INIT_LIST_HEAD(&fh->blks);
+        fh->blks_c = RB_ROOT;
+        fh->blks_u = RB_ROOT;
+        fh->blks_f = RB_ROOT;
+        INIT_LIST_HEAD(&fh->lru);
+        fh->cached = 0;
+        INIT_LIST_HEAD(&fh->wb);
+        fh->wb_nr = 0;
+        init_rwsem(&fh->sem);
 
         init_waitqueue_head(&fh->ref_w);
         spin_lock_init(&fh->lock);
@@ -64,6 +97,7 @@ static struct cflt_file* cflt_file_init(struct inode *inode)
         atomic_set(&fh->compressed, 0);
         fh->inode = inode;
         fh->size_u = 0;
+        fh->rewrites = 0;
         fh->method = cflt_cmethod;
         fh->blksize = cflt_blksize;
 
@@ -75,7 +109,7 @@ static struct cflt_file* cflt_file_init(struct inode *inode)
 }
 
 // dealloc a (struct cflt_file) and remove from master file list
-static void cflt_file_deinit(struct cflt_file *fh)
+void cflt_file_deinit(struct cflt_file *fh)
 {
 	unsigned long flags;
 
@@ -98,14 +132,6 @@ static void cflt_file_deinit(struct cflt_file *fh)
         }
 }
 
-/*
-// callback registered with redirfs
-static inline void cflt_file_deinit_cb(void *data)
-{
-        cflt_file_deinit((struct cflt_file*)data);
-}
-*/
-
 int cflt_file_cache_init(void)
 {
         cflt_debug_printk("compflt: [f:cflt_file_cache_init]\n");
@@ -127,14 +153,18 @@ int cflt_file_cache_init(void)
         return 0;
 }
 
+// the uncompressed size ends with the normal block with the highest off_u
 static void cflt_file_update_size(struct cflt_file *fh)
 {
         struct cflt_block *blk;
+        struct rb_node *node;
 
         spin_lock(&fh->lock);
         fh->size_u = 0;
-        list_for_each_entry(blk, &fh->blks, file) {
-                fh->size_u += blk->size_u;
+        node = rb_last(&fh->blks_u);
+        if (node) {
+                blk = rb_entry(node, struct cflt_block, idx);
+                fh->size_u = blk->off_u + blk->size_u;
         }
         spin_unlock(&fh->lock);
 }
@@ -154,39 +184,220 @@ void cflt_file_cache_deinit(void)
         kmem_cache_destroy(cflt_file_cache);
 }
 
+static int cflt_file_cmp_c(struct rb_node *a, struct rb_node *b)
+{
+        return rb_entry(a, struct cflt_block, node_c)->off_c <
+                rb_entry(b, struct cflt_block, node_c)->off_c;
+}
+
+static int cflt_file_cmp_u(struct rb_node *a, struct rb_node *b)
+{
+        return rb_entry(a, struct cflt_block, idx)->off_u <
+                rb_entry(b, struct cflt_block, idx)->off_u;
+}
+
+// free blocks of the same size are kept in order of off_c
+static int cflt_file_cmp_f(struct rb_node *a, struct rb_node *b)
+{
+        struct cflt_block *ba = rb_entry(a, struct cflt_block, idx);
+        struct cflt_block *bb = rb_entry(b, struct cflt_block, idx);
+
+        if (ba->size_c != bb->size_c)
+                return ba->size_c < bb->size_c;
+
+        return ba->off_c < bb->off_c;
+}
+
+// insert @node into @root, @less returns non-zero if its 1st arg sorts first
+static void cflt_file_rb_insert(struct rb_root *root, struct rb_node *node,
+                int (*less)(struct rb_node*, struct rb_node*))
+{
+        struct rb_node **p = &root->rb_node;
+        struct rb_node *parent = NULL;
+
+        while (*p) {
+                parent = *p;
+                if (less(node, parent))
+                        p = &parent->rb_left;
+                else
+                        p = &parent->rb_right;
+        }
+
+        rb_link_node(node, parent, p);
+        rb_insert_color(node, root);
+}
+
+// insert @blk into @fh->blks_c and to the matching spot in the @fh->blks list
+void cflt_file_link_blk(struct cflt_file *fh, struct cflt_block *blk)
+{
+        struct rb_node *prev;
+
+        cflt_file_rb_insert(&fh->blks_c, &blk->node_c, cflt_file_cmp_c);
+
+        prev = rb_prev(&blk->node_c);
+        if (prev)
+                list_add(&blk->file, &rb_entry(prev, struct cflt_block, node_c)->file);
+        else
+                list_add(&blk->file, &fh->blks);
+}
+
 // Add the block to the right spot in the blks list after it was moved within
 // the file (cflt_file_place_old_blk)
 // @blk: block to (re)place in the list
 static void cflt_file_readd_blk(struct cflt_block *blk)
 {
         list_del(&blk->file);
-        cflt_file_add_blk(blk->par, blk);
+        rb_erase(&blk->node_c, &blk->par->blks_c);
+        cflt_file_link_blk(blk->par, blk);
 }
 
-// Add @block to @fh->blks list in order of off_c
+// Add @block to @fh->blks list in order of off_c and index it by off_u
+// (normal blocks) or by size_c (free blocks)
 // @fh: struct cflt_file to which we are adding the block
 // @blk: added block
 void cflt_file_add_blk(struct cflt_file *fh, struct cflt_block *blk)
 {
-        struct cflt_block *aux;
-        struct list_head *head = NULL;
-
         cflt_debug_printk("compflt: [f:cflt_file_add_blk] i=%li\n", fh->inode->i_ino);
 
-        head = &fh->blks;
-        list_for_each_entry(aux, &fh->blks, file) {
-                if (aux->off_c > blk->off_c)
-                        head = &aux->file;
-        }
+        blk->par = fh;
+        cflt_file_link_blk(fh, blk);
 
-        list_add_tail(&blk->file, head);
+        if (blk->type == CFLT_BLK_FREE)
+                cflt_file_rb_insert(&fh->blks_f, &blk->idx, cflt_file_cmp_f);
+        else
+                cflt_file_rb_insert(&fh->blks_u, &blk->idx, cflt_file_cmp_u);
+}
 
+// index a new block by off_u only, it is linked once it gets placed
+// (cflt_file_link_blk)
+void cflt_file_index_blk(struct cflt_file *fh, struct cflt_block *blk)
+{
         blk->par = fh;
+        cflt_file_rb_insert(&fh->blks_u, &blk->idx, cflt_file_cmp_u);
 }
 
 void cflt_file_del_blk(struct cflt_block *blk)
 {
+        struct cflt_file *fh = blk->par;
+
         list_del(&blk->file);
+        rb_erase(&blk->node_c, &fh->blks_c);
+
+        if (blk->type == CFLT_BLK_FREE)
+                rb_erase(&blk->idx, &fh->blks_f);
+        else
+                rb_erase(&blk->idx, &fh->blks_u);
+}
+
+// find the first normal block that can overlap with data at @off
+// @fh: file to search
+// @off: uncompressed offset
+struct cflt_block *cflt_file_find_blk(struct cflt_file *fh, loff_t off)
+{
+        struct rb_node *node = fh->blks_u.rb_node;
+        struct cflt_block *aux;
+        struct cflt_block *blk = NULL;
+
+        while (node) {
+                aux = rb_entry(node, struct cflt_block, idx);
+                if ((loff_t)aux->off_u + fh->blksize > off) {
+                        blk = aux;
+                        node = node->rb_left;
+                }
+                else
+                        node = node->rb_right;
+        }
+
+        return blk;
+}
+
+// next normal block in order of off_u
+struct cflt_block *cflt_file_next_blk(struct cflt_block *blk)
+{
+        struct rb_node *node = rb_next(&blk->idx);
+
+        if (!node)
+                return NULL;
+
+        return rb_entry(node, struct cflt_block, idx);
+}
+
+// find the smallest free block which @size bytes of data can be placed in,
+// either exactly or leaving enough space for the header of the remainder
+// @fh: file to search
+// @size: size_c of the placed block
+static struct cflt_block *cflt_file_find_free(struct cflt_file *fh, unsigned int size)
+{
+        struct rb_node *node;
+        struct cflt_block *aux;
+        struct cflt_block *blk;
+        int i;
+
+        for (i = 0; i < 2; i++) {
+                node = fh->blks_f.rb_node;
+                blk = NULL;
+
+                while (node) {
+                        aux = rb_entry(node, struct cflt_block, idx);
+                        if (aux->size_c >= size) {
+                                blk = aux;
+                                node = node->rb_left;
+                        }
+                        else
+                                node = node->rb_right;
+                }
+
+                if (!blk || blk->size_c == size || blk->size_c >= size + CFLT_BH_SIZE)
+                        return blk;
+
+                size += CFLT_BH_SIZE;
+        }
+
+        return NULL;
+}
+
+// move and resize a free block (has to keep its place among other blocks)
+static void cflt_file_set_free(struct cflt_block *blk, unsigned int off_c, unsigned int size_c)
+{
+        rb_erase(&blk->idx, &blk->par->blks_f);
+        blk->off_c = off_c;
+        blk->size_c = size_c;
+        cflt_file_rb_insert(&blk->par->blks_f, &blk->idx, cflt_file_cmp_f);
+        atomic_set(&blk->dirty, 1);
+}
+
+// place @blk at the start of the free block @aux and shrink or remove @aux
+static void cflt_file_take_free(struct cflt_block *aux, struct cflt_block *blk)
+{
+        blk->off_c = aux->off_c;
+        atomic_set(&blk->dirty, 1);
+
+        if (aux->size_c == blk->size_c) {
+                cflt_file_del_blk(aux);
+                cflt_block_deinit(aux);
+                return;
+        }
+
+        cflt_file_set_free(aux, aux->off_c+CFLT_BH_SIZE+blk->size_c,
+                        aux->size_c-CFLT_BH_SIZE-blk->size_c);
+}
+
+// add a new free block
+static int cflt_file_add_free(struct cflt_file *fh, unsigned int off_c, unsigned int size_c)
+{
+        struct cflt_block *new;
+
+        new = cflt_block_init();
+        if (!new)
+                return -ENOMEM;
+
+        new->type = CFLT_BLK_FREE;
+        new->off_c = off_c;
+        new->size_c = size_c;
+        atomic_set(&new->dirty, 1);
+        cflt_file_add_blk(fh, new);
+
+        return 0;
 }
 
 // read all block headers from file
@@ -208,47 +419,55 @@ int cflt_file_read_block_headers(struct file *f, struct cflt_file *fh)
                 }
 
                 err = cflt_block_read_header(f, blk, &off);
+                if (!err && blk->size_u > fh->blksize)
+                        err = -EINVAL;
+
                 if (err)
                         cflt_block_deinit(blk);
                 else 
                         cflt_file_add_blk(fh, blk);
         }
 
-        return err;
+        return err > 0 ? 0 : err;
 }
 
 // write headers of all blocks to file
-void cflt_file_write_block_headers(struct file *f, struct cflt_file *fh)
+// a header that failed to be written stays dirty, the error of the last one
+// is returned
+int cflt_file_write_block_headers(struct file *f, struct cflt_file *fh)
 {
         struct cflt_block *blk;
+        int err = 0;
 
         cflt_debug_printk("compflt: [f:cflt_block_write_block_headers]\n");
 
-        //spin_lock(&fh->lock);
         list_for_each_entry(blk, &fh->blks, file) {
-                cflt_block_write_header(f, blk);
+                if (cflt_block_write_header(f, blk))
+                        err = -EIO;
         }
-        //spin_unlock(&fh->lock);
+
+        return err;
 }
 
 // TODO: change to return int , and move cflt_file to params
 // try to find the cflt_file corresponding to @inode in the cache
 // @inode: inode to match with an cflt_file
+// the data stays attached while the caller holds the inode
 struct cflt_file *cflt_file_find(struct inode *inode)
 {
-        struct cflt_privd *pd;
-        struct rfs_priv_data *rfs_data;
-        int err;
+        struct redirfs_data *rfs_data;
+        struct cflt_file *fh;
 
         cflt_debug_printk("compflt: [f:cflt_file_find] i=%li\n", inode->i_ino);
 
-        err = rfs_get_data_inode(compflt, inode, &rfs_data);
-        if (err)
+        rfs_data = redirfs_get_data_inode(compflt, inode);
+        if (!rfs_data)
                 return NULL;
 
-        pd = cflt_privd_from_rfs(rfs_data);
+        fh = cflt_privd_from_rfs(rfs_data)->fh;
+        redirfs_put_data(rfs_data);
 
-        return pd->fh;
+        return fh;
 }
 
 // if the cflt_file is not in the cache and f is set then try to read it from
@@ -257,7 +476,7 @@ struct cflt_file *cflt_file_get(struct inode *inode, struct file *f)
 {
         struct cflt_file *fh = NULL;
         struct cflt_privd *pd = NULL;
-        struct rfs_priv_data *exist = NULL;
+        struct redirfs_data *rfs_data;
 
         cflt_debug_printk("compflt: [f:cflt_file_get] i=%li\n", inode->i_ino);
 
@@ -270,18 +489,36 @@ struct cflt_file *cflt_file_get(struct inode *inode, struct file *f)
 
                 if (cflt_file_read(f, fh)) {
                         // not an error (file doesnt exist or not copressed)
-                        printk(KERN_ERR "compflt: failed to read file header\n");
+                        if (printk_ratelimit())
+                                printk(KERN_ERR "compflt: failed to read file header\n");
+                        cflt_file_deinit(fh);
+                        return NULL;
+                }
+
+                // the blocks are read before the cflt_file can be found
+                if (atomic_read(&fh->compressed) &&
+                    cflt_file_read_block_headers(f, fh)) {
+                        if (printk_ratelimit())
+                                printk(KERN_ERR "compflt: i=%li has corrupted block headers\n", inode->i_ino);
                         cflt_file_deinit(fh);
                         return NULL;
                 }
 
-                // TODO: this can fail ... returns NULL atm ?
                 pd = cflt_privd_init(fh);
+                if (!pd) {
+                        cflt_file_deinit(fh);
+                        return NULL;
+                }
 
-                rfs_attach_data_inode(compflt, inode, &pd->rfs_data, &exist);
-                if (atomic_read(&fh->compressed))
-                        cflt_file_read_block_headers(f, fh);
+                // if another open attached its data first, ours is freed
+                // with its cflt_file by the put
+                rfs_data = redirfs_attach_data_inode(compflt, inode, &pd->rfs_data);
+                redirfs_put_data(&pd->rfs_data);
+                if (!rfs_data)
+                        return NULL;
 
+                fh = cflt_privd_from_rfs(rfs_data)->fh;
+                redirfs_put_data(rfs_data);
         }
 
         if (fh) {
@@ -322,6 +559,19 @@ int cflt_file_blksize_get(char* buf, int bsize)
         return len;
 }
 
+int cflt_file_hot_rewrites_set(unsigned long int new)
+{
+        cflt_hot_rewrites = new;
+        printk(KERN_INFO "compflt: hot file rewrites set to %li\n", new);
+
+        return 0;
+}
+
+int cflt_file_hot_rewrites_get(char* buf, int bsize)
+{
+        return sprintf(buf, "%u\n", cflt_hot_rewrites);
+}
+
 int cflt_file_read(struct file *f, struct cflt_file *fh)
 {
         char buf[CFLT_FH_SIZE];
@@ -342,23 +592,21 @@ int cflt_file_read(struct file *f, struct cflt_file *fh)
         boff += sizeof(u8);
         memcpy(&fh->blksize, buf+boff, sizeof(u32));
 
+        // the pools only have transforms of the known methods and the
+        // buffers are sized for the permitted block sizes
+        if (!fh->method || fh->method >= CFLT_METHOD_NR ||
+            fh->blksize < CFLT_BLKSIZE_MIN || fh->blksize > CFLT_BLKSIZE_MAX)
+                return -EINVAL;
+
         return 0;
 }
 
 struct cflt_block* cflt_file_last_blk(struct cflt_file *fh)
 {
-        struct cflt_block *aux;
-
         if (list_empty(&fh->blks))
                 return NULL;
 
-        list_for_each_entry(aux, &fh->blks, file) {
-                if (list_is_last(&aux->file, &fh->blks))
-                        return aux;
-        }
-
-        BUG();
-        return NULL; // just to shut-up the compiler
+        return list_entry(fh->blks.prev, struct cflt_block, file);
 }
 
 // place a new block in the file (set off_c)
@@ -370,25 +618,11 @@ static int cflt_file_place_new_block(struct cflt_block *new)
         cflt_debug_printk("--- placing new block ---\n");
 
         // try to find a free block
-        // TODO: optimize to use the block that has the smallest size difference
-        list_for_each_entry(aux, &new->par->blks, file) {
-                if (aux->type == CFLT_BLK_FREE && aux->size_c > new->size_c) {
-                        cflt_debug_printk("using an existing free block\n");
-
-                        aux->size_c -= new->size_c;
-                        new->off_c = aux->off_c;
-
-                        if (unlikely(aux->size_c)) {
-                                cflt_file_del_blk(aux);
-                                cflt_block_deinit(aux);
-                        }
-                        else { // some free space left
-                                aux->off_c = new->off_c+CFLT_BH_SIZE+new->size_c;
-                                atomic_set(&aux->dirty, 1);
-                        }
-                        atomic_set(&new->dirty, 1);
-                        return 0;
-                }
+        aux = cflt_file_find_free(new->par, new->size_c);
+        if (aux) {
+                cflt_debug_printk("using an existing free block\n");
+                cflt_file_take_free(aux, new);
+                return 0;
         }
 
         cflt_debug_printk("placing at the end of file\n");
@@ -412,10 +646,9 @@ static int cflt_file_place_new_block(struct cflt_block *new)
 static int cflt_file_place_old_block(struct cflt_block *blk, unsigned int size_c_old)
 {
         struct cflt_block *aux;
-        struct cflt_block *new;
         struct cflt_file *fh = blk->par;
         int size_diff = blk->size_c - size_c_old;
-        unsigned int off_aux = 0;
+        unsigned int off_old = blk->off_c;
 
         cflt_debug_printk("--- placing old block ---\n");
 
@@ -434,12 +667,9 @@ static int cflt_file_place_old_block(struct cflt_block *blk, unsigned int size_c
                         goto move;
 
                 // create free block
-                new = cflt_block_init();
-                new->type = CFLT_BLK_FREE;
-                new->off_c = blk->off_c+CFLT_BH_SIZE+blk->size_c;
-                new->size_c = -size_diff;
-                atomic_set(&new->dirty, 1);
-                cflt_file_add_blk(blk->par, new);
+                if (cflt_file_add_free(fh, blk->off_c+CFLT_BH_SIZE+blk->size_c,
+                                        -size_diff-CFLT_BH_SIZE))
+                        return -ENOMEM;
 
                 atomic_set(&blk->dirty, 1);
         }
@@ -449,9 +679,8 @@ static int cflt_file_place_old_block(struct cflt_block *blk, unsigned int size_c
                 // expand if the next block is free and has enough space
                 aux = list_entry(blk->file.next, struct cflt_block, file);
                 if (aux->type == CFLT_BLK_FREE && aux->size_c > size_diff) {
-                        aux->off_c += size_diff;
-                        aux->size_c -= size_diff;
-                        atomic_set(&aux->dirty, 1);
+                        cflt_file_set_free(aux, aux->off_c+size_diff,
+                                        aux->size_c-size_diff);
                 }
                 else
                         goto move;
@@ -462,50 +691,38 @@ static int cflt_file_place_old_block(struct cflt_block *blk, unsigned int size_c
 
 move:
         // move if the previous block is free and has enough space
-        aux = list_entry(blk->file.prev, struct cflt_block, file);
+        aux = NULL;
+        if (blk->file.prev != &fh->blks)
+                aux = list_entry(blk->file.prev, struct cflt_block, file);
         if (aux && aux->type == CFLT_BLK_FREE && aux->size_c > size_diff) {
                 cflt_debug_printk("using previous free block\n");
                 blk->off_c -= size_diff;
                 atomic_set(&blk->dirty, 1);
-                aux->size_c -= size_diff;
-                atomic_set(&aux->dirty, 1);
+                cflt_file_set_free(aux, aux->off_c, aux->size_c-size_diff);
                 goto end;
         }
 
         // try to find a suitable free block anywhere
-        list_for_each_entry(aux, &blk->par->blks, file) {
-                if (aux->type == CFLT_BLK_FREE && aux->size_c > blk->size_c) {
-                        cflt_debug_printk("using any free block\n");
-                        aux->size_c = size_c_old;
-
-                        off_aux = aux->off_c;
-                        aux->off_c = blk->off_c;
-                        blk->off_c = off_aux;
-
-                        atomic_set(&blk->dirty, 1);
-                        atomic_set(&aux->dirty, 1);
-                        goto end;
-                }
+        aux = cflt_file_find_free(fh, blk->size_c);
+        if (aux) {
+                cflt_debug_printk("using any free block\n");
+                cflt_file_take_free(aux, blk);
         }
+        else {
+                cflt_debug_printk("moving to the end of file\n");
 
-        cflt_debug_printk("moving to the end of file\n");
-
-        // move to the end of the file
-        aux = cflt_file_last_blk(blk->par);
-
-        // create free block
-        new = cflt_block_init();
-        new->type = CFLT_BLK_FREE;
-        new->off_c = blk->off_c;
-        new->size_c = size_c_old;
-        atomic_set(&new->dirty, 1);
-        cflt_file_add_blk(blk->par, new);
-
-        blk->off_c = aux->off_c+CFLT_BH_SIZE+aux->size_c;
-        atomic_set(&blk->dirty, 1);
+                // move to the end of the file
+                aux = cflt_file_last_blk(fh);
+                blk->off_c = aux->off_c+CFLT_BH_SIZE+aux->size_c;
+                atomic_set(&blk->dirty, 1);
+        }
 
         cflt_file_readd_blk(blk);
 
+        // the old place of the block becomes free
+        if (cflt_file_add_free(fh, off_old, size_c_old))
+                return -ENOMEM;
+
         cflt_debug_file(blk->par);
 
 end:
@@ -525,7 +742,7 @@ int cflt_file_place_block(struct cflt_block *blk, unsigned int size_c_old)
                 return cflt_file_place_old_block(blk, size_c_old);
 }
 
-void cflt_file_write(struct file *f, struct cflt_file *fh)
+int cflt_file_write(struct file *f, struct cflt_file *fh)
 {
         loff_t off = 0;
         char buf[CFLT_FH_SIZE];
@@ -534,14 +751,19 @@ void cflt_file_write(struct file *f, struct cflt_file *fh)
         cflt_debug_printk("compflt: [f:cflt_file_write] i=%li\n", fh->inode->i_ino);
 
         if (!atomic_read(&fh->dirty))
-                return;
+                return 0;
 
         memcpy(buf+boff, CFLT_MAGIC, sizeof(CFLT_MAGIC)-1);
         boff += sizeof(CFLT_MAGIC)-1;
         memcpy(buf+boff, &fh->method, sizeof(u8));
         boff += sizeof(u8);
         memcpy(buf+boff, &fh->blksize, sizeof(u32));
-        cflt_orig_write(f, buf, sizeof(buf), &off);
+        if (cflt_orig_write(f, buf, sizeof(buf), &off) != sizeof(buf)) {
+                printk(KERN_ERR "compflt: failed to write file header\n");
+                return -EIO;
+        }
 
         atomic_set(&fh->dirty, 0);
+
+        return 0;
 }
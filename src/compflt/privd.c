@@ -1,5 +1,4 @@
 #include <linux/slab.h>
-#include "../redirfs/redirfs.h"
 #include "compflt.h"
 
 #define CACHE_NAME "cflt_privd"
@@ -8,10 +7,7 @@ static struct kmem_cache *cflt_privd_cache = NULL;
 atomic_t privd_cache_cnt;
 wait_queue_head_t privd_cache_w;
 
-struct list_head cflt_privd_list;
-spinlock_t cflt_privd_list_l = SPIN_LOCK_UNLOCKED;
-
-inline struct cflt_privd *cflt_privd_from_rfs(struct rfs_priv_data *rfs_data)
+inline struct cflt_privd *cflt_privd_from_rfs(struct redirfs_data *rfs_data)
 {
         cflt_debug_printk("compflt: [f:cflt_privd_from_rfs]\n");
         return container_of(rfs_data, struct cflt_privd, rfs_data);
@@ -33,54 +29,37 @@ int cflt_privd_cache_init(void)
         init_waitqueue_head(&privd_cache_w);
         atomic_set(&privd_cache_cnt, 0);
 
-        INIT_LIST_HEAD(&cflt_privd_list);
-
         return 0;
 }
 
-void cflt_privd_deinit(struct cflt_privd *pd)
-{
-        cflt_debug_printk("compflt: [f:cflt_privd_deinit]\n");
-
-        spin_lock(&cflt_privd_list_l);
-        list_del(&(pd->all));
-        spin_unlock(&cflt_privd_list_l);
-
-        rfs_put_data(&pd->rfs_data);
-
-        kmem_cache_free(cflt_privd_cache, pd);
-
-        if(atomic_dec_and_test(&privd_cache_cnt)) {
-                wake_up_interruptible(&privd_cache_w);
-        }
-}
-
+// redirfs frees the data of the filter before it can be unregistered, the
+// free callbacks may still be running
 void cflt_privd_cache_deinit(void)
 {
-        struct cflt_privd *pd;
-        struct cflt_privd *tmp;
-
         cflt_debug_printk("compflt: [f:cflt_privd_cache_deinit]\n");
 
-        list_for_each_entry_safe(pd, tmp, &cflt_privd_list, all) {
-                cflt_privd_deinit(pd);
-        }
-
         wait_event_interruptible(privd_cache_w, !atomic_read(&privd_cache_cnt));
         kmem_cache_destroy(cflt_privd_cache);
 }
 
-
-static void cflt_privd_free_cb(struct rfs_priv_data *rfs_data)
+// called by redirfs after the last reference is gone, i.e. the inode was
+// evicted or its path was removed from the filter
+static void cflt_privd_free_cb(struct redirfs_data *rfs_data)
 {
         struct cflt_privd *pd;
 
         cflt_debug_printk("compflt: [f:cflt_privd_free_cb]\n");
-        
+
         pd = cflt_privd_from_rfs(rfs_data);
-        cflt_privd_deinit(pd);
+        cflt_file_deinit(pd->fh);
+        kmem_cache_free(cflt_privd_cache, pd);
+
+        if(atomic_dec_and_test(&privd_cache_cnt)) {
+                wake_up_interruptible(&privd_cache_w);
+        }
 }
 
+// the returned data holds one reference, the cflt_file is owned by the data
 struct cflt_privd *cflt_privd_init(struct cflt_file *fh)
 {
         struct cflt_privd *pd;
@@ -94,7 +73,8 @@ struct cflt_privd *cflt_privd_init(struct cflt_file *fh)
                 return NULL;
         }
 
-        err = rfs_init_data(&pd->rfs_data, compflt, cflt_privd_free_cb);
+        err = redirfs_init_data(&pd->rfs_data, compflt, cflt_privd_free_cb,
+                        NULL);
         if (err) {
                 kmem_cache_free(cflt_privd_cache, pd);
                 return NULL;
@@ -104,9 +84,5 @@ struct cflt_privd *cflt_privd_init(struct cflt_file *fh)
 
         pd->fh = fh;
 
-        spin_lock(&cflt_privd_list_l);
-        list_add(&(pd->all), &(cflt_privd_list));
-        spin_unlock(&cflt_privd_list_l);
-
         return pd;
 }
@@ -1,25 +1,20 @@
 #include <linux/crypto.h>
 #include <asm/uaccess.h> // get_fs / set_fs
-#include "../redirfs/redir.h"
 #include "compflt.h"
 
+// the compressed data is read and written with the lower file system
+// operations, the filter callbacks are not called for it
 ssize_t cflt_orig_read(struct file *f, char __user *buf, size_t len, loff_t *off)
 {
         mm_segment_t orig_fs;
         ssize_t rv;
-        union rfs_op_args args;
 
         cflt_debug_printk("compflt: [f:orig_read] %i@%i\n", len, (int)*off);
 
-        args.f_read.file = f;
-        args.f_read.buf = buf;
-        args.f_read.count = len;
-        args.f_read.pos = off;
-
         orig_fs = get_fs();
         set_fs(KERNEL_DS);
 
-        rv = rfs_read_subcall(compflt, &args);
+        rv = redirfs_orig_read(compflt, f, buf, len, off);
 
 	set_fs(orig_fs);
 
@@ -31,21 +26,15 @@ ssize_t cflt_orig_read(struct file *f, char __user *buf, size_t len, loff_t *off
 ssize_t cflt_orig_write(struct file *f, const char __user *buf, size_t len, loff_t *off)
 {
 	mm_segment_t orig_fs;
-        int rv;
-        union rfs_op_args args;
+        ssize_t rv;
 
 	cflt_debug_printk("compflt: [f:orig_write] %i@%i\n", len, (int) *off);
 	cflt_hexdump((char*)buf, len); // DEBUG
 
-        args.f_write.file = f;
-        args.f_write.buf = buf;
-        args.f_write.count = len;
-        args.f_write.pos = off;
-
 	orig_fs = get_fs();
 	set_fs(KERNEL_DS);
 
-        rv = rfs_write_subcall(compflt, &args);
+        rv = redirfs_orig_write(compflt, f, buf, len, off);
 
 	set_fs(orig_fs);
 
@@ -107,62 +96,100 @@ static inline void cflt_write_params(struct cflt_block *blk, loff_t req_start, s
         cflt_rw_params(blk, req_start, req_size, dst_off, src_off, size, blk->par->blksize);
 }
 
-// buff_u is expected to have enough space for size_req bytes
-int cflt_read(struct file *f, struct cflt_file *fh, loff_t off_req, size_t *size_req, char *buff_u)
+// buff_u is the user buffer of the read, it is expected to have enough
+// space for size_req bytes
+int cflt_read(struct file *f, struct cflt_file *fh, loff_t off_req, size_t *size_req, char __user *buff_u)
 {
-        struct crypto_comp *tfm;
+        struct cflt_comp_ws *ws = NULL;
         struct cflt_block *blk;
+        char *data;
+        unsigned int gen;
 
         loff_t off_src;
         loff_t off_dst;
         size_t size;
         size_t size_total = 0;
-        int err;
+        int err = 0;
 
         cflt_debug_printk("compflt: [f:read_u] i=%li\n", fh->inode->i_ino);
 
-        memset(buff_u, 0, *size_req);
+        if (clear_user(buff_u, *size_req))
+                return -EFAULT;
 
-        tfm = cflt_comp_init(fh->method);
-
-        //spin_lock(&fh->lock);
-        list_for_each_entry(blk, &fh->blks, file) {
+        down_read(&fh->sem);
+        for (blk = cflt_file_find_blk(fh, off_req);
+             blk && blk->off_u < off_req + *size_req;
+             blk = cflt_file_next_blk(blk)) {
                 cflt_debug_block(blk);
 
-                if (blk->type == CFLT_BLK_FREE ||
-                    !cflt_read_match(blk, off_req, *size_req))
+                if (!cflt_read_match(blk, off_req, *size_req))
                         continue;
 
                 cflt_debug_printk("compflt: [f:read_u] match\n");
 
-                blk->data_u = kmalloc(blk->par->blksize, GFP_KERNEL);
-                if (!blk->data_u)
-                        return -ENOMEM;
-
-                if ((err = cflt_block_read(f, blk, tfm)))
-                        return err;
+                data = blk->data_p;
+                if (!data)
+                        data = cflt_cache_get(blk, &gen);
+                if (!data) {
+                        // only take a transform once some block is not cached
+                        if (!ws && !(ws = cflt_comp_get(fh->method))) {
+                                err = -ENOMEM;
+                                goto end;
+                        }
+
+                        data = kmalloc(blk->par->blksize, GFP_KERNEL);
+                        if (!data) {
+                                err = -ENOMEM;
+                                goto end;
+                        }
+
+                        if ((err = cflt_block_read(f, blk, ws, data))) {
+                                kfree(data);
+                                goto end;
+                        }
+                }
 
                 cflt_read_params(blk, off_req, *size_req, &off_src, &off_dst, &size);
                 cflt_debug_printk("compflt: [f:read_u] memcpy %i@%i -> %i\n", size, (int)off_src, (int)off_dst);
 
-                memcpy(buff_u+off_dst, blk->data_u+off_src, size);
-                kfree(blk->data_u);
+                if (copy_to_user(buff_u+off_dst, data+off_src, size))
+                        err = -EFAULT;
+                if (data != blk->data_p)
+                        cflt_cache_put(blk, data, gen);
+                if (err)
+                        goto end;
                 size_total += size;
         }
-        //spin_unlock(&fh->lock);
 
-        cflt_comp_deinit(tfm);
         *size_req = size_total;
 
-        return 0;
+end:
+        up_read(&fh->sem);
+
+        if (ws)
+                cflt_comp_put(ws);
+
+        return err;
 }
 
-int cflt_write(struct file *f, struct cflt_file *fh, loff_t off_req, size_t *size_req, char *buff_in)
+// queue @blk for write-back with @data as its new contents
+static void cflt_write_pend(struct cflt_file *fh, struct cflt_block *blk, char *data)
+{
+        blk->data_p = data;
+        list_add_tail(&blk->wb, &fh->wb);
+        fh->wb_nr++;
+}
+
+// Data is only updated in memory here, it is compressed and written by
+// cflt_wb_flush once enough blocks are pending or by cflt_wb_sync.
+int cflt_write(struct file *f, struct cflt_file *fh, loff_t off_req, size_t *size_req, const char __user *buff_in)
 {
         int err = 0;
 
-        struct crypto_comp *tfm;
+        struct cflt_comp_ws *ws = NULL;
         struct cflt_block *blk = NULL;
+        char *data;
+        unsigned int gen;
 
         loff_t off_src;
         loff_t off_dst;
@@ -171,31 +198,60 @@ int cflt_write(struct file *f, struct cflt_file *fh, loff_t off_req, size_t *siz
 
         cflt_debug_printk("compflt: [f:write_u] i=%li\n", fh->inode->i_ino);
 
-        tfm = cflt_comp_init(fh->method);
-
-        //spin_lock(&fh->lock);
-        list_for_each_entry(blk, &fh->blks, file) {
-                if (blk->type == CFLT_BLK_FREE)
-                        continue;
-
+        down_write(&fh->sem);
+        for (blk = cflt_file_find_blk(fh, off_req);
+             blk && blk->off_u < off_req + *size_req;
+             blk = cflt_file_next_blk(blk)) {
                 if (!cflt_write_match(blk, off_req, *size_req))
                         continue;
 
                 cflt_debug_printk("compflt: [f:write_u] match:\n");
                 cflt_debug_block(blk);
 
-                blk->data_u = kmalloc(blk->par->blksize, GFP_KERNEL);
-                if (!blk->data_u)
-                        return -ENOMEM;
-
-                if ((err = cflt_block_read(f, blk, tfm)))
-                        return err;
-
                 cflt_write_params(blk, off_req, *size_req, &off_src, &off_dst, &size);
+                fh->rewrites++;
+
+                if (!blk->data_p) {
+                        data = cflt_cache_get(blk, &gen);
+
+                        if (!data && !off_dst && size >= blk->size_u) {
+                                // all of the old data is overwritten
+                                data = kmalloc(fh->blksize, GFP_KERNEL);
+                                if (!data) {
+                                        err = -ENOMEM;
+                                        goto end;
+                                }
+                                memset(data, 0, fh->blksize);
+                        }
+                        else if (!data) {
+                                if (!ws && !(ws = cflt_comp_get(fh->method))) {
+                                        err = -ENOMEM;
+                                        goto end;
+                                }
+
+                                data = kmalloc(fh->blksize, GFP_KERNEL);
+                                if (!data) {
+                                        err = -ENOMEM;
+                                        goto end;
+                                }
+
+                                if ((err = cflt_block_read(f, blk, ws, data))) {
+                                        kfree(data);
+                                        goto end;
+                                }
+                        }
+
+                        // readers must not put back what they took before the write
+                        cflt_cache_inval(blk);
+                        cflt_write_pend(fh, blk, data);
+                }
 
                 cflt_debug_printk("compflt: [f:write_u] memcpy %i@%i -> %i\n", size, (int)off_src, (int)off_dst);
 
-                memcpy(blk->data_u+off_dst, buff_in+off_src, size);
+                if (copy_from_user(blk->data_p+off_dst, buff_in+off_src, size)) {
+                        err = -EFAULT;
+                        goto end;
+                }
 
                 size_total -= size;
 
@@ -205,23 +261,17 @@ int cflt_write(struct file *f, struct cflt_file *fh, loff_t off_req, size_t *siz
                         atomic_set(&blk->dirty, 1);
                 }
 
-                // updates blk->size_c
-                if ((err = cflt_block_write(f, blk, tfm))) {
-                        kfree(blk->data_u);
-                        return err;
-                }
-                kfree(blk->data_u);
-
                 atomic_set(&fh->compressed, 1);
         }
-        //spin_unlock(&fh->lock);
 
         while (size_total > 0) {
                 cflt_debug_printk("compflt: [f:write_u] newblk remaining=%i\n", size_total);
 
                 blk = cflt_block_init();
-                if (!blk)
-                        return -1;
+                if (!blk) {
+                        err = -ENOMEM;
+                        goto end;
+                }
 
                 blk->off_u = off_req + *size_req - size_total;
                 blk->par = fh; // needs to be set for cflt_write_params
@@ -230,27 +280,39 @@ int cflt_write(struct file *f, struct cflt_file *fh, loff_t off_req, size_t *siz
 
                 cflt_debug_printk("compflt: [f:write_u] memcpy %i@%i -> %i\n", blk->size_u, (int)off_src, (int)off_dst);
 
-                blk->data_u = kmalloc(blk->size_u, GFP_KERNEL);
-                if (!blk->data_u)
-                        return -ENOMEM;
-
-                memcpy(blk->data_u, buff_in+off_src, blk->size_u);
+                data = kmalloc(fh->blksize, GFP_KERNEL);
+                if (!data) {
+                        cflt_block_deinit(blk);
+                        err = -ENOMEM;
+                        goto end;
+                }
 
-                // updates blk->size_c
-                if ((err = cflt_block_write(f, blk, tfm))) {
-                        kfree(blk->data_u);
-                        return err;
+                memset(data, 0, fh->blksize);
+                if (copy_from_user(data, buff_in+off_src, blk->size_u)) {
+                        kfree(data);
+                        cflt_block_deinit(blk);
+                        err = -EFAULT;
+                        goto end;
                 }
-                kfree(blk->data_u);
 
                 atomic_set(&fh->compressed, 1);
-                cflt_file_add_blk(fh, blk);
+                cflt_file_index_blk(fh, blk);
+                cflt_write_pend(fh, blk, data);
                 size_total -= blk->size_u;
         }
 
         // size_total *should* be 0 at this point
         *size_req -= size_total;
 
-        cflt_comp_deinit(tfm);
+end:
+        // the write-back needs all transforms available
+        if (ws)
+                cflt_comp_put(ws);
+
+        // blocks that fail stay pending until the release
+        if (!err && fh->wb_nr >= CFLT_WB_MAX)
+                cflt_wb_flush(f, fh);
+
+        up_write(&fh->sem);
         return err;
 }
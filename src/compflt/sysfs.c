@@ -1,84 +1,161 @@
 #include <linux/sysfs.h>
 #include "compflt.h"
 
-#define CFLT_ATTR(__name, __mode)       \
-struct attribute cflt_attr_##__name = { \
-        .name = __stringify(__name),    \
-        .mode = __mode,                 \
-        .owner = THIS_MODULE            \
-};
-
-struct kobject *cflt_root_ko;
-
-static struct kobject cflt_settings_ko;
-static struct kobj_type cflt_settings_ktype;
-static struct sysfs_ops cflt_settings_sops;
-
-static CFLT_ATTR(method, 0644);
-static CFLT_ATTR(blksize, 0644);
-
-static struct attribute *cflt_settings_attrs[] = {
-        &cflt_attr_method,
-        &cflt_attr_blksize,
-        NULL
-};
+// The settings and the statistics are groups of filter attributes in the
+// settings and compression directories of the filter in
+// /sys/fs/redirfs/filters/compflt, the stats attribute of the filter itself
+// is taken by redirfs.
 
-static ssize_t cflt_sysfs_settings_show(struct kobject *kobj, struct attribute *attr,
-                char *buf)
+static ssize_t cflt_sysfs_settings_show(redirfs_filter filter,
+                struct redirfs_filter_attribute *attr, char *buf)
 {
+        const char *name = attr->attr.name;
         int len;
         cflt_debug_printk("compflt: [f:cflt_sysfs_settings_show]\n");
 
-        if (!strcmp(attr->name, "method"))
+        if (!strcmp(name, "method"))
                 len = cflt_comp_method_get(buf, PAGE_SIZE);
-        else if (!strcmp(attr->name, "blksize"))
+        else if (!strcmp(name, "blksize"))
                 len = cflt_file_blksize_get(buf, PAGE_SIZE);
+        else if (!strcmp(name, "cache_max"))
+                len = cflt_cache_max_get(buf, PAGE_SIZE);
+        else if (!strcmp(name, "cache_file_max"))
+                len = cflt_cache_file_max_get(buf, PAGE_SIZE);
+        else if (!strcmp(name, "min_saving"))
+                len = cflt_comp_min_saving_get(buf, PAGE_SIZE);
+        else if (!strcmp(name, "hot_method"))
+                len = cflt_comp_hot_method_get(buf, PAGE_SIZE);
+        else if (!strcmp(name, "hot_rewrites"))
+                len = cflt_file_hot_rewrites_get(buf, PAGE_SIZE);
         else
                 return -EINVAL;
 
         return len;
 }
 
-static ssize_t cflt_sysfs_settings_store(struct kobject *kobj, struct attribute *attr,
-                const char *buf, size_t size)
+static ssize_t cflt_sysfs_settings_store(redirfs_filter filter,
+                struct redirfs_filter_attribute *attr, const char *buf,
+                size_t size)
 {
+        const char *name = attr->attr.name;
         cflt_debug_printk("compflt: [f:cflt_sysfs_settings_store]\n");
 
-        if (!strcmp(attr->name, "method"))
+        if (!strcmp(name, "method"))
                 cflt_comp_method_set(buf);
-        else if (!strcmp(attr->name, "blksize"))
+        else if (!strcmp(name, "blksize"))
                 cflt_file_blksize_set(simple_strtol(buf, (char**)NULL, 10));
+        else if (!strcmp(name, "cache_max"))
+                cflt_cache_max_set(simple_strtoul(buf, (char**)NULL, 10));
+        else if (!strcmp(name, "cache_file_max"))
+                cflt_cache_file_max_set(simple_strtoul(buf, (char**)NULL, 10));
+        else if (!strcmp(name, "min_saving"))
+                cflt_comp_min_saving_set(simple_strtoul(buf, (char**)NULL, 10));
+        else if (!strcmp(name, "hot_method"))
+                cflt_comp_hot_method_set(buf);
+        else if (!strcmp(name, "hot_rewrites"))
+                cflt_file_hot_rewrites_set(simple_strtoul(buf, (char**)NULL, 10));
 
         return size; // this is ok for now
 }
 
-int cflt_sysfs_init (void)
+// raw counts all blocks stored uncompressed, skipped those of them that were
+// not even passed to the compressor
+static ssize_t cflt_sysfs_stats_show(redirfs_filter filter,
+                struct redirfs_filter_attribute *attr, char *buf)
 {
-        int err;
+        const char *name = attr->attr.name;
+        cflt_debug_printk("compflt: [f:cflt_sysfs_stats_show]\n");
+
+        if (!strcmp(name, "compressed"))
+                return sprintf(buf, "%i\n", atomic_read(&cflt_stats[CFLT_STAT_COMPRESSED]));
+        else if (!strcmp(name, "raw"))
+                return sprintf(buf, "%i\n", atomic_read(&cflt_stats[CFLT_STAT_RAW]));
+        else if (!strcmp(name, "skipped"))
+                return sprintf(buf, "%i\n", atomic_read(&cflt_stats[CFLT_STAT_SKIPPED]));
+        else if (!strcmp(name, "bytes_in"))
+                return sprintf(buf, "%li\n", atomic_long_read(&cflt_stats_bytes[0]));
+        else if (!strcmp(name, "bytes_out"))
+                return sprintf(buf, "%li\n", atomic_long_read(&cflt_stats_bytes[1]));
+
+        return -EINVAL;
+}
 
-        cflt_debug_printk("compflt: [f:cflt_sysfs_init]\n");
+#define CFLT_ATTR(__name, __mode, __show, __store) \
+static struct redirfs_filter_attribute cflt_attr_##__name = \
+        REDIRFS_FILTER_ATTRIBUTE(__name, __mode, __show, __store)
 
-        err = rfs_get_kobject(compflt, &cflt_root_ko);
-        if (err)
-                return err;
+#define CFLT_SETTING(__name) \
+        CFLT_ATTR(__name, 0644, cflt_sysfs_settings_show, \
+                        cflt_sysfs_settings_store)
+
+#define CFLT_STAT(__name) \
+        CFLT_ATTR(__name, 0444, cflt_sysfs_stats_show, NULL)
+
+CFLT_SETTING(method);
+CFLT_SETTING(blksize);
+CFLT_SETTING(cache_max);
+CFLT_SETTING(cache_file_max);
+CFLT_SETTING(min_saving);
+CFLT_SETTING(hot_method);
+CFLT_SETTING(hot_rewrites);
+
+static struct attribute *cflt_settings_attrs[] = {
+        &cflt_attr_method.attr,
+        &cflt_attr_blksize.attr,
+        &cflt_attr_cache_max.attr,
+        &cflt_attr_cache_file_max.attr,
+        &cflt_attr_min_saving.attr,
+        &cflt_attr_hot_method.attr,
+        &cflt_attr_hot_rewrites.attr,
+        NULL
+};
+
+static struct attribute_group cflt_settings_group = {
+        .name = "settings",
+        .attrs = cflt_settings_attrs,
+};
+
+CFLT_STAT(compressed);
+CFLT_STAT(raw);
+CFLT_STAT(skipped);
+CFLT_STAT(bytes_in);
+CFLT_STAT(bytes_out);
+
+static struct attribute *cflt_stats_attrs[] = {
+        &cflt_attr_compressed.attr,
+        &cflt_attr_raw.attr,
+        &cflt_attr_skipped.attr,
+        &cflt_attr_bytes_in.attr,
+        &cflt_attr_bytes_out.attr,
+        NULL
+};
 
-        memset(&cflt_settings_ko, 0, sizeof(cflt_settings_ko));
-        memset(&cflt_settings_ktype, 0, sizeof(cflt_settings_ktype));
-        memset(&cflt_settings_sops, 0, sizeof(cflt_settings_sops));
+static struct attribute_group cflt_stats_group = {
+        .name = "compression",
+        .attrs = cflt_stats_attrs,
+};
+
+static struct kobject *cflt_root_ko;
+
+int cflt_sysfs_init(void)
+{
+        int err;
 
-        cflt_settings_sops.show = cflt_sysfs_settings_show;
-        cflt_settings_sops.store = cflt_sysfs_settings_store;
+        cflt_debug_printk("compflt: [f:cflt_sysfs_init]\n");
 
-        cflt_settings_ktype.release = NULL;
-        cflt_settings_ktype.default_attrs = cflt_settings_attrs;
-        cflt_settings_ktype.sysfs_ops = &cflt_settings_sops;
+        cflt_root_ko = redirfs_filter_kobject(compflt);
+        if (IS_ERR(cflt_root_ko))
+                return PTR_ERR(cflt_root_ko);
 
-        kobject_set_name(&cflt_settings_ko, "%s", "settings");
-        cflt_settings_ko.parent = cflt_root_ko;
-        cflt_settings_ko.ktype = &cflt_settings_ktype;
+        err = sysfs_create_group(cflt_root_ko, &cflt_settings_group);
+        if (err)
+                return err;
 
-        if ((err = kobject_register(&cflt_settings_ko)))
+        err = sysfs_create_group(cflt_root_ko, &cflt_stats_group);
+        if (err) {
+                sysfs_remove_group(cflt_root_ko, &cflt_settings_group);
                 return err;
+        }
 
         return 0;
 }
@@ -86,5 +163,6 @@ int cflt_sysfs_init (void)
 void cflt_sysfs_deinit(void)
 {
         cflt_debug_printk("compflt: [f:cflt_sysfs_deinit]\n");
-        kobject_unregister(&cflt_settings_ko);
+        sysfs_remove_group(cflt_root_ko, &cflt_stats_group);
+        sysfs_remove_group(cflt_root_ko, &cflt_settings_group);
 }
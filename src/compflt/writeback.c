@@ -0,0 +1,286 @@
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/sort.h>
+#include "compflt.h"
+
+// Writes only update the decompressed data of blocks and queue them to the
+// cflt_file->wb list. Once there are CFLT_WB_MAX such blocks, the file is
+// synced, flushed or written with O_SYNC, all of them are compressed in parallel on the cflt_wb_wq
+// workqueue, placed within the file one by one and written together with
+// their headers in as few contiguous writes as possible.
+
+struct cflt_wb_blk {
+        struct work_struct work;
+        struct cflt_block *blk;
+        unsigned int size_c_old;
+        int err;
+        atomic_t *cnt;
+        struct completion *done;
+};
+
+static struct workqueue_struct *cflt_wb_wq = NULL;
+
+static void cflt_wb_comp(struct cflt_wb_blk *wb)
+{
+        struct cflt_block *blk = wb->blk;
+        struct cflt_comp_ws *ws;
+
+        cflt_debug_printk("compflt: [f:cflt_wb_comp]\n");
+
+        ws = cflt_comp_get(blk->par->method);
+        if (!ws) {
+                wb->err = -ENOMEM;
+                goto end;
+        }
+
+        blk->data_u = blk->data_p;
+        wb->err = cflt_comp_block(ws, blk);
+        if (!wb->err) {
+                blk->data_c = kmalloc(blk->size_c, GFP_KERNEL);
+                if (blk->data_c)
+                        memcpy(blk->data_c, ws->buf, blk->size_c);
+                else
+                        wb->err = -ENOMEM;
+        }
+        cflt_comp_put(ws);
+
+        if (wb->err) {
+                blk->data_c = NULL;
+                blk->size_c = wb->size_c_old;
+        }
+end:
+        if (atomic_dec_and_test(wb->cnt))
+                complete(wb->done);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void cflt_wb_work_fn(void *data)
+{
+        cflt_wb_comp(data);
+}
+#else
+static void cflt_wb_work_fn(struct work_struct *work)
+{
+        cflt_wb_comp(container_of(work, struct cflt_wb_blk, work));
+}
+#endif
+
+// spread the blocks over the online cpus, older kernels can only queue
+// the work on the current cpu
+static inline int cflt_wb_queue(struct cflt_wb_blk *wb, int cpu)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,27)
+        queue_work(cflt_wb_wq, &wb->work);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(2,6,28)
+        cpu = next_cpu(cpu, cpu_online_map);
+        if (cpu >= NR_CPUS)
+                cpu = first_cpu(cpu_online_map);
+        queue_work_on(cpu, cflt_wb_wq, &wb->work);
+#else
+        cpu = cpumask_next(cpu, cpu_online_mask);
+        if (cpu >= nr_cpu_ids)
+                cpu = cpumask_first(cpu_online_mask);
+        queue_work_on(cpu, cflt_wb_wq, &wb->work);
+#endif
+        return cpu;
+}
+
+static int cflt_wb_cmp(const void *a, const void *b)
+{
+        unsigned int off_a = ((struct cflt_wb_blk *)a)->blk->off_c;
+        unsigned int off_b = ((struct cflt_wb_blk *)b)->blk->off_c;
+
+        if (off_a < off_b)
+                return -1;
+
+        return off_a > off_b;
+}
+
+static int cflt_wb_write_run(struct file *f, char *buf, size_t len, loff_t off)
+{
+        if (cflt_orig_write(f, buf, len, &off) != len) {
+                printk(KERN_ERR "compflt: failed to write %i bytes\n", (int)len);
+                return -EIO;
+        }
+
+        return 0;
+}
+
+// write blocks sorted by off_c, adjacent ones are merged to a single write
+static int cflt_wb_write(struct file *f, struct cflt_wb_blk *wbs, int nr)
+{
+        struct cflt_block *blk;
+        char *buf;
+        size_t len = 0;
+        size_t size;
+        loff_t off = 0;
+        int err = 0;
+        int i;
+
+        buf = vmalloc(CFLT_WB_BUFSIZE);
+
+        for (i = 0; i < nr; i++) {
+                if (wbs[i].err)
+                        continue;
+
+                blk = wbs[i].blk;
+                size = CFLT_BH_SIZE + blk->size_c;
+
+                if (!buf) {
+                        atomic_set(&blk->dirty, 1);
+                        if (cflt_block_write_header(f, blk) ||
+                            cflt_wb_write_run(f, blk->data_c, blk->size_c,
+                                    blk->off_c + CFLT_BH_SIZE))
+                                err = -EIO;
+                        continue;
+                }
+
+                if (len && (off + len != blk->off_c || len + size > CFLT_WB_BUFSIZE)) {
+                        if (cflt_wb_write_run(f, buf, len, off))
+                                err = -EIO;
+                        len = 0;
+                }
+
+                if (!len)
+                        off = blk->off_c;
+
+                cflt_block_pack_header(blk, buf + len);
+                memcpy(buf + len + CFLT_BH_SIZE, blk->data_c, blk->size_c);
+                len += size;
+                atomic_set(&blk->dirty, 0);
+        }
+
+        if (len && cflt_wb_write_run(f, buf, len, off))
+                err = -EIO;
+
+        if (buf)
+                vfree(buf);
+
+        return err;
+}
+
+// compress and write all pending blocks of @fh, fh->sem has to be held for
+// writing and the caller must not hold any transform (cflt_comp_get)
+int cflt_wb_flush(struct file *f, struct cflt_file *fh)
+{
+        struct cflt_wb_blk *wbs;
+        struct cflt_block *blk;
+        struct completion done;
+        atomic_t cnt;
+        char *data;
+        int nr = fh->wb_nr;
+        int cpu = -1;
+        int err = 0;
+        int i = 0;
+
+        cflt_debug_printk("compflt: [f:cflt_wb_flush] i=%li nr=%i\n", fh->inode->i_ino, nr);
+
+        if (!nr)
+                return 0;
+
+        wbs = kmalloc(nr * sizeof(struct cflt_wb_blk), GFP_KERNEL);
+        if (!wbs)
+                return -ENOMEM;
+
+        init_completion(&done);
+        atomic_set(&cnt, nr);
+
+        list_for_each_entry(blk, &fh->wb, wb) {
+                wbs[i].blk = blk;
+                wbs[i].size_c_old = blk->size_c;
+                wbs[i].err = 0;
+                wbs[i].cnt = &cnt;
+                wbs[i].done = &done;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+                INIT_WORK(&wbs[i].work, cflt_wb_work_fn, &wbs[i]);
+#else
+                INIT_WORK(&wbs[i].work, cflt_wb_work_fn);
+#endif
+                cpu = cflt_wb_queue(&wbs[i], cpu);
+                i++;
+        }
+
+        wait_for_completion(&done);
+
+        // placement has to follow the off_u order of the wb list
+        for (i = 0; i < nr; i++) {
+                if (wbs[i].err) {
+                        err = wbs[i].err;
+                        continue;
+                }
+
+                blk = wbs[i].blk;
+                cflt_file_place_block(blk, wbs[i].size_c_old);
+                if (list_empty(&blk->file))
+                        cflt_file_link_blk(fh, blk);
+        }
+
+        sort(wbs, nr, sizeof(struct cflt_wb_blk), cflt_wb_cmp, NULL);
+
+        if (cflt_wb_write(f, wbs, nr))
+                err = -EIO;
+
+        // blocks that failed to compress stay pending
+        for (i = 0; i < nr; i++) {
+                if (wbs[i].err)
+                        continue;
+
+                blk = wbs[i].blk;
+                kfree(blk->data_c);
+                blk->data_c = NULL;
+
+                data = blk->data_p;
+                blk->data_p = NULL;
+                list_del_init(&blk->wb);
+                fh->wb_nr--;
+
+                cflt_cache_put(blk, data, blk->gen);
+        }
+
+        kfree(wbs);
+
+        return err;
+}
+
+// write back all pending blocks of @fh together with the file and block
+// headers, fh->sem has to be held for writing. Blocks that failed to
+// compress stay pending and are reported as an error, so are the headers
+// that failed to be written.
+int cflt_wb_sync(struct file *f, struct cflt_file *fh)
+{
+        int err;
+
+        cflt_debug_printk("compflt: [f:cflt_wb_sync] i=%li\n", fh->inode->i_ino);
+
+        err = cflt_wb_flush(f, fh);
+        if (cflt_file_write(f, fh))
+                err = -EIO;
+        if (cflt_file_write_block_headers(f, fh))
+                err = -EIO;
+
+        if (!err && fh->wb_nr)
+                err = -EIO;
+
+        return err;
+}
+
+int cflt_wb_init(void)
+{
+        cflt_debug_printk("compflt: [f:cflt_wb_init]\n");
+
+        cflt_wb_wq = create_workqueue("compflt");
+        if (!cflt_wb_wq)
+                return -ENOMEM;
+
+        return 0;
+}
+
+void cflt_wb_deinit(void)
+{
+        cflt_debug_printk("compflt: [f:cflt_wb_deinit]\n");
+
+        destroy_workqueue(cflt_wb_wq);
+}
@@ -6,13 +6,62 @@
  */
 
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
+#include <stdint.h>
 #include "av.h"
 
+#define AV_PROTO_TEXT 1
+#define AV_PROTO_BIN  2
+#define AV_PROTO_RING 3
+#define AV_PROTO_PATH 4
+
+#define AV_BATCH_MAX 64
+#define AV_RING_ENTRIES 256
+#define AV_PATH_BUF 65536
+
+#define AV_IOC_GET_FD _IO('v', 1)
+#define AV_IOC_SET_VER _IO('v', 2)
+#define AV_IOC_SET_QUEUE _IO('v', 3)
+
+struct av_msg_event {
+	int32_t id;
+	int32_t type;
+	int32_t fd;
+	int32_t pid;
+	int32_t tgid;
+};
+
+struct av_msg_path {
+	int32_t id;
+	int32_t type;
+	int32_t pid;
+	int32_t tgid;
+	uint32_t size;
+};
+
+struct av_msg_reply {
+	int32_t id;
+	int32_t res;
+	int32_t cache;
+};
+
+struct av_ring_hdr {
+	volatile uint32_t req_head;
+	volatile uint32_t req_tail;
+	volatile uint32_t rep_head;
+	volatile uint32_t rep_tail;
+	uint32_t entries;
+	uint32_t req_off;
+	uint32_t rep_off;
+};
+
 static int av_open_conn(struct av_connection *conn, int flags)
 {
 	if (!conn) {
@@ -23,6 +72,13 @@ static int av_open_conn(struct av_connection *conn, int flags)
 	if ((conn->fd = open("/dev/avflt", flags)) == -1)
 		return -1;
 
+	conn->ver = AV_PROTO_TEXT;
+	conn->ring = NULL;
+	conn->ring_size = 0;
+	conn->path_buf = NULL;
+	conn->path_len = 0;
+	conn->path_off = 0;
+
 	return 0;
 }
 
@@ -38,6 +94,14 @@ int av_unregister(struct av_connection *conn)
 		return -1;
 	}
 
+	if (conn->ring && munmap(conn->ring, conn->ring_size) == -1)
+		return -1;
+
+	conn->ring = NULL;
+
+	free(conn->path_buf);
+	conn->path_buf = NULL;
+
 	if (close(conn->fd) == -1)
 		return -1;
 
@@ -54,18 +118,19 @@ int av_unregister_trusted(struct av_connection *conn)
 	return av_unregister(conn);
 }
 
-int av_request(struct av_connection *conn, struct av_event *event, int timeout)
+/*
+ * timeout -1 reads without waiting and returns 0 if there is no request
+ */
+static int av_wait(struct av_connection *conn, void *buf, size_t size,
+		int timeout)
 {
 	struct timeval tv;
 	struct timeval *ptv;
-	char buf[256];
 	fd_set rfds;
 	int rv = 0;
 
-	if (!conn || !event || timeout < 0) {
-		errno = EINVAL;
-		return -1;
-	}
+	if (timeout == -1)
+		return read(conn->fd, buf, size);
 
 	FD_ZERO(&rfds);
 	FD_SET(conn->fd, &rfds);
@@ -86,11 +151,60 @@ int av_request(struct av_connection *conn, struct av_event *event, int timeout)
 		if (rv == -1)
 			return -1;
 
-		rv = read(conn->fd, buf, 256);
+		rv = read(conn->fd, buf, size);
 		if (rv == -1)
 			return -1;
 	}
 
+	return rv;
+}
+
+static int av_set_bin(struct av_connection *conn)
+{
+	if (conn->ver == AV_PROTO_BIN)
+		return 0;
+
+	if (ioctl(conn->fd, AV_IOC_SET_VER, AV_PROTO_BIN) == -1)
+		return -1;
+
+	conn->ver = AV_PROTO_BIN;
+
+	return 0;
+}
+
+static int av_event_release(struct av_event *event)
+{
+	int rv = 0;
+
+	if (event->fd != -1 && close(event->fd) == -1)
+		rv = -1;
+
+	free(event->path);
+	event->path = NULL;
+	event->fd = -1;
+
+	return rv;
+}
+
+int av_request(struct av_connection *conn, struct av_event *event, int timeout)
+{
+	char buf[256];
+
+	if (!conn || !event || timeout < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (conn->ver != AV_PROTO_TEXT) {
+		if (av_request_batch(conn, event, 1, timeout) != 1)
+			return -1;
+
+		return 0;
+	}
+
+	if (av_wait(conn, buf, 256, timeout) == -1)
+		return -1;
+
 	if (sscanf(buf, "id:%d,type:%d,fd:%d,pid:%d,tgid:%d",
 				&event->id, &event->type, &event->fd,
 				&event->pid, &event->tgid) != 5)
@@ -98,6 +212,8 @@ int av_request(struct av_connection *conn, struct av_event *event, int timeout)
 
 	event->res = 0;
 	event->cache = AV_CACHE_ENABLE;
+	event->hashed = 0;
+	event->path = NULL;
 
 	return 0;
 }
@@ -111,13 +227,414 @@ int av_reply(struct av_connection *conn, struct av_event *event)
 		return -1;
 	}
 
+	if (conn->ver != AV_PROTO_TEXT)
+		return av_reply_batch(conn, event, 1);
+
 	snprintf(buf, 256, "id:%d,res:%d,cache:%d", event->id, event->res,
 			event->cache);
 
 	if (write(conn->fd, buf, strlen(buf) + 1) == -1)
 		return -1;
 
-	if (close(event->fd) == -1)
+	return av_event_release(event);
+}
+
+static int av_ring_get(struct av_connection *conn, struct av_event *events,
+		int nr)
+{
+	struct av_ring_hdr *hdr = conn->ring;
+	struct av_msg_event *msg;
+	uint32_t head;
+	uint32_t tail;
+	int i;
+
+	tail = hdr->req_tail;
+	head = hdr->req_head;
+	__sync_synchronize();
+
+	for (i = 0; i < nr && tail != head; i++, tail++) {
+		msg = (struct av_msg_event *)((char *)hdr + hdr->req_off) +
+			(tail & (hdr->entries - 1));
+		events[i].id = msg->id;
+		events[i].type = msg->type;
+		events[i].fd = msg->fd;
+		events[i].pid = msg->pid;
+		events[i].tgid = msg->tgid;
+		events[i].res = 0;
+		events[i].cache = AV_CACHE_ENABLE;
+		events[i].hashed = 0;
+		events[i].path = NULL;
+	}
+
+	__sync_synchronize();
+	hdr->req_tail = tail;
+
+	return i;
+}
+
+static int av_ring_request(struct av_connection *conn,
+		struct av_event *events, int nr, int timeout)
+{
+	int rv;
+
+	rv = av_ring_get(conn, events, nr);
+	if (rv)
+		return rv;
+
+	/*
+	 * read on the ring connection fills the request ring and returns the
+	 * number of new requests
+	 */
+	if (av_wait(conn, NULL, 0, timeout) == -1)
+		return -1;
+
+	return av_ring_get(conn, events, nr);
+}
+
+static int av_ring_reply(struct av_connection *conn, struct av_event *events,
+		int nr)
+{
+	struct av_ring_hdr *hdr = conn->ring;
+	struct av_msg_reply *msg;
+	uint32_t head;
+	int rv = 0;
+	int i;
+
+	head = hdr->rep_head;
+
+	for (i = 0; i < nr; i++, head++) {
+		while (head - hdr->rep_tail >= hdr->entries) {
+			__sync_synchronize();
+			hdr->rep_head = head;
+			if (read(conn->fd, NULL, 0) == -1)
+				return -1;
+		}
+
+		msg = (struct av_msg_reply *)((char *)hdr + hdr->rep_off) +
+			(head & (hdr->entries - 1));
+		msg->id = events[i].id;
+		msg->res = events[i].res;
+		msg->cache = events[i].cache;
+	}
+
+	__sync_synchronize();
+	hdr->rep_head = head;
+
+	/*
+	 * let the kernel consume the replies, this also posts new requests
+	 */
+	if (read(conn->fd, NULL, 0) == -1)
+		rv = -1;
+
+	for (i = 0; i < nr; i++) {
+		if (av_event_release(&events[i]))
+			rv = -1;
+	}
+
+	return rv;
+}
+
+/*
+ * Maps the request and reply rings shared with avflt. After that
+ * av_request_batch and av_reply_batch pass events through the rings. The
+ * rings are not locked, so a connection with rings can be used only by one
+ * thread at a time.
+ */
+int av_ring_setup(struct av_connection *conn)
+{
+	size_t page;
+	size_t size;
+	void *ring;
+
+	if (!conn || conn->ring) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	page = sysconf(_SC_PAGESIZE);
+	size = page + AV_RING_ENTRIES * (sizeof(struct av_msg_event) +
+			sizeof(struct av_msg_reply));
+	size = (size + page - 1) & ~(page - 1);
+
+	ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, conn->fd,
+			0);
+	if (ring == MAP_FAILED)
+		return -1;
+
+	conn->ring = ring;
+	conn->ring_size = size;
+	conn->ver = AV_PROTO_RING;
+
+	return 0;
+}
+
+/*
+ * A read returns as many records as fit into the buffer, the ones not
+ * taken by this call are kept in the connection for the next one.
+ */
+static int av_path_request(struct av_connection *conn,
+		struct av_event *events, int nr, int timeout)
+{
+	struct av_msg_path *msg;
+	int rv;
+	int i;
+
+	if (conn->path_off == conn->path_len) {
+		rv = av_wait(conn, conn->path_buf, AV_PATH_BUF, timeout);
+		if (rv == -1)
+			return -1;
+
+		conn->path_len = rv;
+		conn->path_off = 0;
+	}
+
+	for (i = 0; i < nr && conn->path_off < conn->path_len; i++) {
+		msg = (struct av_msg_path *)((char *)conn->path_buf +
+				conn->path_off);
+		conn->path_off += msg->size;
+
+		events[i].id = msg->id;
+		events[i].type = msg->type;
+		events[i].fd = -1;
+		events[i].pid = msg->pid;
+		events[i].tgid = msg->tgid;
+		events[i].res = 0;
+		events[i].cache = AV_CACHE_ENABLE;
+		events[i].hashed = 0;
+		events[i].path = strdup((char *)(msg + 1));
+	}
+
+	return i;
+}
+
+/*
+ * Switches the connection to events carrying the pathname instead of an
+ * open fd, av_get_fd opens the file only when the scanner needs it.
+ */
+int av_set_path(struct av_connection *conn)
+{
+	if (!conn || conn->ring) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (conn->ver == AV_PROTO_PATH)
+		return 0;
+
+	if (!conn->path_buf) {
+		conn->path_buf = malloc(AV_PATH_BUF);
+		if (!conn->path_buf)
+			return -1;
+	}
+
+	if (ioctl(conn->fd, AV_IOC_SET_VER, AV_PROTO_PATH) == -1)
+		return -1;
+
+	conn->ver = AV_PROTO_PATH;
+	conn->path_len = 0;
+	conn->path_off = 0;
+
+	return 0;
+}
+
+int av_get_fd(struct av_connection *conn, struct av_event *event)
+{
+	int fd;
+
+	if (!conn || !event) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (event->fd != -1)
+		return event->fd;
+
+	fd = ioctl(conn->fd, AV_IOC_GET_FD, event->id);
+	if (fd == -1)
+		return -1;
+
+	event->fd = fd;
+
+	return fd;
+}
+
+static int av_request_events(struct av_connection *conn,
+		struct av_event *events, int nr, int timeout)
+{
+	struct av_msg_event msgs[AV_BATCH_MAX];
+	int rv;
+	int i;
+
+	if (conn->ver == AV_PROTO_RING)
+		return av_ring_request(conn, events, nr, timeout);
+
+	if (conn->ver == AV_PROTO_PATH)
+		return av_path_request(conn, events, nr, timeout);
+
+	if (av_set_bin(conn))
+		return -1;
+
+	if (nr > AV_BATCH_MAX)
+		nr = AV_BATCH_MAX;
+
+	rv = av_wait(conn, msgs, sizeof(struct av_msg_event) * nr, timeout);
+	if (rv == -1)
+		return -1;
+
+	nr = rv / sizeof(struct av_msg_event);
+
+	for (i = 0; i < nr; i++) {
+		events[i].id = msgs[i].id;
+		events[i].type = msgs[i].type;
+		events[i].fd = msgs[i].fd;
+		events[i].pid = msgs[i].pid;
+		events[i].tgid = msgs[i].tgid;
+		events[i].res = 0;
+		events[i].cache = AV_CACHE_ENABLE;
+		events[i].hashed = 0;
+		events[i].path = NULL;
+	}
+
+	return nr;
+}
+
+/*
+ * Switches the connection to the binary protocol and returns up to nr (at
+ * most AV_BATCH_MAX) events received by a single read.
+ */
+int av_request_batch(struct av_connection *conn, struct av_event *events,
+		int nr, int timeout)
+{
+	if (!conn || !events || nr <= 0 || timeout < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return av_request_events(conn, events, nr, timeout);
+}
+
+/*
+ * Returns the fd to be polled for requests. The fd is switched to the
+ * non-blocking mode, so av_dispatch does not block even on a connection
+ * bound to a queue.
+ */
+int av_fd(struct av_connection *conn)
+{
+	int flags;
+
+	if (!conn) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	flags = fcntl(conn->fd, F_GETFL);
+	if (flags == -1)
+		return -1;
+
+	if (fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return -1;
+
+	return conn->fd;
+}
+
+/*
+ * Handles all the requests pending for the connection without blocking and
+ * returns their number. Meant to be called when av_fd becomes readable in
+ * the caller's event loop. The callback sets the result of each event, the
+ * replies are sent in batches.
+ */
+int av_dispatch(struct av_connection *conn, av_callback callback,
+		void *data)
+{
+	struct av_event events[AV_BATCH_MAX];
+	int total = 0;
+	int nr;
+	int i;
+
+	if (!conn || !callback) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (;;) {
+		nr = av_request_events(conn, events, AV_BATCH_MAX, -1);
+		if (nr == -1 && errno == EAGAIN)
+			break;
+
+		if (nr == -1)
+			return -1;
+
+		if (!nr)
+			break;
+
+		for (i = 0; i < nr; i++)
+			callback(&events[i], data);
+
+		if (av_reply_batch(conn, events, nr))
+			return -1;
+
+		total += nr;
+	}
+
+	return total;
+}
+
+int av_reply_batch(struct av_connection *conn, struct av_event *events,
+		int nr)
+{
+	struct av_msg_reply msgs[AV_BATCH_MAX];
+	int rv = 0;
+	int len;
+	int i, j;
+
+	if (!conn || !events || nr <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (conn->ver == AV_PROTO_RING)
+		return av_ring_reply(conn, events, nr);
+
+	if (conn->ver != AV_PROTO_PATH && av_set_bin(conn))
+		return -1;
+
+	for (i = 0; i < nr; i += len) {
+		len = nr - i;
+		if (len > AV_BATCH_MAX)
+			len = AV_BATCH_MAX;
+
+		for (j = 0; j < len; j++) {
+			msgs[j].id = events[i + j].id;
+			msgs[j].res = events[i + j].res;
+			msgs[j].cache = events[i + j].cache;
+		}
+
+		if (write(conn->fd, msgs, sizeof(struct av_msg_reply) * len)
+				== -1)
+			rv = -1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (av_event_release(&events[i]))
+			rv = -1;
+	}
+
+	return rv;
+}
+
+/*
+ * Binds the connection to the avflt request queue of the given cpu, -1
+ * unbinds it. A read on a bound connection blocks until a request arrives
+ * and each request wakes only one of the connections bound to its queue.
+ */
+int av_set_queue(struct av_connection *conn, int queue)
+{
+	if (!conn || queue < -1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (ioctl(conn->fd, AV_IOC_SET_QUEUE, queue) == -1)
 		return -1;
 
 	return 0;
@@ -166,8 +683,14 @@ int av_get_filename(struct av_event *event, char *buf, int size)
 		return -1;
 	}
 
-	memset(fn, 0, 256);
 	memset(buf, 0, size);
+
+	if (event->path) {
+		strncpy(buf, event->path, size - 1);
+		return 0;
+	}
+
+	memset(fn, 0, 256);
 	snprintf(fn, 255, "/proc/%d/fd/%d", getpid(), event->fd);
 
 	if (readlink(fn, buf, size - 1) == -1)
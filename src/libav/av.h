@@ -9,6 +9,7 @@
 #define __AV_H__
 
 #include <sys/types.h>
+#include <stdint.h>
 
 #define AV_EVENT_OPEN  1
 #define AV_EVENT_CLOSE 2
@@ -21,6 +22,12 @@
 
 struct av_connection {
 	int fd;
+	int ver;
+	void *ring;
+	size_t ring_size;
+	void *path_buf;
+	int path_len;
+	int path_off;
 };
 
 struct av_event {
@@ -31,17 +38,48 @@ struct av_event {
 	pid_t tgid;
 	int res;
 	int cache;
+	int hashed;
+	off_t size;
+	uint64_t hash[2];
+	char *path;
 };
 
+struct av_cache;
+struct av_pool;
+
+typedef int (*av_callback)(struct av_event *event, void *data);
+
+#define AV_POOL_AFFINE 1
+
 int av_register(struct av_connection *conn);
 int av_unregister(struct av_connection *conn);
 int av_register_trusted(struct av_connection *conn);
 int av_unregister_trusted(struct av_connection *conn);
 int av_request(struct av_connection *conn, struct av_event *event, int timeout);
 int av_reply(struct av_connection *conn, struct av_event *event);
+int av_request_batch(struct av_connection *conn, struct av_event *events,
+		int nr, int timeout);
+int av_reply_batch(struct av_connection *conn, struct av_event *events,
+		int nr);
+int av_ring_setup(struct av_connection *conn);
+int av_fd(struct av_connection *conn);
+int av_dispatch(struct av_connection *conn, av_callback callback,
+		void *data);
+int av_set_queue(struct av_connection *conn, int queue);
+int av_set_path(struct av_connection *conn);
+int av_get_fd(struct av_connection *conn, struct av_event *event);
 int av_set_result(struct av_event *event, int res);
 int av_set_cache(struct av_event *event, int cache);
 int av_get_filename(struct av_event *event, char *buf, int size);
+struct av_cache *av_cache_create(int size);
+void av_cache_destroy(struct av_cache *cache);
+int av_cache_lookup(struct av_cache *cache, struct av_event *event);
+int av_cache_update(struct av_cache *cache, struct av_event *event);
+int av_cache_save(struct av_cache *cache, const char *path);
+int av_cache_load(struct av_cache *cache, const char *path);
+struct av_pool *av_pool_create(int threads, int flags, av_callback callback,
+		void *data);
+int av_pool_destroy(struct av_pool *pool);
 
 #endif
 
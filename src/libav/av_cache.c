@@ -0,0 +1,542 @@
+/*
+ *          Copyright Frantisek Hrbata 2008 - 2010.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "av.h"
+
+/*
+ * Verdict cache keyed by a hash of the file content. The content is hashed
+ * with SipHash-2-4 (128 bit output) keyed by a random per cache key, so the
+ * hash of a clean file cannot be matched by crafted content. The cache is
+ * split into shards, each with its own lock, hash table and LRU list.
+ */
+
+#define AV_CACHE_SHARDS 16
+#define AV_CACHE_MAGIC 0x31435641
+#define AV_CACHE_CHUNK 65536
+
+struct av_cache_entry {
+	uint64_t hash[2];
+	off_t size;
+	int res;
+	struct av_cache_entry *hnext;
+	struct av_cache_entry *prev;
+	struct av_cache_entry *next;
+};
+
+struct av_cache_shard {
+	pthread_mutex_t lock;
+	struct av_cache_entry **table;
+	struct av_cache_entry *entries;
+	struct av_cache_entry *free;
+	struct av_cache_entry *head;
+	struct av_cache_entry *tail;
+	unsigned int mask;
+};
+
+struct av_cache {
+	uint64_t key[2];
+	struct av_cache_shard shards[AV_CACHE_SHARDS];
+};
+
+struct av_cache_rec {
+	uint64_t hash[2];
+	int64_t size;
+	int32_t res;
+	int32_t pad;
+};
+
+struct av_sip {
+	uint64_t v[4];
+	uint64_t tail;
+	uint64_t len;
+};
+
+#define AV_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define AV_SIPROUND(v) \
+	do { \
+		v[0] += v[1]; v[1] = AV_ROTL(v[1], 13); v[1] ^= v[0]; \
+		v[0] = AV_ROTL(v[0], 32); \
+		v[2] += v[3]; v[3] = AV_ROTL(v[3], 16); v[3] ^= v[2]; \
+		v[0] += v[3]; v[3] = AV_ROTL(v[3], 21); v[3] ^= v[0]; \
+		v[2] += v[1]; v[1] = AV_ROTL(v[1], 17); v[1] ^= v[2]; \
+		v[2] = AV_ROTL(v[2], 32); \
+	} while (0)
+
+static void av_sip_init(struct av_sip *sip, const uint64_t key[2])
+{
+	sip->v[0] = 0x736f6d6570736575ULL ^ key[0];
+	sip->v[1] = 0x646f72616e646f6dULL ^ key[1] ^ 0xee;
+	sip->v[2] = 0x6c7967656e657261ULL ^ key[0];
+	sip->v[3] = 0x7465646279746573ULL ^ key[1];
+	sip->tail = 0;
+	sip->len = 0;
+}
+
+static void av_sip_block(struct av_sip *sip, uint64_t m)
+{
+	sip->v[3] ^= m;
+	AV_SIPROUND(sip->v);
+	AV_SIPROUND(sip->v);
+	sip->v[0] ^= m;
+}
+
+/* compilers turn this into a single load on little endian machines */
+static uint64_t av_sip_le64(const unsigned char *p)
+{
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 |
+		(uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+		(uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+		(uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+/*
+ * Bytes are gathered in the tail only till it is word aligned again, the
+ * rest of the buffer is consumed eight bytes at a time.
+ */
+static void av_sip_update(struct av_sip *sip, const unsigned char *buf,
+		size_t size)
+{
+	size_t i = 0;
+
+	for (; i < size && (sip->len & 7); i++) {
+		sip->tail |= (uint64_t)buf[i] << (8 * (sip->len & 7));
+		if (++sip->len & 7)
+			continue;
+
+		av_sip_block(sip, sip->tail);
+		sip->tail = 0;
+	}
+
+	for (; i + 8 <= size; i += 8) {
+		av_sip_block(sip, av_sip_le64(buf + i));
+		sip->len += 8;
+	}
+
+	for (; i < size; i++) {
+		sip->tail |= (uint64_t)buf[i] << (8 * (sip->len & 7));
+		sip->len++;
+	}
+}
+
+static void av_sip_final(struct av_sip *sip, uint64_t hash[2])
+{
+	int i;
+
+	av_sip_block(sip, sip->tail | (sip->len << 56));
+
+	sip->v[2] ^= 0xee;
+	for (i = 0; i < 4; i++)
+		AV_SIPROUND(sip->v);
+	hash[0] = sip->v[0] ^ sip->v[1] ^ sip->v[2] ^ sip->v[3];
+
+	sip->v[1] ^= 0xdd;
+	for (i = 0; i < 4; i++)
+		AV_SIPROUND(sip->v);
+	hash[1] = sip->v[0] ^ sip->v[1] ^ sip->v[2] ^ sip->v[3];
+}
+
+static int av_cache_hash(struct av_cache *cache, int fd, off_t *size,
+		uint64_t hash[2])
+{
+	unsigned char *buf;
+	struct av_sip sip;
+	off_t off = 0;
+	ssize_t rv;
+
+	buf = malloc(AV_CACHE_CHUNK);
+	if (!buf)
+		return -1;
+
+	av_sip_init(&sip, cache->key);
+
+	while ((rv = pread(fd, buf, AV_CACHE_CHUNK, off)) > 0) {
+		av_sip_update(&sip, buf, rv);
+		off += rv;
+	}
+
+	free(buf);
+
+	if (rv == -1)
+		return -1;
+
+	av_sip_final(&sip, hash);
+	*size = off;
+
+	return 0;
+}
+
+static struct av_cache_shard *av_cache_shard(struct av_cache *cache,
+		const uint64_t hash[2])
+{
+	return &cache->shards[hash[1] % AV_CACHE_SHARDS];
+}
+
+static struct av_cache_entry **av_cache_bucket(struct av_cache_shard *shard,
+		const uint64_t hash[2])
+{
+	return &shard->table[hash[0] & shard->mask];
+}
+
+static void av_cache_lru_del(struct av_cache_shard *shard,
+		struct av_cache_entry *entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		shard->head = entry->next;
+
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		shard->tail = entry->prev;
+}
+
+static void av_cache_lru_add(struct av_cache_shard *shard,
+		struct av_cache_entry *entry)
+{
+	entry->prev = NULL;
+	entry->next = shard->head;
+
+	if (shard->head)
+		shard->head->prev = entry;
+	else
+		shard->tail = entry;
+
+	shard->head = entry;
+}
+
+static struct av_cache_entry *av_cache_find(struct av_cache_shard *shard,
+		const uint64_t hash[2], off_t size)
+{
+	struct av_cache_entry *entry;
+
+	entry = *av_cache_bucket(shard, hash);
+
+	while (entry) {
+		if (entry->hash[0] == hash[0] && entry->hash[1] == hash[1] &&
+				entry->size == size)
+			return entry;
+
+		entry = entry->hnext;
+	}
+
+	return NULL;
+}
+
+static void av_cache_unhash(struct av_cache_shard *shard,
+		struct av_cache_entry *entry)
+{
+	struct av_cache_entry **pos;
+
+	pos = av_cache_bucket(shard, entry->hash);
+
+	while (*pos != entry)
+		pos = &(*pos)->hnext;
+
+	*pos = entry->hnext;
+}
+
+static void av_cache_insert(struct av_cache *cache, const uint64_t hash[2],
+		off_t size, int res)
+{
+	struct av_cache_shard *shard;
+	struct av_cache_entry *entry;
+	struct av_cache_entry **bucket;
+
+	shard = av_cache_shard(cache, hash);
+
+	pthread_mutex_lock(&shard->lock);
+
+	entry = av_cache_find(shard, hash, size);
+	if (entry) {
+		entry->res = res;
+		av_cache_lru_del(shard, entry);
+		av_cache_lru_add(shard, entry);
+		goto exit;
+	}
+
+	if (shard->free) {
+		entry = shard->free;
+		shard->free = entry->hnext;
+
+	} else {
+		entry = shard->tail;
+		av_cache_lru_del(shard, entry);
+		av_cache_unhash(shard, entry);
+	}
+
+	entry->hash[0] = hash[0];
+	entry->hash[1] = hash[1];
+	entry->size = size;
+	entry->res = res;
+
+	bucket = av_cache_bucket(shard, hash);
+	entry->hnext = *bucket;
+	*bucket = entry;
+	av_cache_lru_add(shard, entry);
+exit:
+	pthread_mutex_unlock(&shard->lock);
+}
+
+static void av_cache_key(uint64_t key[2])
+{
+	int fd;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd != -1) {
+		if (read(fd, key, sizeof(uint64_t) * 2) ==
+				sizeof(uint64_t) * 2) {
+			close(fd);
+			return;
+		}
+		close(fd);
+	}
+
+	key[0] = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+	key[1] = (uint64_t)(uintptr_t)key ^ (uint64_t)clock();
+}
+
+/*
+ * Creates a cache holding at most size verdicts.
+ */
+static void av_cache_free_shards(struct av_cache *cache, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		pthread_mutex_destroy(&cache->shards[i].lock);
+		free(cache->shards[i].table);
+		free(cache->shards[i].entries);
+	}
+}
+
+struct av_cache *av_cache_create(int size)
+{
+	struct av_cache_shard *shard;
+	struct av_cache *cache;
+	unsigned int buckets;
+	unsigned int nr;
+	unsigned int j;
+	int i;
+
+	if (size < AV_CACHE_SHARDS) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	cache = calloc(1, sizeof(struct av_cache));
+	if (!cache)
+		return NULL;
+
+	av_cache_key(cache->key);
+
+	nr = size / AV_CACHE_SHARDS;
+	for (buckets = 1; buckets < nr; buckets <<= 1)
+		;
+
+	for (i = 0; i < AV_CACHE_SHARDS; i++) {
+		shard = &cache->shards[i];
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->mask = buckets - 1;
+		shard->table = calloc(buckets, sizeof(struct av_cache_entry *));
+		shard->entries = calloc(nr, sizeof(struct av_cache_entry));
+		if (!shard->table || !shard->entries) {
+			av_cache_free_shards(cache, i + 1);
+			free(cache);
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		for (j = 0; j < nr; j++) {
+			shard->entries[j].hnext = shard->free;
+			shard->free = &shard->entries[j];
+		}
+	}
+
+	return cache;
+}
+
+void av_cache_destroy(struct av_cache *cache)
+{
+	if (!cache)
+		return;
+
+	av_cache_free_shards(cache, AV_CACHE_SHARDS);
+	free(cache);
+}
+
+/*
+ * Hashes the content of the event's file and looks the verdict up. On a
+ * hit returns 1 and sets the event's result, so it can be passed directly
+ * to av_reply, on a miss returns 0. The hash is kept in the event for
+ * av_cache_update. With av_set_path the fd has to be obtained by av_get_fd
+ * first.
+ */
+int av_cache_lookup(struct av_cache *cache, struct av_event *event)
+{
+	struct av_cache_shard *shard;
+	struct av_cache_entry *entry;
+	int res = 0;
+
+	if (!cache || !event) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (av_cache_hash(cache, event->fd, &event->size, event->hash))
+		return -1;
+
+	event->hashed = 1;
+	shard = av_cache_shard(cache, event->hash);
+
+	pthread_mutex_lock(&shard->lock);
+
+	entry = av_cache_find(shard, event->hash, event->size);
+	if (entry) {
+		res = entry->res;
+		av_cache_lru_del(shard, entry);
+		av_cache_lru_add(shard, entry);
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+
+	if (!res)
+		return 0;
+
+	event->res = res;
+	return 1;
+}
+
+/*
+ * Stores the event's result for its content.
+ */
+int av_cache_update(struct av_cache *cache, struct av_event *event)
+{
+	if (!cache || !event) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (event->res != AV_ACCESS_ALLOW && event->res != AV_ACCESS_DENY) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!event->hashed) {
+		if (av_cache_hash(cache, event->fd, &event->size, event->hash))
+			return -1;
+
+		event->hashed = 1;
+	}
+
+	av_cache_insert(cache, event->hash, event->size, event->res);
+
+	return 0;
+}
+
+/*
+ * The checkpoint contains the hash key, so it has to be protected as the
+ * engine's configuration.
+ */
+int av_cache_save(struct av_cache *cache, const char *path)
+{
+	struct av_cache_shard *shard;
+	struct av_cache_entry *entry;
+	struct av_cache_rec rec;
+	uint32_t magic = AV_CACHE_MAGIC;
+	FILE *file;
+	int rv = 0;
+	int i;
+
+	if (!cache || !path) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	file = fopen(path, "w");
+	if (!file)
+		return -1;
+
+	if (fwrite(&magic, sizeof(magic), 1, file) != 1 ||
+			fwrite(cache->key, sizeof(cache->key), 1, file) != 1)
+		rv = -1;
+
+	for (i = 0; i < AV_CACHE_SHARDS && !rv; i++) {
+		shard = &cache->shards[i];
+		pthread_mutex_lock(&shard->lock);
+
+		for (entry = shard->tail; entry; entry = entry->prev) {
+			memset(&rec, 0, sizeof(rec));
+			rec.hash[0] = entry->hash[0];
+			rec.hash[1] = entry->hash[1];
+			rec.size = entry->size;
+			rec.res = entry->res;
+
+			if (fwrite(&rec, sizeof(rec), 1, file) != 1) {
+				rv = -1;
+				break;
+			}
+		}
+
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	if (fclose(file))
+		rv = -1;
+
+	return rv;
+}
+
+/*
+ * Loads a checkpoint into an empty cache, the cache takes over its key.
+ */
+int av_cache_load(struct av_cache *cache, const char *path)
+{
+	struct av_cache_rec rec;
+	uint32_t magic;
+	FILE *file;
+
+	if (!cache || !path) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	file = fopen(path, "r");
+	if (!file)
+		return -1;
+
+	if (fread(&magic, sizeof(magic), 1, file) != 1 ||
+			magic != AV_CACHE_MAGIC ||
+			fread(cache->key, sizeof(cache->key), 1, file) != 1) {
+		fclose(file);
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (fread(&rec, sizeof(rec), 1, file) == 1) {
+		if (rec.res != AV_ACCESS_ALLOW && rec.res != AV_ACCESS_DENY)
+			continue;
+
+		av_cache_insert(cache, rec.hash, rec.size, rec.res);
+	}
+
+	fclose(file);
+
+	return 0;
+}
@@ -0,0 +1,230 @@
+/*
+ *          Copyright Frantisek Hrbata 2008 - 2010.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "av.h"
+
+/*
+ * Scanner pool, each worker has its own connection and handles the
+ * requests in batches. With AV_POOL_AFFINE the workers are spread over the
+ * online cpus the process may run on, worker i runs on the i-th of them
+ * (modulo their number) and its connection is bound to the avflt queue of
+ * the same cpu, so the requests are scanned on the cpu and the NUMA node
+ * where the file was opened. The connections are set up before the
+ * workers start, so av_pool_create reports their errors. The workers wake up every
+ * AV_POOL_TICK ms to check if the pool is being destroyed.
+ */
+
+#define AV_POOL_BATCH 64
+#define AV_POOL_TICK 200
+
+struct av_pool_worker {
+	pthread_t thread;
+	struct av_connection conn;
+	struct av_pool *pool;
+	int cpu;
+	int started;
+};
+
+struct av_pool {
+	struct av_pool_worker *workers;
+	av_callback callback;
+	void *data;
+	volatile int stop;
+	int nr;
+};
+
+static int av_pool_cpu(const cpu_set_t *online, int nr, int i)
+{
+	int cpu;
+
+	i %= nr;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, online))
+			continue;
+
+		if (!i--)
+			return cpu;
+	}
+
+	return -1;
+}
+
+static void *av_pool_work(void *arg)
+{
+	struct av_pool_worker *worker = arg;
+	struct av_pool *pool = worker->pool;
+	struct av_event events[AV_POOL_BATCH];
+	int nr;
+	int i;
+
+	while (!pool->stop) {
+		nr = av_request_batch(&worker->conn, events, AV_POOL_BATCH,
+				AV_POOL_TICK);
+		if (nr == -1 && (errno == ETIMEDOUT || errno == EAGAIN ||
+					errno == EINTR))
+			continue;
+
+		if (nr == -1)
+			break;
+
+		for (i = 0; i < nr; i++)
+			pool->callback(&events[i], pool->data);
+
+		if (nr)
+			av_reply_batch(&worker->conn, events, nr);
+	}
+
+	return NULL;
+}
+
+static int av_pool_start(struct av_pool_worker *worker)
+{
+	pthread_attr_t attr;
+	cpu_set_t set;
+	int rv;
+
+	if (av_fd(&worker->conn) == -1)
+		return -1;
+
+	if (pthread_attr_init(&attr)) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (worker->cpu != -1) {
+		if (av_set_queue(&worker->conn, worker->cpu))
+			goto error;
+
+		CPU_ZERO(&set);
+		CPU_SET(worker->cpu, &set);
+
+		rv = pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		if (rv) {
+			errno = rv;
+			goto error;
+		}
+	}
+
+	rv = pthread_create(&worker->thread, &attr, av_pool_work, worker);
+	if (rv) {
+		errno = rv;
+		goto error;
+	}
+
+	pthread_attr_destroy(&attr);
+	return 0;
+error:
+	pthread_attr_destroy(&attr);
+	return -1;
+}
+
+struct av_pool *av_pool_create(int threads, int flags, av_callback callback,
+		void *data)
+{
+	struct av_pool_worker *worker;
+	struct av_pool *pool;
+	cpu_set_t online;
+	long cpus;
+	int err;
+	int i;
+
+	if (threads < 0 || !callback) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	CPU_ZERO(&online);
+	if (sched_getaffinity(0, sizeof(online), &online) == -1)
+		return NULL;
+
+	cpus = CPU_COUNT(&online);
+	if (cpus < 1)
+		cpus = 1;
+
+	if (!threads)
+		threads = cpus;
+
+	pool = malloc(sizeof(struct av_pool));
+	if (!pool)
+		return NULL;
+
+	pool->workers = calloc(threads, sizeof(struct av_pool_worker));
+	if (!pool->workers) {
+		free(pool);
+		return NULL;
+	}
+
+	pool->callback = callback;
+	pool->data = data;
+	pool->stop = 0;
+	pool->nr = threads;
+
+	for (i = 0; i < threads; i++) {
+		worker = &pool->workers[i];
+		worker->pool = pool;
+		worker->cpu = -1;
+		if (flags & AV_POOL_AFFINE)
+			worker->cpu = av_pool_cpu(&online, cpus, i);
+
+		if (av_register(&worker->conn))
+			goto error;
+
+		if (av_pool_start(worker)) {
+			err = errno;
+			av_unregister(&worker->conn);
+			errno = err;
+			goto error;
+		}
+
+		worker->started = 1;
+	}
+
+	return pool;
+error:
+	err = errno;
+	av_pool_destroy(pool);
+	errno = err;
+	return NULL;
+}
+
+int av_pool_destroy(struct av_pool *pool)
+{
+	struct av_pool_worker *worker;
+	int rv = 0;
+	int i;
+
+	if (!pool) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pool->stop = 1;
+
+	for (i = 0; i < pool->nr; i++) {
+		worker = &pool->workers[i];
+		if (!worker->started)
+			continue;
+
+		pthread_join(worker->thread, NULL);
+
+		if (av_unregister(&worker->conn))
+			rv = -1;
+	}
+
+	free(pool->workers);
+	free(pool);
+
+	return rv;
+}
@@ -147,6 +147,7 @@ static struct avfltctl_path *avfltctl_get_path(struct rfsctl_path *rpath)
 	}
 
 	strncpy(fn, rpath->name, fn_size);
+	memset(&path->stats, 0, sizeof(struct avfltctl_path_stats));
 	path->type = rpath->type;
 	path->id = rpath->id;
 	path->name = fn;
@@ -189,6 +190,8 @@ static struct avfltctl_filter *avfltctl_alloc_filter(struct rfsctl_filter *rflt)
 	flt->name = fn;
 	flt->priority = rflt->priority;
 	flt->active = rflt->active;
+	memset(flt->wait_hist, 0, sizeof(flt->wait_hist));
+	memset(flt->service_hist, 0, sizeof(flt->service_hist));
 
 	return flt;
 }
@@ -315,6 +318,81 @@ static int avfltctl_set_filter_cache(struct avfltctl_filter *flt)
 	return 0;
 }
 
+static int avfltctl_get_hist(const char *buf, const char *name, int *hist)
+{
+	size_t len = strlen(name);
+	int i;
+
+	if (strncmp(buf, name, len) || buf[len] != ':')
+		return -1;
+
+	buf += len;
+
+	for (i = 0; i < AVFLTCTL_HIST_NR && *buf; i++) {
+		if (sscanf(buf + 1, "%d", &hist[i]) != 1)
+			return -1;
+
+		buf = strchr(buf + 1, ',');
+		if (!buf)
+			break;
+	}
+
+	return 0;
+}
+
+static void avfltctl_set_path_stats(struct avfltctl_filter *flt,
+		const char *buf)
+{
+	struct avfltctl_path_stats stats;
+	int id;
+	int i;
+
+	if (sscanf(buf, "%d:hits:%d,misses:%d,invalidations:%d,queued:%d,"
+				"timeouts:%d,readds:%d", &id, &stats.hits,
+				&stats.misses, &stats.invalidations,
+				&stats.queued, &stats.timeouts,
+				&stats.readds) != 7)
+		return;
+
+	for (i = 0; flt->paths[i]; i++) {
+		if (flt->paths[i]->id == id)
+			flt->paths[i]->stats = stats;
+	}
+}
+
+/*
+ * Modules without the stats attribute leave all the stats zeroed.
+ */
+static int avfltctl_set_filter_stats(struct avfltctl_filter *flt)
+{
+	long page_size;
+	char *buf;
+	int off = 0;
+	int rb;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	buf = malloc(sizeof(char) * page_size);
+	if (!buf)
+		return -1;
+
+	rb = rfsctl_read_data(flt->name, "stats", buf, page_size);
+	if (rb == -1) {
+		free(buf);
+		return 0;
+	}
+
+	while (off < rb) {
+		if (avfltctl_get_hist(buf + off, "wait", flt->wait_hist) &&
+		    avfltctl_get_hist(buf + off, "service", flt->service_hist))
+			avfltctl_set_path_stats(flt, buf + off);
+
+		off += strlen(buf + off) + 1;
+	}
+
+	free(buf);
+	return 0;
+}
+
 static pid_t *avfltctl_get_pids(const char *file)
 {
 	char *buf;
@@ -417,6 +495,10 @@ struct avfltctl_filter *avfltctl_get_filter(void)
 	if (rv)
 		goto error;
 
+	rv = avfltctl_set_filter_stats(flt);
+	if (rv)
+		goto error;
+
 	rfsctl_put_filter(rflt);
 	return flt;
 error:
@@ -556,3 +638,55 @@ int avfltctl_set_timeout(int timeout)
 	return 0;
 }
 
+
+int avfltctl_set_persist(int ver)
+{
+	char buf[256];
+	int size;
+
+	size = snprintf(buf, 256, "%d", ver);
+	if (size < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (rfsctl_write_data("avflt", "persist", buf, size + 1) == -1)
+		return -1;
+
+	return 0;
+}
+
+int avfltctl_set_qos(int open, int bulk, int close, int age, long long huge)
+{
+	char buf[256];
+	int size;
+
+	size = snprintf(buf, 256, "open:%d,bulk:%d,close:%d,age:%d,huge:%lld",
+			open, bulk, close, age, huge);
+	if (size < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (rfsctl_write_data("avflt", "qos", buf, size + 1) == -1)
+		return -1;
+
+	return 0;
+}
+
+int avfltctl_set_async_close(int limit)
+{
+	char buf[256];
+	int size;
+
+	size = snprintf(buf, 256, "%d", limit);
+	if (size < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (rfsctl_write_data("avflt", "async_close", buf, size + 1) == -1)
+		return -1;
+
+	return 0;
+}
@@ -13,11 +13,23 @@
 #define AVFLTCTL_PATH_INCLUDE RFSCTL_PATH_INCLUDE
 #define AVFLTCTL_PATH_EXCLUDE RFSCTL_PATH_EXCLUDE
 
+#define AVFLTCTL_HIST_NR 24
+
+struct avfltctl_path_stats {
+	int hits;
+	int misses;
+	int invalidations;
+	int queued;
+	int timeouts;
+	int readds;
+};
+
 struct avfltctl_path {
 	int type;
 	int id;
 	char *name;
 	int cache;
+	struct avfltctl_path_stats stats;
 };
 
 struct avfltctl_filter {
@@ -29,6 +41,8 @@ struct avfltctl_filter {
 	int active;
 	int timeout;
 	int cache;
+	int wait_hist[AVFLTCTL_HIST_NR];
+	int service_hist[AVFLTCTL_HIST_NR];
 };
 
 struct avfltctl_filter *avfltctl_get_filter(void);
@@ -46,6 +60,9 @@ int avfltctl_invalidate_path_cache(int id);
 int avfltctl_enable_path_cache(int id);
 int avfltctl_disable_path_cache(int id);
 int avfltctl_set_timeout(int timeout);
+int avfltctl_set_persist(int ver);
+int avfltctl_set_qos(int open, int bulk, int close, int age, long long huge);
+int avfltctl_set_async_close(int limit);
 
 #endif
 
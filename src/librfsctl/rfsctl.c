@@ -19,47 +19,104 @@
 
 static const char *rfsctl_dir = "/sys/fs/redirfs/filters";
 
-static struct rfsctl_path *rfsctl_get_path(const char *buf)
+static int rfsctl_parse_path(char *rec, struct rfsctl_path *path, int stats)
 {
-	struct rfsctl_path *path = NULL;
-	char *name = NULL;
-	char type;
-	int id;
+	char *end;
 
-	path = malloc(sizeof(struct rfsctl_path));
-	if (!path)
-		return NULL;
-
-	name = malloc(sizeof(char) * strlen(buf));
-	if (!name) {
-		free(path);
-		return NULL;
-	}
-
-	if (sscanf(buf, "%c:%d:%s", &type, &id, name) != 3) {
-		free(path);
-		free(name);
-		return NULL;
-	}
+	if ((rec[0] != 'i' && rec[0] != 'e') || rec[1] != ':')
+		return -1;
 
-	if (type == 'i')
+	if (rec[0] == 'i')
 		path->type = RFSCTL_PATH_INCLUDE;
 	else
 		path->type = RFSCTL_PATH_EXCLUDE;
 
-	path->id = id;
-	path->name = name;
+	path->id = strtol(rec + 2, &end, 10);
+	if (end == rec + 2 || *end != ':')
+		return -1;
+
+	path->rdentries = -1;
+	path->lazy = -1;
+	path->lazy_nr = -1;
+
+	if (stats) {
+		rec = end + 1;
+		path->rdentries = strtol(rec, &end, 10);
+		if (end == rec || *end != ':')
+			return -1;
+
+		switch (end[1]) {
+		case 'n':
+			path->lazy = RFSCTL_LAZY_NONE;
+			break;
+
+		case 'p':
+			path->lazy = RFSCTL_LAZY_PENDING;
+			break;
 
-	return path;
+		case 'd':
+			path->lazy = RFSCTL_LAZY_DONE;
+			break;
+
+		default:
+			return -1;
+		}
+
+		if (end[2] != ':')
+			return -1;
+
+		rec = end + 3;
+		path->lazy_nr = strtol(rec, &end, 10);
+		if (end == rec || *end != ':')
+			return -1;
+	}
+
+	path->name = end + 1;
+
+	return 0;
 }
 
-static void rfsctl_put_path(struct rfsctl_path *path)
+/*
+ * All paths are kept in one block. It starts with the NULL terminated array
+ * of pointers, followed by the path structures and a copy of the records the
+ * names point into. So the whole block is released by one free.
+ */
+static int rfsctl_parse_paths(struct rfsctl_filter *flt, const char *buf,
+		int size, int stats)
 {
-	if (!path)
-		return;
+	struct rfsctl_path *path;
+	char *data;
+	int off;
+	int nr = 0;
+	int i;
 
-	free(path->name);
-	free(path);
+	for (off = 0; off < size; off += strlen(buf + off) + 1)
+		nr++;
+
+	flt->paths = malloc(sizeof(struct rfsctl_path *) * (nr + 1) +
+			sizeof(struct rfsctl_path) * nr + size + 1);
+	if (!flt->paths)
+		return -1;
+
+	path = (struct rfsctl_path *)(flt->paths + nr + 1);
+	data = (char *)(path + nr);
+	memcpy(data, buf, size);
+	data[size] = 0;
+
+	for (i = 0, off = 0; i < nr; i++, off += strlen(data + off) + 1) {
+		flt->paths[i] = NULL;
+
+		if (rfsctl_parse_path(data + off, path + i, stats)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		flt->paths[i] = path + i;
+	}
+
+	flt->paths[nr] = NULL;
+
+	return 0;
 }
 
 static struct rfsctl_filter *rfsctl_alloc_filter(const char *name)
@@ -87,15 +144,6 @@ static struct rfsctl_filter *rfsctl_alloc_filter(const char *name)
 
 static void rfsctl_free_filter(struct rfsctl_filter *flt)
 {
-	int i = 0;
-
-	if (flt->paths) {
-		while (flt->paths[i]) {
-			rfsctl_put_path(flt->paths[i]);
-			i++;
-		}
-	}
-
 	free(flt->paths);
 	free(flt->name);
 	free(flt);
@@ -244,17 +292,13 @@ static int rfsctl_set_filter_active(struct rfsctl_filter *flt)
 
 static int rfsctl_set_filter_paths(struct rfsctl_filter *flt)
 {
-	struct rfsctl_path *path;
-	struct rfsctl_path **paths;
-	int off = 0;
 	int rv = -1;
-	int i = 0;
 	char *buf;
 	int rb;
 	long page_size;
 
 	page_size = sysconf(_SC_PAGESIZE);
-	buf = malloc(sizeof(char) * page_size);
+	buf = malloc(sizeof(char) * (page_size + 1));
 	if (!buf)
 		return -1;
 
@@ -262,37 +306,49 @@ static int rfsctl_set_filter_paths(struct rfsctl_filter *flt)
 	if (rb == -1)
 		goto exit;
 
-	flt->paths = malloc(sizeof(struct rfsctl_path *));
-	if (!flt->paths)
-		goto exit;
+	buf[rb] = 0;
 
-	flt->paths[0] = NULL;
+	rv = rfsctl_parse_paths(flt, buf, rb, 0);
+exit:
+	free(buf);
+	return rv;
+}
 
-	if (rb == 0) {
-		rv = 0;
-		goto exit;
-	}
+/*
+ * The snapshot attribute returns the priority, the active state and all
+ * paths with their statistics in one read. The first record is
+ * "priority:active", each of the following ones
+ * "type:id:rdentries:lazy:lazy_nr:name".
+ */
+static int rfsctl_set_filter_snapshot(struct rfsctl_filter *flt)
+{
+	int rv = -1;
+	char *buf;
+	int off;
+	int rb;
+	long page_size;
 
-	while (off < rb) {
-		path = rfsctl_get_path(buf + off);
-		if (!path)
-			goto exit;
+	page_size = sysconf(_SC_PAGESIZE);
+	buf = malloc(sizeof(char) * (page_size + 1));
+	if (!buf)
+		return -1;
 
-		paths = realloc(flt->paths,
-				sizeof(struct rfsctl_path *) * (i + 2));
-		if (!paths) {
-			rfsctl_put_path(path);
-			goto exit;;
-		}
+	rb = rfsctl_read_data(flt->name, "snapshot", buf, page_size);
+	if (rb == -1)
+		goto exit;
 
-		flt->paths = paths;
-		flt->paths[i++] = path;
-		flt->paths[i] = NULL;
-		
-		off += strlen(buf + off) + 1;
+	buf[rb] = 0;
+
+	if (sscanf(buf, "%d:%d", &flt->priority, &flt->active) != 2) {
+		errno = EINVAL;
+		goto exit;
 	}
 
-	rv = 0;
+	off = strlen(buf) + 1;
+	if (off > rb)
+		off = rb;
+
+	rv = rfsctl_parse_paths(flt, buf + off, rb - off, 1);
 exit:
 	free(buf);
 	return rv;
@@ -312,6 +368,14 @@ struct rfsctl_filter *rfsctl_get_filter(const char *name)
 	if (!flt)
 		return NULL;
 
+	rv = rfsctl_set_filter_snapshot(flt);
+	if (!rv)
+		return flt;
+
+	/* redirfs without the snapshot attribute */
+	if (errno != ENOENT)
+		goto error;
+
 	rv = rfsctl_set_filter_priority(flt);
 	if (rv)
 		goto error;
@@ -381,6 +445,7 @@ struct rfsctl_filter **rfsctl_get_filters(void)
 		flts[i] = NULL;
 	}
 
+	closedir(dir);
 	return flts;
 }
 
@@ -442,6 +507,78 @@ int rfsctl_add_path(const char *name, const char *path, int type)
 	return 0;
 }
 
+/*
+ * Paths are sent to redirfs in batches fitting into one page. Each batch is
+ * added atomically, so on error only paths from the failed batch are not
+ * added at all.
+ */
+int rfsctl_add_paths(const char *name, const char **paths, const int *types,
+		int nr)
+{
+	char *buf;
+	int size;
+	int len;
+	int i;
+	char t;
+	long page_size;
+
+	if (!name || !paths || !types || nr <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	page_size = sysconf(_SC_PAGESIZE);
+	buf = malloc(sizeof(char) * page_size);
+	if (!buf)
+		return -1;
+
+	len = snprintf(buf, page_size, "b");
+
+	for (i = 0; i < nr; i++) {
+		if (!paths[i]) {
+			free(buf);
+			errno = EINVAL;
+			return -1;
+		}
+
+		if (types[i] == RFSCTL_PATH_INCLUDE)
+			t = 'i';
+		else if (types[i] == RFSCTL_PATH_EXCLUDE)
+			t = 'e';
+		else {
+			free(buf);
+			errno = EINVAL;
+			return -1;
+		}
+
+		size = strlen(paths[i]) + 3; /* \n + type + : */
+		if (size + 2 > page_size) {
+			free(buf);
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		if (len + size + 1 > page_size) {
+			if (rfsctl_write_data(name, "paths", buf, len + 1) == -1) {
+				free(buf);
+				return -1;
+			}
+			len = snprintf(buf, page_size, "b");
+		}
+
+		len += snprintf(buf + len, page_size - len, "\n%c:%s", t,
+				paths[i]);
+	}
+
+	if (rfsctl_write_data(name, "paths", buf, len + 1) == -1) {
+		free(buf);
+		return -1;
+	}
+
+	free(buf);
+	return 0;
+}
+
 int rfsctl_rem_path(const char *name, int id)
 {
 	char buf[256];
@@ -11,10 +11,18 @@
 #define RFSCTL_PATH_INCLUDE	1
 #define RFSCTL_PATH_EXCLUDE	2
 
+#define RFSCTL_LAZY_NONE	0
+#define RFSCTL_LAZY_PENDING	1
+#define RFSCTL_LAZY_DONE	2
+
 struct rfsctl_path {
 	int type;
 	int id;
 	char *name;
+	/* the statistics are -1 if not provided by redirfs */
+	int rdentries;
+	int lazy;
+	long lazy_nr;
 };
 
 struct rfsctl_filter {
@@ -29,6 +37,8 @@ void rfsctl_put_filter(struct rfsctl_filter *filter);
 struct rfsctl_filter **rfsctl_get_filters(void);
 void rfsctl_put_filters(struct rfsctl_filter **filters);
 int rfsctl_add_path(const char *name, const char *path, int type);
+int rfsctl_add_paths(const char *name, const char **paths, const int *types,
+		int nr);
 int rfsctl_rem_path(const char *name, int id);
 int rfsctl_rem_path_name(const char *name, const char *path);
 int rfsctl_del_paths(const char *name);
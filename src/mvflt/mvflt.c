@@ -22,125 +22,244 @@
  */
 
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#include <linux/time.h>
 #include <redirfs.h>
 
-#define MVFLT_VERSION "0.0"
+#define MVFLT_VERSION "0.1"
+
+/*
+ * Each rename seen by the filter is recorded to a ring of the cpu it runs
+ * on. A ring has one writer, the rename on its cpu with the preemption
+ * disabled, so no lock is needed. The oldest records are overwritten when
+ * the ring is full. The writer clears the record's seq before it changes
+ * the record and sets it afterwards, so the reader drops records which
+ * were overwritten while it copied them.
+ *
+ * Records are read and consumed via the "renames" sysfs attribute, which
+ * is readable by root only, as a read empties the rings. Each
+ * record is "cpu:seq:time:dir:call:old_id:new_id:old_name/new_name" where
+ * dir is 'o' for renames of dentries under the filter's paths and 'i' for
+ * dentries moved into them, call is 'p' for precall and 'o' for postcall
+ * and the ids are of the paths of the old and new dentry (-1 if none).
+ * The last record is "lost:nr" with the number of records overwritten
+ * before they were read.
+ */
+#define MVFLT_RING_NR	256
+#define MVFLT_NAME_LEN	48
+#define MVFLT_REC_SIZE	(2 * MVFLT_NAME_LEN + 96)
+
+struct mvflt_rec {
+	unsigned long seq;
+	u64 time;
+	int old_id;
+	int new_id;
+	char dir;
+	char call;
+	char old_name[MVFLT_NAME_LEN];
+	char new_name[MVFLT_NAME_LEN];
+};
+
+struct mvflt_ring {
+	unsigned long head;
+	unsigned long tail;
+	struct mvflt_rec *recs;
+};
 
 static redirfs_filter mvflt;
+static struct mvflt_ring *mvflt_rings;
+static unsigned long mvflt_lost;
+static DEFINE_MUTEX(mvflt_ring_mutex);
 
-enum redirfs_rv mvflt_rename_out(redirfs_context context,
-		struct redirfs_args *args)
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,16))
+static inline u64 mvflt_clock(void)
 {
-	char *filename;
-	char *call;
-	redirfs_root root;
-	redirfs_path path;
-	redirfs_path* paths;
-	struct redirfs_path_info *path_info;
-	int rv;
+	return ktime_to_ns(ktime_get());
+}
+#else
+static inline u64 mvflt_clock(void)
+{
+	struct timeval tv;
 
-	filename = NULL;
-	path_info = NULL;
-	call = args->type.call == REDIRFS_PRECALL ? "precall" : "postcall";
+	do_gettimeofday(&tv);
 
-	root = redirfs_get_root_dentry(mvflt, args->args.i_rename.old_dentry);
-	if (!root) {
-		printk(KERN_WARNING "mvflt: redirfs_get_root_dentry: NULL\n");
-		return REDIRFS_CONTINUE;
-	}
+	return (u64)tv.tv_sec * NSEC_PER_SEC + tv.tv_usec * NSEC_PER_USEC;
+}
+#endif
 
-	paths = redirfs_get_paths_root(mvflt, root);
-	path = paths[0];
-	if (!path) {
-		printk(KERN_WARNING "mvflt: redirfs_get_paths_root: NULL\n");
-		goto exit;
-	}
+static void mvflt_get_name(struct dentry *dentry, char *buf)
+{
+	spin_lock(&dentry->d_lock);
+	strlcpy(buf, (const char *)dentry->d_name.name, MVFLT_NAME_LEN);
+	spin_unlock(&dentry->d_lock);
+}
 
-	path_info = redirfs_get_path_info(mvflt, path);
-	if (IS_ERR(path_info)) {
-		printk(KERN_ERR "mvflt: redirfs_get_path_info failed(%ld)\n",
-				PTR_ERR(path_info));
-		goto exit;
-	}
+static int mvflt_get_id(struct dentry *dentry)
+{
+	int id;
 
-	filename = kzalloc(sizeof(char) * PAGE_SIZE, GFP_KERNEL);
-	if (!filename) {
-		printk(KERN_WARNING "mvflt: filename allocation failed\n");
-		goto exit;
-	}
+	id = redirfs_get_id_dentry(mvflt, dentry);
+	if (id < 0)
+		return -1;
 
-	rv = redirfs_get_filename(path_info->mnt,
-			args->args.i_rename.old_dentry, filename, PAGE_SIZE);
-	if (rv) {
-		printk(KERN_ERR "mvflt: redirfs_get_filename failed(%d)\n", rv);
-		goto exit;
-	}
+	return id;
+}
 
-	printk(KERN_ALERT "mvflt: move out: %s: %s\n", call, filename);
-exit:
-	kfree(filename);
-	redirfs_put_path_info(path_info);
-	redirfs_put_paths(paths);
-	redirfs_put_root(root);
+static void mvflt_record(char dir, struct redirfs_args *args)
+{
+	struct mvflt_ring *ring;
+	struct mvflt_rec *rec;
+	unsigned long head;
+	int old_id;
+	int new_id;
+
+	/*
+	 * The ids are looked up before get_cpu(), redirfs_get_id_dentry()
+	 * takes the srcu read lock and might sleep.
+	 */
+	old_id = mvflt_get_id(args->args.i_rename.old_dentry);
+	new_id = mvflt_get_id(args->args.i_rename.new_dentry);
+
+	ring = per_cpu_ptr(mvflt_rings, get_cpu());
+	head = ring->head;
+	rec = &ring->recs[head & (MVFLT_RING_NR - 1)];
+
+	rec->seq = 0;
+	smp_wmb();
+
+	rec->time = mvflt_clock();
+	rec->old_id = old_id;
+	rec->new_id = new_id;
+	rec->dir = dir;
+	rec->call = args->type.call == REDIRFS_PRECALL ? 'p' : 'o';
+	mvflt_get_name(args->args.i_rename.old_dentry, rec->old_name);
+	mvflt_get_name(args->args.i_rename.new_dentry, rec->new_name);
+
+	smp_wmb();
+	rec->seq = head + 1;
+	ring->head = head + 1;
+	put_cpu();
+}
+
+enum redirfs_rv mvflt_rename_out(redirfs_context context,
+		struct redirfs_args *args)
+{
+	mvflt_record('o', args);
 	return REDIRFS_CONTINUE;
 }
 
 enum redirfs_rv mvflt_rename_in(redirfs_context context,
 		struct redirfs_args *args)
 {
-	char *filename;
-	char *call;
-	redirfs_root root;
-	redirfs_path path;
-	redirfs_path* paths;
-	struct redirfs_path_info *path_info;
-	int rv;
+	mvflt_record('i', args);
+	return REDIRFS_CONTINUE;
+}
+
+static int mvflt_ring_read(struct mvflt_ring *ring, struct mvflt_rec *rec)
+{
+	struct mvflt_rec *slot;
+	unsigned long seq;
 
-	filename = NULL;
-	path_info = NULL;
-	call = args->type.call == REDIRFS_PRECALL ? "precall" : "postcall";
+	slot = &ring->recs[ring->tail & (MVFLT_RING_NR - 1)];
 
-	root = redirfs_get_root_dentry(mvflt, args->args.i_rename.new_dentry);
-	if (!root) {
-		printk(KERN_WARNING "mvflt: redirfs_get_root_dentry: NULL\n");
-		return REDIRFS_CONTINUE;
-	}
+	seq = ACCESS_ONCE(slot->seq);
+	smp_rmb();
+	memcpy(rec, slot, sizeof(struct mvflt_rec));
+	smp_rmb();
 
-	paths = redirfs_get_paths_root(mvflt, root);
-	path = paths[0];
-	if (!path) {
-		printk(KERN_WARNING "mvflt: redirfs_get_paths_root: NULL\n");
-		goto exit;
-	}
+	if (seq != ring->tail + 1 || ACCESS_ONCE(slot->seq) != seq)
+		return -1;
 
-	path_info = redirfs_get_path_info(mvflt, path);
-	if (IS_ERR(path_info)) {
-		printk(KERN_ERR "mvflt: redirfs_get_path_info failed(%ld)\n",
-				PTR_ERR(path_info));
-		goto exit;
-	}
+	return 0;
+}
 
-	filename = kzalloc(sizeof(char) * PAGE_SIZE, GFP_KERNEL);
-	if (!filename) {
-		printk(KERN_WARNING "mvflt: filename allocation failed\n");
-		goto exit;
-	}
+static ssize_t mvflt_renames_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	struct mvflt_ring *ring;
+	struct mvflt_rec rec;
+	unsigned long head;
+	ssize_t size = 0;
+	int cpu;
 
-	rv = redirfs_get_filename(path_info->mnt,
-			args->args.i_rename.new_dentry, filename, PAGE_SIZE);
-	if (rv) {
-		printk(KERN_ERR "mvflt: redirfs_get_filename failed(%d)\n", rv);
-		goto exit;
+	mutex_lock(&mvflt_ring_mutex);
+
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(mvflt_rings, cpu);
+		head = ACCESS_ONCE(ring->head);
+		smp_rmb();
+
+		if (head - ring->tail > MVFLT_RING_NR) {
+			mvflt_lost += head - ring->tail - MVFLT_RING_NR;
+			ring->tail = head - MVFLT_RING_NR;
+		}
+
+		for (; ring->tail != head; ring->tail++) {
+			if (size + MVFLT_REC_SIZE + 32 > PAGE_SIZE)
+				goto exit;
+
+			if (mvflt_ring_read(ring, &rec)) {
+				mvflt_lost++;
+				continue;
+			}
+
+			size += snprintf(buf + size, PAGE_SIZE - size,
+					"%d:%lu:%llu:%c:%c:%d:%d:%s/%s", cpu,
+					rec.seq, (unsigned long long)rec.time,
+					rec.dir, rec.call, rec.old_id,
+					rec.new_id, rec.old_name,
+					rec.new_name) + 1;
+		}
 	}
 
-	printk(KERN_ALERT "mvflt: move in: %s: %s\n", call, filename);
 exit:
-	kfree(filename);
-	redirfs_put_path_info(path_info);
-	redirfs_put_paths(paths);
-	redirfs_put_root(root);
-	return REDIRFS_CONTINUE;
+	size += snprintf(buf + size, PAGE_SIZE - size, "lost:%lu",
+			mvflt_lost) + 1;
+	mvflt_lost = 0;
+
+	mutex_unlock(&mvflt_ring_mutex);
+
+	return size;
+}
+
+static struct redirfs_filter_attribute mvflt_renames_attr =
+	REDIRFS_FILTER_ATTRIBUTE(renames, 0400, mvflt_renames_show, NULL);
+
+static void mvflt_rings_free(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		vfree(per_cpu_ptr(mvflt_rings, cpu)->recs);
+
+	free_percpu(mvflt_rings);
+}
+
+static int mvflt_rings_alloc(void)
+{
+	struct mvflt_ring *ring;
+	int cpu;
+
+	mvflt_rings = alloc_percpu(struct mvflt_ring);
+	if (!mvflt_rings)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(mvflt_rings, cpu);
+		ring->head = 0;
+		ring->tail = 0;
+		ring->recs = vmalloc(sizeof(struct mvflt_rec) * MVFLT_RING_NR);
+		if (!ring->recs) {
+			mvflt_rings_free();
+			return -ENOMEM;
+		}
+
+		memset(ring->recs, 0, sizeof(struct mvflt_rec) * MVFLT_RING_NR);
+	}
 
+	return 0;
 }
 
 struct redirfs_filter_operations mvflt_ops = {
@@ -166,10 +285,17 @@ static int __init mvflt_init(void)
 	int err;
 	int rv;
 
+	rv = mvflt_rings_alloc();
+	if (rv) {
+		printk(KERN_ERR "mvflt: rings allocation failed(%d)\n", rv);
+		return rv;
+	}
+
 	mvflt = redirfs_register_filter(&mvflt_info);
 	if (IS_ERR(mvflt)) {
 		rv = PTR_ERR(mvflt);
 		printk(KERN_ERR "mvflt: register filter failed(%d)\n", rv);
+		mvflt_rings_free();
 		return rv;
 	}
 
@@ -179,6 +305,12 @@ static int __init mvflt_init(void)
 		goto error;
 	}
 
+	rv = redirfs_create_attribute(mvflt, &mvflt_renames_attr);
+	if (rv) {
+		printk(KERN_ERR "mvflt: create attribute failed(%d)\n", rv);
+		goto error;
+	}
+
 	printk(KERN_INFO "Move/Rename Filter Version "
 			MVFLT_VERSION " <www.redirfs.org>\n");
 	return 0;
@@ -190,12 +322,14 @@ error:
 		return 0;
 	}
 	redirfs_delete_filter(mvflt);
+	mvflt_rings_free();
 	return rv;
 }
 
 static void __exit mvflt_exit(void)
 {
 	redirfs_delete_filter(mvflt);
+	mvflt_rings_free();
 }
 
 module_init(mvflt_init);
@@ -204,4 +338,3 @@ module_exit(mvflt_exit);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Frantisek Hrbata <frantisek.hrbata@redirfs.org>");
 MODULE_DESCRIPTION("Move/Rename Filter Version " MVFLT_VERSION "<www.redirfs.org>");
-
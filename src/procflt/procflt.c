@@ -1,5 +1,5 @@
 /*
- * ProcFlt: Read-Only Filter
+ * ProcFlt: Process Hiding Filter
  * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
  *
  * Copyright 2008 - 2010 Frantisek Hrbata
@@ -21,100 +21,407 @@
  * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/dcache.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26))
+#include <linux/rculist.h>
+#endif
+#include <redirfs.h>
 
-#include "../redirfs/redirfs.h"
+#define PROCFLT_VERSION "0.2"
 
-static rfs_filter procflt;
-static struct rfs_path_info path_info;
-static filldir_t filldir_orig = NULL;
-static char *pidstr = "-1";
+/*
+ * Entries of directories read through the filter are hidden if their names
+ * are in the hide set, usually pids of processes under /proc. The filter
+ * is attached to /proc by rfsctl. The set is a hash table of names, the
+ * readers look names up under RCU and the changes done via the "hide"
+ * sysfs attribute are serialized by procflt_mutex. The original dirent and
+ * filldir are kept in the context scratch area of the readdir call, so
+ * concurrent readdirs do not share any state.
+ */
+#define PROCFLT_HASH_BITS 8
+#define PROCFLT_HASH_SIZE (1 << PROCFLT_HASH_BITS)
 
-enum rfs_retv procflt_readdir(rfs_context context, struct rfs_args *args);
+struct procflt_name {
+	struct hlist_node hash;
+	struct rcu_head rcu;
+	unsigned int key;
+	int len;
+	char name[0];
+};
 
-static struct rfs_filter_info flt_info = {"procflt", 99, 0};
+struct procflt_dirent {
+	void *dirent;
+	filldir_t filldir;
+};
 
-static struct rfs_op_info op_info[] = {
-	{RFS_DIR_FOP_READDIR, procflt_readdir, NULL},
-	{RFS_OP_END, NULL, NULL}
+/* used only if redirfs has no scratch slot left for the filter */
+struct procflt_data {
+	struct redirfs_data rfs_data;
+	struct procflt_dirent pd;
 };
 
-static int procflt_filldir(void *__buf, const char *name, int namlen, loff_t offset, u64 ino, unsigned int d_type)
+static redirfs_filter procflt;
+static struct hlist_head procflt_hash[PROCFLT_HASH_SIZE];
+static atomic_t procflt_hidden = ATOMIC_INIT(0);
+static DEFINE_MUTEX(procflt_mutex);
+static char *pidstr = NULL;
+
+static struct procflt_name *procflt_find(const char *name, int len,
+		unsigned int key)
 {
-	int len;
+	struct procflt_name *pn;
+	struct hlist_node *pos;
+	struct hlist_head *head;
+
+	head = &procflt_hash[hash_long(key, PROCFLT_HASH_BITS)];
+
+	hlist_for_each_entry_rcu(pn, pos, head, hash) {
+		if (pn->key == key && pn->len == len &&
+				!memcmp(pn->name, name, len))
+			return pn;
+	}
+
+	return NULL;
+}
+
+static int procflt_add(const char *name, int len)
+{
+	struct procflt_name *pn;
+	unsigned int key;
+
+	key = full_name_hash((const unsigned char *)name, len);
 
-	len = strlen(pidstr);
-	if (len != namlen)
-		return filldir_orig(__buf, name, namlen, offset, ino, d_type);
+	mutex_lock(&procflt_mutex);
 
-	if (!strncmp(pidstr, name, namlen))
+	if (procflt_find(name, len, key)) {
+		mutex_unlock(&procflt_mutex);
 		return 0;
+	}
+
+	pn = kmalloc(sizeof(struct procflt_name) + len + 1, GFP_KERNEL);
+	if (!pn) {
+		mutex_unlock(&procflt_mutex);
+		return -ENOMEM;
+	}
+
+	pn->key = key;
+	pn->len = len;
+	memcpy(pn->name, name, len);
+	pn->name[len] = 0;
+
+	hlist_add_head_rcu(&pn->hash,
+			&procflt_hash[hash_long(key, PROCFLT_HASH_BITS)]);
+	atomic_inc(&procflt_hidden);
+
+	mutex_unlock(&procflt_mutex);
+
+	return 0;
+}
+
+static void procflt_name_free(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, struct procflt_name, rcu));
+}
+
+static void procflt_del(struct procflt_name *pn)
+{
+	hlist_del_rcu(&pn->hash);
+	atomic_dec(&procflt_hidden);
+	call_rcu(&pn->rcu, procflt_name_free);
+}
+
+static int procflt_rem(const char *name, int len)
+{
+	struct procflt_name *pn;
+	unsigned int key;
+
+	key = full_name_hash((const unsigned char *)name, len);
+
+	mutex_lock(&procflt_mutex);
+
+	pn = procflt_find(name, len, key);
+	if (!pn) {
+		mutex_unlock(&procflt_mutex);
+		return -ENOENT;
+	}
+
+	procflt_del(pn);
+
+	mutex_unlock(&procflt_mutex);
+
+	return 0;
+}
+
+static void procflt_clear(void)
+{
+	struct procflt_name *pn;
+	struct hlist_node *pos;
+	struct hlist_node *tmp;
+	int i;
+
+	mutex_lock(&procflt_mutex);
+
+	for (i = 0; i < PROCFLT_HASH_SIZE; i++) {
+		hlist_for_each_entry_safe(pn, pos, tmp, &procflt_hash[i], hash)
+			procflt_del(pn);
+	}
+
+	mutex_unlock(&procflt_mutex);
+}
+
+static int procflt_filldir(void *buf, const char *name, int namlen,
+		loff_t offset, u64 ino, unsigned int d_type)
+{
+	struct procflt_dirent *pd = buf;
+	struct procflt_name *pn;
+
+	rcu_read_lock();
+	pn = procflt_find(name, namlen,
+			full_name_hash((const unsigned char *)name, namlen));
+	rcu_read_unlock();
+
+	if (pn)
+		return 0;
+
+	return pd->filldir(pd->dirent, name, namlen, offset, ino, d_type);
+}
+
+static void procflt_data_free(struct redirfs_data *rfs_data)
+{
+	kfree(container_of(rfs_data, struct procflt_data, rfs_data));
+}
+
+static struct procflt_dirent *procflt_attach_dirent(redirfs_context context)
+{
+	struct procflt_data *data;
+	struct redirfs_data *rfs_data;
+
+	data = kzalloc(sizeof(struct procflt_data), GFP_KERNEL);
+	if (!data)
+		return NULL;
+
+	if (redirfs_init_data(&data->rfs_data, procflt, procflt_data_free,
+				NULL)) {
+		kfree(data);
+		return NULL;
+	}
+
+	rfs_data = redirfs_attach_data_context(procflt, context,
+			&data->rfs_data);
+	redirfs_put_data(&data->rfs_data);
+	if (!rfs_data)
+		return NULL;
+
+	redirfs_put_data(rfs_data);
 
-	return filldir_orig(__buf, name, namlen, offset, ino, d_type);
+	return &container_of(rfs_data, struct procflt_data, rfs_data)->pd;
 }
 
-enum rfs_retv procflt_readdir(rfs_context context, struct rfs_args *args)
+static enum redirfs_rv procflt_readdir_pre(redirfs_context context,
+		struct redirfs_args *args)
 {
-	filldir_orig = args->args.f_readdir.filldir;
+	struct procflt_dirent *pd;
+
+	if (!atomic_read(&procflt_hidden))
+		return REDIRFS_CONTINUE;
+
+	pd = redirfs_context_scratch(procflt, context);
+	if (!pd)
+		pd = procflt_attach_dirent(context);
+
+	if (!pd) {
+		args->rv.rv_int = -ENOMEM;
+		return REDIRFS_STOP;
+	}
+
+	pd->dirent = args->args.f_readdir.dirent;
+	pd->filldir = args->args.f_readdir.filldir;
+	args->args.f_readdir.dirent = pd;
 	args->args.f_readdir.filldir = procflt_filldir;
 
-	return RFS_CONTINUE;
+	return REDIRFS_CONTINUE;
 }
 
-static int __init procflt_init(void)
+static enum redirfs_rv procflt_readdir_post(redirfs_context context,
+		struct redirfs_args *args)
 {
-	enum rfs_err err;
+	struct procflt_dirent *pd;
+	struct redirfs_data *rfs_data;
 
-	err = rfs_register_filter(&procflt, &flt_info);
-	if (err != RFS_ERR_OK) {
-		printk(KERN_ERR "procflt: register filter failed: error %d\n", err);
-		goto error;
+	if (args->args.f_readdir.filldir != procflt_filldir)
+		return REDIRFS_CONTINUE;
+
+	pd = args->args.f_readdir.dirent;
+	args->args.f_readdir.dirent = pd->dirent;
+	args->args.f_readdir.filldir = pd->filldir;
+
+	rfs_data = redirfs_detach_data_context(procflt, context);
+	if (rfs_data)
+		redirfs_put_data(rfs_data);
+
+	return REDIRFS_CONTINUE;
+}
+
+static ssize_t procflt_hide_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	struct procflt_name *pn;
+	struct hlist_node *pos;
+	ssize_t size = 0;
+	int i;
+
+	mutex_lock(&procflt_mutex);
+
+	for (i = 0; i < PROCFLT_HASH_SIZE && size < PAGE_SIZE; i++) {
+		hlist_for_each_entry(pn, pos, &procflt_hash[i], hash) {
+			size += snprintf(buf + size, PAGE_SIZE - size, "%s",
+					pn->name) + 1;
+
+			if (size >= PAGE_SIZE) {
+				size = PAGE_SIZE;
+				break;
+			}
+		}
 	}
 
-	err = rfs_set_operations(procflt, op_info); 
-	if (err != RFS_ERR_OK) {
-		printk(KERN_ERR "procflt: set operations failed: error %d\n", err);
-		goto error;
+	mutex_unlock(&procflt_mutex);
+
+	return size;
+}
+
+/*
+ * "a:name" adds and "r:name" removes names, more names can be separated by
+ * new lines. "clear" clears the whole set.
+ */
+static ssize_t procflt_hide_store(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, const char *buf,
+		size_t count)
+{
+	const char *end = buf + count;
+	const char *name;
+	int len;
+	int rv;
+
+	if (count >= 5 && !strncmp(buf, "clear", 5) &&
+	    (count == 5 || buf[5] == '\n' || !buf[5])) {
+		procflt_clear();
+		return count;
+	}
+
+	if (count < 3 || buf[1] != ':' || (buf[0] != 'a' && buf[0] != 'r'))
+		return -EINVAL;
+
+	for (name = buf + 2; name < end && *name; name += len + 1) {
+		for (len = 0; name + len < end && name[len] &&
+				name[len] != '\n'; len++)
+			;
+
+		if (!len)
+			continue;
+
+		if (len > NAME_MAX)
+			return -ENAMETOOLONG;
+
+		if (buf[0] == 'a')
+			rv = procflt_add(name, len);
+		else
+			rv = procflt_rem(name, len);
+
+		if (rv)
+			return rv;
+	}
+
+	return count;
+}
+
+static struct redirfs_filter_attribute procflt_hide_attr =
+	REDIRFS_FILTER_ATTRIBUTE(hide, 0644, procflt_hide_show,
+			procflt_hide_store);
+
+static struct redirfs_filter_info procflt_info = {
+	.owner = THIS_MODULE,
+	.name = "procflt",
+	.priority = 700000000,
+	.active = 1
+};
+
+static struct redirfs_op_info procflt_op_info[] = {
+	{REDIRFS_DIR_FOP_READDIR, procflt_readdir_pre, procflt_readdir_post},
+	{REDIRFS_OP_END, NULL, NULL}
+};
+
+static int __init procflt_init(void)
+{
+	int err;
+	int rv;
+
+	BUILD_BUG_ON(sizeof(struct procflt_dirent) >
+			REDIRFS_CONTEXT_SCRATCH_SIZE);
+
+	if (pidstr) {
+		rv = procflt_add(pidstr, strlen(pidstr));
+		if (rv)
+			return rv;
 	}
 
-	path_info.path = "/proc";
-	path_info.flags = RFS_PATH_INCLUDE | RFS_PATH_SINGLE;
+	procflt = redirfs_register_filter(&procflt_info);
+	if (IS_ERR(procflt)) {
+		rv = PTR_ERR(procflt);
+		printk(KERN_ERR "procflt: register filter failed(%d)\n", rv);
+		goto err_clear;
+	}
 
-	err = rfs_set_path(procflt, &path_info); 
-	if (err != RFS_ERR_OK) {
-		printk(KERN_ERR "procflt: set path failed: error %d\n", err);
+	rv = redirfs_set_operations(procflt, procflt_op_info);
+	if (rv) {
+		printk(KERN_ERR "procflt: set operations failed(%d)\n", rv);
 		goto error;
 	}
 
-	err = rfs_activate_filter(procflt); 
-	if (err != RFS_ERR_OK) {
-		printk(KERN_ERR "procflt: activate filter failed: error %d\n", err);
+	rv = redirfs_create_attribute(procflt, &procflt_hide_attr);
+	if (rv) {
+		printk(KERN_ERR "procflt: create attribute failed(%d)\n", rv);
 		goto error;
 	}
 
+	printk(KERN_INFO "Process Hiding Filter Version "
+			PROCFLT_VERSION " <www.redirfs.org>\n");
 	return 0;
 
 error:
-	if (rfs_unregister_filter(procflt))
-		printk(KERN_ERR "procflt: unregister filter failed: error %d\n", err);
+	err = redirfs_unregister_filter(procflt);
+	if (err) {
+		printk(KERN_ERR "procflt: unregister filter "
+				"failed(%d)\n", err);
+		return 0;
+	}
+
+	redirfs_delete_filter(procflt);
+err_clear:
+	procflt_clear();
+	rcu_barrier();
 
-	return err;
+	return rv;
 }
 
 static void __exit procflt_exit(void)
 {
-	enum rfs_err err;
-	
-	err = rfs_unregister_filter(procflt);
-	if (err != RFS_ERR_OK)
-		printk(KERN_ERR "procflt: unregistration failed: error %d\n", err);
+	redirfs_delete_filter(procflt);
+	procflt_clear();
+	rcu_barrier();
 }
 
 module_init(procflt_init);
 module_exit(procflt_exit);
 
 module_param(pidstr, charp, 0000);
-MODULE_PARM_DESC(pidstr, "pid string to hide");
+MODULE_PARM_DESC(pidstr, "name to hide when the filter is loaded");
 
 MODULE_LICENSE("GPL");
-MODULE_AUTHOR("Frantisek Hrbata <franta@redirfs.org>");
-MODULE_DESCRIPTION("Filter for process hiding");
+MODULE_AUTHOR("Frantisek Hrbata <frantisek.hrbata@redirfs.org>");
+MODULE_DESCRIPTION("Process Hiding Filter Version " PROCFLT_VERSION
+		" <www.redirfs.org>");
@@ -38,6 +38,7 @@
 
 #define REDIRFS_PATH_INCLUDE		1
 #define REDIRFS_PATH_EXCLUDE		2
+#define REDIRFS_PATH_LAZY		4
 
 #define REDIRFS_FILTER_ATTRIBUTE(__name, __mode, __show, __store) \
 	__ATTR(__name, __mode, __show, __store)
@@ -139,13 +140,17 @@ enum redirfs_op_id {
 
 	REDIRFS_REG_FOP_OPEN,
 	REDIRFS_REG_FOP_RELEASE,
-	/* REDIRFS_REG_FOP_LLSEEK, */
-	/* REDIRFS_REG_FOP_READ, */
-	/* REDIRFS_REG_FOP_WRITE, */
-	/* REDIRFS_REG_FOP_AIO_READ, */
-	/* REDIRFS_REG_FOP_AIO_WRITE, */
-	/* REDIRFS_REG_FOP_MMAP, */
-	/* REDIRFS_REG_FOP_FLUSH, */
+	REDIRFS_REG_FOP_LLSEEK,
+	REDIRFS_REG_FOP_READ,
+	REDIRFS_REG_FOP_WRITE,
+	REDIRFS_REG_FOP_AIO_READ,
+	REDIRFS_REG_FOP_AIO_WRITE,
+	REDIRFS_REG_FOP_MMAP,
+	REDIRFS_REG_FOP_FLUSH,
+	REDIRFS_REG_FOP_FSYNC,
+	REDIRFS_REG_FOP_SPLICE_READ,
+	REDIRFS_REG_FOP_SPLICE_WRITE,
+	REDIRFS_REG_FOP_SENDFILE,
 
 	REDIRFS_DIR_FOP_OPEN,
 	REDIRFS_DIR_FOP_RELEASE,
@@ -188,10 +193,10 @@ enum redirfs_op_id {
 	/* REDIRFS_LNK_FOP_AIO_WRITE, */
 	/* REDIRFS_LNK_FOP_FLUSH, */
 
-	/* REDIRFS_REG_AOP_READPAGE, */
-	/* REDIRFS_REG_AOP_WRITEPAGE, */
-	/* REDIRFS_REG_AOP_READPAGES, */
-	/* REDIRFS_REG_AOP_WRITEPAGES, */
+	REDIRFS_REG_AOP_READPAGE,
+	REDIRFS_REG_AOP_WRITEPAGE,
+	REDIRFS_REG_AOP_READPAGES,
+	REDIRFS_REG_AOP_WRITEPAGES,
 	/* REDIRFS_REG_AOP_SYNC_PAGE, */
 	/* REDIRFS_REG_AOP_SET_PAGE_DIRTY, */
 	/* REDIRFS_REG_AOP_PREPARE_WRITE, */
@@ -332,6 +337,8 @@ union redirfs_op_args {
 		struct dentry *old_dentry;
 		struct inode *new_dir;
 		struct dentry *new_dentry;
+		const struct qstr *old_name;
+		const struct qstr *new_name;
 	} i_rename;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,27)
@@ -373,19 +380,51 @@ union redirfs_op_args {
 		struct file *file;
 	} f_release;
 
-	/*
 	struct {
 		struct file *file;
 		fl_owner_t id;
 	} f_flush;
-	*/
 
-	/*
+	struct {
+		struct file *file;
+		struct dentry *dentry;
+		loff_t start;
+		loff_t end;
+		int datasync;
+	} f_fsync;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,17)
+	struct {
+		struct file *file;
+		loff_t *pos;
+		struct pipe_inode_info *pipe;
+		size_t len;
+		unsigned int flags;
+	} f_splice_read;
+
+	struct {
+		struct pipe_inode_info *pipe;
+		struct file *file;
+		loff_t *pos;
+		size_t len;
+		unsigned int flags;
+	} f_splice_write;
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
+	struct {
+		struct file *file;
+		loff_t *pos;
+		size_t count;
+		read_actor_t actor;
+		void *target;
+	} f_sendfile;
+#endif
+
 	struct {
 		struct file *file;
 		struct vm_area_struct *vma;
 	} f_mmap;
-	*/
 
 	struct {
 		struct file *file;
@@ -393,79 +432,61 @@ union redirfs_op_args {
 		filldir_t filldir;
 	} f_readdir;
 
-	/*
 	struct {
-                struct file *file;
-                loff_t offset;
-                int origin;
+		struct file *file;
+		loff_t offset;
+		int origin;
 	} f_llseek;
-	*/
 
-	/*
 	struct {
 		struct file *file;
 		char __user *buf;
 		size_t count;
 		loff_t *pos;
 	} f_read;
-	*/
 
-	/*
 	struct {
 		struct file *file;
 		const char __user *buf;
 		size_t count;
 		loff_t *pos;
 	} f_write;
-	*/
 
-	/*
 	struct {
 		struct kiocb *iocb;
 		const struct iovec *iov;
 		unsigned long nr_segs;
 		loff_t pos;
 	} f_aio_read;
-	*/
 
-	/*
 	struct {
 		struct kiocb *iocb;
 		const struct iovec *iov;
 		unsigned long nr_segs;
 		loff_t pos;
 	} f_aio_write;
-	*/
 
-	/*
 	struct {
 		struct file *file;
 		struct page *page;
 	} a_readpage;
-	*/
 
-	/*
 	struct {
 		struct page *page;
 		struct writeback_control *wbc;
 	} a_writepage;
-	*/
 
-	/*
 	struct {
 		struct file *file;
 		struct address_space *mapping;
 		struct list_head *pages;
 		unsigned nr_pages;
 	} a_readpages;
-	*/
 
-	/*
 	struct {
 		struct address_space *mapping;
 		struct writeback_control *wbc;
 	} a_writepages;
-	*/
 
 	/*
 	struct {
@@ -568,10 +589,49 @@ struct redirfs_path_info {
 	int flags;
 };
 
+/*
+ * A post callback registered with REDIRFS_POST_DEFERRED is not called
+ * from the operation but later from a redirfs worker thread, after the
+ * syscall returned. Its return value and changes to the args are ignored.
+ * Dentries and inodes in the args are pinned until the callback returns,
+ * other pointers (nameidata, symlink name) are NULL and the context has
+ * no data attached in the pre callback. Only dentry modifying directory
+ * operations (create, link, unlink, symlink, mkdir, rmdir, mknod and
+ * rename) can be deferred. A deferred rename runs after d_move swapped the
+ * names of its dentries, old_name and new_name of its args point to copies
+ * of the names taken before the callback was queued.
+ */
+#define REDIRFS_POST_DEFERRED 1
+
+/*
+ * The pre and post callbacks do not sleep and can be called from the
+ * rcu-walk path lookup (permission and d_revalidate). Without it these
+ * operations fall back to the ref-walk while the filter hooks them.
+ */
+#define REDIRFS_RCU_SAFE 2
+
+/*
+ * An operation registered with REDIRFS_RULE_STOP and without a pre callback
+ * is stopped by the redirfs core itself with rule_rv as its return value.
+ * With REDIRFS_RULE_FMODE_WRITE the rule applies only to files opened for
+ * writing (f_open only). Rules are supported for operations returning int.
+ */
+#define REDIRFS_RULE_STOP 4
+#define REDIRFS_RULE_FMODE_WRITE 8
+
+/*
+ * Size of the per filter area returned by redirfs_context_scratch. It is
+ * zeroed on the first access during an operation and lives until the
+ * operation's post callbacks are done.
+ */
+#define REDIRFS_CONTEXT_SCRATCH_SIZE 16
+
 struct redirfs_op_info {
 	enum redirfs_op_id op_id;
 	enum redirfs_rv (*pre_cb)(redirfs_context, struct redirfs_args *);
 	enum redirfs_rv (*post_cb)(redirfs_context, struct redirfs_args *);
+	unsigned int flags;
+	int rule_rv;
 };
 
 struct redirfs_filter_operations {
@@ -621,6 +681,8 @@ int redirfs_remove_attribute(redirfs_filter filter,
 struct kobject *redirfs_filter_kobject(redirfs_filter filter);
 redirfs_path redirfs_add_path(redirfs_filter filter,
 		struct redirfs_path_info *info);
+int redirfs_add_paths(redirfs_filter filter, struct redirfs_path_info *infos,
+		int nr, redirfs_path *paths);
 int redirfs_rem_path(redirfs_filter filter, redirfs_path path);
 int redirfs_get_id_path(redirfs_path path);
 redirfs_path redirfs_get_path_id(int id);
@@ -636,6 +698,7 @@ int redirfs_rem_paths(redirfs_filter filter);
 redirfs_root redirfs_get_root_file(redirfs_filter filter, struct file *file);
 redirfs_root redirfs_get_root_dentry(redirfs_filter filter,
 		struct dentry *dentry);
+int redirfs_get_id_dentry(redirfs_filter filter, struct dentry *dentry);
 redirfs_root redirfs_get_root_inode(redirfs_filter filter, struct inode *inode);
 redirfs_root redirfs_get_root_path(redirfs_path path);
 redirfs_root redirfs_get_root(redirfs_root root);
@@ -677,11 +740,16 @@ struct redirfs_data *redirfs_detach_data_context(redirfs_filter filter,
 		redirfs_context context);
 struct redirfs_data *redirfs_get_data_context(redirfs_filter filter,
 		redirfs_context context);
+void *redirfs_context_scratch(redirfs_filter filter, redirfs_context context);
 struct redirfs_data *redirfs_attach_data_root(redirfs_filter filter,
 		redirfs_root root, struct redirfs_data *data);
 struct redirfs_data *redirfs_detach_data_root(redirfs_filter filter,
 		redirfs_root root);
 struct redirfs_data *redirfs_get_data_root(redirfs_filter filter,
 		redirfs_root root);
+ssize_t redirfs_orig_read(redirfs_filter filter, struct file *file,
+		char __user *buf, size_t count, loff_t *pos);
+ssize_t redirfs_orig_write(redirfs_filter filter, struct file *file,
+		const char __user *buf, size_t count, loff_t *pos);
 #endif
 
@@ -25,33 +25,58 @@
 
 struct rfs_info *rfs_info_none;
 
+/*
+ * Static rules are evaluated here instead of calling a filter's callback.
+ */
+static inline int rfs_rule_match(struct rfs_chain_cb *rcb,
+		struct redirfs_args *rargs)
+{
+	if (rcb->rule & REDIRFS_RULE_FMODE_WRITE)
+		return rargs->args.f_open.file->f_mode & FMODE_WRITE;
+
+	return 1;
+}
+
 int rfs_precall_flts(struct rfs_chain *rchain, struct rfs_context *rcont,
 		struct redirfs_args *rargs)
 {
-	enum redirfs_rv (*rop)(redirfs_context, struct redirfs_args *);
+	struct rfs_chain_op *rop;
 	enum redirfs_rv rv;
+	int i;
+
+	if (rfs_stats_enabled())
+		rfs_stats_op_enter(rcont, rargs);
 
 	if (!rchain)
 		return 0;
 
 	rargs->type.call = REDIRFS_PRECALL;
 
-	rcont->idx = rcont->idx_start;
+	rop = &rchain->ops[rargs->type.id];
 
-	for (; rcont->idx < rchain->rflts_nr; rcont->idx++) {
-		if (!atomic_read(&rchain->rflts[rcont->idx]->active))
+	for (i = 0; i < rop->pre_nr; i++) {
+		if (rop->pre[i].idx < rcont->idx_start)
 			continue;
 
-		rop = rchain->rflts[rcont->idx]->cbs[rargs->type.id].pre_cb;
-		if (!rop)
-			continue;
+		rcont->idx = rop->pre[i].idx;
+		if (!rop->pre[i].cb) {
+			if (!rfs_rule_match(&rop->pre[i], rargs))
+				continue;
 
-		rv = rop(rcont, rargs);
+			rargs->rv.rv_int = rop->pre[i].rule_rv;
+			return -1;
+		}
+
+		if (rfs_stats_enabled())
+			rv = rfs_stats_call(rchain->rflts[rcont->idx],
+					rop->pre[i].cb, rcont, rargs);
+		else
+			rv = rop->pre[i].cb(rcont, rargs);
 		if (rv == REDIRFS_STOP)
 			return -1;
 	}
 
-	rcont->idx--;
+	rcont->idx = rchain->rflts_nr - 1;
 
 	return 0;
 }
@@ -59,32 +84,226 @@ int rfs_precall_flts(struct rfs_chain *rchain, struct rfs_context *rcont,
 void rfs_postcall_flts(struct rfs_chain *rchain, struct rfs_context *rcont,
 		struct redirfs_args *rargs)
 {
-	enum redirfs_rv (*rop)(redirfs_context, struct redirfs_args *);
+	struct rfs_chain_op *rop;
+	int idx;
+	int i;
 
 	if (!rchain)
-		return;
+		goto exit;
 
 	rargs->type.call = REDIRFS_POSTCALL;
 
-	for (; rcont->idx >= rcont->idx_start; rcont->idx--) {
-		if (!atomic_read(&rchain->rflts[rcont->idx]->active))
+	rop = &rchain->ops[rargs->type.id];
+	idx = rcont->idx;
+
+	for (i = rop->post_nr - 1; i >= 0; i--) {
+		if (rop->post[i].idx > idx)
 			continue;
 
-		rop = rchain->rflts[rcont->idx]->cbs[rargs->type.id].post_cb;
-		if (rop) 
-			rop(rcont, rargs);
+		if (rop->post[i].idx < rcont->idx_start)
+			break;
+
+		rcont->idx = rop->post[i].idx;
+		if (rfs_stats_enabled())
+			rfs_stats_call(rchain->rflts[rcont->idx],
+					rop->post[i].cb, rcont, rargs);
+		else
+			rop->post[i].cb(rcont, rargs);
 	}
 
-	rcont->idx++;
+	if (rop->defer_nr)
+		rfs_defer_add(rchain, rargs, idx, rcont->idx_start);
+
+	rcont->idx = rcont->idx_start;
+exit:
+	if (rfs_stats_enabled())
+		rfs_stats_op_exit(rcont, rargs);
+}
+
+#define RFS_DOP_CASES(op) \
+	case REDIRFS_NONE_DOP_##op: \
+	case REDIRFS_REG_DOP_##op: \
+	case REDIRFS_DIR_DOP_##op: \
+	case REDIRFS_CHR_DOP_##op: \
+	case REDIRFS_BLK_DOP_##op: \
+	case REDIRFS_FIFO_DOP_##op: \
+	case REDIRFS_LNK_DOP_##op: \
+	case REDIRFS_SOCK_DOP_##op
+
+#define RFS_IOP_CASES(op) \
+	case REDIRFS_REG_IOP_##op: \
+	case REDIRFS_DIR_IOP_##op: \
+	case REDIRFS_CHR_IOP_##op: \
+	case REDIRFS_BLK_IOP_##op: \
+	case REDIRFS_FIFO_IOP_##op: \
+	case REDIRFS_LNK_IOP_##op: \
+	case REDIRFS_SOCK_IOP_##op
+
+#define RFS_FOP_CASES(op) \
+	case REDIRFS_REG_FOP_##op: \
+	case REDIRFS_DIR_FOP_##op: \
+	case REDIRFS_CHR_FOP_##op: \
+	case REDIRFS_BLK_FOP_##op: \
+	case REDIRFS_FIFO_FOP_##op: \
+	case REDIRFS_LNK_FOP_##op
+
+static unsigned long rfs_dentry_ino(const struct dentry *dentry)
+{
+	if (!dentry || !dentry->d_inode)
+		return 0;
+
+	return dentry->d_inode->i_ino;
+}
+
+static unsigned long rfs_file_ino(struct file *file)
+{
+	if (!file)
+		return 0;
+
+	return rfs_dentry_ino(file->f_dentry);
+}
+
+static unsigned long rfs_mapping_ino(struct address_space *mapping)
+{
+	if (!mapping || !mapping->host)
+		return 0;
+
+	return mapping->host->i_ino;
+}
+
+/*
+ * Inode number of the object an operation works on, only used for tracing.
+ */
+unsigned long rfs_args_ino(struct redirfs_args *rargs)
+{
+	union redirfs_op_args *args = &rargs->args;
+
+	switch (rargs->type.id) {
+	RFS_DOP_CASES(D_REVALIDATE):
+		return rfs_dentry_ino(args->d_revalidate.dentry);
+
+	RFS_DOP_CASES(D_COMPARE):
+		return rfs_dentry_ino(args->d_compare.dentry);
+
+	RFS_DOP_CASES(D_RELEASE):
+		return rfs_dentry_ino(args->d_release.dentry);
+
+	RFS_DOP_CASES(D_IPUT):
+		return args->d_iput.inode->i_ino;
+
+	RFS_IOP_CASES(PERMISSION):
+		return args->i_permission.inode->i_ino;
+
+	RFS_IOP_CASES(SETATTR):
+		return rfs_dentry_ino(args->i_setattr.dentry);
+
+	case REDIRFS_DIR_IOP_CREATE:
+		return args->i_create.dir->i_ino;
+
+	case REDIRFS_DIR_IOP_LOOKUP:
+		return args->i_lookup.dir->i_ino;
+
+	case REDIRFS_DIR_IOP_LINK:
+		return args->i_link.dir->i_ino;
+
+	case REDIRFS_DIR_IOP_UNLINK:
+		return args->i_unlink.dir->i_ino;
+
+	case REDIRFS_DIR_IOP_SYMLINK:
+		return args->i_symlink.dir->i_ino;
+
+	case REDIRFS_DIR_IOP_MKDIR:
+		return args->i_mkdir.dir->i_ino;
+
+	case REDIRFS_DIR_IOP_RMDIR:
+		return args->i_rmdir.dir->i_ino;
+
+	case REDIRFS_DIR_IOP_MKNOD:
+		return args->i_mknod.dir->i_ino;
+
+	case REDIRFS_DIR_IOP_RENAME:
+		return args->i_rename.old_dir->i_ino;
+
+	RFS_FOP_CASES(OPEN):
+		return args->f_open.inode->i_ino;
+
+	RFS_FOP_CASES(RELEASE):
+		return args->f_release.inode->i_ino;
+
+	case REDIRFS_REG_FOP_LLSEEK:
+		return rfs_file_ino(args->f_llseek.file);
+
+	case REDIRFS_REG_FOP_READ:
+		return rfs_file_ino(args->f_read.file);
+
+	case REDIRFS_REG_FOP_WRITE:
+		return rfs_file_ino(args->f_write.file);
+
+	case REDIRFS_REG_FOP_AIO_READ:
+		return rfs_file_ino(args->f_aio_read.iocb->ki_filp);
+
+	case REDIRFS_REG_FOP_AIO_WRITE:
+		return rfs_file_ino(args->f_aio_write.iocb->ki_filp);
+
+	case REDIRFS_REG_FOP_MMAP:
+		return rfs_file_ino(args->f_mmap.file);
+
+	case REDIRFS_REG_FOP_FLUSH:
+		return rfs_file_ino(args->f_flush.file);
+
+	case REDIRFS_REG_FOP_FSYNC:
+		return rfs_file_ino(args->f_fsync.file);
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,17))
+	case REDIRFS_REG_FOP_SPLICE_READ:
+		return rfs_file_ino(args->f_splice_read.file);
+
+	case REDIRFS_REG_FOP_SPLICE_WRITE:
+		return rfs_file_ino(args->f_splice_write.file);
+#endif
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23))
+	case REDIRFS_REG_FOP_SENDFILE:
+		return rfs_file_ino(args->f_sendfile.file);
+#endif
+
+	case REDIRFS_DIR_FOP_READDIR:
+		return rfs_file_ino(args->f_readdir.file);
+
+	case REDIRFS_REG_AOP_READPAGE:
+		return rfs_mapping_ino(args->a_readpage.page->mapping);
+
+	case REDIRFS_REG_AOP_WRITEPAGE:
+		return rfs_mapping_ino(args->a_writepage.page->mapping);
+
+	case REDIRFS_REG_AOP_READPAGES:
+		return rfs_mapping_ino(args->a_readpages.mapping);
+
+	case REDIRFS_REG_AOP_WRITEPAGES:
+		return rfs_mapping_ino(args->a_writepages.mapping);
+
+	default:
+		return 0;
+	}
 }
 
 static int __init rfs_init(void)
 {
 	int rv;
 
+	rv = rfs_info_srcu_init();
+	if (rv)
+		return rv;
+
 	rfs_info_none = rfs_info_alloc(NULL, NULL);
-	if (IS_ERR(rfs_info_none))
-		return PTR_ERR(rfs_info_none);
+	if (IS_ERR(rfs_info_none)) {
+		rv = PTR_ERR(rfs_info_none);
+		goto err_info_none;
+	}
+
+	rv = rfs_optab_create();
+	if (rv)
+		goto err_optab;
 
 	rv = rfs_dentry_cache_create();
 	if (rv)
@@ -98,6 +317,14 @@ static int __init rfs_init(void)
 	if (rv)
 		goto err_file_cache;
 
+	rv = rfs_dcache_cache_create();
+	if (rv)
+		goto err_dcache_cache;
+
+	rv = rfs_defer_create();
+	if (rv)
+		goto err_defer;
+
 	rv = rfs_sysfs_create();
 	if (rv)
 		goto err_sysfs;
@@ -108,13 +335,22 @@ static int __init rfs_init(void)
 	return 0;
 
 err_sysfs:
+	rfs_defer_destroy();
+err_defer:
+	rfs_dcache_cache_destroy();
+err_dcache_cache:
 	rfs_file_cache_destory();
 err_file_cache:
 	rfs_inode_cache_destroy();
 err_inode_cache:
 	rfs_dentry_cache_destory();
 err_dentry_cache:
+	rfs_optab_destroy();
+err_optab:
 	rfs_info_put(rfs_info_none);
+	rfs_info_flush();
+err_info_none:
+	rfs_info_srcu_cleanup();
 	return rv;
 }
 
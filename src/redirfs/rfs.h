@@ -29,13 +29,31 @@
 #include <linux/sched.h>
 #include <linux/quotaops.h>
 #include <linux/slab.h>
+#include <linux/srcu.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <linux/cpu.h>
+#include <linux/hash.h>
+#include <linux/rcupdate.h>
+#include <linux/vmalloc.h>
+#include <linux/seqlock.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/writeback.h>
+#include <linux/time.h>
+#include <linux/idr.h>
+#include <linux/sort.h>
 #include "redirfs.h"
 
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0))
+#include <linux/jump_label.h>
+#endif
+
 #define RFS_ADD_OP(ops_new, op) \
-	(ops_new.op = rfs_##op)
+	((ops_new)->op = rfs_##op)
 
 #define RFS_REM_OP(ops_new, ops_old, op) \
-	(ops_new.op = ops_old ? ops_old->op : NULL)
+	((ops_new)->op = ops_old ? ops_old->op : NULL)
 
 #define RFS_SET_OP(arr, id, ops_new, ops_old, op) \
 	(arr[id] ? \
@@ -43,31 +61,38 @@
 	 	RFS_REM_OP(ops_new, ops_old, op) \
 	)
 
-#define RFS_SET_FOP(rf, id, op) \
+#define RFS_SET_FOP(rf, ops_new, id, op) \
 	(rf->rdentry->rinfo->rops ? \
-		RFS_SET_OP(rf->rdentry->rinfo->rops->arr, id, rf->op_new, \
+		RFS_SET_OP(rf->rdentry->rinfo->rops->arr, id, ops_new, \
 			rf->op_old, op) : \
-	 	RFS_REM_OP(rf->op_new, rf->op_old, op) \
+	 	RFS_REM_OP(ops_new, rf->op_old, op) \
 	)
 
-#define RFS_SET_DOP(rd, id, op) \
+#define RFS_SET_DOP(rd, ops_new, id, op) \
 	(rd->rinfo->rops ? \
-		RFS_SET_OP(rd->rinfo->rops->arr, id, rd->op_new,\
+		RFS_SET_OP(rd->rinfo->rops->arr, id, ops_new,\
 			rd->op_old, op) : \
-	 	RFS_REM_OP(rd->op_new, rd->op_old, op) \
+	 	RFS_REM_OP(ops_new, rd->op_old, op) \
 	)
 
-#define RFS_SET_IOP_MGT(ri, op) \
+#define RFS_SET_IOP_MGT(ri, ops_new, op) \
 	(ri->rinfo->rops ? \
-	 	RFS_ADD_OP(ri->op_new, op) : \
-	 	RFS_REM_OP(ri->op_new, ri->op_old, op) \
+	 	RFS_ADD_OP(ops_new, op) : \
+	 	RFS_REM_OP(ops_new, ri->op_old, op) \
 	)
 
-#define RFS_SET_IOP(ri, id, op) \
+#define RFS_SET_IOP(ri, ops_new, id, op) \
 	(ri->rinfo->rops ? \
-	 	RFS_SET_OP(ri->rinfo->rops->arr, id, ri->op_new, \
+	 	RFS_SET_OP(ri->rinfo->rops->arr, id, ops_new, \
 			ri->op_old, op) : \
-	 	RFS_REM_OP(ri->op_new, ri->op_old, op) \
+	 	RFS_REM_OP(ops_new, ri->op_old, op) \
+	)
+
+#define RFS_SET_AOP(ri, ops_new, id, op) \
+	(ri->rinfo->rops ? \
+	 	RFS_SET_OP(ri->rinfo->rops->arr, id, ops_new, \
+			ri->aop_old, op) : \
+	 	RFS_REM_OP(ops_new, ri->aop_old, op) \
 	)
 
 struct rfs_file;
@@ -104,15 +129,86 @@ inline static void rfs_inode_mutex_unlock(struct inode *inode)
 }
 #endif
 
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,34))
+#define rfs_srcu_dereference(p, sp) rcu_dereference(p)
+#else
+#define rfs_srcu_dereference(p, sp) srcu_dereference(p, sp)
+#endif
+
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,15))
 #define rfs_kmem_cache_t kmem_cache_t
 #else
 #define rfs_kmem_cache_t struct kmem_cache
 #endif
 
+enum rfs_pcount_state {
+	RFS_PCOUNT_PERCPU,
+	RFS_PCOUNT_DRAIN,
+	RFS_PCOUNT_ATOMIC
+};
+
+struct rfs_pcount {
+	int *pcpu;
+	atomic_t count;
+	int state;
+};
+
+int rfs_pcount_init(struct rfs_pcount *pc);
+void rfs_pcount_free(struct rfs_pcount *pc);
+void rfs_pcount_atomic(struct rfs_pcount *pc);
+void rfs_pcount_percpu(struct rfs_pcount *pc);
+
+static inline void rfs_pcount_get(struct rfs_pcount *pc)
+{
+	preempt_disable();
+
+	if (likely(ACCESS_ONCE(pc->state) == RFS_PCOUNT_PERCPU))
+		(*per_cpu_ptr(pc->pcpu, smp_processor_id()))++;
+	else {
+		BUG_ON(!atomic_read(&pc->count));
+		atomic_inc(&pc->count);
+	}
+
+	preempt_enable();
+}
+
+static inline int rfs_pcount_put(struct rfs_pcount *pc)
+{
+	int rv = 0;
+
+	preempt_disable();
+
+	if (likely(ACCESS_ONCE(pc->state) == RFS_PCOUNT_PERCPU))
+		(*per_cpu_ptr(pc->pcpu, smp_processor_id()))--;
+	else {
+		BUG_ON(!atomic_read(&pc->count));
+		rv = atomic_dec_and_test(&pc->count);
+	}
+
+	preempt_enable();
+
+	return rv;
+}
+
+/*
+ * The value is valid only in the atomic mode, -1 is returned otherwise.
+ */
+static inline int rfs_pcount_read(struct rfs_pcount *pc)
+{
+	if (ACCESS_ONCE(pc->state) != RFS_PCOUNT_ATOMIC)
+		return -1;
+
+	smp_rmb();
+	return atomic_read(&pc->count);
+}
+
 struct rfs_op_info {
 	enum redirfs_rv (*pre_cb)(redirfs_context, struct redirfs_args *);
 	enum redirfs_rv (*post_cb)(redirfs_context, struct redirfs_args *);
+	int post_deferred;
+	int rcu_safe;
+	unsigned int rule;
+	int rule_rv;
 };
 
 struct rfs_flt {
@@ -125,16 +221,60 @@ struct rfs_flt {
 	int paths_nr;
 	spinlock_t lock;
 	atomic_t active;
-	atomic_t count;
+	struct rfs_pcount count;
 	struct redirfs_filter_operations *ops;
+	struct rfs_flt_stats *stats;
+	int stats_on;
+	int slot;
+	atomic_t data_nr;
 };
 
 void rfs_flt_put(struct rfs_flt *rflt);
 struct rfs_flt *rfs_flt_get(struct rfs_flt *rflt);
 void rfs_flt_release(struct kobject *kobj);
 
+struct rfs_context;
+
+#define RFS_STATS_BUCKETS 16
+
+/*
+ * Per-CPU callback latency of one filter. hist[id][call][0] counts calls
+ * shorter than 1us, hist[id][call][b] calls taking [2^(b-1), 2^b) us and
+ * the last bucket everything longer.
+ */
+struct rfs_flt_stats {
+	u64 total[REDIRFS_OP_END][2];
+	u32 hist[REDIRFS_OP_END][2][RFS_STATS_BUCKETS];
+};
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0))
+extern struct jump_label_key rfs_stats_key;
+#define rfs_stats_enabled() static_branch(&rfs_stats_key)
+#else
+extern atomic_t rfs_stats_key;
+#define rfs_stats_enabled() unlikely(atomic_read(&rfs_stats_key))
+#endif
+
+void rfs_stats_op_enter(struct rfs_context *rcont, struct redirfs_args *rargs);
+void rfs_stats_op_exit(struct rfs_context *rcont, struct redirfs_args *rargs);
+enum redirfs_rv rfs_stats_call(struct rfs_flt *rflt,
+		enum redirfs_rv (*cb)(redirfs_context, struct redirfs_args *),
+		struct rfs_context *rcont, struct redirfs_args *rargs);
+int rfs_stats_set(struct rfs_flt *rflt, int on);
+void rfs_stats_reset(struct rfs_flt *rflt);
+void rfs_stats_free(struct rfs_flt *rflt);
+int rfs_stats_get_info(struct rfs_flt *rflt, char *buf, int size);
+void rfs_trace_reg(void);
+void rfs_trace_unreg(void);
+unsigned long rfs_args_ino(struct redirfs_args *rargs);
+
+#define RFS_PATH_HASH_BITS 12
+
+#define rfs_path_hashfn(dentry) hash_ptr(dentry, RFS_PATH_HASH_BITS)
+
 struct rfs_path {
 	struct list_head list;
+	struct hlist_node hash;
 	struct list_head rfst_list;
 	struct list_head rroot_list;
 	struct rfs_root *rroot;
@@ -153,24 +293,55 @@ void rfs_path_put(struct rfs_path *rpath);
 struct rfs_path *rfs_path_find(struct vfsmount *mnt, struct dentry *dentry);
 struct rfs_path *rfs_path_find_id(int id);
 int rfs_path_get_info(struct rfs_flt *rflt, char *buf, int size);
+int rfs_path_get_lazy_info(struct rfs_flt *rflt, char *buf, int size);
+int rfs_path_get_mem_info(struct rfs_flt *rflt, char *buf, int size);
+int rfs_path_get_snapshot_info(struct rfs_flt *rflt, char *buf, int size);
 int rfs_fsrename(struct inode *old_dir, struct dentry *old_dentry,
 		struct inode *new_dir, struct dentry *new_dentry);
 
+/*
+ * Ids of the paths including each filter of the root's rinch. Replaced
+ * under the rfs_path_mutex and read under the rcu read lock.
+ */
+struct rfs_root_ids {
+	struct rcu_head rcu;
+	int nr;
+	struct {
+		struct rfs_flt *rflt;
+		int id;
+	} ids[0];
+};
+
 struct rfs_root {
 	struct list_head list;
+	struct hlist_node hash;
 	struct list_head walk_list;
 	struct list_head rpaths;
 	struct list_head data;
 	struct rfs_chain *rinch;
 	struct rfs_chain *rexch;
+	struct rfs_root_ids *ids;
 	struct rfs_info *rinfo;
 	struct dentry *dentry;
 	int paths_nr;
 	spinlock_t lock;
-	atomic_t count;
+	struct rfs_pcount count;
+	struct work_struct lazy_work;
+	unsigned long lazy_nr;
+	atomic_t rdentries_nr;
+	int lazy;
+};
+
+enum rfs_root_lazy_state {
+	RFS_ROOT_LAZY_NONE,
+	RFS_ROOT_LAZY_PENDING,
+	RFS_ROOT_LAZY_DONE
 };
 
+#define RFS_ROOT_LAZY_CHUNK 1024
+
 extern struct list_head rfs_root_list;
+extern atomic_t rfs_root_lazy_nr;
 extern struct list_head rfs_root_walk_list;
 
 struct rfs_root *rfs_root_get(struct rfs_root *rroot);
@@ -178,6 +349,8 @@ void rfs_root_put(struct rfs_root *rroot);
 void rfs_root_add_rpath(struct rfs_root *rroot, struct rfs_path *rpath);
 void rfs_root_rem_rpath(struct rfs_root *rroot, struct rfs_path *rpath);
 struct rfs_root *rfs_root_add(struct dentry *dentry);
+struct rfs_root_ids *rfs_root_ids_alloc(struct rfs_root *rroot);
+void rfs_root_ids_set(struct rfs_root *rroot, struct rfs_root_ids *rids);
 int rfs_root_add_include(struct rfs_root *rroot, struct rfs_flt *rflt);
 int rfs_root_add_exclude(struct rfs_root *rroot, struct rfs_flt *rflt);
 int rfs_root_rem_include(struct rfs_root *rroot, struct rfs_flt *rflt);
@@ -186,6 +359,8 @@ int rfs_root_add_flt(struct rfs_root *rroot, void *data);
 int rfs_root_rem_flt(struct rfs_root *rroot, void *data);
 int rfs_root_walk(int (*cb)(struct rfs_root*, void *), void *data);
 void rfs_root_add_walk(struct dentry *dentry);
+void rfs_root_lazy_begin(struct rfs_root *rroot);
+void rfs_root_lazy_queue(struct rfs_root *rroot);
 void rfs_root_set_rinfo(struct rfs_root *rroot, struct rfs_info *rinfo);
 
 struct rfs_ops {
@@ -198,8 +373,34 @@ struct rfs_ops *rfs_ops_alloc(void);
 struct rfs_ops *rfs_ops_get(struct rfs_ops *rops);
 void rfs_ops_put(struct rfs_ops *rops);
 
+struct rfs_chain_cb {
+	enum redirfs_rv (*cb)(redirfs_context, struct redirfs_args *);
+	int idx;
+	unsigned int rule;
+	int rule_rv;
+};
+
+struct rfs_chain_op {
+	struct rfs_chain_cb *pre;
+	struct rfs_chain_cb *post;
+	struct rfs_chain_cb *defer;
+	int pre_nr;
+	int post_nr;
+	int defer_nr;
+	int block_nr;
+};
+
+#define rfs_chain_op_nr(rchain, id) \
+	((rchain) ? (rchain)->ops[id].pre_nr + (rchain)->ops[id].post_nr + \
+	 (rchain)->ops[id].defer_nr : 0)
+
+#define rfs_chain_op_blocks(rchain, id) \
+	((rchain) ? (rchain)->ops[id].block_nr : 0)
+
 struct rfs_chain {
 	struct rfs_flt **rflts;
+	struct rfs_chain_op ops[REDIRFS_OP_END];
+	struct rfs_chain_cb *cbs;
 	int rflts_nr;
 	atomic_t count;
 };
@@ -209,6 +410,7 @@ void rfs_chain_put(struct rfs_chain *rchain);
 int rfs_chain_find(struct rfs_chain *rchain, struct rfs_flt *rflt);
 struct rfs_chain *rfs_chain_add(struct rfs_chain *rchain, struct rfs_flt *rflt);
 struct rfs_chain *rfs_chain_rem(struct rfs_chain *rchain, struct rfs_flt *rflt);
+struct rfs_chain *rfs_chain_copy(struct rfs_chain *rchain);
 void rfs_chain_ops(struct rfs_chain *rchain, struct rfs_ops *ops);
 int rfs_chain_cmp(struct rfs_chain *rch1, struct rfs_chain *rch2);
 struct rfs_chain *rfs_chain_join(struct rfs_chain *rch1,
@@ -217,6 +419,7 @@ struct rfs_chain *rfs_chain_diff(struct rfs_chain *rch1,
 		struct rfs_chain *rch2);
 
 struct rfs_info {
+	struct list_head free_list;
 	struct rfs_chain *rchain;
 	struct rfs_ops *rops;
 	struct rfs_root *rroot;
@@ -224,6 +427,17 @@ struct rfs_info {
 };
 
 extern struct rfs_info *rfs_info_none;
+extern struct srcu_struct rfs_info_srcu;
+
+#define rfs_info_read_lock() srcu_read_lock(&rfs_info_srcu)
+#define rfs_info_read_unlock(idx) srcu_read_unlock(&rfs_info_srcu, idx)
+#define rfs_info_dereference(p) rfs_srcu_dereference(p, &rfs_info_srcu)
+
+extern struct workqueue_struct *rfs_info_wq;
+
+int rfs_info_srcu_init(void);
+void rfs_info_srcu_cleanup(void);
+void rfs_info_flush(void);
 
 struct rfs_info *rfs_info_alloc(struct rfs_root *rroot,
 		struct rfs_chain *rchain);
@@ -242,6 +456,114 @@ int rfs_info_set(struct dentry *dentry, struct rfs_info *rinfo,
 		struct rfs_flt *rflt);
 int rfs_info_reset(struct dentry *dentry, struct rfs_info *rinfo);
 
+enum rfs_mem_type {
+	RFS_MEM_DENTRY,
+	RFS_MEM_INODE,
+	RFS_MEM_FILE,
+	RFS_MEM_INFO,
+	RFS_MEM_CHAIN,
+	RFS_MEM_DATA,
+	RFS_MEM_END
+};
+
+void rfs_mem_account(enum rfs_mem_type type, int nr, long bytes);
+void rfs_mem_root_inc(struct rfs_info *rinfo);
+void rfs_mem_root_dec(struct rfs_info *rinfo);
+int rfs_mem_get_info(char *buf, int size);
+
+#define rfs_mem_inc(type, bytes) rfs_mem_account(type, 1, bytes)
+#define rfs_mem_dec(type, bytes) rfs_mem_account(type, -1, -(long)(bytes))
+
+const void *rfs_optab_get(const void *op_old, const void *ops, size_t size);
+void rfs_optab_put(const void *ops);
+const void *rfs_optab_old(const void *ops);
+int rfs_optab_create(void);
+void rfs_optab_destroy(void);
+
+#define RFS_DATA_SLOTS 8
+
+#define RFS_HASH_LOCK_BITS 8
+#define RFS_HASH_LOCKS (1 << RFS_HASH_LOCK_BITS)
+#define RFS_HASH_MAX_BITS 20
+#define RFS_HASH_MEM_SHIFT 7
+
+struct rfs_hash_table {
+	unsigned int bits;
+	struct hlist_head heads[0];
+};
+
+struct rfs_hash {
+	struct rfs_hash_table *table;
+	struct rfs_hash_table *new;
+	spinlock_t locks[RFS_HASH_LOCKS];
+	unsigned char moved[RFS_HASH_LOCKS];
+	seqcount_t seq;
+	atomic_t nr;
+	unsigned int bits;
+	unsigned int min_bits;
+	unsigned int max_bits;
+	const void *(*key)(struct hlist_node *node);
+	struct work_struct work;
+};
+
+int rfs_hash_init(struct rfs_hash *rhash, unsigned int bits,
+		unsigned int max_bits, const void *(*key)(struct hlist_node *));
+void rfs_hash_destroy(struct rfs_hash *rhash);
+unsigned int rfs_hash_mem_bits(unsigned int shift);
+struct hlist_head *rfs_hash_head(struct rfs_hash *rhash, const void *key);
+void rfs_hash_add(struct rfs_hash *rhash, const void *key,
+		struct hlist_node *node);
+void rfs_hash_rem(struct rfs_hash *rhash, const void *key,
+		struct hlist_node *node);
+
+/*
+ * The lock index is made of the top bits of the bucket index, so the lock of
+ * a key is the same for all table sizes.
+ */
+#define rfs_hash_lock(rhash, key) \
+	(&(rhash)->locks[hash_ptr((void *)(key), RFS_HASH_LOCK_BITS)])
+
+/*
+ * Called in the rcu read side section. During a resize the entries are
+ * moved to the new table, a reader who may have followed a moved entry
+ * into the other table retries when it found nothing.
+ */
+static inline struct hlist_node *rfs_hash_lookup_rcu(struct rfs_hash *rhash,
+		const void *key, int (*match)(struct hlist_node *, const void *))
+{
+	struct rfs_hash_table *table;
+	struct rfs_hash_table *new;
+	struct hlist_node *pos;
+	unsigned seq;
+
+	do {
+		seq = read_seqcount_begin(&rhash->seq);
+		table = rcu_dereference(rhash->table);
+		new = rcu_dereference(rhash->new);
+
+		for (pos = rcu_dereference(table->heads[hash_ptr((void *)key,
+						table->bits)].first);
+				pos; pos = rcu_dereference(pos->next)) {
+			if (match(pos, key))
+				return pos;
+		}
+
+		if (!new || new == table)
+			continue;
+
+		for (pos = rcu_dereference(new->heads[hash_ptr((void *)key,
+						new->bits)].first);
+				pos; pos = rcu_dereference(pos->next)) {
+			if (match(pos, key))
+				return pos;
+		}
+	} while (read_seqcount_retry(&rhash->seq, seq));
+
+	return NULL;
+}
+
+struct rfs_name;
+
 struct rfs_dentry {
 	struct list_head rinode_list;
 	struct list_head rfiles;
@@ -252,19 +574,36 @@ struct rfs_dentry {
 #else
 	struct dentry_operations *op_old;
 #endif
-	struct dentry_operations op_new;
+	const struct dentry_operations *op_new;
+	struct redirfs_data *slots[RFS_DATA_SLOTS];
+	struct hlist_node hash;
+	struct list_head lru;
+	struct rcu_head rcu;
 	struct rfs_inode *rinode;
 	struct rfs_info *rinfo;
+	struct rfs_info *subs_rinfo;
+	struct rfs_name *name;
+	unsigned name_seq;
+	int referenced;
 	spinlock_t lock;
 	atomic_t count;
 };
 
 #define rfs_dentry_find(dentry) \
 	(dentry && dentry->d_op && dentry->d_op->d_iput == rfs_d_iput ? \
-	 rfs_dentry_get(container_of(dentry->d_op, struct rfs_dentry, op_new)) : \
+	 rfs_dentry_lookup(dentry) : \
 	 NULL)
 
+#define rfs_dentry_find_rcu(dentry) \
+	(dentry && dentry->d_op && dentry->d_op->d_iput == rfs_d_iput ? \
+	 rfs_dentry_lookup_rcu(dentry) : \
+	 NULL)
+
+#define rfs_dentry_rcu_rinfo(rdentry) rfs_info_dereference((rdentry)->rinfo)
+
 void rfs_d_iput(struct dentry *dentry, struct inode *inode);
+struct rfs_dentry *rfs_dentry_lookup(struct dentry *dentry);
+struct rfs_dentry *rfs_dentry_lookup_rcu(struct dentry *dentry);
 struct rfs_dentry *rfs_dentry_get(struct rfs_dentry *rdentry);
 void rfs_dentry_put(struct rfs_dentry *rdentry);
 struct rfs_dentry *rfs_dentry_add(struct dentry *dentry,
@@ -295,22 +634,41 @@ struct rfs_inode {
 	struct inode_operations *op_old;
 	struct file_operations *fop_old;
 #endif
-	struct inode_operations op_new;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18))
+	const struct address_space_operations *aop_old;
+#else
+	struct address_space_operations *aop_old;
+#endif
+	const struct inode_operations *op_new;
+	const struct address_space_operations *aop_new;
+	struct redirfs_data *slots[RFS_DATA_SLOTS];
+	struct hlist_node hash;
+	struct rcu_head rcu;
 	struct rfs_info *rinfo;
 	struct rfs_mutex_t mutex;
 	spinlock_t lock;
 	atomic_t count;
 	atomic_t nlink;
+	atomic_t lazy;
 	int rdentries_nr; /* mutex */
 };
 
 #define rfs_inode_find(inode) \
 	(inode && inode->i_op && inode->i_op->rename == rfs_rename ? \
-	 rfs_inode_get(container_of(inode->i_op, struct rfs_inode, op_new)) : \
+	 rfs_inode_lookup(inode) : \
 	 NULL)
 
+#define rfs_inode_find_rcu(inode) \
+	(inode && inode->i_op && inode->i_op->rename == rfs_rename ? \
+	 rfs_inode_lookup_rcu(inode) : \
+	 NULL)
+
+#define rfs_inode_rcu_rinfo(rinode) rfs_info_dereference((rinode)->rinfo)
+
 int rfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 		struct inode *new_dir, struct dentry *new_dentry);
+struct rfs_inode *rfs_inode_lookup(struct inode *inode);
+struct rfs_inode *rfs_inode_lookup_rcu(struct inode *inode);
 struct rfs_inode *rfs_inode_get(struct rfs_inode *rinode);
 void rfs_inode_put(struct rfs_inode *rinode);
 struct rfs_inode *rfs_inode_add(struct inode *inode, struct rfs_info *rinfo);
@@ -335,19 +693,23 @@ struct rfs_file {
 #else
 	struct file_operations *op_old;
 #endif
-	struct file_operations op_new;
+	const struct file_operations *op_new;
+	struct redirfs_data *slots[RFS_DATA_SLOTS];
+	struct hlist_node hash;
+	struct rcu_head rcu;
 	spinlock_t lock;
 	atomic_t count;
 };
 
 #define rfs_file_find(file) \
 	(file && file->f_op && file->f_op->open == rfs_open ? \
-	 rfs_file_get(container_of(file->f_op, struct rfs_file, op_new)) : \
+	 rfs_file_lookup(file) : \
 	 NULL)
 	 
 extern struct file_operations rfs_file_ops;
 
 int rfs_open(struct inode *inode, struct file *file);
+struct rfs_file *rfs_file_lookup(struct file *file);
 struct rfs_file *rfs_file_get(struct rfs_file *rfile);
 void rfs_file_put(struct rfs_file *rfile);
 void rfs_file_set_ops(struct rfs_file *rfile);
@@ -376,20 +738,54 @@ int rfs_dcache_add(struct dentry *dentry, void *data);
 int rfs_dcache_rem(struct dentry *dentry, void *data);
 int rfs_dcache_set(struct dentry *dentry, void *data);
 int rfs_dcache_reset(struct dentry *dentry, void *data);
+int rfs_dcache_add_lazy(struct dentry *dentry, struct rfs_dcache_data *rdata);
+extern atomic_t rfs_dcache_rename_seq;
+
+int rfs_dcache_lazy(struct dentry *dentry, void *data);
+void rfs_dcache_lazy_subs(struct rfs_inode *rinode);
 int rfs_dcache_rdentry_add(struct dentry *dentry, struct rfs_info *rinfo);
 int rfs_dcache_rinode_del(struct rfs_dentry *rdentry, struct inode *inode);
+struct rfs_name_seq {
+	unsigned rename;
+	unsigned own;
+	int dirs;
+};
+
+int rfs_name_get(struct rfs_dentry *rdentry, struct vfsmount *mnt, char *buf,
+		int size, struct rfs_name_seq *seq);
+void rfs_name_set(struct rfs_dentry *rdentry, struct vfsmount *mnt,
+		const char *name, struct rfs_name_seq *seq);
+void rfs_name_rem(struct rfs_dentry *rdentry);
+void rfs_name_rename(struct dentry *dentry);
+
 int rfs_dcache_get_subs(struct dentry *dir, struct list_head *sibs);
+int rfs_dcache_get_subs_new(struct dentry *dir, struct list_head *sibs);
+int rfs_dcache_subs_attached(struct rfs_dentry *rdentry,
+		struct rfs_info *rinfo);
+int rfs_dcache_cache_create(void);
+void rfs_dcache_cache_destroy(void);
 void rfs_dcache_entry_free_list(struct list_head *head);
 
 struct rfs_context {
 	struct list_head data;
 	int idx;
 	int idx_start;
+	u64 start;
+	unsigned long scratch_map;
+	unsigned long scratch[RFS_DATA_SLOTS][REDIRFS_CONTEXT_SCRATCH_SIZE /
+		sizeof(unsigned long)];
 };
 
 void rfs_context_init(struct rfs_context *rcont, int start);
 void rfs_context_deinit(struct rfs_context *rcont);
 
+int rfs_defer_supported(enum redirfs_op_id id);
+void rfs_defer_add(struct rfs_chain *rchain, struct redirfs_args *rargs,
+		int idx, int idx_start);
+void rfs_defer_flush(void);
+int rfs_defer_create(void);
+void rfs_defer_destroy(void);
+
 int rfs_precall_flts(struct rfs_chain *rchain, struct rfs_context *rcont,
 		struct redirfs_args *rargs);
 void rfs_postcall_flts(struct rfs_chain *rchain, struct rfs_context *rcont,
@@ -403,6 +799,9 @@ void rfs_kobject_init(struct kobject *kobj);
 int rfs_sysfs_create(void);
 
 void rfs_data_remove(struct list_head *head);
+void rfs_data_flush(void);
+int rfs_data_slot_get(void);
+void rfs_data_slot_put(int slot);
 
 
 
@@ -551,6 +950,11 @@ static inline struct dentry *rfs_dget_locked(struct dentry *d)
 	return dget_locked(d);
 }
 
+static inline int rfs_d_count(struct dentry *d)
+{
+	return atomic_read(&d->d_count);
+}
+
 #else
 
 static inline void rfs_dcache_lock(struct dentry *d)
@@ -568,6 +972,11 @@ static inline struct dentry *rfs_dget_locked(struct dentry *d)
 	return dget_dlock(d);
 }
 
+static inline int rfs_d_count(struct dentry *d)
+{
+	return d->d_count;
+}
+
 #endif
 
 
@@ -613,5 +1022,27 @@ static inline int rfs_inode_setattr(struct inode *inode, const struct iattr *att
 
 #endif
 
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32))
+
+#include "rfs_trace.h"
+
+#else
+
+static inline void trace_redirfs_op_enter(struct redirfs_args *rargs)
+{
+}
+
+static inline void trace_redirfs_op_exit(struct redirfs_args *rargs,
+		u64 duration)
+{
+}
+
+static inline void trace_redirfs_flt_call(struct rfs_flt *rflt,
+		struct redirfs_args *rargs, enum redirfs_rv rv, u64 duration)
+{
+}
+
+#endif
+
 #endif
 
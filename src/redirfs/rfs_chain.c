@@ -39,6 +39,99 @@ static struct rfs_chain *rfs_chain_alloc(int size, int type)
 	rchain->rflts = rflts;
 	rchain->rflts_nr = size;
 	atomic_set(&rchain->count, 1);
+	rfs_mem_inc(RFS_MEM_CHAIN, sizeof(struct rfs_chain) +
+			sizeof(struct rfs_flt *) * size);
+
+	return rchain;
+}
+
+/*
+ * Compile per operation arrays of callbacks of active filters. This way
+ * rfs_precall_flts and rfs_postcall_flts do not need to touch filters which
+ * are not interested in the operation. The arrays have to be rebuilt each
+ * time the set of active callbacks changes, see rfs_flt_set_ops.
+ */
+static struct rfs_chain *rfs_chain_build(struct rfs_chain *rchain)
+{
+	struct rfs_chain_cb *rcb;
+	struct rfs_op_info *cbs;
+	int size = 0;
+	int i, j;
+
+	for (i = 0; i < rchain->rflts_nr; i++) {
+		if (!atomic_read(&rchain->rflts[i]->active))
+			continue;
+
+		cbs = rchain->rflts[i]->cbs;
+
+		for (j = 0; j < REDIRFS_OP_END; j++) {
+			if (!cbs[j].rcu_safe && (cbs[j].pre_cb ||
+			    (cbs[j].post_cb && !cbs[j].post_deferred)))
+				rchain->ops[j].block_nr++;
+			if (cbs[j].pre_cb || cbs[j].rule)
+				rchain->ops[j].pre_nr++;
+			if (cbs[j].post_cb && cbs[j].post_deferred)
+				rchain->ops[j].defer_nr++;
+			else if (cbs[j].post_cb)
+				rchain->ops[j].post_nr++;
+		}
+	}
+
+	for (j = 0; j < REDIRFS_OP_END; j++)
+		size += rchain->ops[j].pre_nr + rchain->ops[j].post_nr +
+			rchain->ops[j].defer_nr;
+
+	if (!size)
+		return rchain;
+
+	rcb = kzalloc(sizeof(struct rfs_chain_cb) * size, GFP_KERNEL);
+	if (!rcb) {
+		rfs_chain_put(rchain);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	rchain->cbs = rcb;
+	rfs_mem_account(RFS_MEM_CHAIN, 0, sizeof(struct rfs_chain_cb) * size);
+
+	for (j = 0; j < REDIRFS_OP_END; j++) {
+		rchain->ops[j].pre = rcb;
+		rcb += rchain->ops[j].pre_nr;
+		rchain->ops[j].post = rcb;
+		rcb += rchain->ops[j].post_nr;
+		rchain->ops[j].defer = rcb;
+		rcb += rchain->ops[j].defer_nr;
+		rchain->ops[j].pre_nr = 0;
+		rchain->ops[j].post_nr = 0;
+		rchain->ops[j].defer_nr = 0;
+	}
+
+	for (i = 0; i < rchain->rflts_nr; i++) {
+		if (!atomic_read(&rchain->rflts[i]->active))
+			continue;
+
+		cbs = rchain->rflts[i]->cbs;
+
+		for (j = 0; j < REDIRFS_OP_END; j++) {
+			if (cbs[j].pre_cb || cbs[j].rule) {
+				rcb = &rchain->ops[j].pre[rchain->ops[j].pre_nr++];
+				rcb->cb = cbs[j].pre_cb;
+				rcb->idx = i;
+				rcb->rule = cbs[j].rule;
+				rcb->rule_rv = cbs[j].rule_rv;
+			}
+
+			if (cbs[j].post_cb && cbs[j].post_deferred) {
+				rcb = &rchain->ops[j].defer[rchain->ops[j].defer_nr++];
+				rcb->cb = cbs[j].post_cb;
+				rcb->idx = i;
+
+			} else if (cbs[j].post_cb) {
+				rcb = &rchain->ops[j].post[rchain->ops[j].post_nr++];
+				rcb->cb = cbs[j].post_cb;
+				rcb->idx = i;
+			}
+		}
+	}
 
 	return rchain;
 }
@@ -56,6 +149,7 @@ struct rfs_chain *rfs_chain_get(struct rfs_chain *rchain)
 
 void rfs_chain_put(struct rfs_chain *rchain)
 {
+	size_t size;
 	int i;
 
 	if (!rchain || IS_ERR(rchain))
@@ -68,6 +162,18 @@ void rfs_chain_put(struct rfs_chain *rchain)
 	for (i = 0; i < rchain->rflts_nr; i++)
 		rfs_flt_put(rchain->rflts[i]);
 
+	size = sizeof(struct rfs_chain) +
+		sizeof(struct rfs_flt *) * rchain->rflts_nr;
+
+	if (rchain->cbs) {
+		for (i = 0; i < REDIRFS_OP_END; i++)
+			size += sizeof(struct rfs_chain_cb) *
+				(rchain->ops[i].pre_nr + rchain->ops[i].post_nr +
+				 rchain->ops[i].defer_nr);
+	}
+
+	rfs_mem_dec(RFS_MEM_CHAIN, size);
+	kfree(rchain->cbs);
 	kfree(rchain->rflts);
 	kfree(rchain);
 }
@@ -108,7 +214,7 @@ struct rfs_chain *rfs_chain_add(struct rfs_chain *rchain, struct rfs_flt *rflt)
 
 	if (!rchain) {
 		rchain_new->rflts[0] = rfs_flt_get(rflt);
-		return rchain_new;
+		return rfs_chain_build(rchain_new);
 	}
 
 	while (rchain->rflts[i]->priority < rflt->priority) {
@@ -123,7 +229,7 @@ struct rfs_chain *rfs_chain_add(struct rfs_chain *rchain, struct rfs_flt *rflt)
 		rchain_new->rflts[j++] = rfs_flt_get(rchain->rflts[i++]);
 	}
 
-	return rchain_new;
+	return rfs_chain_build(rchain_new);
 }
 
 struct rfs_chain *rfs_chain_rem(struct rfs_chain *rchain, struct rfs_flt *rflt)
@@ -146,24 +252,36 @@ struct rfs_chain *rfs_chain_rem(struct rfs_chain *rchain, struct rfs_flt *rflt)
 			rchain_new->rflts[j++] = rfs_flt_get(rchain->rflts[i]);
 	}
 
-	return rchain_new;
+	return rfs_chain_build(rchain_new);
+}
+
+struct rfs_chain *rfs_chain_copy(struct rfs_chain *rchain)
+{
+	struct rfs_chain *rchain_new;
+	int i;
+
+	if (!rchain)
+		return NULL;
+
+	rchain_new = rfs_chain_alloc(rchain->rflts_nr, GFP_KERNEL);
+	if (IS_ERR(rchain_new))
+		return rchain_new;
+
+	for (i = 0; i < rchain->rflts_nr; i++)
+		rchain_new->rflts[i] = rfs_flt_get(rchain->rflts[i]);
+
+	return rfs_chain_build(rchain_new);
 }
 
 void rfs_chain_ops(struct rfs_chain *rchain, struct rfs_ops *rops)
 {
-	int i, j;
+	int i;
 
 	if (!rchain)
 		return;
 
-	for (i = 0; i < rchain->rflts_nr; i++) {
-		for (j = 0; j < REDIRFS_OP_END; j++) {
-			if (rchain->rflts[i]->cbs[j].pre_cb)
-				rops->arr[j]++;
-			if (rchain->rflts[i]->cbs[j].post_cb)
-				rops->arr[j]++;
-		}
-	}
+	for (i = 0; i < REDIRFS_OP_END; i++)
+		rops->arr[i] += rfs_chain_op_nr(rchain, i);
 }
 
 int rfs_chain_cmp(struct rfs_chain *rch1, struct rfs_chain *rch2)
@@ -233,7 +351,7 @@ struct rfs_chain *rfs_chain_join(struct rfs_chain *rch1, struct rfs_chain *rch2)
 	while (l != rch2->rflts_nr)
 		rch->rflts[i++] = rfs_flt_get(rch2->rflts[l++]);
 
-	return rch;
+	return rfs_chain_build(rch);
 }
 
 struct rfs_chain *rfs_chain_diff(struct rfs_chain *rch1, struct rfs_chain *rch2)
@@ -272,6 +390,6 @@ struct rfs_chain *rfs_chain_diff(struct rfs_chain *rch1, struct rfs_chain *rch2)
 
 	BUG_ON(j != size);
 
-	return rch;
+	return rfs_chain_build(rch);
 }
 
@@ -23,6 +23,128 @@
 
 #include "rfs.h"
 
+static LIST_HEAD(rfs_data_free_list);
+static DEFINE_SPINLOCK(rfs_data_free_lock);
+static RFS_DEFINE_MUTEX(rfs_data_free_mutex);
+static DEFINE_SPINLOCK(rfs_data_slot_lock);
+static unsigned long rfs_data_slot_map;
+
+/*
+ * Each filter gets one of RFS_DATA_SLOTS slots. Data attached to a dentry,
+ * inode or file is then also published in the object's slot array and
+ * redirfs_get_data_* finds it without taking the object lock. Filters
+ * registered after all slots are taken fall back to the data list.
+ *
+ * Readers only hold rfs_info_srcu, so the last put of the data queues it
+ * and the free callback is called after the grace period. Like for the
+ * rinfo, the grace period is waited for on the rfs_info workqueue and not
+ * on the shared one.
+ */
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20))
+static void rfs_data_free_work_fn(void *data)
+{
+	rfs_data_flush();
+}
+
+static DECLARE_WORK(rfs_data_free_work, rfs_data_free_work_fn, NULL);
+#else
+static void rfs_data_free_work_fn(struct work_struct *work)
+{
+	rfs_data_flush();
+}
+
+static DECLARE_WORK(rfs_data_free_work, rfs_data_free_work_fn);
+#endif
+
+void rfs_data_flush(void)
+{
+	LIST_HEAD(head);
+	struct redirfs_data *data;
+	struct redirfs_data *tmp;
+	struct rfs_flt *rflt;
+
+	might_sleep();
+
+	rfs_mutex_lock(&rfs_data_free_mutex);
+
+	for (;;) {
+		spin_lock(&rfs_data_free_lock);
+		list_splice_init(&rfs_data_free_list, &head);
+		spin_unlock(&rfs_data_free_lock);
+
+		if (list_empty(&head))
+			break;
+
+		synchronize_srcu(&rfs_info_srcu);
+
+		list_for_each_entry_safe(data, tmp, &head, list) {
+			list_del(&data->list);
+			rflt = data->filter;
+			atomic_dec(&rflt->data_nr);
+			rfs_mem_dec(RFS_MEM_DATA, 0);
+			data->free(data);
+			rfs_flt_put(rflt);
+		}
+	}
+
+	rfs_mutex_unlock(&rfs_data_free_mutex);
+}
+
+int rfs_data_slot_get(void)
+{
+	int slot;
+
+	spin_lock(&rfs_data_slot_lock);
+
+	slot = find_first_zero_bit(&rfs_data_slot_map, RFS_DATA_SLOTS);
+	if (slot < RFS_DATA_SLOTS)
+		set_bit(slot, &rfs_data_slot_map);
+	else
+		slot = -1;
+
+	spin_unlock(&rfs_data_slot_lock);
+
+	return slot;
+}
+
+void rfs_data_slot_put(int slot)
+{
+	if (slot < 0)
+		return;
+
+	spin_lock(&rfs_data_slot_lock);
+	clear_bit(slot, &rfs_data_slot_map);
+	spin_unlock(&rfs_data_slot_lock);
+}
+
+static struct redirfs_data *rfs_data_slot_find(struct redirfs_data **slots,
+		redirfs_filter filter)
+{
+	struct redirfs_data *data;
+	int idx;
+
+	idx = rfs_info_read_lock();
+
+	data = rfs_info_dereference(slots[((struct rfs_flt *)filter)->slot]);
+	if (data && !atomic_inc_not_zero(&data->cnt))
+		data = NULL;
+
+	rfs_info_read_unlock(idx);
+
+	return data;
+}
+
+static void rfs_data_slot_set(struct redirfs_data **slots,
+		redirfs_filter filter, struct redirfs_data *data)
+{
+	int slot = ((struct rfs_flt *)filter)->slot;
+
+	if (slot < 0)
+		return;
+
+	rcu_assign_pointer(slots[slot], data);
+}
+
 void rfs_data_remove(struct list_head *head)
 {
 	struct redirfs_data *data;
@@ -48,6 +170,9 @@ int redirfs_init_data(struct redirfs_data *data, redirfs_filter filter,
 	data->free = free;
 	data->detach = detach;
 	data->filter = rfs_flt_get(filter);
+	atomic_inc(&((struct rfs_flt *)filter)->data_nr);
+	/* data are embedded in filter's objects of unknown size */
+	rfs_mem_inc(RFS_MEM_DATA, 0);
 
 	return 0;
 }
@@ -74,8 +199,11 @@ void redirfs_put_data(struct redirfs_data *data)
 	if (!atomic_dec_and_test(&data->cnt))
 		return;
 
-	rfs_flt_put(data->filter);
-	data->free(data);
+	spin_lock(&rfs_data_free_lock);
+	list_add_tail(&data->list, &rfs_data_free_list);
+	spin_unlock(&rfs_data_free_lock);
+
+	queue_work(rfs_info_wq, &rfs_data_free_work);
 }
 
 static struct redirfs_data *rfs_find_data(struct list_head *head,
@@ -114,7 +242,8 @@ struct redirfs_data *redirfs_attach_data_file(redirfs_filter filter,
 	if (rv)
 		goto exit;
 
-	list_add_tail(&data->list, &rfile->data); 
+	list_add_tail(&data->list, &rfile->data);
+	rfs_data_slot_set(rfile->slots, filter, data);
 	redirfs_get_data(data);
 	rv = redirfs_get_data(data);
 exit:
@@ -140,8 +269,10 @@ struct redirfs_data *redirfs_detach_data_file(redirfs_filter filter,
 	spin_lock(&rfile->lock);
 
 	data = rfs_find_data(&rfile->data, filter);
-	if (data)
-		list_del(&data->list);
+	if (data) {
+		list_del_init(&data->list);
+		rfs_data_slot_set(rfile->slots, filter, NULL);
+	}
 
 	spin_unlock(&rfile->lock);
 	redirfs_put_data(data);
@@ -162,11 +293,14 @@ struct redirfs_data *redirfs_get_data_file(redirfs_filter filter,
 	if (!rfile)
 		return NULL;
 
-	spin_lock(&rfile->lock);
-
-	data = rfs_find_data(&rfile->data, filter);
+	if (((struct rfs_flt *)filter)->slot >= 0)
+		data = rfs_data_slot_find(rfile->slots, filter);
+	else {
+		spin_lock(&rfile->lock);
+		data = rfs_find_data(&rfile->data, filter);
+		spin_unlock(&rfile->lock);
+	}
 
-	spin_unlock(&rfile->lock);
 	rfs_file_put(rfile);
 	return data;
 }
@@ -193,7 +327,8 @@ struct redirfs_data *redirfs_attach_data_dentry(redirfs_filter filter,
 	if (rv)
 		goto exit;
 
-	list_add_tail(&data->list, &rdentry->data); 
+	list_add_tail(&data->list, &rdentry->data);
+	rfs_data_slot_set(rdentry->slots, filter, data);
 	redirfs_get_data(data);
 	rv = redirfs_get_data(data);
 exit:
@@ -218,8 +353,10 @@ struct redirfs_data *redirfs_detach_data_dentry(redirfs_filter filter,
 	spin_lock(&rdentry->lock);
 
 	data = rfs_find_data(&rdentry->data, filter);
-	if (data)
-		list_del(&data->list);
+	if (data) {
+		list_del_init(&data->list);
+		rfs_data_slot_set(rdentry->slots, filter, NULL);
+	}
 
 	spin_unlock(&rdentry->lock);
 	redirfs_put_data(data);
@@ -240,11 +377,14 @@ struct redirfs_data *redirfs_get_data_dentry(redirfs_filter filter,
 	if (!rdentry)
 		return NULL;
 
-	spin_lock(&rdentry->lock);
-
-	data = rfs_find_data(&rdentry->data, filter);
+	if (((struct rfs_flt *)filter)->slot >= 0)
+		data = rfs_data_slot_find(rdentry->slots, filter);
+	else {
+		spin_lock(&rdentry->lock);
+		data = rfs_find_data(&rdentry->data, filter);
+		spin_unlock(&rdentry->lock);
+	}
 
-	spin_unlock(&rdentry->lock);
 	rfs_dentry_put(rdentry);
 	return data;
 }
@@ -271,7 +411,8 @@ struct redirfs_data *redirfs_attach_data_inode(redirfs_filter filter,
 	if (rv)
 		goto exit;
 
-	list_add_tail(&data->list, &rinode->data); 
+	list_add_tail(&data->list, &rinode->data);
+	rfs_data_slot_set(rinode->slots, filter, data);
 	redirfs_get_data(data);
 	rv = redirfs_get_data(data);
 exit:
@@ -296,8 +437,10 @@ struct redirfs_data *redirfs_detach_data_inode(redirfs_filter filter,
 	spin_lock(&rinode->lock);
 
 	data = rfs_find_data(&rinode->data, filter);
-	if (data)
-		list_del(&data->list);
+	if (data) {
+		list_del_init(&data->list);
+		rfs_data_slot_set(rinode->slots, filter, NULL);
+	}
 
 	spin_unlock(&rinode->lock);
 	redirfs_put_data(data);
@@ -318,11 +461,14 @@ struct redirfs_data *redirfs_get_data_inode(redirfs_filter filter,
 	if (!rinode)
 		return NULL;
 
-	spin_lock(&rinode->lock);
-
-	data = rfs_find_data(&rinode->data, filter);
+	if (((struct rfs_flt *)filter)->slot >= 0)
+		data = rfs_data_slot_find(rinode->slots, filter);
+	else {
+		spin_lock(&rinode->lock);
+		data = rfs_find_data(&rinode->data, filter);
+		spin_unlock(&rinode->lock);
+	}
 
-	spin_unlock(&rinode->lock);
 	rfs_inode_put(rinode);
 	return data;
 }
@@ -332,6 +478,8 @@ void rfs_context_init(struct rfs_context *rcont, int start)
 	INIT_LIST_HEAD(&rcont->data);
 	rcont->idx_start = start;
 	rcont->idx = 0;
+	rcont->start = 0;
+	rcont->scratch_map = 0;
 }
 
 void rfs_context_deinit(struct rfs_context *rcont)
@@ -389,6 +537,31 @@ struct redirfs_data *redirfs_get_data_context(redirfs_filter filter,
 	return data;
 }
 
+/*
+ * Allocation free alternative to the context data for passing a small state
+ * from the pre to the post callback. The area is indexed by the filter's data
+ * slot, filters without a slot get NULL and have to use the context data.
+ */
+void *redirfs_context_scratch(redirfs_filter filter, redirfs_context context)
+{
+	struct rfs_context *rcont = (struct rfs_context *)context;
+	int slot;
+
+	if (!filter || IS_ERR(filter) || !context)
+		return NULL;
+
+	slot = ((struct rfs_flt *)filter)->slot;
+	if (slot < 0)
+		return NULL;
+
+	if (!test_bit(slot, &rcont->scratch_map)) {
+		memset(rcont->scratch[slot], 0, REDIRFS_CONTEXT_SCRATCH_SIZE);
+		__set_bit(slot, &rcont->scratch_map);
+	}
+
+	return rcont->scratch[slot];
+}
+
 struct redirfs_data *redirfs_attach_data_root(redirfs_filter filter,
 		redirfs_root root, struct redirfs_data *data)
 {
@@ -476,6 +649,7 @@ EXPORT_SYMBOL(redirfs_get_data_inode);
 EXPORT_SYMBOL(redirfs_attach_data_context);
 EXPORT_SYMBOL(redirfs_detach_data_context);
 EXPORT_SYMBOL(redirfs_get_data_context);
+EXPORT_SYMBOL(redirfs_context_scratch);
 EXPORT_SYMBOL(redirfs_attach_data_root);
 EXPORT_SYMBOL(redirfs_detach_data_root);
 EXPORT_SYMBOL(redirfs_get_data_root);
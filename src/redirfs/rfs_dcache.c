@@ -23,6 +23,8 @@
 
 #include "rfs.h"
 
+static rfs_kmem_cache_t *rfs_dcache_entry_cache = NULL;
+
 struct rfs_dcache_data *rfs_dcache_data_alloc(struct dentry *dentry,
 		struct rfs_info *rinfo, struct rfs_flt *rflt)
 {
@@ -52,7 +54,7 @@ static struct rfs_dcache_entry *rfs_dcache_entry_alloc_locked(
 {
 	struct rfs_dcache_entry *entry;
 
-	entry = kzalloc(sizeof(struct rfs_dcache_entry), GFP_ATOMIC);
+	entry = kmem_cache_alloc(rfs_dcache_entry_cache, GFP_ATOMIC);
 	if (!entry)
 		return ERR_PTR(-ENOMEM);
 
@@ -68,7 +70,7 @@ static struct rfs_dcache_entry *rfs_dcache_entry_alloc(struct dentry *dentry,
 {
 	struct rfs_dcache_entry *entry;
 
-	entry = kzalloc(sizeof(struct rfs_dcache_entry), GFP_KERNEL);
+	entry = kmem_cache_alloc(rfs_dcache_entry_cache, GFP_KERNEL);
 	if (!entry)
 		return ERR_PTR(-ENOMEM);
 
@@ -86,11 +88,30 @@ static void rfs_dcache_entry_free(struct rfs_dcache_entry *entry)
 
 	list_del_init(&entry->list);
 	dput(entry->dentry);
-	kfree(entry);
+	kmem_cache_free(rfs_dcache_entry_cache, entry);
+}
+
+int rfs_dcache_cache_create(void)
+{
+	rfs_dcache_entry_cache = rfs_kmem_cache_create("rfs_dcache_entry_cache",
+			sizeof(struct rfs_dcache_entry));
+
+	if (!rfs_dcache_entry_cache)
+		return -ENOMEM;
+
+	return 0;
 }
 
+void rfs_dcache_cache_destroy(void)
+{
+	kmem_cache_destroy(rfs_dcache_entry_cache);
+}
+
+#define rfs_dcache_attached(dentry) \
+	((dentry)->d_op && (dentry)->d_op->d_iput == rfs_d_iput)
+
 static int rfs_dcache_get_subs_atomic(struct dentry *dir,
-		struct list_head *sibs)
+		struct list_head *sibs, int all)
 {
 	struct rfs_dcache_entry *sib;
 	struct dentry *dentry;
@@ -99,6 +120,8 @@ static int rfs_dcache_get_subs_atomic(struct dentry *dir,
 	rfs_dcache_lock(dir);
 
 	rfs_for_each_d_child(dentry, &dir->d_subdirs) {
+		if (!all && rfs_dcache_attached(dentry))
+			continue;
 
 		sib = rfs_dcache_entry_alloc_locked(dentry, sibs);
 		if (IS_ERR(sib)) {
@@ -113,7 +136,7 @@ static int rfs_dcache_get_subs_atomic(struct dentry *dir,
 }
 
 static int rfs_dcache_get_subs_kernel(struct dentry *dir,
-		struct list_head *sibs)
+		struct list_head *sibs, int all)
 {
 	LIST_HEAD(pool);
 	int pool_size = 32;
@@ -136,6 +159,9 @@ again:
 	rfs_dcache_lock(dir);
 
 	rfs_for_each_d_child(dentry, &dir->d_subdirs) {
+		if (!all && rfs_dcache_attached(dentry))
+			continue;
+
 		if (list_empty(&pool)) {
 			pool_small = 1;
 			break;
@@ -159,17 +185,62 @@ again:
 	return 0;
 }
 
-int rfs_dcache_get_subs(struct dentry *dir, struct list_head *sibs)
+static int rfs_dcache_get_subs_all(struct dentry *dir, struct list_head *sibs,
+		int all)
 {
 	int rv;
 
-	rv = rfs_dcache_get_subs_atomic(dir, sibs);
+	rv = rfs_dcache_get_subs_atomic(dir, sibs, all);
 	if (!rv)
 		return rv;
 
 	rfs_dcache_entry_free_list(sibs);
 	
-	rv = rfs_dcache_get_subs_kernel(dir, sibs);
+	rv = rfs_dcache_get_subs_kernel(dir, sibs, all);
+
+	return rv;
+}
+
+int rfs_dcache_get_subs(struct dentry *dir, struct list_head *sibs)
+{
+	return rfs_dcache_get_subs_all(dir, sibs, 1);
+}
+
+/*
+ * Get only children which are not attached to redirfs yet. Attached
+ * children are skipped under the dcache lock, no entry is allocated and
+ * no reference is taken for them.
+ */
+int rfs_dcache_get_subs_new(struct dentry *dir, struct list_head *sibs)
+{
+	return rfs_dcache_get_subs_all(dir, sibs, 0);
+}
+
+/*
+ * Check whether all children of the directory are known to be attached
+ * to redirfs. rdentry->subs_rinfo is set after readdir attached all of
+ * them for the current rinfo. New dentries are added at the head of
+ * d_subdirs, so it is enough to check the first child to see if some
+ * dentry was added behind our back since then.
+ */
+int rfs_dcache_subs_attached(struct rfs_dentry *rdentry,
+		struct rfs_info *rinfo)
+{
+	struct dentry *dir = rdentry->dentry;
+	struct dentry *dentry;
+	int rv = 1;
+
+	if (rdentry->subs_rinfo != rinfo)
+		return 0;
+
+	rfs_dcache_lock(dir);
+
+	rfs_for_each_d_child(dentry, &dir->d_subdirs) {
+		rv = rfs_dcache_attached(dentry);
+		break;
+	}
+
+	rfs_dcache_unlock(dir);
 
 	return rv;
 }
@@ -312,6 +383,10 @@ int rfs_dcache_rdentry_add(struct dentry *dentry, struct rfs_info *rinfo)
 	if (rv)
 		goto exit;
 
+	if (atomic_read(&rfs_root_lazy_nr) && rdentry->rinode &&
+	    S_ISDIR(rdentry->rinode->inode->i_mode))
+		atomic_set(&rdentry->rinode->lazy, 1);
+
 	rv = rfs_inode_set_rinfo(rdentry->rinode);
 	if (rv)
 		goto exit;
@@ -443,6 +518,128 @@ exit:
 	return rv;
 }
 
+int rfs_dcache_add_lazy(struct dentry *dentry, struct rfs_dcache_data *rdata)
+{
+	struct rfs_root *rroot;
+	int rv;
+
+	rv = rfs_dcache_rdentry_add(dentry, rdata->rinfo);
+	if (rv)
+		return rv;
+
+	list_for_each_entry(rroot, &rfs_root_list, list) {
+		if (rroot->dentry == dentry)
+			continue;
+
+		if (is_subdir(rroot->dentry, dentry))
+			rfs_root_add_walk(rroot->dentry);
+	}
+
+	return 0;
+}
+
+/*
+ * Bumped by every directory rename between two directories. Such a rename
+ * can move a directory still waiting in the lazy walk out of the root, or
+ * move another one in, while the walk has the locks dropped.
+ */
+atomic_t rfs_dcache_rename_seq = ATOMIC_INIT(0);
+
+int rfs_dcache_lazy(struct dentry *dentry, void *data)
+{
+	struct rfs_dcache_data *rdata = data;
+	struct rfs_root *rroot = rdata->rinfo->rroot;
+	struct super_block *sb = rroot->dentry->d_sb;
+	int seq;
+	int rv;
+
+	if (rfs_dcache_skip(dentry, rdata))
+		return 1;
+
+	rv = rfs_dcache_rdentry_add(dentry, rdata->rinfo);
+	if (rv)
+		return rv;
+
+	if (++rroot->lazy_nr % RFS_ROOT_LAZY_CHUNK)
+		return 0;
+
+	seq = atomic_read(&rfs_dcache_rename_seq);
+
+	rfs_mutex_unlock(&rfs_path_mutex);
+	rfs_rename_unlock(sb);
+	cond_resched();
+	rfs_rename_lock(sb);
+	rfs_mutex_lock(&rfs_path_mutex);
+
+	/*
+	 * The directories queued in the walk may not be under the root
+	 * anymore, start over from the root.
+	 */
+	if (rroot->rinfo != rdata->rinfo ||
+	    atomic_read(&rfs_dcache_rename_seq) != seq)
+		return -EAGAIN;
+
+	return 0;
+}
+
+/*
+ * Attach cached children of a lazily attached directory. Called on the
+ * first permission check of the directory, before the path walk can get
+ * to its cached children.
+ */
+void rfs_dcache_lazy_subs(struct rfs_inode *rinode)
+{
+	LIST_HEAD(sibs);
+	struct rfs_dcache_entry *sib;
+	struct rfs_dentry *rdentry = NULL;
+	struct rfs_dentry *rd;
+	struct rfs_info *rinfo;
+
+	if (atomic_cmpxchg(&rinode->lazy, 1, 0) != 1)
+		return;
+
+	rfs_mutex_lock(&rinode->mutex);
+	if (!list_empty(&rinode->rdentries))
+		rdentry = rfs_dentry_get(list_entry(rinode->rdentries.next,
+					struct rfs_dentry, rinode_list));
+	rfs_mutex_unlock(&rinode->mutex);
+
+	if (!rdentry)
+		return;
+
+	rinfo = rfs_dentry_get_rinfo(rdentry);
+
+	if (rfs_dcache_get_subs(rdentry->dentry, &sibs))
+		goto exit;
+
+	list_for_each_entry(sib, &sibs, list) {
+		rd = rfs_dentry_find(sib->dentry);
+		if (rd) {
+			if (rd->rinfo == rinfo || (rd->rinfo->rroot &&
+			    rd->rinfo->rroot->dentry == sib->dentry)) {
+				rfs_dentry_put(rd);
+				continue;
+			}
+			rfs_dentry_put(rd);
+		}
+
+		if (!rinfo->rops) {
+			if (!sib->dentry->d_inode)
+				continue;
+
+			if (!S_ISDIR(sib->dentry->d_inode->i_mode))
+				continue;
+		}
+
+		if (rfs_dcache_rdentry_add(sib->dentry, rinfo))
+			break;
+	}
+exit:
+	rfs_dcache_entry_free_list(&sibs);
+	rfs_info_put(rinfo);
+	rfs_dentry_put(rdentry);
+}
+
 int rfs_dcache_reset(struct dentry *dentry, void *data)
 {
 	struct rfs_dcache_data *rdata = data;
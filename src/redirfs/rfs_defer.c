@@ -0,0 +1,415 @@
+/*
+ * RedirFS: Redirecting File System
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rfs.h"
+
+/*
+ * Deferred post callbacks. The args of the operation are copied with
+ * references to their dentries and inodes and queued to the current cpu.
+ * The queue is processed by the redirfs workqueue thread of that cpu, all
+ * queued operations at once. The record also holds a reference to the
+ * chain, which keeps the filters and their modules alive. If the record
+ * cannot be allocated, the callbacks are called synchronously. The names of
+ * renamed dentries are swapped by d_move before the callbacks run, so the
+ * record keeps copies of them.
+ */
+struct rfs_defer {
+	struct list_head list;
+	struct rfs_chain *rchain;
+	struct redirfs_args rargs;
+	struct qstr names[2];
+	char *names_buf;
+	int idx;
+	int idx_start;
+};
+
+struct rfs_defer_queue {
+	spinlock_t lock;
+	struct list_head list;
+	struct work_struct work;
+};
+
+static DEFINE_PER_CPU(struct rfs_defer_queue, rfs_defer_queues);
+static struct workqueue_struct *rfs_defer_wq;
+static rfs_kmem_cache_t *rfs_defer_cache;
+
+int rfs_defer_supported(enum redirfs_op_id id)
+{
+	switch (id) {
+	case REDIRFS_DIR_IOP_CREATE:
+	case REDIRFS_DIR_IOP_LINK:
+	case REDIRFS_DIR_IOP_UNLINK:
+	case REDIRFS_DIR_IOP_SYMLINK:
+	case REDIRFS_DIR_IOP_MKDIR:
+	case REDIRFS_DIR_IOP_RMDIR:
+	case REDIRFS_DIR_IOP_MKNOD:
+	case REDIRFS_DIR_IOP_RENAME:
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+static void rfs_defer_call(struct rfs_chain *rchain,
+		struct redirfs_args *rargs, int idx, int idx_start)
+{
+	struct rfs_chain_op *rop;
+	struct rfs_context rcont;
+	int i;
+
+	rop = &rchain->ops[rargs->type.id];
+	rfs_context_init(&rcont, idx_start);
+
+	for (i = rop->defer_nr - 1; i >= 0; i--) {
+		if (rop->defer[i].idx > idx)
+			continue;
+
+		if (rop->defer[i].idx < idx_start)
+			break;
+
+		rcont.idx = rop->defer[i].idx;
+		rop->defer[i].cb(&rcont, rargs);
+	}
+
+	rfs_context_deinit(&rcont);
+}
+
+static int rfs_defer_pin(struct inode **inode, struct dentry **dentry)
+{
+	if (*inode) {
+		*inode = igrab(*inode);
+		if (!*inode)
+			return -ENOENT;
+	}
+
+	*dentry = dget(*dentry);
+
+	return 0;
+}
+
+static void rfs_defer_unpin(struct inode *inode, struct dentry *dentry)
+{
+	dput(dentry);
+	iput(inode);
+}
+
+static int rfs_defer_get_names(struct rfs_defer *rdefer)
+{
+	union redirfs_op_args *args = &rdefer->rargs.args;
+	const struct qstr *names[2];
+	char *buf;
+	int i;
+
+	names[0] = args->i_rename.old_name;
+	names[1] = args->i_rename.new_name;
+
+	buf = kmalloc(names[0]->len + names[1]->len + 2, GFP_NOFS);
+	if (!buf)
+		return -ENOMEM;
+
+	rdefer->names_buf = buf;
+
+	for (i = 0; i < 2; i++) {
+		memcpy(buf, names[i]->name, names[i]->len);
+		buf[names[i]->len] = 0;
+		rdefer->names[i].name = (unsigned char *)buf;
+		rdefer->names[i].len = names[i]->len;
+		rdefer->names[i].hash = names[i]->hash;
+		buf += names[i]->len + 1;
+	}
+
+	args->i_rename.old_name = &rdefer->names[0];
+	args->i_rename.new_name = &rdefer->names[1];
+
+	return 0;
+}
+
+static int rfs_defer_get_args(struct rfs_defer *rdefer)
+{
+	union redirfs_op_args *args = &rdefer->rargs.args;
+	int rv;
+
+	rdefer->names_buf = NULL;
+
+	switch (rdefer->rargs.type.id) {
+	case REDIRFS_DIR_IOP_CREATE:
+		args->i_create.nd = NULL;
+		return rfs_defer_pin(&args->i_create.dir,
+				&args->i_create.dentry);
+
+	case REDIRFS_DIR_IOP_LINK:
+		rv = rfs_defer_pin(&args->i_link.dir,
+				&args->i_link.dentry);
+		if (!rv)
+			args->i_link.old_dentry =
+				dget(args->i_link.old_dentry);
+		return rv;
+
+	case REDIRFS_DIR_IOP_UNLINK:
+		return rfs_defer_pin(&args->i_unlink.dir,
+				&args->i_unlink.dentry);
+
+	case REDIRFS_DIR_IOP_SYMLINK:
+		args->i_symlink.oldname = NULL;
+		return rfs_defer_pin(&args->i_symlink.dir,
+				&args->i_symlink.dentry);
+
+	case REDIRFS_DIR_IOP_MKDIR:
+		return rfs_defer_pin(&args->i_mkdir.dir,
+				&args->i_mkdir.dentry);
+
+	case REDIRFS_DIR_IOP_RMDIR:
+		return rfs_defer_pin(&args->i_rmdir.dir,
+				&args->i_rmdir.dentry);
+
+	case REDIRFS_DIR_IOP_MKNOD:
+		return rfs_defer_pin(&args->i_mknod.dir,
+				&args->i_mknod.dentry);
+
+	case REDIRFS_DIR_IOP_RENAME:
+		rv = rfs_defer_get_names(rdefer);
+		if (rv)
+			return rv;
+
+		rv = rfs_defer_pin(&args->i_rename.old_dir,
+				&args->i_rename.old_dentry);
+		if (rv)
+			goto err_names;
+
+		rv = rfs_defer_pin(&args->i_rename.new_dir,
+				&args->i_rename.new_dentry);
+		if (!rv)
+			return 0;
+
+		rfs_defer_unpin(args->i_rename.old_dir,
+				args->i_rename.old_dentry);
+err_names:
+		kfree(rdefer->names_buf);
+		return rv;
+
+	default:
+		BUG();
+	}
+
+	return -EINVAL;
+}
+
+static void rfs_defer_put_args(struct rfs_defer *rdefer)
+{
+	union redirfs_op_args *args = &rdefer->rargs.args;
+
+	switch (rdefer->rargs.type.id) {
+	case REDIRFS_DIR_IOP_CREATE:
+		rfs_defer_unpin(args->i_create.dir,
+				args->i_create.dentry);
+		break;
+
+	case REDIRFS_DIR_IOP_LINK:
+		dput(args->i_link.old_dentry);
+		rfs_defer_unpin(args->i_link.dir, args->i_link.dentry);
+		break;
+
+	case REDIRFS_DIR_IOP_UNLINK:
+		rfs_defer_unpin(args->i_unlink.dir,
+				args->i_unlink.dentry);
+		break;
+
+	case REDIRFS_DIR_IOP_SYMLINK:
+		rfs_defer_unpin(args->i_symlink.dir,
+				args->i_symlink.dentry);
+		break;
+
+	case REDIRFS_DIR_IOP_MKDIR:
+		rfs_defer_unpin(args->i_mkdir.dir,
+				args->i_mkdir.dentry);
+		break;
+
+	case REDIRFS_DIR_IOP_RMDIR:
+		rfs_defer_unpin(args->i_rmdir.dir,
+				args->i_rmdir.dentry);
+		break;
+
+	case REDIRFS_DIR_IOP_MKNOD:
+		rfs_defer_unpin(args->i_mknod.dir,
+				args->i_mknod.dentry);
+		break;
+
+	case REDIRFS_DIR_IOP_RENAME:
+		rfs_defer_unpin(args->i_rename.old_dir,
+				args->i_rename.old_dentry);
+		rfs_defer_unpin(args->i_rename.new_dir,
+				args->i_rename.new_dentry);
+		kfree(rdefer->names_buf);
+		break;
+
+	default:
+		BUG();
+	}
+}
+
+static void rfs_defer_run(struct rfs_defer_queue *rqueue)
+{
+	struct rfs_defer *rdefer;
+	struct rfs_defer *tmp;
+	LIST_HEAD(head);
+
+	spin_lock(&rqueue->lock);
+	list_splice_init(&rqueue->list, &head);
+	spin_unlock(&rqueue->lock);
+
+	list_for_each_entry_safe(rdefer, tmp, &head, list) {
+		list_del(&rdefer->list);
+		rfs_defer_call(rdefer->rchain, &rdefer->rargs, rdefer->idx,
+				rdefer->idx_start);
+		rfs_defer_put_args(rdefer);
+		rfs_chain_put(rdefer->rchain);
+		kmem_cache_free(rfs_defer_cache, rdefer);
+	}
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20))
+static void rfs_defer_work_fn(void *data)
+{
+	rfs_defer_run(data);
+}
+#else
+static void rfs_defer_work_fn(struct work_struct *work)
+{
+	rfs_defer_run(container_of(work, struct rfs_defer_queue, work));
+}
+#endif
+
+#ifdef CONFIG_HOTPLUG_CPU
+/*
+ * The worker of an offlined cpu may never get to its queue, the records left
+ * there are run from the notifier once the cpu is dead.
+ */
+static int rfs_defer_cpu_callback(struct notifier_block *nb,
+		unsigned long action, void *hcpu)
+{
+	long cpu = (long)hcpu;
+
+	switch (action) {
+	case CPU_DEAD:
+#ifdef CPU_DEAD_FROZEN
+	case CPU_DEAD_FROZEN:
+#endif
+		rfs_defer_run(&per_cpu(rfs_defer_queues, cpu));
+		break;
+	}
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block rfs_defer_cpu_notifier = {
+	.notifier_call = rfs_defer_cpu_callback
+};
+#endif
+
+void rfs_defer_add(struct rfs_chain *rchain, struct redirfs_args *rargs,
+		int idx, int idx_start)
+{
+	struct rfs_defer_queue *rqueue;
+	struct rfs_defer *rdefer;
+	int empty;
+
+	rdefer = kmem_cache_alloc(rfs_defer_cache, GFP_NOFS);
+	if (!rdefer)
+		goto sync;
+
+	rdefer->rargs = *rargs;
+	if (rfs_defer_get_args(rdefer)) {
+		kmem_cache_free(rfs_defer_cache, rdefer);
+		goto sync;
+	}
+
+	rdefer->rchain = rfs_chain_get(rchain);
+	rdefer->idx = idx;
+	rdefer->idx_start = idx_start;
+
+	rqueue = &get_cpu_var(rfs_defer_queues);
+
+	spin_lock(&rqueue->lock);
+	empty = list_empty(&rqueue->list);
+	list_add_tail(&rdefer->list, &rqueue->list);
+	spin_unlock(&rqueue->lock);
+
+	if (empty)
+		queue_work(rfs_defer_wq, &rqueue->work);
+
+	put_cpu_var(rfs_defer_queues);
+
+	return;
+sync:
+	rfs_defer_call(rchain, rargs, idx, idx_start);
+}
+
+void rfs_defer_flush(void)
+{
+	might_sleep();
+
+	flush_workqueue(rfs_defer_wq);
+}
+
+int rfs_defer_create(void)
+{
+	struct rfs_defer_queue *rqueue;
+	int cpu;
+
+	rfs_defer_cache = rfs_kmem_cache_create("rfs_defer_cache",
+			sizeof(struct rfs_defer));
+	if (!rfs_defer_cache)
+		return -ENOMEM;
+
+	rfs_defer_wq = create_workqueue("redirfs");
+	if (!rfs_defer_wq) {
+		kmem_cache_destroy(rfs_defer_cache);
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu) {
+		rqueue = &per_cpu(rfs_defer_queues, cpu);
+		spin_lock_init(&rqueue->lock);
+		INIT_LIST_HEAD(&rqueue->list);
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20))
+		INIT_WORK(&rqueue->work, rfs_defer_work_fn, rqueue);
+#else
+		INIT_WORK(&rqueue->work, rfs_defer_work_fn);
+#endif
+	}
+
+#ifdef CONFIG_HOTPLUG_CPU
+	register_cpu_notifier(&rfs_defer_cpu_notifier);
+#endif
+	return 0;
+}
+
+void rfs_defer_destroy(void)
+{
+#ifdef CONFIG_HOTPLUG_CPU
+	unregister_cpu_notifier(&rfs_defer_cpu_notifier);
+#endif
+	destroy_workqueue(rfs_defer_wq);
+	kmem_cache_destroy(rfs_defer_cache);
+}
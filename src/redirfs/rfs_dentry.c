@@ -24,32 +24,239 @@
 #include "rfs.h"
 
 static rfs_kmem_cache_t *rfs_dentry_cache = NULL;
+static struct rfs_hash rfs_dentry_hash;
+static LIST_HEAD(rfs_dentry_lru);
+static DEFINE_SPINLOCK(rfs_dentry_lru_lock);
+static long rfs_dentry_lru_nr;
+
+static int rfs_d_revalidate_detached(struct dentry *dentry,
+		struct nameidata *nd);
+static void rfs_d_release_detached(struct dentry *dentry);
+
+#define rfs_dentry_detached(dentry) \
+	((dentry)->d_op && (dentry)->d_op->d_release == rfs_d_release_detached)
 
 static struct rfs_dentry *rfs_dentry_alloc(struct dentry *dentry)
 {
+	struct dentry_operations op_new;
 	struct rfs_dentry *rdentry;
 
 	rdentry = kmem_cache_zalloc(rfs_dentry_cache, GFP_KERNEL);
 	if (!rdentry)
 		return ERR_PTR(-ENOMEM);
 
+	rfs_mem_inc(RFS_MEM_DENTRY, sizeof(struct rfs_dentry));
+
 	INIT_LIST_HEAD(&rdentry->rinode_list);
 	INIT_LIST_HEAD(&rdentry->rfiles);
 	INIT_LIST_HEAD(&rdentry->data);
+	INIT_HLIST_NODE(&rdentry->hash);
+	INIT_LIST_HEAD(&rdentry->lru);
 	rdentry->dentry = dentry;
 	rdentry->op_old = dentry->d_op;
 	spin_lock_init(&rdentry->lock);
 	atomic_set(&rdentry->count, 1);
 
-	if (dentry->d_op)
-		memcpy(&rdentry->op_new, dentry->d_op,
+	/*
+	 * Workaround for the isofs_lookup function. It assigns
+	 * dentry operations for the new dentry from the root dentry.
+	 * This leads to the situation when the new dentry has our
+	 * shared operations but no rdentry object.
+	 *
+	 * isofs_lookup: dentry->d_op = dir->i_sb->s_root->d_op;
+	 *
+	 * A dentry detached by the shrinker has the detached operations, which
+	 * are interned on top of the original ones as well.
+	 */
+	if (dentry->d_op && (dentry->d_op->d_iput == rfs_d_iput ||
+				rfs_dentry_detached(dentry)))
+		rdentry->op_old = rfs_optab_old(dentry->d_op);
+
+	if (rdentry->op_old)
+		memcpy(&op_new, rdentry->op_old,
 				sizeof(struct dentry_operations));
+	else
+		memset(&op_new, 0, sizeof(struct dentry_operations));
+
+	op_new.d_iput = rfs_d_iput;
 
-	rdentry->op_new.d_iput = rfs_d_iput;
+	rdentry->op_new = rfs_optab_get(rdentry->op_old, &op_new,
+			sizeof(struct dentry_operations));
+	if (!rdentry->op_new) {
+		rfs_mem_dec(RFS_MEM_DENTRY, sizeof(struct rfs_dentry));
+		kmem_cache_free(rfs_dentry_cache, rdentry);
+		return ERR_PTR(-ENOMEM);
+	}
 
 	return rdentry;
 }
 
+static void rfs_dentry_free(struct rcu_head *head)
+{
+	struct rfs_dentry *rdentry;
+
+	rdentry = container_of(head, struct rfs_dentry, rcu);
+	rfs_mem_dec(RFS_MEM_DENTRY, sizeof(struct rfs_dentry));
+	kmem_cache_free(rfs_dentry_cache, rdentry);
+}
+
+/*
+ * Lookups mark the rdentry as recently used for the shrinker, the flag is
+ * only written when it changes to keep the cache line shared.
+ */
+static inline void rfs_dentry_touch(struct rfs_dentry *rdentry)
+{
+	if (!rdentry->referenced)
+		rdentry->referenced = 1;
+}
+
+static const void *rfs_dentry_hash_key(struct hlist_node *node)
+{
+	return hlist_entry(node, struct rfs_dentry, hash)->dentry;
+}
+
+static int rfs_dentry_match(struct hlist_node *node, const void *dentry)
+{
+	struct rfs_dentry *rdentry = hlist_entry(node, struct rfs_dentry, hash);
+
+	if (rdentry->dentry != dentry)
+		return 0;
+
+	if (!atomic_inc_not_zero(&rdentry->count))
+		return 0;
+
+	rfs_dentry_touch(rdentry);
+	return 1;
+}
+
+static int rfs_dentry_match_rcu(struct hlist_node *node, const void *dentry)
+{
+	struct rfs_dentry *rdentry = hlist_entry(node, struct rfs_dentry, hash);
+
+	if (rdentry->dentry != dentry || !atomic_read(&rdentry->count))
+		return 0;
+
+	rfs_dentry_touch(rdentry);
+	return 1;
+}
+
+struct rfs_dentry *rfs_dentry_lookup(struct dentry *dentry)
+{
+	struct hlist_node *node;
+
+	rcu_read_lock();
+	node = rfs_hash_lookup_rcu(&rfs_dentry_hash, dentry, rfs_dentry_match);
+	rcu_read_unlock();
+
+	if (!node)
+		return NULL;
+
+	return hlist_entry(node, struct rfs_dentry, hash);
+}
+
+struct rfs_dentry *rfs_dentry_lookup_rcu(struct dentry *dentry)
+{
+	struct hlist_node *node;
+
+	node = rfs_hash_lookup_rcu(&rfs_dentry_hash, dentry,
+			rfs_dentry_match_rcu);
+	if (!node)
+		return NULL;
+
+	return hlist_entry(node, struct rfs_dentry, hash);
+}
+
+static void rfs_dentry_hash_add(struct rfs_dentry *rdentry)
+{
+	rfs_hash_add(&rfs_dentry_hash, rdentry->dentry, &rdentry->hash);
+}
+
+static void rfs_dentry_hash_rem(struct rfs_dentry *rdentry)
+{
+	rfs_hash_rem(&rfs_dentry_hash, rdentry->dentry, &rdentry->hash);
+}
+
+static void rfs_dentry_lru_add(struct rfs_dentry *rdentry)
+{
+	spin_lock(&rfs_dentry_lru_lock);
+	list_add_tail(&rdentry->lru, &rfs_dentry_lru);
+	rfs_dentry_lru_nr++;
+	spin_unlock(&rfs_dentry_lru_lock);
+}
+
+static void rfs_dentry_lru_del(struct rfs_dentry *rdentry)
+{
+	spin_lock(&rfs_dentry_lru_lock);
+	if (!list_empty(&rdentry->lru)) {
+		list_del_init(&rdentry->lru);
+		rfs_dentry_lru_nr--;
+	}
+	spin_unlock(&rfs_dentry_lru_lock);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38)
+
+/*
+ * The VFS calls d_hash, d_compare, d_revalidate and d_delete only when the
+ * DCACHE_OP_* flag is set, so keep the flags in sync with the operations
+ * actually installed. Called with the d_lock held.
+ */
+static void rfs_dentry_set_d_op(struct dentry *dentry,
+		const struct dentry_operations *op)
+{
+	dentry->d_flags &= ~(DCACHE_OP_HASH | DCACHE_OP_COMPARE |
+			DCACHE_OP_REVALIDATE | DCACHE_OP_DELETE);
+
+	if (op) {
+		if (op->d_hash)
+			dentry->d_flags |= DCACHE_OP_HASH;
+		if (op->d_compare)
+			dentry->d_flags |= DCACHE_OP_COMPARE;
+		if (op->d_revalidate)
+			dentry->d_flags |= DCACHE_OP_REVALIDATE;
+		if (op->d_delete)
+			dentry->d_flags |= DCACHE_OP_DELETE;
+	}
+
+	dentry->d_op = op;
+}
+
+#else
+
+static inline void rfs_dentry_set_d_op(struct dentry *dentry,
+		const struct dentry_operations *op)
+{
+	dentry->d_op = op;
+}
+
+#endif
+
+static void rfs_dentry_swap_ops(struct rfs_dentry *rdentry,
+		struct dentry_operations *op_new)
+{
+	const struct dentry_operations *op_old;
+	const struct dentry_operations *op;
+
+	op = rfs_optab_get(rdentry->op_old, op_new,
+			sizeof(struct dentry_operations));
+	if (!op) {
+		printk(KERN_ERR "redirfs: cannot allocate dentry operations\n");
+		return;
+	}
+
+	op_old = rdentry->op_new;
+	rdentry->op_new = op;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38)
+	cmpxchg(&rdentry->dentry->d_op, op_old, op);
+#else
+	spin_lock(&rdentry->dentry->d_lock);
+	if (rdentry->dentry->d_op == op_old)
+		rfs_dentry_set_d_op(rdentry->dentry, op);
+	spin_unlock(&rdentry->dentry->d_lock);
+#endif
+	rfs_optab_put(op_old);
+}
+
 struct rfs_dentry *rfs_dentry_get(struct rfs_dentry *rdentry)
 {
 	if (!rdentry || IS_ERR(rdentry))
@@ -71,14 +278,18 @@ void rfs_dentry_put(struct rfs_dentry *rdentry)
 		return;
 
 	rfs_inode_put(rdentry->rinode);
+	rfs_mem_root_dec(rdentry->rinfo);
 	rfs_info_put(rdentry->rinfo);
+	rfs_name_rem(rdentry);
 
 	rfs_data_remove(&rdentry->data);
-	kmem_cache_free(rfs_dentry_cache, rdentry);
+	rfs_optab_put(rdentry->op_new);
+	call_rcu(&rdentry->rcu, rfs_dentry_free);
 }
 
 struct rfs_dentry *rfs_dentry_add(struct dentry *dentry, struct rfs_info *rinfo)
 {
+	const struct dentry_operations *op_detached = NULL;
 	struct rfs_dentry *rd_new;
 	struct rfs_dentry *rd;
 
@@ -93,29 +304,21 @@ struct rfs_dentry *rfs_dentry_add(struct dentry *dentry, struct rfs_info *rinfo)
 
 	rd = rfs_dentry_find(dentry);
 
-	/*
-	 * Workaround for the isofs_lookup function. It assigns
-	 * dentry operations for the new dentry from the root dentry.
-	 * This leads to the situation when one rdentry object can be
-	 * found for more dentry objects.
-	 *
-	 * isofs_lookup: dentry->d_op = dir->i_sb->s_root->d_op;
-	 */
-	if (rd && (rd->dentry != dentry)) {
-		rd_new->op_old = rd->op_old;
-		rfs_dentry_put(rd);
-		rd = NULL;
-	}
-
 	if (!rd) {
+		if (rfs_dentry_detached(dentry))
+			op_detached = dentry->d_op;
 		rd_new->rinfo = rfs_info_get(rinfo);
-		dentry->d_op = &rd_new->op_new;
+		rfs_mem_root_inc(rinfo);
+		rfs_dentry_set_d_op(dentry, rd_new->op_new);
 		rfs_dentry_get(rd_new);
+		rfs_dentry_hash_add(rd_new);
+		rfs_dentry_lru_add(rd_new);
 		rd = rfs_dentry_get(rd_new);
 	}
 
 	spin_unlock(&dentry->d_lock);
 
+	rfs_optab_put(op_detached);
 	rfs_dentry_put(rd_new);
 
 	return rd;
@@ -123,7 +326,16 @@ struct rfs_dentry *rfs_dentry_add(struct dentry *dentry, struct rfs_info *rinfo)
 
 void rfs_dentry_del(struct rfs_dentry *rdentry)
 {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38)
 	rdentry->dentry->d_op = rdentry->op_old;
+#else
+	spin_lock(&rdentry->dentry->d_lock);
+	rfs_dentry_set_d_op(rdentry->dentry, rdentry->op_old);
+	spin_unlock(&rdentry->dentry->d_lock);
+#endif
+	smp_wmb();
+	rfs_dentry_hash_rem(rdentry);
+	rfs_dentry_lru_del(rdentry);
 	rfs_dentry_put(rdentry);
 }
 
@@ -185,10 +397,15 @@ struct rfs_info *rfs_dentry_get_rinfo(struct rfs_dentry *rdentry)
 
 void rfs_dentry_set_rinfo(struct rfs_dentry *rdentry, struct rfs_info *rinfo)
 {
+	struct rfs_info *rinfo_old;
+
 	spin_lock(&rdentry->lock);
-	rfs_info_put(rdentry->rinfo);
-	rdentry->rinfo = rfs_info_get(rinfo);
+	rinfo_old = rdentry->rinfo;
+	rcu_assign_pointer(rdentry->rinfo, rfs_info_get(rinfo));
+	rfs_mem_root_dec(rinfo_old);
+	rfs_mem_root_inc(rinfo);
 	spin_unlock(&rdentry->lock);
+	rfs_info_put(rinfo_old);
 }
 
 void rfs_dentry_add_rfile(struct rfs_dentry *rdentry, struct rfs_file *rfile)
@@ -207,6 +424,258 @@ void rfs_dentry_rem_rfile(struct rfs_file *rfile)
 	rfs_file_put(rfile);
 }
 
+/*
+ * Under memory pressure the redirfs objects of cold dentries are freed. The
+ * rdentries are kept on a clock list, a lookup marks the rdentry as
+ * referenced and the shrinker gives a referenced rdentry one more round
+ * instead of detaching it. An unused negative or non-directory dentry is
+ * detached in place, its rdentry, rinode and the data attached by filters
+ * are released, but the dentry itself stays in the dcache. It gets detached
+ * operations shared by all detached dentries with the same original ones,
+ * and rfs_d_revalidate_detached attaches it again on the next lookup.
+ * Directories are kept, their rdentries are needed to attach new children.
+ *
+ * The VM calls the shrinker with locks held, possibly the ones taken by
+ * redirfs itself, so the shrinker only queues the work on the rfs_info
+ * workqueue.
+ */
+static atomic_t rfs_dentry_shrink_nr = ATOMIC_INIT(0);
+
+#define RFS_DENTRY_SHRINK_SAMPLE 64
+
+/*
+ * Called with the d_lock held. Dirty and writeback pages are still written
+ * through the filters, such inodes keep their rinodes.
+ */
+static int rfs_dentry_detachable(struct rfs_dentry *rdentry)
+{
+	struct dentry *dentry = rdentry->dentry;
+	struct inode *inode = dentry->d_inode;
+
+	if (rfs_d_count(dentry) || d_unhashed(dentry) || d_mountpoint(dentry))
+		return 0;
+
+	if (dentry->d_op != rdentry->op_new)
+		return 0;
+
+	if (!inode)
+		return 1;
+
+	if (S_ISDIR(inode->i_mode))
+		return 0;
+
+	if (mapping_tagged(inode->i_mapping, PAGECACHE_TAG_DIRTY) ||
+	    mapping_tagged(inode->i_mapping, PAGECACHE_TAG_WRITEBACK))
+		return 0;
+
+	return 1;
+}
+
+static int rfs_dentry_detach(struct rfs_dentry *rdentry)
+{
+	struct dentry_operations op_detached;
+	const struct dentry_operations *op;
+	struct dentry *dentry = rdentry->dentry;
+	struct rfs_info *rinfo;
+	struct inode *inode;
+	int root;
+
+	rinfo = rfs_dentry_get_rinfo(rdentry);
+	root = rinfo && rinfo->rroot && rinfo->rroot->dentry == dentry;
+	rfs_info_put(rinfo);
+	if (root)
+		return 0;
+
+	if (rdentry->op_old)
+		memcpy(&op_detached, rdentry->op_old,
+				sizeof(struct dentry_operations));
+	else
+		memset(&op_detached, 0, sizeof(struct dentry_operations));
+
+	op_detached.d_revalidate = rfs_d_revalidate_detached;
+	op_detached.d_release = rfs_d_release_detached;
+
+	op = rfs_optab_get(rdentry->op_old, &op_detached,
+			sizeof(struct dentry_operations));
+	if (!op)
+		return -ENOMEM;
+
+	/*
+	 * The dentry is pinned so its inode cannot go away before the rinode
+	 * is removed. Before 2.6.38 a dentry with zero count can be pinned
+	 * only under the dcache_lock.
+	 */
+	rfs_dcache_lock(dentry);
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38))
+	spin_lock(&dentry->d_lock);
+#endif
+	if (!rfs_dentry_detachable(rdentry)) {
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38))
+		spin_unlock(&dentry->d_lock);
+#endif
+		rfs_dcache_unlock(dentry);
+		rfs_optab_put(op);
+		return 0;
+	}
+
+	rfs_dget_locked(dentry);
+	inode = dentry->d_inode;
+	rfs_dentry_set_d_op(dentry, op);
+	smp_wmb();
+	rfs_dentry_hash_rem(rdentry);
+	rfs_dentry_lru_del(rdentry);
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38))
+	spin_unlock(&dentry->d_lock);
+#endif
+	rfs_dcache_unlock(dentry);
+
+	if (inode && rfs_dcache_rinode_del(rdentry, inode))
+		printk(KERN_ERR "redirfs: cannot reset inode of a detached "
+				"dentry\n");
+
+	rfs_dentry_put(rdentry);
+	dput(dentry);
+
+	return 1;
+}
+
+static void rfs_dentry_shrink(void)
+{
+	struct rfs_dentry *rdentry;
+	long nr_scan;
+
+	nr_scan = atomic_xchg(&rfs_dentry_shrink_nr, 0);
+
+	spin_lock(&rfs_dentry_lru_lock);
+
+	if (nr_scan > rfs_dentry_lru_nr)
+		nr_scan = rfs_dentry_lru_nr;
+
+	while (nr_scan-- > 0 && !list_empty(&rfs_dentry_lru)) {
+		rdentry = list_entry(rfs_dentry_lru.next, struct rfs_dentry,
+				lru);
+		list_move_tail(&rdentry->lru, &rfs_dentry_lru);
+
+		if (rdentry->referenced) {
+			rdentry->referenced = 0;
+			continue;
+		}
+
+		if (!atomic_inc_not_zero(&rdentry->count))
+			continue;
+
+		spin_unlock(&rfs_dentry_lru_lock);
+
+		if (rfs_dentry_detach(rdentry) < 0) {
+			rfs_dentry_put(rdentry);
+			return;
+		}
+
+		rfs_dentry_put(rdentry);
+		cond_resched();
+		spin_lock(&rfs_dentry_lru_lock);
+	}
+
+	spin_unlock(&rfs_dentry_lru_lock);
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20))
+static void rfs_dentry_shrink_work_fn(void *data)
+{
+	rfs_dentry_shrink();
+}
+
+static DECLARE_WORK(rfs_dentry_shrink_work, rfs_dentry_shrink_work_fn, NULL);
+#else
+static void rfs_dentry_shrink_work_fn(struct work_struct *work)
+{
+	rfs_dentry_shrink();
+}
+
+static DECLARE_WORK(rfs_dentry_shrink_work, rfs_dentry_shrink_work_fn);
+#endif
+
+/*
+ * Most rdentries belong to directories or dentries in use, reporting all of
+ * them makes the VM call the shrinker over and over for nothing. The share
+ * of cold unused ones is sampled at the head of the clock list without the
+ * d_lock, it is only an estimate.
+ */
+static int rfs_dentry_shrink_count(int nr_scan, gfp_t gfp_mask)
+{
+	struct rfs_dentry *rdentry;
+	long sampled = 0;
+	long found = 0;
+	long nr;
+
+	if (nr_scan) {
+		atomic_add(nr_scan, &rfs_dentry_shrink_nr);
+		queue_work(rfs_info_wq, &rfs_dentry_shrink_work);
+	}
+
+	spin_lock(&rfs_dentry_lru_lock);
+
+	list_for_each_entry(rdentry, &rfs_dentry_lru, lru) {
+		if (sampled == RFS_DENTRY_SHRINK_SAMPLE)
+			break;
+
+		sampled++;
+		if (!rdentry->referenced && !rfs_d_count(rdentry->dentry))
+			found++;
+	}
+
+	nr = rfs_dentry_lru_nr;
+
+	spin_unlock(&rfs_dentry_lru_lock);
+
+	if (!found)
+		return 0;
+
+	return nr * found / sampled;
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0))
+static int rfs_dentry_shrinker_fn(struct shrinker *shrink,
+		struct shrink_control *sc)
+{
+	return rfs_dentry_shrink_count(sc->nr_to_scan, sc->gfp_mask);
+}
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35))
+static int rfs_dentry_shrinker_fn(struct shrinker *shrink, int nr_to_scan,
+		gfp_t gfp_mask)
+{
+	return rfs_dentry_shrink_count(nr_to_scan, gfp_mask);
+}
+#else
+static int rfs_dentry_shrinker_fn(int nr_to_scan, gfp_t gfp_mask)
+{
+	return rfs_dentry_shrink_count(nr_to_scan, gfp_mask);
+}
+#endif
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,23))
+
+static struct shrinker rfs_dentry_shrinker = {
+	.shrink = rfs_dentry_shrinker_fn,
+	.seeks = DEFAULT_SEEKS
+};
+
+#define rfs_dentry_shrinker_register() register_shrinker(&rfs_dentry_shrinker)
+#define rfs_dentry_shrinker_unregister() \
+	unregister_shrinker(&rfs_dentry_shrinker)
+
+#else
+
+static struct shrinker *rfs_dentry_shrinker;
+
+#define rfs_dentry_shrinker_register() \
+	(rfs_dentry_shrinker = set_shrinker(DEFAULT_SEEKS, \
+					    rfs_dentry_shrinker_fn))
+#define rfs_dentry_shrinker_unregister() \
+	remove_shrinker(rfs_dentry_shrinker)
+
+#endif
+
 int rfs_dentry_cache_create(void)
 {
 	rfs_dentry_cache = rfs_kmem_cache_create("rfs_dentry_cache",
@@ -215,11 +684,24 @@ int rfs_dentry_cache_create(void)
 	if (!rfs_dentry_cache)
 		return -ENOMEM;
 
+	if (rfs_hash_init(&rfs_dentry_hash,
+			rfs_hash_mem_bits(RFS_HASH_MEM_SHIFT),
+			rfs_hash_mem_bits(0), rfs_dentry_hash_key)) {
+		kmem_cache_destroy(rfs_dentry_cache);
+		return -ENOMEM;
+	}
+
+	rfs_dentry_shrinker_register();
+
 	return 0;
 }
 
 void rfs_dentry_cache_destory(void)
 {
+	rfs_dentry_shrinker_unregister();
+	flush_workqueue(rfs_info_wq);
+	rcu_barrier();
+	rfs_hash_destroy(&rfs_dentry_hash);
 	kmem_cache_destroy(rfs_dentry_cache);
 }
 
@@ -229,9 +711,11 @@ void rfs_d_iput(struct dentry *dentry, struct inode *inode)
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
+	int idx;
 
 	rdentry = rfs_dentry_find(dentry);
-	rinfo = rfs_dentry_get_rinfo(rdentry);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_dentry_rcu_rinfo(rdentry);
 	rfs_context_init(&rcont, 0);
 
 	if (S_ISREG(inode->i_mode))
@@ -266,7 +750,7 @@ void rfs_d_iput(struct dentry *dentry, struct inode *inode)
 	rfs_context_deinit(&rcont);
 
 	rfs_dentry_put(rdentry);
-	rfs_info_put(rinfo);
+	rfs_info_read_unlock(idx);
 }
 
 static void rfs_d_release(struct dentry *dentry)
@@ -275,9 +759,11 @@ static void rfs_d_release(struct dentry *dentry)
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
+	int idx;
 
 	rdentry = rfs_dentry_find(dentry);
-	rinfo = rfs_dentry_get_rinfo(rdentry);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_dentry_rcu_rinfo(rdentry);
 	rfs_context_init(&rcont, 0);
 	rargs.type.id = REDIRFS_NONE_DOP_D_RELEASE;
 	rargs.args.d_release.dentry = dentry;
@@ -292,7 +778,7 @@ static void rfs_d_release(struct dentry *dentry)
 
 	rfs_dentry_del(rdentry);
 	rfs_dentry_put(rdentry);
-	rfs_info_put(rinfo);
+	rfs_info_read_unlock(idx);
 }
 
 static inline int rfs_d_compare_default(const struct qstr *name1,
@@ -315,9 +801,11 @@ static int rfs_d_compare(struct dentry *dentry, struct qstr *name1,
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
+	int idx;
 
 	rdentry = rfs_dentry_find(dentry);
-	rinfo = rfs_dentry_get_rinfo(rdentry);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_dentry_rcu_rinfo(rdentry);
 	rfs_context_init(&rcont, 0);
 
 	if (dentry->d_inode) {
@@ -358,26 +846,44 @@ static int rfs_d_compare(struct dentry *dentry, struct qstr *name1,
 	rfs_context_deinit(&rcont);
 
 	rfs_dentry_put(rdentry);
-	rfs_info_put(rinfo);
+	rfs_info_read_unlock(idx);
 
 	return rargs.rv.rv_int;
 }
 
 #else
 
+/*
+ * The d_compare is called in the rcu-walk as well as in the ref-walk always
+ * within the rcu read section and it cannot fall back, so no reference to
+ * the rdentry is taken and filters hooking it must not block.
+ */
 static int rfs_d_compare(const struct dentry *parent, const struct inode *inode,
 		const struct dentry *dentry, const struct inode *d_inode,
 		unsigned int tlen, const char *tname,
 		const struct qstr *name)
 {
+	const struct dentry_operations *op;
 	struct rfs_dentry *rdentry;
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
+	int idx;
 
-	rdentry = rfs_dentry_find(dentry);
-	rinfo = rfs_dentry_get_rinfo(rdentry);
-	rfs_context_init(&rcont, 0);
+	idx = rfs_info_read_lock();
+
+	rdentry = rfs_dentry_find_rcu(dentry);
+	if (!rdentry) {
+		rfs_info_read_unlock(idx);
+		op = ACCESS_ONCE(dentry->d_op);
+		if (op && op->d_compare && op->d_compare != rfs_d_compare)
+			return op->d_compare(parent, inode, dentry, d_inode,
+					tlen, tname, name);
+
+		return rfs_d_compare_default(&dentry->d_name, name);
+	}
+
+	rinfo = rfs_dentry_rcu_rinfo(rdentry);
 
 	if (dentry->d_inode) {
 		if (S_ISREG(dentry->d_inode->i_mode))
@@ -397,6 +903,18 @@ static int rfs_d_compare(const struct dentry *parent, const struct inode *inode,
 	} else
 		rargs.type.id = REDIRFS_NONE_DOP_D_COMPARE;
 
+	if (!rfs_chain_op_nr(rinfo->rchain, rargs.type.id)) {
+		if (rdentry->op_old && rdentry->op_old->d_compare)
+			rargs.rv.rv_int = rdentry->op_old->d_compare(parent,
+					inode, dentry, d_inode, tlen, tname,
+					name);
+		else
+			rargs.rv.rv_int = rfs_d_compare_default(
+					&dentry->d_name, name);
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
 	rargs.args.d_compare.parent = parent;
 	rargs.args.d_compare.inode = inode;
 	rargs.args.d_compare.dentry = dentry;
@@ -423,25 +941,55 @@ static int rfs_d_compare(const struct dentry *parent, const struct inode *inode,
 
 	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
 	rfs_context_deinit(&rcont);
-
-	rfs_dentry_put(rdentry);
-	rfs_info_put(rinfo);
+exit:
+	rfs_info_read_unlock(idx);
 
 	return rargs.rv.rv_int;
 }
 
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38)
+#define rfs_nd_rcu(nd) 0
+#else
+#define rfs_nd_rcu(nd) ((nd) && ((nd)->flags & LOOKUP_RCU))
+#endif
+
+static inline int rfs_d_revalidate_old(struct rfs_dentry *rdentry,
+		struct dentry *dentry, struct nameidata *nd)
+{
+	if (rdentry->op_old && rdentry->op_old->d_revalidate)
+		return rdentry->op_old->d_revalidate(dentry, nd);
+
+	return 1;
+}
+
+/*
+ * In the rcu-walk no reference to the rdentry is taken and the filters are
+ * called only if all of them are marked as rcu safe. Otherwise -ECHILD makes
+ * the VFS to repeat the lookup in the ref-walk.
+ */
 static int rfs_d_revalidate(struct dentry *dentry, struct nameidata *nd)
 {
 	struct rfs_dentry *rdentry;
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
+	int rcu = rfs_nd_rcu(nd);
+	int idx;
 
-	rdentry = rfs_dentry_find(dentry);
-	rinfo = rfs_dentry_get_rinfo(rdentry);
-	rfs_context_init(&rcont, 0);
+	idx = rfs_info_read_lock();
+
+	if (rcu) {
+		rdentry = rfs_dentry_find_rcu(dentry);
+		if (!rdentry) {
+			rfs_info_read_unlock(idx);
+			return -ECHILD;
+		}
+	} else
+		rdentry = rfs_dentry_find(dentry);
+
+	rinfo = rfs_dentry_rcu_rinfo(rdentry);
 
 	if (dentry->d_inode) {
 		if (S_ISREG(dentry->d_inode->i_mode))
@@ -461,86 +1009,196 @@ static int rfs_d_revalidate(struct dentry *dentry, struct nameidata *nd)
 	} else
 		rargs.type.id = REDIRFS_NONE_DOP_D_REVALIDATE;
 
+	if (!rfs_chain_op_nr(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_int = rfs_d_revalidate_old(rdentry, dentry, nd);
+		goto exit;
+	}
+
+	if (rcu && rfs_chain_op_blocks(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_int = -ECHILD;
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
 	rargs.args.d_revalidate.dentry = dentry;
 	rargs.args.d_revalidate.nd = nd;
 
-	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
-		if (rdentry->op_old && rdentry->op_old->d_revalidate)
-			rargs.rv.rv_int = rdentry->op_old->d_revalidate(
-					rargs.args.d_revalidate.dentry,
-					rargs.args.d_revalidate.nd);
-		else
-			rargs.rv.rv_int = 1;
-	}
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_int = rfs_d_revalidate_old(rdentry,
+				rargs.args.d_revalidate.dentry,
+				rargs.args.d_revalidate.nd);
 
 	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
 	rfs_context_deinit(&rcont);
-
-	rfs_dentry_put(rdentry);
-	rfs_info_put(rinfo);
+exit:
+	if (!rcu)
+		rfs_dentry_put(rdentry);
+	rfs_info_read_unlock(idx);
 
 	return rargs.rv.rv_int;
 }
 
-static void rfs_dentry_set_ops_none(struct rfs_dentry *rdentry)
+/*
+ * A detached dentry gets the rinfo of its parent the same way rfs_lookup
+ * attaches a new one. If the parent is not attached anymore, the dentry is
+ * not under any path and it gets back its original operations.
+ */
+static void rfs_dentry_reattach(struct dentry *dentry)
+{
+	const struct dentry_operations *op = NULL;
+	struct rfs_dentry *rparent;
+	struct rfs_info *rinfo;
+	struct dentry *parent;
+
+	parent = dget_parent(dentry);
+	rparent = rfs_dentry_find(parent);
+	if (rparent) {
+		rinfo = rfs_dentry_get_rinfo(rparent);
+		if (rfs_dcache_rdentry_add(dentry, rinfo))
+			printk(KERN_ERR "redirfs: cannot reattach dentry\n");
+		rfs_info_put(rinfo);
+		rfs_dentry_put(rparent);
+		dput(parent);
+		return;
+	}
+	dput(parent);
+
+	spin_lock(&dentry->d_lock);
+	if (rfs_dentry_detached(dentry)) {
+		op = dentry->d_op;
+		rfs_dentry_set_d_op(dentry, rfs_optab_old(op));
+	}
+	spin_unlock(&dentry->d_lock);
+
+	rfs_optab_put(op);
+}
+
+/*
+ * The VFS holds a reference to the dentry, so it cannot be detached again
+ * while it is being revalidated. Another lookup can reattach it in the
+ * meantime and put the detached operations, they are read under the rcu
+ * read lock.
+ */
+static int rfs_d_revalidate_detached(struct dentry *dentry,
+		struct nameidata *nd)
+{
+	const struct dentry_operations *op_old = NULL;
+	const struct dentry_operations *op;
+
+	if (rfs_nd_rcu(nd))
+		return -ECHILD;
+
+	rcu_read_lock();
+	op = rcu_dereference(dentry->d_op);
+	if (op && op->d_release == rfs_d_release_detached)
+		op_old = rfs_optab_old(op);
+	rcu_read_unlock();
+
+	rfs_dentry_reattach(dentry);
+
+	op = dentry->d_op;
+	if (op && op->d_iput == rfs_d_iput)
+		return rfs_d_revalidate(dentry, nd);
+
+	if (!op_old)
+		op_old = op;
+
+	if (op_old && op_old->d_revalidate &&
+	    op_old->d_revalidate != rfs_d_revalidate_detached)
+		return op_old->d_revalidate(dentry, nd);
+
+	return 1;
+}
+
+static void rfs_d_release_detached(struct dentry *dentry)
+{
+	const struct dentry_operations *op = dentry->d_op;
+	const struct dentry_operations *op_old = rfs_optab_old(op);
+
+	if (op_old && op_old->d_release)
+		op_old->d_release(dentry);
+
+	rfs_optab_put(op);
+}
+
+static void rfs_dentry_set_ops_none(struct rfs_dentry *rdentry,
+		struct dentry_operations *op_new)
 {
-	RFS_SET_DOP(rdentry, REDIRFS_NONE_DOP_D_COMPARE, d_compare);
-	RFS_SET_DOP(rdentry, REDIRFS_NONE_DOP_D_REVALIDATE, d_revalidate);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_NONE_DOP_D_COMPARE, d_compare);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_NONE_DOP_D_REVALIDATE,
+			d_revalidate);
 }
 
-static void rfs_dentry_set_ops_reg(struct rfs_dentry *rdentry)
+static void rfs_dentry_set_ops_reg(struct rfs_dentry *rdentry,
+		struct dentry_operations *op_new)
 {
-	RFS_SET_DOP(rdentry, REDIRFS_REG_DOP_D_COMPARE, d_compare);
-	RFS_SET_DOP(rdentry, REDIRFS_REG_DOP_D_REVALIDATE, d_revalidate);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_REG_DOP_D_COMPARE, d_compare);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_REG_DOP_D_REVALIDATE,
+			d_revalidate);
 }
 
-static void rfs_dentry_set_ops_dir(struct rfs_dentry *rdentry)
+static void rfs_dentry_set_ops_dir(struct rfs_dentry *rdentry,
+		struct dentry_operations *op_new)
 {
-	RFS_SET_DOP(rdentry, REDIRFS_DIR_DOP_D_COMPARE, d_compare);
-	RFS_SET_DOP(rdentry, REDIRFS_DIR_DOP_D_REVALIDATE, d_revalidate);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_DIR_DOP_D_COMPARE, d_compare);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_DIR_DOP_D_REVALIDATE,
+			d_revalidate);
 }
 
-static void rfs_dentry_set_ops_lnk(struct rfs_dentry *rdentry)
+static void rfs_dentry_set_ops_lnk(struct rfs_dentry *rdentry,
+		struct dentry_operations *op_new)
 {
-	RFS_SET_DOP(rdentry, REDIRFS_LNK_DOP_D_COMPARE, d_compare);
-	RFS_SET_DOP(rdentry, REDIRFS_LNK_DOP_D_REVALIDATE, d_revalidate);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_LNK_DOP_D_COMPARE, d_compare);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_LNK_DOP_D_REVALIDATE,
+			d_revalidate);
 }
 
-static void rfs_dentry_set_ops_chr(struct rfs_dentry *rdentry)
+static void rfs_dentry_set_ops_chr(struct rfs_dentry *rdentry,
+		struct dentry_operations *op_new)
 {
-	RFS_SET_DOP(rdentry, REDIRFS_CHR_DOP_D_COMPARE, d_compare);
-	RFS_SET_DOP(rdentry, REDIRFS_CHR_DOP_D_REVALIDATE, d_revalidate);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_CHR_DOP_D_COMPARE, d_compare);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_CHR_DOP_D_REVALIDATE,
+			d_revalidate);
 }
 
-static void rfs_dentry_set_ops_blk(struct rfs_dentry *rdentry)
+static void rfs_dentry_set_ops_blk(struct rfs_dentry *rdentry,
+		struct dentry_operations *op_new)
 {
-	RFS_SET_DOP(rdentry, REDIRFS_BLK_DOP_D_COMPARE, d_compare);
-	RFS_SET_DOP(rdentry, REDIRFS_BLK_DOP_D_REVALIDATE, d_revalidate);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_BLK_DOP_D_COMPARE, d_compare);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_BLK_DOP_D_REVALIDATE,
+			d_revalidate);
 }
 
-static void rfs_dentry_set_ops_fifo(struct rfs_dentry *rdentry)
+static void rfs_dentry_set_ops_fifo(struct rfs_dentry *rdentry,
+		struct dentry_operations *op_new)
 {
-	RFS_SET_DOP(rdentry, REDIRFS_FIFO_DOP_D_COMPARE, d_compare);
-	RFS_SET_DOP(rdentry, REDIRFS_FIFO_DOP_D_REVALIDATE, d_revalidate);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_FIFO_DOP_D_COMPARE, d_compare);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_FIFO_DOP_D_REVALIDATE,
+			d_revalidate);
 }
 
-static void rfs_dentry_set_ops_sock(struct rfs_dentry *rdentry)
+static void rfs_dentry_set_ops_sock(struct rfs_dentry *rdentry,
+		struct dentry_operations *op_new)
 {
-	RFS_SET_DOP(rdentry, REDIRFS_SOCK_DOP_D_COMPARE, d_compare);
-	RFS_SET_DOP(rdentry, REDIRFS_SOCK_DOP_D_REVALIDATE, d_revalidate);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_SOCK_DOP_D_COMPARE, d_compare);
+	RFS_SET_DOP(rdentry, op_new, REDIRFS_SOCK_DOP_D_REVALIDATE,
+			d_revalidate);
 }
 
 void rfs_dentry_set_ops(struct rfs_dentry *rdentry)
 {
+	struct dentry_operations op_new;
 	struct rfs_file *rfile;
 	umode_t mode;
 
 	spin_lock(&rdentry->lock);
 
-	rdentry->op_new.d_release = rfs_d_release;
+	op_new = *rdentry->op_new;
+	op_new.d_release = rfs_d_release;
 
 	if (!rdentry->rinode) {
-		rfs_dentry_set_ops_none(rdentry);
+		rfs_dentry_set_ops_none(rdentry, &op_new);
+		rfs_dentry_swap_ops(rdentry, &op_new);
 		spin_unlock(&rdentry->lock);
 		return;
 	}
@@ -552,26 +1210,27 @@ void rfs_dentry_set_ops(struct rfs_dentry *rdentry)
 	mode = rdentry->rinode->inode->i_mode;
 
 	if (S_ISREG(mode))
-		rfs_dentry_set_ops_reg(rdentry);
+		rfs_dentry_set_ops_reg(rdentry, &op_new);
 
 	else if (S_ISDIR(mode))
-		rfs_dentry_set_ops_dir(rdentry);
+		rfs_dentry_set_ops_dir(rdentry, &op_new);
 
 	else if (S_ISLNK(mode))
-		rfs_dentry_set_ops_lnk(rdentry);
+		rfs_dentry_set_ops_lnk(rdentry, &op_new);
 
 	else if (S_ISCHR(mode))
-		rfs_dentry_set_ops_chr(rdentry);
+		rfs_dentry_set_ops_chr(rdentry, &op_new);
 
 	else if (S_ISBLK(mode))
-		rfs_dentry_set_ops_blk(rdentry);
+		rfs_dentry_set_ops_blk(rdentry, &op_new);
 
 	else if (S_ISFIFO(mode))
-		rfs_dentry_set_ops_fifo(rdentry);
+		rfs_dentry_set_ops_fifo(rdentry, &op_new);
 
 	else if (S_ISSOCK(mode))
-		rfs_dentry_set_ops_sock(rdentry);
+		rfs_dentry_set_ops_sock(rdentry, &op_new);
 
+	rfs_dentry_swap_ops(rdentry, &op_new);
 	spin_unlock(&rdentry->lock);
 	rfs_inode_set_ops(rdentry->rinode);
 }
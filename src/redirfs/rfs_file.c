@@ -24,6 +24,7 @@
 #include "rfs.h"
 
 static rfs_kmem_cache_t *rfs_file_cache = NULL;
+static struct rfs_hash rfs_file_hash;
 
 struct file_operations rfs_file_ops = {
 	.open = rfs_open
@@ -31,28 +32,107 @@ struct file_operations rfs_file_ops = {
 
 static struct rfs_file *rfs_file_alloc(struct file *file)
 {
+	struct file_operations op_new;
 	struct rfs_file *rfile;
 
 	rfile = kmem_cache_zalloc(rfs_file_cache, GFP_KERNEL);
 	if (!rfile)
 		return ERR_PTR(-ENOMEM);
 
+	rfs_mem_inc(RFS_MEM_FILE, sizeof(struct rfs_file));
+
 	INIT_LIST_HEAD(&rfile->rdentry_list);
 	INIT_LIST_HEAD(&rfile->data);
+	INIT_HLIST_NODE(&rfile->hash);
 	rfile->file = file;
 	spin_lock_init(&rfile->lock);
 	atomic_set(&rfile->count, 1);
 	rfile->op_old = fops_get(file->f_op);
 
 	if (rfile->op_old)
-		memcpy(&rfile->op_new, rfile->op_old,
+		memcpy(&op_new, rfile->op_old,
 				sizeof(struct file_operations));
+	else
+		memset(&op_new, 0, sizeof(struct file_operations));
 
-	rfile->op_new.open = rfs_open;
+	op_new.open = rfs_open;
+
+	rfile->op_new = rfs_optab_get(rfile->op_old, &op_new,
+			sizeof(struct file_operations));
+	if (!rfile->op_new) {
+		fops_put(rfile->op_old);
+		rfs_mem_dec(RFS_MEM_FILE, sizeof(struct rfs_file));
+		kmem_cache_free(rfs_file_cache, rfile);
+		return ERR_PTR(-ENOMEM);
+	}
 
 	return rfile;
 }
 
+static void rfs_file_free(struct rcu_head *head)
+{
+	struct rfs_file *rfile;
+
+	rfile = container_of(head, struct rfs_file, rcu);
+	rfs_mem_dec(RFS_MEM_FILE, sizeof(struct rfs_file));
+	kmem_cache_free(rfs_file_cache, rfile);
+}
+
+static const void *rfs_file_hash_key(struct hlist_node *node)
+{
+	return hlist_entry(node, struct rfs_file, hash)->file;
+}
+
+static int rfs_file_match(struct hlist_node *node, const void *file)
+{
+	struct rfs_file *rfile = hlist_entry(node, struct rfs_file, hash);
+
+	return rfile->file == file && atomic_inc_not_zero(&rfile->count);
+}
+
+struct rfs_file *rfs_file_lookup(struct file *file)
+{
+	struct hlist_node *node;
+
+	rcu_read_lock();
+	node = rfs_hash_lookup_rcu(&rfs_file_hash, file, rfs_file_match);
+	rcu_read_unlock();
+
+	if (!node)
+		return NULL;
+
+	return hlist_entry(node, struct rfs_file, hash);
+}
+
+static void rfs_file_hash_add(struct rfs_file *rfile)
+{
+	rfs_hash_add(&rfs_file_hash, rfile->file, &rfile->hash);
+}
+
+static void rfs_file_hash_rem(struct rfs_file *rfile)
+{
+	rfs_hash_rem(&rfs_file_hash, rfile->file, &rfile->hash);
+}
+
+static void rfs_file_swap_ops(struct rfs_file *rfile,
+		struct file_operations *op_new)
+{
+	const struct file_operations *op_old;
+	const struct file_operations *op;
+
+	op = rfs_optab_get(rfile->op_old, op_new,
+			sizeof(struct file_operations));
+	if (!op) {
+		printk(KERN_ERR "redirfs: cannot allocate file operations\n");
+		return;
+	}
+
+	op_old = rfile->op_new;
+	rfile->op_new = op;
+	cmpxchg(&rfile->file->f_op, op_old, op);
+	rfs_optab_put(op_old);
+}
+
 struct rfs_file *rfs_file_get(struct rfs_file *rfile)
 {
 	if (!rfile || IS_ERR(rfile))
@@ -77,7 +157,8 @@ void rfs_file_put(struct rfs_file *rfile)
 	fops_put(rfile->op_old);
 
 	rfs_data_remove(&rfile->data);
-	kmem_cache_free(rfs_file_cache, rfile);
+	rfs_optab_put(rfile->op_new);
+	call_rcu(&rfile->rcu, rfs_file_free);
 }
 
 static struct rfs_file *rfs_file_add(struct file *file)
@@ -91,8 +172,9 @@ static struct rfs_file *rfs_file_add(struct file *file)
 	rfile->rdentry = rfs_dentry_find(file->f_dentry);
 	rfs_dentry_add_rfile(rfile->rdentry, rfile);
 	fops_put(file->f_op);
-	file->f_op = &rfile->op_new;
+	file->f_op = rfile->op_new;
 	rfs_file_get(rfile);
+	rfs_file_hash_add(rfile);
 	spin_lock(&rfile->rdentry->lock);
 	rfs_file_set_ops(rfile);
 	spin_unlock(&rfile->rdentry->lock);
@@ -104,6 +186,8 @@ static void rfs_file_del(struct rfs_file *rfile)
 {
 	rfs_dentry_rem_rfile(rfile);
 	rfile->file->f_op = fops_get(rfile->op_old);
+	smp_wmb();
+	rfs_file_hash_rem(rfile);
 	rfs_file_put(rfile);
 }
 
@@ -115,11 +199,20 @@ int rfs_file_cache_create(void)
 	if (!rfs_file_cache)
 		return -ENOMEM;
 
+	if (rfs_hash_init(&rfs_file_hash,
+			rfs_hash_mem_bits(RFS_HASH_MEM_SHIFT),
+			rfs_hash_mem_bits(0), rfs_file_hash_key)) {
+		kmem_cache_destroy(rfs_file_cache);
+		return -ENOMEM;
+	}
+
 	return 0;
 }
 
 void rfs_file_cache_destory(void)
 {
+	rcu_barrier();
+	rfs_hash_destroy(&rfs_file_hash);
 	kmem_cache_destroy(rfs_file_cache);
 }
 
@@ -131,6 +224,7 @@ int rfs_open(struct inode *inode, struct file *file)
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
+	int idx;
 
 	rinode = rfs_inode_find(inode);
 	fops_put(file->f_op);
@@ -145,7 +239,8 @@ int rfs_open(struct inode *inode, struct file *file)
 		return 0;
 	}
 
-	rinfo = rfs_dentry_get_rinfo(rdentry);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_dentry_rcu_rinfo(rdentry);
 	rfs_dentry_put(rdentry);
 	rfs_context_init(&rcont, 0);
 
@@ -185,7 +280,7 @@ int rfs_open(struct inode *inode, struct file *file)
 	rfs_context_deinit(&rcont);
 
 	rfs_inode_put(rinode);
-	rfs_info_put(rinfo);
+	rfs_info_read_unlock(idx);
 	return rargs.rv.rv_int;
 }
 
@@ -195,9 +290,11 @@ static int rfs_release(struct inode *inode, struct file *file)
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
+	int idx;
 
 	rfile = rfs_file_find(file);
-	rinfo = rfs_dentry_get_rinfo(rfile->rdentry);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_dentry_rcu_rinfo(rfile->rdentry);
 	rfs_context_init(&rcont, 0);
 
 	if (S_ISREG(inode->i_mode))
@@ -230,7 +327,7 @@ static int rfs_release(struct inode *inode, struct file *file)
 
 	rfs_file_del(rfile);
 	rfs_file_put(rfile);
-	rfs_info_put(rinfo);
+	rfs_info_read_unlock(idx);
 	return rargs.rv.rv_int;
 }
 
@@ -241,11 +338,12 @@ static int rfs_readdir(struct file *file, void *dirent, filldir_t filldir)
 	struct rfs_file *rfile;
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
-	struct rfs_dentry *rdentry;
 	struct redirfs_args rargs;
+	int idx;
 
 	rfile = rfs_file_find(file);
-	rinfo = rfs_dentry_get_rinfo(rfile->rdentry);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_dentry_rcu_rinfo(rfile->rdentry);
 	rfs_context_init(&rcont, 0);
 
 	if (S_ISDIR(file->f_dentry->d_inode->i_mode))
@@ -271,18 +369,15 @@ static int rfs_readdir(struct file *file, void *dirent, filldir_t filldir)
 	if (rargs.rv.rv_int)
 		goto exit;
 
-	if (rfs_dcache_get_subs(file->f_dentry, &sibs)) {
+	if (rfs_dcache_subs_attached(rfile->rdentry, rinfo))
+		goto exit;
+
+	if (rfs_dcache_get_subs_new(file->f_dentry, &sibs)) {
 		BUG();
 		goto exit;
 	}
 
 	list_for_each_entry(sib, &sibs, list) {
-		rdentry = rfs_dentry_find(sib->dentry);
-		if (rdentry) {
-			rfs_dentry_put(rdentry);
-			continue;
-		}
-
 		if (!rinfo->rops) {
 			if (!sib->dentry->d_inode)
 				continue;
@@ -297,65 +392,632 @@ static int rfs_readdir(struct file *file, void *dirent, filldir_t filldir)
 		}
 	}
 
+	rfile->rdentry->subs_rinfo = rinfo;
 exit:
 	rfs_dcache_entry_free_list(&sibs);
 	rfs_file_put(rfile);
-	rfs_info_put(rinfo);
+	rfs_info_read_unlock(idx);
+	return rargs.rv.rv_int;
+}
+
+static loff_t rfs_llseek(struct file *file, loff_t offset, int origin)
+{
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	int idx;
+
+	rfile = rfs_file_find(file);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_dentry_rcu_rinfo(rfile->rdentry);
+	rfs_context_init(&rcont, 0);
+
+	rargs.type.id = REDIRFS_REG_FOP_LLSEEK;
+	rargs.args.f_llseek.file = file;
+	rargs.args.f_llseek.offset = offset;
+	rargs.args.f_llseek.origin = origin;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
+		if (rfile->op_old && rfile->op_old->llseek)
+			rargs.rv.rv_loff = rfile->op_old->llseek(
+					rargs.args.f_llseek.file,
+					rargs.args.f_llseek.offset,
+					rargs.args.f_llseek.origin);
+		else
+			rargs.rv.rv_loff = default_llseek(
+					rargs.args.f_llseek.file,
+					rargs.args.f_llseek.offset,
+					rargs.args.f_llseek.origin);
+	}
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+
+	rfs_file_put(rfile);
+	rfs_info_read_unlock(idx);
+	return rargs.rv.rv_loff;
+}
+
+static ssize_t rfs_read(struct file *file, char __user *buf, size_t count,
+		loff_t *pos)
+{
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	int idx;
+
+	rfile = rfs_file_find(file);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_dentry_rcu_rinfo(rfile->rdentry);
+	rfs_context_init(&rcont, 0);
+
+	rargs.type.id = REDIRFS_REG_FOP_READ;
+	rargs.args.f_read.file = file;
+	rargs.args.f_read.buf = buf;
+	rargs.args.f_read.count = count;
+	rargs.args.f_read.pos = pos;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
+		if (rfile->op_old && rfile->op_old->read)
+			rargs.rv.rv_ssize = rfile->op_old->read(
+					rargs.args.f_read.file,
+					rargs.args.f_read.buf,
+					rargs.args.f_read.count,
+					rargs.args.f_read.pos);
+		else if (rfile->op_old && rfile->op_old->aio_read)
+			rargs.rv.rv_ssize = do_sync_read(
+					rargs.args.f_read.file,
+					rargs.args.f_read.buf,
+					rargs.args.f_read.count,
+					rargs.args.f_read.pos);
+		else
+			rargs.rv.rv_ssize = -EINVAL;
+	}
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+
+	rfs_file_put(rfile);
+	rfs_info_read_unlock(idx);
+	return rargs.rv.rv_ssize;
+}
+
+static ssize_t rfs_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *pos)
+{
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	int idx;
+
+	rfile = rfs_file_find(file);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_dentry_rcu_rinfo(rfile->rdentry);
+	rfs_context_init(&rcont, 0);
+
+	rargs.type.id = REDIRFS_REG_FOP_WRITE;
+	rargs.args.f_write.file = file;
+	rargs.args.f_write.buf = buf;
+	rargs.args.f_write.count = count;
+	rargs.args.f_write.pos = pos;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
+		if (rfile->op_old && rfile->op_old->write)
+			rargs.rv.rv_ssize = rfile->op_old->write(
+					rargs.args.f_write.file,
+					rargs.args.f_write.buf,
+					rargs.args.f_write.count,
+					rargs.args.f_write.pos);
+		else if (rfile->op_old && rfile->op_old->aio_write)
+			rargs.rv.rv_ssize = do_sync_write(
+					rargs.args.f_write.file,
+					rargs.args.f_write.buf,
+					rargs.args.f_write.count,
+					rargs.args.f_write.pos);
+		else
+			rargs.rv.rv_ssize = -EINVAL;
+	}
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+
+	rfs_file_put(rfile);
+	rfs_info_read_unlock(idx);
+	return rargs.rv.rv_ssize;
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19))
+static ssize_t rfs_aio_read(struct kiocb *iocb, const struct iovec *iov,
+		unsigned long nr_segs, loff_t pos)
+{
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	int idx;
+
+	rfile = rfs_file_find(iocb->ki_filp);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_dentry_rcu_rinfo(rfile->rdentry);
+	rfs_context_init(&rcont, 0);
+
+	rargs.type.id = REDIRFS_REG_FOP_AIO_READ;
+	rargs.args.f_aio_read.iocb = iocb;
+	rargs.args.f_aio_read.iov = iov;
+	rargs.args.f_aio_read.nr_segs = nr_segs;
+	rargs.args.f_aio_read.pos = pos;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
+		if (rfile->op_old && rfile->op_old->aio_read)
+			rargs.rv.rv_ssize = rfile->op_old->aio_read(
+					rargs.args.f_aio_read.iocb,
+					rargs.args.f_aio_read.iov,
+					rargs.args.f_aio_read.nr_segs,
+					rargs.args.f_aio_read.pos);
+		else
+			rargs.rv.rv_ssize = -EINVAL;
+	}
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+
+	rfs_file_put(rfile);
+	rfs_info_read_unlock(idx);
+	return rargs.rv.rv_ssize;
+}
+
+static ssize_t rfs_aio_write(struct kiocb *iocb, const struct iovec *iov,
+		unsigned long nr_segs, loff_t pos)
+{
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	int idx;
+
+	rfile = rfs_file_find(iocb->ki_filp);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_dentry_rcu_rinfo(rfile->rdentry);
+	rfs_context_init(&rcont, 0);
+
+	rargs.type.id = REDIRFS_REG_FOP_AIO_WRITE;
+	rargs.args.f_aio_write.iocb = iocb;
+	rargs.args.f_aio_write.iov = iov;
+	rargs.args.f_aio_write.nr_segs = nr_segs;
+	rargs.args.f_aio_write.pos = pos;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
+		if (rfile->op_old && rfile->op_old->aio_write)
+			rargs.rv.rv_ssize = rfile->op_old->aio_write(
+					rargs.args.f_aio_write.iocb,
+					rargs.args.f_aio_write.iov,
+					rargs.args.f_aio_write.nr_segs,
+					rargs.args.f_aio_write.pos);
+		else
+			rargs.rv.rv_ssize = -EINVAL;
+	}
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+
+	rfs_file_put(rfile);
+	rfs_info_read_unlock(idx);
+	return rargs.rv.rv_ssize;
+}
+#endif
+
+static int rfs_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	int idx;
+
+	rfile = rfs_file_find(file);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_dentry_rcu_rinfo(rfile->rdentry);
+	rfs_context_init(&rcont, 0);
+
+	rargs.type.id = REDIRFS_REG_FOP_MMAP;
+	rargs.args.f_mmap.file = file;
+	rargs.args.f_mmap.vma = vma;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
+		if (rfile->op_old && rfile->op_old->mmap)
+			rargs.rv.rv_int = rfile->op_old->mmap(
+					rargs.args.f_mmap.file,
+					rargs.args.f_mmap.vma);
+		else
+			rargs.rv.rv_int = -ENODEV;
+	}
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+
+	rfs_file_put(rfile);
+	rfs_info_read_unlock(idx);
 	return rargs.rv.rv_int;
 }
 
-static void rfs_file_set_ops_reg(struct rfs_file *rfile)
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18))
+static int rfs_flush(struct file *file, fl_owner_t id)
+#else
+static int rfs_flush(struct file *file)
+#endif
+{
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	int idx;
+
+	rfile = rfs_file_find(file);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_dentry_rcu_rinfo(rfile->rdentry);
+	rfs_context_init(&rcont, 0);
+
+	rargs.type.id = REDIRFS_REG_FOP_FLUSH;
+	rargs.args.f_flush.file = file;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18))
+	rargs.args.f_flush.id = id;
+#else
+	rargs.args.f_flush.id = NULL;
+#endif
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
+		if (rfile->op_old && rfile->op_old->flush)
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18))
+			rargs.rv.rv_int = rfile->op_old->flush(
+					rargs.args.f_flush.file,
+					rargs.args.f_flush.id);
+#else
+			rargs.rv.rv_int = rfile->op_old->flush(
+					rargs.args.f_flush.file);
+#endif
+		else
+			rargs.rv.rv_int = 0;
+	}
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+
+	rfs_file_put(rfile);
+	rfs_info_read_unlock(idx);
+	return rargs.rv.rv_int;
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35))
+static int rfs_fsync(struct file *file, struct dentry *dentry, int datasync)
+#elif (LINUX_VERSION_CODE < KERNEL_VERSION(3,1,0))
+static int rfs_fsync(struct file *file, int datasync)
+#else
+static int rfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+#endif
+{
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	int idx;
+
+	rfile = rfs_file_find(file);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_dentry_rcu_rinfo(rfile->rdentry);
+	rfs_context_init(&rcont, 0);
+
+	rargs.type.id = REDIRFS_REG_FOP_FSYNC;
+	rargs.args.f_fsync.file = file;
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35))
+	rargs.args.f_fsync.dentry = dentry;
+#else
+	rargs.args.f_fsync.dentry = file->f_dentry;
+#endif
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3,1,0))
+	rargs.args.f_fsync.start = 0;
+	rargs.args.f_fsync.end = LLONG_MAX;
+#else
+	rargs.args.f_fsync.start = start;
+	rargs.args.f_fsync.end = end;
+#endif
+	rargs.args.f_fsync.datasync = datasync;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
+		if (rfile->op_old && rfile->op_old->fsync)
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35))
+			rargs.rv.rv_int = rfile->op_old->fsync(
+					rargs.args.f_fsync.file,
+					rargs.args.f_fsync.dentry,
+					rargs.args.f_fsync.datasync);
+#elif (LINUX_VERSION_CODE < KERNEL_VERSION(3,1,0))
+			rargs.rv.rv_int = rfile->op_old->fsync(
+					rargs.args.f_fsync.file,
+					rargs.args.f_fsync.datasync);
+#else
+			rargs.rv.rv_int = rfile->op_old->fsync(
+					rargs.args.f_fsync.file,
+					rargs.args.f_fsync.start,
+					rargs.args.f_fsync.end,
+					rargs.args.f_fsync.datasync);
+#endif
+		else
+			rargs.rv.rv_int = -EINVAL;
+	}
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+
+	rfs_file_put(rfile);
+	rfs_info_read_unlock(idx);
+	return rargs.rv.rv_int;
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,17))
+static ssize_t rfs_splice_read(struct file *file, loff_t *pos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	int idx;
+
+	rfile = rfs_file_find(file);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_dentry_rcu_rinfo(rfile->rdentry);
+	rfs_context_init(&rcont, 0);
+
+	rargs.type.id = REDIRFS_REG_FOP_SPLICE_READ;
+	rargs.args.f_splice_read.file = file;
+	rargs.args.f_splice_read.pos = pos;
+	rargs.args.f_splice_read.pipe = pipe;
+	rargs.args.f_splice_read.len = len;
+	rargs.args.f_splice_read.flags = flags;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
+		if (rfile->op_old && rfile->op_old->splice_read)
+			rargs.rv.rv_ssize = rfile->op_old->splice_read(
+					rargs.args.f_splice_read.file,
+					rargs.args.f_splice_read.pos,
+					rargs.args.f_splice_read.pipe,
+					rargs.args.f_splice_read.len,
+					rargs.args.f_splice_read.flags);
+		else
+			rargs.rv.rv_ssize = -EINVAL;
+	}
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+
+	rfs_file_put(rfile);
+	rfs_info_read_unlock(idx);
+	return rargs.rv.rv_ssize;
+}
+
+static ssize_t rfs_splice_write(struct pipe_inode_info *pipe,
+		struct file *file, loff_t *pos, size_t len, unsigned int flags)
 {
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	int idx;
+
+	rfile = rfs_file_find(file);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_dentry_rcu_rinfo(rfile->rdentry);
+	rfs_context_init(&rcont, 0);
+
+	rargs.type.id = REDIRFS_REG_FOP_SPLICE_WRITE;
+	rargs.args.f_splice_write.pipe = pipe;
+	rargs.args.f_splice_write.file = file;
+	rargs.args.f_splice_write.pos = pos;
+	rargs.args.f_splice_write.len = len;
+	rargs.args.f_splice_write.flags = flags;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
+		if (rfile->op_old && rfile->op_old->splice_write)
+			rargs.rv.rv_ssize = rfile->op_old->splice_write(
+					rargs.args.f_splice_write.pipe,
+					rargs.args.f_splice_write.file,
+					rargs.args.f_splice_write.pos,
+					rargs.args.f_splice_write.len,
+					rargs.args.f_splice_write.flags);
+		else
+			rargs.rv.rv_ssize = -EINVAL;
+	}
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+
+	rfs_file_put(rfile);
+	rfs_info_read_unlock(idx);
+	return rargs.rv.rv_ssize;
 }
+#endif
 
-static void rfs_file_set_ops_dir(struct rfs_file *rfile)
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23))
+static ssize_t rfs_sendfile(struct file *file, loff_t *pos, size_t count,
+		read_actor_t actor, void *target)
 {
-	rfile->op_new.readdir = rfs_readdir;
+	struct rfs_file *rfile;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	int idx;
+
+	rfile = rfs_file_find(file);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_dentry_rcu_rinfo(rfile->rdentry);
+	rfs_context_init(&rcont, 0);
+
+	rargs.type.id = REDIRFS_REG_FOP_SENDFILE;
+	rargs.args.f_sendfile.file = file;
+	rargs.args.f_sendfile.pos = pos;
+	rargs.args.f_sendfile.count = count;
+	rargs.args.f_sendfile.actor = actor;
+	rargs.args.f_sendfile.target = target;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
+		if (rfile->op_old && rfile->op_old->sendfile)
+			rargs.rv.rv_ssize = rfile->op_old->sendfile(
+					rargs.args.f_sendfile.file,
+					rargs.args.f_sendfile.pos,
+					rargs.args.f_sendfile.count,
+					rargs.args.f_sendfile.actor,
+					rargs.args.f_sendfile.target);
+		else
+			rargs.rv.rv_ssize = -EINVAL;
+	}
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+
+	rfs_file_put(rfile);
+	rfs_info_read_unlock(idx);
+	return rargs.rv.rv_ssize;
+}
+#endif
+
+static void rfs_file_set_ops_reg(struct rfs_file *rfile,
+		struct file_operations *op_new)
+{
+	RFS_SET_FOP(rfile, op_new, REDIRFS_REG_FOP_LLSEEK, llseek);
+	RFS_SET_FOP(rfile, op_new, REDIRFS_REG_FOP_READ, read);
+	RFS_SET_FOP(rfile, op_new, REDIRFS_REG_FOP_WRITE, write);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19))
+	RFS_SET_FOP(rfile, op_new, REDIRFS_REG_FOP_AIO_READ, aio_read);
+	RFS_SET_FOP(rfile, op_new, REDIRFS_REG_FOP_AIO_WRITE, aio_write);
+#endif
+	RFS_SET_FOP(rfile, op_new, REDIRFS_REG_FOP_MMAP, mmap);
+	RFS_SET_FOP(rfile, op_new, REDIRFS_REG_FOP_FLUSH, flush);
+	RFS_SET_FOP(rfile, op_new, REDIRFS_REG_FOP_FSYNC, fsync);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,17))
+	RFS_SET_FOP(rfile, op_new, REDIRFS_REG_FOP_SPLICE_READ, splice_read);
+	RFS_SET_FOP(rfile, op_new, REDIRFS_REG_FOP_SPLICE_WRITE, splice_write);
+#endif
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23))
+	RFS_SET_FOP(rfile, op_new, REDIRFS_REG_FOP_SENDFILE, sendfile);
+#endif
 }
 
-static void rfs_file_set_ops_lnk(struct rfs_file *rfile)
+static void rfs_file_set_ops_dir(struct rfs_file *rfile,
+		struct file_operations *op_new)
 {
+	op_new->readdir = rfs_readdir;
 }
 
-static void rfs_file_set_ops_chr(struct rfs_file *rfile)
+static void rfs_file_set_ops_lnk(struct rfs_file *rfile,
+		struct file_operations *op_new)
 {
 }
 
-static void rfs_file_set_ops_blk(struct rfs_file *rfile)
+static void rfs_file_set_ops_chr(struct rfs_file *rfile,
+		struct file_operations *op_new)
 {
 }
 
-static void rfs_file_set_ops_fifo(struct rfs_file *rfile)
+static void rfs_file_set_ops_blk(struct rfs_file *rfile,
+		struct file_operations *op_new)
+{
+}
+
+static void rfs_file_set_ops_fifo(struct rfs_file *rfile,
+		struct file_operations *op_new)
 {
 }
 
 void rfs_file_set_ops(struct rfs_file *rfile)
 {
+	struct file_operations op_new;
 	umode_t mode;
 
 	if (!rfile->rdentry->rinode)
 		return;
 
+	op_new = *rfile->op_new;
 	mode = rfile->rdentry->rinode->inode->i_mode;
 
 	if (S_ISREG(mode))
-		rfs_file_set_ops_reg(rfile);
+		rfs_file_set_ops_reg(rfile, &op_new);
 
 	else if (S_ISDIR(mode))
-		rfs_file_set_ops_dir(rfile);
+		rfs_file_set_ops_dir(rfile, &op_new);
 
 	else if (S_ISLNK(mode))
-		rfs_file_set_ops_lnk(rfile);
+		rfs_file_set_ops_lnk(rfile, &op_new);
 
 	else if (S_ISCHR(mode))
-		rfs_file_set_ops_chr(rfile);
+		rfs_file_set_ops_chr(rfile, &op_new);
 
 	else if (S_ISBLK(mode))
-		rfs_file_set_ops_blk(rfile);
+		rfs_file_set_ops_blk(rfile, &op_new);
 
 	else if (S_ISFIFO(mode))
-		rfs_file_set_ops_fifo(rfile);
+		rfs_file_set_ops_fifo(rfile, &op_new);
+
+	op_new.release = rfs_release;
+
+	rfs_file_swap_ops(rfile, &op_new);
+}
+
+
+/*
+ * Reads and writes the file with the operations of its file system, the
+ * callbacks of the filters are not called. A filter presenting the data of
+ * a file differently, e.g. compressed, uses them to access the stored data
+ * from its own callbacks.
+ */
+ssize_t redirfs_orig_read(redirfs_filter filter, struct file *file,
+		char __user *buf, size_t count, loff_t *pos)
+{
+	const struct file_operations *op;
+	struct rfs_file *rfile;
+	ssize_t rv;
+
+	if (!filter || IS_ERR(filter) || !file)
+		return -EINVAL;
+
+	rfile = rfs_file_find(file);
+	op = rfile ? rfile->op_old : file->f_op;
+
+	if (op && op->read)
+		rv = op->read(file, buf, count, pos);
+	else if (op && op->aio_read)
+		rv = do_sync_read(file, buf, count, pos);
+	else
+		rv = -EINVAL;
+
+	rfs_file_put(rfile);
+	return rv;
+}
+
+ssize_t redirfs_orig_write(redirfs_filter filter, struct file *file,
+		const char __user *buf, size_t count, loff_t *pos)
+{
+	const struct file_operations *op;
+	struct rfs_file *rfile;
+	ssize_t rv;
+
+	if (!filter || IS_ERR(filter) || !file)
+		return -EINVAL;
 
-	rfile->op_new.release = rfs_release;
+	rfile = rfs_file_find(file);
+	op = rfile ? rfile->op_old : file->f_op;
+
+	if (op && op->write)
+		rv = op->write(file, buf, count, pos);
+	else if (op && op->aio_write)
+		rv = do_sync_write(file, buf, count, pos);
+	else
+		rv = -EINVAL;
+
+	rfs_file_put(rfile);
+	return rv;
 }
 
+EXPORT_SYMBOL(redirfs_orig_read);
+EXPORT_SYMBOL(redirfs_orig_write);
@@ -45,12 +45,19 @@ struct rfs_flt *rfs_flt_alloc(struct redirfs_filter_info *flt_info)
 		return ERR_PTR(-ENOMEM);
 	}
 
+	if (rfs_pcount_init(&rflt->count)) {
+		kfree(rflt);
+		kfree(name);
+		return ERR_PTR(-ENOMEM);
+	}
+
 	INIT_LIST_HEAD(&rflt->list);
 	rflt->name = name;
 	rflt->priority = flt_info->priority;
 	rflt->owner = flt_info->owner;
 	rflt->ops = flt_info->ops;
-	atomic_set(&rflt->count, 1);
+	rflt->slot = rfs_data_slot_get();
+	atomic_set(&rflt->data_nr, 0);
 	spin_lock_init(&rflt->lock);
 	try_module_get(rflt->owner);
 
@@ -67,8 +74,7 @@ struct rfs_flt *rfs_flt_get(struct rfs_flt *rflt)
 	if (!rflt || IS_ERR(rflt))
 		return NULL;
 
-	BUG_ON(!atomic_read(&rflt->count));
-	atomic_inc(&rflt->count);
+	rfs_pcount_get(&rflt->count);
 
 	return rflt;
 }
@@ -78,10 +84,12 @@ void rfs_flt_put(struct rfs_flt *rflt)
 	if (!rflt || IS_ERR(rflt))
 		return;
 
-	BUG_ON(!atomic_read(&rflt->count));
-	if (!atomic_dec_and_test(&rflt->count))
+	if (!rfs_pcount_put(&rflt->count))
 		return;
 
+	rfs_pcount_free(&rflt->count);
+	rfs_data_slot_put(rflt->slot);
+	rfs_stats_free(rflt);
 	kfree(rflt->name);
 	kfree(rflt);
 }
@@ -133,6 +141,7 @@ redirfs_filter redirfs_register_filter(struct redirfs_filter_info *info)
 
 	rv = rfs_flt_sysfs_init(rflt);
 	if (rv) {
+		rfs_pcount_atomic(&rflt->count);
 		rfs_flt_put(rflt);
 		rfs_mutex_unlock(&rfs_flt_list_mutex);
 		return ERR_PTR(rv);
@@ -155,13 +164,31 @@ int redirfs_unregister_filter(redirfs_filter filter)
 	if (!rflt || IS_ERR(rflt))
 		return -EINVAL;
 
+	/*
+	 * Release deferred callbacks, rinfos queued after removed paths and
+	 * queued filter data, they hold references to the filter.
+	 */
+	rfs_defer_flush();
+	rfs_info_flush();
+	rfs_data_flush();
+
+	rfs_mutex_lock(&rfs_flt_list_mutex);
+
+	/*
+	 * The reference counter has to be in the atomic mode to be checked.
+	 * It is switched back to the per cpu mode if the filter is still in
+	 * use.
+	 */
+	rfs_pcount_atomic(&rflt->count);
+
 	spin_lock(&rflt->lock);
 
 	/*
 	 * Check if the unregistration is already in progress.
 	 */
-	if (atomic_read(&rflt->count) < 3) {
+	if (rfs_pcount_read(&rflt->count) < 3) {
 		spin_unlock(&rflt->lock);
+		rfs_mutex_unlock(&rfs_flt_list_mutex);
 		return 0;
 	}
 
@@ -173,15 +200,16 @@ int redirfs_unregister_filter(redirfs_filter filter)
 	 *    - internal filter list
 	 *    - handler returned to filter after registration
 	 */
-	if (atomic_read(&rflt->count) != 3) {
+	if (rfs_pcount_read(&rflt->count) != 3) {
 		spin_unlock(&rflt->lock);
+		rfs_pcount_percpu(&rflt->count);
+		rfs_mutex_unlock(&rfs_flt_list_mutex);
 		return -EBUSY;
 	}
 
 	rfs_flt_put(rflt);
 	spin_unlock(&rflt->lock);
 
-	rfs_mutex_lock(&rfs_flt_list_mutex);
 	list_del_init(&rflt->list);
 	rfs_mutex_unlock(&rfs_flt_list_mutex);
 
@@ -197,23 +225,37 @@ void redirfs_delete_filter(redirfs_filter filter)
 	if (!rflt || IS_ERR(rflt))
 		return;
 
-	BUG_ON(atomic_read(&rflt->count) != 2);
+	BUG_ON(rfs_pcount_read(&rflt->count) != 2);
 
 	rfs_flt_sysfs_exit(rflt);
 	rfs_flt_put(rflt);
 }
 
+/*
+ * Rebuild chains in all roots the filter is attached to. This recompiles the
+ * per operation callback arrays and the op_new tables of all VFS objects
+ * after the filter changed its callbacks or was (de)activated.
+ */
 static int rfs_flt_set_ops(struct rfs_flt *rflt)
 {
 	struct rfs_root *rroot;
+	struct rfs_chain *rchain;
 	struct rfs_info *rinfo;
 	int rv;
 
 	list_for_each_entry(rroot, &rfs_root_list, list) {
+		if (!rroot->rinfo)
+			continue;
+
 		if (rfs_chain_find(rroot->rinfo->rchain, rflt) == -1)
 			continue;
 
-		rinfo = rfs_info_alloc(rroot, rroot->rinfo->rchain);
+		rchain = rfs_chain_copy(rroot->rinfo->rchain);
+		if (IS_ERR(rchain))
+			return PTR_ERR(rchain);
+
+		rinfo = rfs_info_alloc(rroot, rchain);
+		rfs_chain_put(rchain);
 		if (IS_ERR(rinfo))
 			return PTR_ERR(rinfo);
 
@@ -230,6 +272,49 @@ static int rfs_flt_set_ops(struct rfs_flt *rflt)
 	return 0;
 }
 
+static int rfs_flt_rule_supported(struct redirfs_op_info *op)
+{
+	if (!(op->flags & REDIRFS_RULE_STOP) || op->pre_cb)
+		return 0;
+
+	switch (op->op_id) {
+	case REDIRFS_REG_FOP_OPEN:
+	case REDIRFS_DIR_FOP_OPEN:
+	case REDIRFS_CHR_FOP_OPEN:
+	case REDIRFS_BLK_FOP_OPEN:
+	case REDIRFS_FIFO_FOP_OPEN:
+	case REDIRFS_LNK_FOP_OPEN:
+		return 1;
+
+	case REDIRFS_NONE_DOP_D_RELEASE:
+	case REDIRFS_NONE_DOP_D_IPUT:
+	case REDIRFS_REG_DOP_D_RELEASE:
+	case REDIRFS_REG_DOP_D_IPUT:
+	case REDIRFS_DIR_DOP_D_RELEASE:
+	case REDIRFS_DIR_DOP_D_IPUT:
+	case REDIRFS_CHR_DOP_D_RELEASE:
+	case REDIRFS_CHR_DOP_D_IPUT:
+	case REDIRFS_BLK_DOP_D_RELEASE:
+	case REDIRFS_BLK_DOP_D_IPUT:
+	case REDIRFS_FIFO_DOP_D_RELEASE:
+	case REDIRFS_FIFO_DOP_D_IPUT:
+	case REDIRFS_LNK_DOP_D_RELEASE:
+	case REDIRFS_LNK_DOP_D_IPUT:
+	case REDIRFS_SOCK_DOP_D_RELEASE:
+	case REDIRFS_SOCK_DOP_D_IPUT:
+	case REDIRFS_DIR_IOP_LOOKUP:
+	case REDIRFS_REG_FOP_LLSEEK:
+	case REDIRFS_REG_FOP_READ:
+	case REDIRFS_REG_FOP_WRITE:
+	case REDIRFS_REG_FOP_AIO_READ:
+	case REDIRFS_REG_FOP_AIO_WRITE:
+		return 0;
+
+	default:
+		return !(op->flags & REDIRFS_RULE_FMODE_WRITE);
+	}
+}
+
 int redirfs_set_operations(redirfs_filter filter, struct redirfs_op_info ops[])
 {
 	struct rfs_flt *rflt = (struct rfs_flt *)filter;
@@ -241,9 +326,28 @@ int redirfs_set_operations(redirfs_filter filter, struct redirfs_op_info ops[])
 	if (!rflt || IS_ERR(rflt))
 		return -EINVAL;
 
+	for (i = 0; ops[i].op_id != REDIRFS_OP_END; i++) {
+		if (ops[i].flags & REDIRFS_POST_DEFERRED &&
+		    !rfs_defer_supported(ops[i].op_id))
+			return -EINVAL;
+
+		if (ops[i].flags & (REDIRFS_RULE_STOP |
+		    REDIRFS_RULE_FMODE_WRITE) &&
+		    !rfs_flt_rule_supported(&ops[i]))
+			return -EINVAL;
+	}
+
+	i = 0;
 	while (ops[i].op_id != REDIRFS_OP_END) {
 		rflt->cbs[ops[i].op_id].pre_cb = ops[i].pre_cb;
 		rflt->cbs[ops[i].op_id].post_cb = ops[i].post_cb;
+		rflt->cbs[ops[i].op_id].post_deferred =
+			ops[i].flags & REDIRFS_POST_DEFERRED ? 1 : 0;
+		rflt->cbs[ops[i].op_id].rcu_safe =
+			ops[i].flags & REDIRFS_RCU_SAFE ? 1 : 0;
+		rflt->cbs[ops[i].op_id].rule = ops[i].flags &
+			(REDIRFS_RULE_STOP | REDIRFS_RULE_FMODE_WRITE);
+		rflt->cbs[ops[i].op_id].rule_rv = ops[i].rule_rv;
 		i++;
 	}
 
@@ -254,28 +358,71 @@ int redirfs_set_operations(redirfs_filter filter, struct redirfs_op_info ops[])
 	return rv;
 }
 
+/*
+ * The roots already switched by a failed rfs_flt_set_ops are rebuilt with
+ * the previous state, so the active flag matches the installed chains.
+ */
+static int rfs_flt_set_active(struct rfs_flt *rflt, int active)
+{
+	int rv;
+
+	atomic_set(&rflt->active, active);
+	rv = rfs_flt_set_ops(rflt);
+	if (!rv)
+		return 0;
+
+	atomic_set(&rflt->active, !active);
+	if (rfs_flt_set_ops(rflt))
+		printk(KERN_ERR "redirfs: failed to restore the operations of "
+				"filter %s\n", rflt->name);
+
+	return rv;
+}
+
 int redirfs_activate_filter(redirfs_filter filter)
 {
 	struct rfs_flt *rflt = (struct rfs_flt *)filter;
+	int rv;
+
+	might_sleep();
 
 	if (!rflt || IS_ERR(rflt))
 		return -EINVAL;
 
-	atomic_set(&rflt->active, 1);
+	rfs_mutex_lock(&rfs_path_mutex);
 
-	return 0;
+	if (atomic_read(&rflt->active)) {
+		rfs_mutex_unlock(&rfs_path_mutex);
+		return 0;
+	}
+
+	rv = rfs_flt_set_active(rflt, 1);
+	rfs_mutex_unlock(&rfs_path_mutex);
+
+	return rv;
 }
 
 int redirfs_deactivate_filter(redirfs_filter filter)
 {
 	struct rfs_flt *rflt = (struct rfs_flt *)filter;
+	int rv;
+
+	might_sleep();
 
 	if (!rflt || IS_ERR(rflt))
 		return -EINVAL;
 
-	atomic_set(&rflt->active, 0);
+	rfs_mutex_lock(&rfs_path_mutex);
 
-	return 0;
+	if (!atomic_read(&rflt->active)) {
+		rfs_mutex_unlock(&rfs_path_mutex);
+		return 0;
+	}
+
+	rv = rfs_flt_set_active(rflt, 0);
+	rfs_mutex_unlock(&rfs_path_mutex);
+
+	return rv;
 }
 
 EXPORT_SYMBOL(redirfs_register_filter);
@@ -23,6 +23,92 @@
 
 #include "rfs.h"
 
+struct srcu_struct rfs_info_srcu;
+static LIST_HEAD(rfs_info_free_list);
+static DEFINE_SPINLOCK(rfs_info_free_lock);
+static RFS_DEFINE_MUTEX(rfs_info_free_mutex);
+
+/*
+ * VFS operations do not take a reference to the rinfo, they just dereference
+ * it inside the rfs_info_srcu read side section. The last put of the rinfo
+ * therefore does not free it directly but queues it. Queued rinfos are freed
+ * after the grace period from a workqueue, see rfs_info_flush. The read side
+ * sections span filter callbacks which may block for a long time, so the
+ * grace period is waited for on a private workqueue.
+ */
+struct workqueue_struct *rfs_info_wq;
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20))
+static void rfs_info_free_work_fn(void *data)
+{
+	rfs_info_flush();
+}
+
+static DECLARE_WORK(rfs_info_free_work, rfs_info_free_work_fn, NULL);
+#else
+static void rfs_info_free_work_fn(struct work_struct *work)
+{
+	rfs_info_flush();
+}
+
+static DECLARE_WORK(rfs_info_free_work, rfs_info_free_work_fn);
+#endif
+
+void rfs_info_flush(void)
+{
+	LIST_HEAD(head);
+	struct rfs_info *rinfo;
+	struct rfs_info *tmp;
+
+	might_sleep();
+
+	rfs_mutex_lock(&rfs_info_free_mutex);
+
+	for (;;) {
+		spin_lock(&rfs_info_free_lock);
+		list_splice_init(&rfs_info_free_list, &head);
+		spin_unlock(&rfs_info_free_lock);
+
+		if (list_empty(&head))
+			break;
+
+		synchronize_srcu(&rfs_info_srcu);
+
+		list_for_each_entry_safe(rinfo, tmp, &head, free_list) {
+			list_del(&rinfo->free_list);
+			rfs_chain_put(rinfo->rchain);
+			rfs_ops_put(rinfo->rops);
+			rfs_root_put(rinfo->rroot);
+			rfs_mem_dec(RFS_MEM_INFO, sizeof(struct rfs_info));
+			kfree(rinfo);
+		}
+	}
+
+	rfs_mutex_unlock(&rfs_info_free_mutex);
+}
+
+int rfs_info_srcu_init(void)
+{
+	int rv;
+
+	rfs_info_wq = create_singlethread_workqueue("rfs_info");
+	if (!rfs_info_wq)
+		return -ENOMEM;
+
+	rv = init_srcu_struct(&rfs_info_srcu);
+	if (rv)
+		destroy_workqueue(rfs_info_wq);
+
+	return rv;
+}
+
+void rfs_info_srcu_cleanup(void)
+{
+	flush_workqueue(rfs_info_wq);
+	cleanup_srcu_struct(&rfs_info_srcu);
+	destroy_workqueue(rfs_info_wq);
+}
+
 static int rfs_info_add_ops(struct rfs_info *rinfo, struct rfs_chain *rchain)
 {
 	struct rfs_ops *rops;
@@ -58,6 +144,9 @@ struct rfs_info *rfs_info_alloc(struct rfs_root *rroot,
 		return ERR_PTR(rv);
 	}
 
+	rfs_mem_inc(RFS_MEM_INFO, sizeof(struct rfs_info));
+
+	INIT_LIST_HEAD(&rinfo->free_list);
 	rinfo->rchain = rfs_chain_get(rchain);
 	rinfo->rroot = rfs_root_get(rroot);
 	atomic_set(&rinfo->count, 1);
@@ -85,10 +174,11 @@ void rfs_info_put(struct rfs_info *rinfo)
 	if (!atomic_dec_and_test(&rinfo->count))
 		return;
 
-	rfs_chain_put(rinfo->rchain);
-	rfs_ops_put(rinfo->rops);
-	rfs_root_put(rinfo->rroot);
-	kfree(rinfo);
+	spin_lock(&rfs_info_free_lock);
+	list_add_tail(&rinfo->free_list, &rfs_info_free_list);
+	spin_unlock(&rfs_info_free_lock);
+
+	queue_work(rfs_info_wq, &rfs_info_free_work);
 }
 
 static struct rfs_info *rfs_info_dentry(struct dentry *dentry)
@@ -141,10 +231,7 @@ static void rfs_info_rdentry_rem(struct dentry *dentry)
 	if (!rdentry)
 		return;
 
-	spin_lock(&rdentry->lock);
-	rfs_info_put(rdentry->rinfo);
-	rdentry->rinfo = rfs_info_get(rfs_info_none);
-	spin_unlock(&rdentry->lock);
+	rfs_dentry_set_rinfo(rdentry, rfs_info_none);
 
 	rfs_dentry_put(rdentry);
 }
@@ -159,7 +246,11 @@ int rfs_info_add(struct dentry *dentry, struct rfs_info *rinfo,
 	if (IS_ERR(rdata))
 		return PTR_ERR(rdata);
 
-	rv = rfs_dcache_walk(dentry, rfs_dcache_add, rdata);
+	if (rinfo->rroot && rinfo->rroot->dentry == dentry &&
+	    rinfo->rroot->lazy == RFS_ROOT_LAZY_PENDING)
+		rv = rfs_dcache_add_lazy(dentry, rdata);
+	else
+		rv = rfs_dcache_walk(dentry, rfs_dcache_add, rdata);
 	rfs_dcache_data_free(rdata);
 
 	if (!rv)
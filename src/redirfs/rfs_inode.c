@@ -24,35 +24,139 @@
 #include "rfs.h"
 
 static rfs_kmem_cache_t *rfs_inode_cache = NULL;
+static struct rfs_hash rfs_inode_hash;
 
 static struct rfs_inode *rfs_inode_alloc(struct inode *inode)
 {
+	struct inode_operations op_new;
 	struct rfs_inode *rinode;
 
 	rinode = kmem_cache_zalloc(rfs_inode_cache, GFP_KERNEL);
 	if (IS_ERR(rinode))
 		return ERR_PTR(-ENOMEM);
 
+	rfs_mem_inc(RFS_MEM_INODE, sizeof(struct rfs_inode));
+
 	INIT_LIST_HEAD(&rinode->rdentries);
 	INIT_LIST_HEAD(&rinode->data);
+	INIT_HLIST_NODE(&rinode->hash);
 	rinode->inode = inode;
 	rinode->op_old = inode->i_op;
 	rinode->fop_old = inode->i_fop;
+	rinode->aop_old = inode->i_mapping ? inode->i_mapping->a_ops : NULL;
 	spin_lock_init(&rinode->lock);
 	rfs_mutex_init(&rinode->mutex);
 	atomic_set(&rinode->count, 1);
 	atomic_set(&rinode->nlink, 1);
+	atomic_set(&rinode->lazy, 0);
 	rinode->rdentries_nr = 0;
 
 	if (inode->i_op)
-		memcpy(&rinode->op_new, inode->i_op,
+		memcpy(&op_new, inode->i_op,
 				sizeof(struct inode_operations));
+	else
+		memset(&op_new, 0, sizeof(struct inode_operations));
 
-	rinode->op_new.rename = rfs_rename;
+	op_new.rename = rfs_rename;
+
+	rinode->op_new = rfs_optab_get(rinode->op_old, &op_new,
+			sizeof(struct inode_operations));
+	if (!rinode->op_new) {
+		rfs_mem_dec(RFS_MEM_INODE, sizeof(struct rfs_inode));
+		kmem_cache_free(rfs_inode_cache, rinode);
+		return ERR_PTR(-ENOMEM);
+	}
 
 	return rinode;
 }
 
+static void rfs_inode_free(struct rcu_head *head)
+{
+	struct rfs_inode *rinode;
+
+	rinode = container_of(head, struct rfs_inode, rcu);
+	rfs_mem_dec(RFS_MEM_INODE, sizeof(struct rfs_inode));
+	kmem_cache_free(rfs_inode_cache, rinode);
+}
+
+static const void *rfs_inode_hash_key(struct hlist_node *node)
+{
+	return hlist_entry(node, struct rfs_inode, hash)->inode;
+}
+
+static int rfs_inode_match(struct hlist_node *node, const void *inode)
+{
+	struct rfs_inode *rinode = hlist_entry(node, struct rfs_inode, hash);
+
+	return rinode->inode == inode && atomic_inc_not_zero(&rinode->count);
+}
+
+static int rfs_inode_match_rcu(struct hlist_node *node, const void *inode)
+{
+	struct rfs_inode *rinode = hlist_entry(node, struct rfs_inode, hash);
+
+	return rinode->inode == inode && atomic_read(&rinode->count);
+}
+
+struct rfs_inode *rfs_inode_lookup(struct inode *inode)
+{
+	struct hlist_node *node;
+
+	rcu_read_lock();
+	node = rfs_hash_lookup_rcu(&rfs_inode_hash, inode, rfs_inode_match);
+	rcu_read_unlock();
+
+	if (!node)
+		return NULL;
+
+	return hlist_entry(node, struct rfs_inode, hash);
+}
+
+/*
+ * Lookup for the rcu-walk, the caller is in the rcu read side section and
+ * no reference is taken. The rinode is freed after the grace period.
+ */
+struct rfs_inode *rfs_inode_lookup_rcu(struct inode *inode)
+{
+	struct hlist_node *node;
+
+	node = rfs_hash_lookup_rcu(&rfs_inode_hash, inode,
+			rfs_inode_match_rcu);
+	if (!node)
+		return NULL;
+
+	return hlist_entry(node, struct rfs_inode, hash);
+}
+
+static void rfs_inode_hash_add(struct rfs_inode *rinode)
+{
+	rfs_hash_add(&rfs_inode_hash, rinode->inode, &rinode->hash);
+}
+
+static void rfs_inode_hash_rem(struct rfs_inode *rinode)
+{
+	rfs_hash_rem(&rfs_inode_hash, rinode->inode, &rinode->hash);
+}
+
+static void rfs_inode_swap_ops(struct rfs_inode *rinode,
+		struct inode_operations *op_new)
+{
+	const struct inode_operations *op_old;
+	const struct inode_operations *op;
+
+	op = rfs_optab_get(rinode->op_old, op_new,
+			sizeof(struct inode_operations));
+	if (!op) {
+		printk(KERN_ERR "redirfs: cannot allocate inode operations\n");
+		return;
+	}
+
+	op_old = rinode->op_new;
+	rinode->op_new = op;
+	cmpxchg(&rinode->inode->i_op, op_old, op);
+	rfs_optab_put(op_old);
+}
+
 struct rfs_inode *rfs_inode_get(struct rfs_inode *rinode)
 {
 	if (!rinode || IS_ERR(rinode))
@@ -75,7 +179,9 @@ void rfs_inode_put(struct rfs_inode *rinode)
 
 	rfs_info_put(rinode->rinfo);
 	rfs_data_remove(&rinode->data);
-	kmem_cache_free(rfs_inode_cache, rinode);
+	rfs_optab_put(rinode->op_new);
+	rfs_optab_put(rinode->aop_new);
+	call_rcu(&rinode->rcu, rfs_inode_free);
 }
 
 struct rfs_inode *rfs_inode_add(struct inode *inode, struct rfs_info *rinfo)
@@ -98,8 +204,9 @@ struct rfs_inode *rfs_inode_add(struct inode *inode, struct rfs_info *rinfo)
 		if (!S_ISSOCK(inode->i_mode))
 			inode->i_fop = &rfs_file_ops;
 
-		inode->i_op = &ri_new->op_new;
+		inode->i_op = ri_new->op_new;
 		rfs_inode_get(ri_new);
+		rfs_inode_hash_add(ri_new);
 		ri = rfs_inode_get(ri_new);
 	} else
 		atomic_inc(&ri->nlink);
@@ -116,10 +223,22 @@ void rfs_inode_del(struct rfs_inode *rinode)
 	if (!atomic_dec_and_test(&rinode->nlink))
 		return;
 
+	/*
+	 * The original operations are restored before the rinode is unhashed,
+	 * so an operation which does not find the rinode anymore can call
+	 * them directly.
+	 */
 	if (!S_ISSOCK(rinode->inode->i_mode))
 		rinode->inode->i_fop = rinode->fop_old;
 
+	if (rinode->aop_new)
+		cmpxchg(&rinode->inode->i_mapping->a_ops, rinode->aop_new,
+				rinode->aop_old);
+
 	rinode->inode->i_op = rinode->op_old;
+	smp_wmb();
+
+	rfs_inode_hash_rem(rinode);
 	rfs_inode_put(rinode);
 }
 
@@ -174,6 +293,7 @@ static struct rfs_chain *rfs_inode_join_rchains(struct rfs_inode *rinode)
 static int rfs_inode_set_rinfo_fast(struct rfs_inode *rinode)
 {
 	struct rfs_dentry *rdentry;
+	struct rfs_info *rinfo;
 
 	if (!rinode->rdentries_nr)
 		return 0;
@@ -185,10 +305,11 @@ static int rfs_inode_set_rinfo_fast(struct rfs_inode *rinode)
 
 	spin_lock(&rdentry->lock);
 	spin_lock(&rinode->lock);
-	rfs_info_put(rinode->rinfo);
-	rinode->rinfo = rfs_info_get(rdentry->rinfo);
+	rinfo = rinode->rinfo;
+	rcu_assign_pointer(rinode->rinfo, rfs_info_get(rdentry->rinfo));
 	spin_unlock(&rinode->lock);
 	spin_unlock(&rdentry->lock);
+	rfs_info_put(rinfo);
 
 	return 0;
 }
@@ -208,6 +329,7 @@ int rfs_inode_set_rinfo(struct rfs_inode *rinode)
 {
 	struct rfs_chain *rchain;
 	struct rfs_info *rinfo;
+	struct rfs_info *rinfo_old;
 	struct rfs_ops *rops;
 	int rv;
 
@@ -256,10 +378,11 @@ int rfs_inode_set_rinfo(struct rfs_inode *rinode)
 
 	rfs_chain_ops(rinfo->rchain, rinfo->rops);
 	spin_lock(&rinode->lock);
-	rfs_info_put(rinode->rinfo);
-	rinode->rinfo = rinfo;
+	rinfo_old = rinode->rinfo;
+	rcu_assign_pointer(rinode->rinfo, rinfo);
 	spin_unlock(&rinode->lock);
 	rfs_mutex_unlock(&rinode->mutex);
+	rfs_info_put(rinfo_old);
 
 	return 0;
 }
@@ -272,11 +395,20 @@ int rfs_inode_cache_create(void)
 	if (!rfs_inode_cache)
 		return -ENOMEM;
 
+	if (rfs_hash_init(&rfs_inode_hash,
+			rfs_hash_mem_bits(RFS_HASH_MEM_SHIFT),
+			rfs_hash_mem_bits(0), rfs_inode_hash_key)) {
+		kmem_cache_destroy(rfs_inode_cache);
+		return -ENOMEM;
+	}
+
 	return 0;
 }
 
 void rfs_inode_cache_destroy(void)
 {
+	rcu_barrier();
+	rfs_hash_destroy(&rfs_inode_hash);
 	kmem_cache_destroy(rfs_inode_cache);
 }
 
@@ -287,6 +419,7 @@ static struct dentry *rfs_lookup(struct inode *dir, struct dentry *dentry,
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
+	int idx;
 	struct dentry *dadd = dentry;
 
 	if (S_ISDIR(dir->i_mode))
@@ -295,7 +428,8 @@ static struct dentry *rfs_lookup(struct inode *dir, struct dentry *dentry,
 		return ERR_PTR(-ENOTDIR);
 
 	rinode = rfs_inode_find(dir);
-	rinfo = rfs_inode_get_rinfo(rinode);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_inode_rcu_rinfo(rinode);
 	rfs_context_init(&rcont, 0);
 
 	rargs.args.i_lookup.dir = dir;
@@ -325,7 +459,7 @@ static struct dentry *rfs_lookup(struct inode *dir, struct dentry *dentry,
 		BUG();
 exit:
 	rfs_inode_put(rinode);
-	rfs_info_put(rinfo);
+	rfs_info_read_unlock(idx);
 	return rargs.rv.rv_dentry;
 }
 
@@ -335,9 +469,11 @@ static int rfs_mkdir(struct inode *dir, struct dentry *dentry, int mode)
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
+	int idx;
 
 	rinode = rfs_inode_find(dir);
-	rinfo = rfs_inode_get_rinfo(rinode);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_inode_rcu_rinfo(rinode);
 	rfs_context_init(&rcont, 0);
 
 	if (S_ISDIR(dir->i_mode))
@@ -368,7 +504,7 @@ static int rfs_mkdir(struct inode *dir, struct dentry *dentry, int mode)
 	}
 
 	rfs_inode_put(rinode);
-	rfs_info_put(rinfo);
+	rfs_info_read_unlock(idx);
 	return rargs.rv.rv_int;
 }
 
@@ -379,9 +515,11 @@ static int rfs_create(struct inode *dir, struct dentry *dentry, int mode,
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
+	int idx;
 
 	rinode = rfs_inode_find(dir);
-	rinfo = rfs_inode_get_rinfo(rinode);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_inode_rcu_rinfo(rinode);
 	rfs_context_init(&rcont, 0);
 
 	if (S_ISDIR(dir->i_mode))
@@ -414,7 +552,7 @@ static int rfs_create(struct inode *dir, struct dentry *dentry, int mode,
 	}
 
 	rfs_inode_put(rinode);
-	rfs_info_put(rinfo);
+	rfs_info_read_unlock(idx);
 	return rargs.rv.rv_int;
 }
 
@@ -425,9 +563,11 @@ static int rfs_link(struct dentry *old_dentry, struct inode *dir,
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
+	int idx;
 
 	rinode = rfs_inode_find(dir);
-	rinfo = rfs_inode_get_rinfo(rinode);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_inode_rcu_rinfo(rinode);
 	rfs_context_init(&rcont, 0);
 
 	if (S_ISDIR(dir->i_mode))
@@ -458,7 +598,7 @@ static int rfs_link(struct dentry *old_dentry, struct inode *dir,
 	}
 
 	rfs_inode_put(rinode);
-	rfs_info_put(rinfo);
+	rfs_info_read_unlock(idx);
 	return rargs.rv.rv_int;
 }
 
@@ -469,9 +609,11 @@ static int rfs_symlink(struct inode *dir, struct dentry *dentry,
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
+	int idx;
 
 	rinode = rfs_inode_find(dir);
-	rinfo = rfs_inode_get_rinfo(rinode);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_inode_rcu_rinfo(rinode);
 	rfs_context_init(&rcont, 0);
 
 	if (S_ISDIR(dir->i_mode))
@@ -502,7 +644,7 @@ static int rfs_symlink(struct inode *dir, struct dentry *dentry,
 	}
 
 	rfs_inode_put(rinode);
-	rfs_info_put(rinfo);
+	rfs_info_read_unlock(idx);
 	return rargs.rv.rv_int;
 }
 
@@ -513,9 +655,11 @@ static int rfs_mknod(struct inode * dir, struct dentry *dentry, int mode,
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
+	int idx;
 
 	rinode = rfs_inode_find(dir);
-	rinfo = rfs_inode_get_rinfo(rinode);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_inode_rcu_rinfo(rinode);
 	rfs_context_init(&rcont, 0);
 
 	if (S_ISDIR(dir->i_mode))
@@ -548,7 +692,7 @@ static int rfs_mknod(struct inode * dir, struct dentry *dentry, int mode,
 	}
 
 	rfs_inode_put(rinode);
-	rfs_info_put(rinfo);
+	rfs_info_read_unlock(idx);
 	return rargs.rv.rv_int;
 }
 
@@ -558,9 +702,11 @@ static int rfs_unlink(struct inode *inode, struct dentry *dentry)
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
+	int idx;
 
 	rinode = rfs_inode_find(inode);
-	rinfo = rfs_inode_get_rinfo(rinode);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_inode_rcu_rinfo(rinode);
 	rfs_context_init(&rcont, 0);
 
 	if (S_ISDIR(inode->i_mode))
@@ -584,7 +730,7 @@ static int rfs_unlink(struct inode *inode, struct dentry *dentry)
 	rfs_context_deinit(&rcont);
 
 	rfs_inode_put(rinode);
-	rfs_info_put(rinfo);
+	rfs_info_read_unlock(idx);
 	return rargs.rv.rv_int;
 }
 
@@ -594,9 +740,11 @@ static int rfs_rmdir(struct inode *inode, struct dentry *dentry)
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
+	int idx;
 
 	rinode = rfs_inode_find(inode);
-	rinfo = rfs_inode_get_rinfo(rinode);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_inode_rcu_rinfo(rinode);
 	rfs_context_init(&rcont, 0);
 
 	if (S_ISDIR(inode->i_mode))
@@ -620,7 +768,7 @@ static int rfs_rmdir(struct inode *inode, struct dentry *dentry)
 	rfs_context_deinit(&rcont);
 
 	rfs_inode_put(rinode);
-	rfs_info_put(rinfo);
+	rfs_info_read_unlock(idx);
 	return rargs.rv.rv_int;
 }
 
@@ -632,11 +780,17 @@ static int rfs_permission(struct inode *inode, int mask, struct nameidata *nd)
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
+	int idx;
 	int submask;
 
 	submask = mask & ~MAY_APPEND;
 	rinode = rfs_inode_find(inode);
-	rinfo = rfs_inode_get_rinfo(rinode);
+
+	if (atomic_read(&rinode->lazy))
+		rfs_dcache_lazy_subs(rinode);
+
+	idx = rfs_info_read_lock();
+	rinfo = rfs_inode_rcu_rinfo(rinode);
 	rfs_context_init(&rcont, 0);
 
 	if (S_ISREG(inode->i_mode))
@@ -673,7 +827,7 @@ static int rfs_permission(struct inode *inode, int mask, struct nameidata *nd)
 	rfs_context_deinit(&rcont);
 
 	rfs_inode_put(rinode);
-	rfs_info_put(rinfo);
+	rfs_info_read_unlock(idx);
 	return rargs.rv.rv_int;
 }
 
@@ -685,11 +839,17 @@ static int rfs_permission(struct inode *inode, int mask)
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
+	int idx;
 	int submask;
 
 	submask = mask & ~MAY_APPEND;
 	rinode = rfs_inode_find(inode);
-	rinfo = rfs_inode_get_rinfo(rinode);
+
+	if (atomic_read(&rinode->lazy))
+		rfs_dcache_lazy_subs(rinode);
+
+	idx = rfs_info_read_lock();
+	rinfo = rfs_inode_rcu_rinfo(rinode);
 	rfs_context_init(&rcont, 0);
 
 	if (S_ISREG(inode->i_mode))
@@ -724,24 +884,56 @@ static int rfs_permission(struct inode *inode, int mask)
 	rfs_context_deinit(&rcont);
 
 	rfs_inode_put(rinode);
-	rfs_info_put(rinfo);
+	rfs_info_read_unlock(idx);
 	return rargs.rv.rv_int;
 }
 
 #elif LINUX_VERSION_CODE < KERNEL_VERSION(3,1,0)
 
+static inline int rfs_permission_old(struct rfs_inode *rinode,
+		struct inode *inode, int mask, unsigned int flags)
+{
+	if (rinode->op_old && rinode->op_old->permission)
+		return rinode->op_old->permission(inode, mask, flags);
+
+	return generic_permission(inode, mask & ~MAY_APPEND, flags, NULL);
+}
+
+/*
+ * In the rcu-walk (IPERM_FLAG_RCU) no reference to the rinode is taken.
+ * When no filter hooks the permission, it is redirected only because of
+ * the lazy walk, the original permission is called right away. The
+ * filters are called only if all of them are marked as rcu safe,
+ * otherwise the VFS is asked to retry in the ref-walk.
+ */
 static int rfs_permission(struct inode *inode, int mask, unsigned int flags)
 {
 	struct rfs_inode *rinode;
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
-	int submask;
+	int rcu = flags & IPERM_FLAG_RCU;
+	int idx;
+
+	/*
+	 * In the rcu-walk the rinode is not referenced, so the srcu read lock
+	 * has to be held before it is looked up to keep its rinfo alive.
+	 */
+	if (rcu) {
+		idx = rfs_info_read_lock();
+		rinode = rfs_inode_find_rcu(inode);
+		if (!rinode || atomic_read(&rinode->lazy)) {
+			rfs_info_read_unlock(idx);
+			return -ECHILD;
+		}
+	} else {
+		rinode = rfs_inode_find(inode);
+		if (atomic_read(&rinode->lazy))
+			rfs_dcache_lazy_subs(rinode);
+		idx = rfs_info_read_lock();
+	}
 
-	submask = mask & ~MAY_APPEND;
-	rinode = rfs_inode_find(inode);
-	rinfo = rfs_inode_get_rinfo(rinode);
-	rfs_context_init(&rcont, 0);
+	rinfo = rfs_inode_rcu_rinfo(rinode);
 
 	if (S_ISREG(inode->i_mode))
 		rargs.type.id = REDIRFS_REG_IOP_PERMISSION;
@@ -758,43 +950,75 @@ static int rfs_permission(struct inode *inode, int mask, unsigned int flags)
 	else 
 		rargs.type.id = REDIRFS_SOCK_IOP_PERMISSION;
 
+	if (!rfs_chain_op_nr(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_int = rfs_permission_old(rinode, inode, mask,
+				flags);
+		goto exit;
+	}
+
+	if (rcu && rfs_chain_op_blocks(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_int = -ECHILD;
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
 	rargs.args.i_permission.inode = inode;
 	rargs.args.i_permission.mask = mask;
 	rargs.args.i_permission.flags = flags;
 
-	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
-		if (rinode->op_old && rinode->op_old->permission)
-			rargs.rv.rv_int = rinode->op_old->permission(
-					rargs.args.i_permission.inode,
-					rargs.args.i_permission.mask,
-					rargs.args.i_permission.flags);
-		else
-			rargs.rv.rv_int = generic_permission(inode, submask,
-					flags, NULL);
-	}
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_int = rfs_permission_old(rinode,
+				rargs.args.i_permission.inode,
+				rargs.args.i_permission.mask,
+				rargs.args.i_permission.flags);
 
 	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
 	rfs_context_deinit(&rcont);
-
-	rfs_inode_put(rinode);
-	rfs_info_put(rinfo);
+exit:
+	if (!rcu)
+		rfs_inode_put(rinode);
+	rfs_info_read_unlock(idx);
 	return rargs.rv.rv_int;
 }
 
 #else
 
+static inline int rfs_permission_old(struct rfs_inode *rinode,
+		struct inode *inode, int mask)
+{
+	if (rinode->op_old && rinode->op_old->permission)
+		return rinode->op_old->permission(inode, mask);
+
+	return generic_permission(inode, mask & ~MAY_APPEND);
+}
+
+/*
+ * See the previous version, the rcu-walk is signalled by MAY_NOT_BLOCK.
+ */
 static int rfs_permission(struct inode *inode, int mask)
 {
 	struct rfs_inode *rinode;
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
-	int submask;
+	int rcu = mask & MAY_NOT_BLOCK;
+	int idx;
+
+	if (rcu) {
+		idx = rfs_info_read_lock();
+		rinode = rfs_inode_find_rcu(inode);
+		if (!rinode || atomic_read(&rinode->lazy)) {
+			rfs_info_read_unlock(idx);
+			return -ECHILD;
+		}
+	} else {
+		rinode = rfs_inode_find(inode);
+		if (atomic_read(&rinode->lazy))
+			rfs_dcache_lazy_subs(rinode);
+		idx = rfs_info_read_lock();
+	}
 
-	submask = mask & ~MAY_APPEND;
-	rinode = rfs_inode_find(inode);
-	rinfo = rfs_inode_get_rinfo(rinode);
-	rfs_context_init(&rcont, 0);
+	rinfo = rfs_inode_rcu_rinfo(rinode);
 
 	if (S_ISREG(inode->i_mode))
 		rargs.type.id = REDIRFS_REG_IOP_PERMISSION;
@@ -811,23 +1035,31 @@ static int rfs_permission(struct inode *inode, int mask)
 	else 
 		rargs.type.id = REDIRFS_SOCK_IOP_PERMISSION;
 
+	if (!rfs_chain_op_nr(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_int = rfs_permission_old(rinode, inode, mask);
+		goto exit;
+	}
+
+	if (rcu && rfs_chain_op_blocks(rinfo->rchain, rargs.type.id)) {
+		rargs.rv.rv_int = -ECHILD;
+		goto exit;
+	}
+
+	rfs_context_init(&rcont, 0);
 	rargs.args.i_permission.inode = inode;
 	rargs.args.i_permission.mask = mask;
 
-	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
-		if (rinode->op_old && rinode->op_old->permission)
-			rargs.rv.rv_int = rinode->op_old->permission(
-					rargs.args.i_permission.inode,
-					rargs.args.i_permission.mask);
-		else
-			rargs.rv.rv_int = generic_permission(inode, submask);
-	}
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs))
+		rargs.rv.rv_int = rfs_permission_old(rinode,
+				rargs.args.i_permission.inode,
+				rargs.args.i_permission.mask);
 
 	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
 	rfs_context_deinit(&rcont);
-
-	rfs_inode_put(rinode);
-	rfs_info_put(rinfo);
+exit:
+	if (!rcu)
+		rfs_inode_put(rinode);
+	rfs_info_read_unlock(idx);
 	return rargs.rv.rv_int;
 }
 
@@ -859,9 +1091,11 @@ static int rfs_setattr(struct dentry *dentry, struct iattr *iattr)
 	struct rfs_info *rinfo;
 	struct rfs_context rcont;
 	struct redirfs_args rargs;
+	int idx;
 
 	rinode = rfs_inode_find(dentry->d_inode);
-	rinfo = rfs_inode_get_rinfo(rinode);
+	idx = rfs_info_read_lock();
+	rinfo = rfs_inode_rcu_rinfo(rinode);
 	rfs_context_init(&rcont, 0);
 
 	if (S_ISREG(dentry->d_inode->i_mode))
@@ -895,7 +1129,7 @@ static int rfs_setattr(struct dentry *dentry, struct iattr *iattr)
 	rfs_context_deinit(&rcont);
 
 	rfs_inode_put(rinode);
-	rfs_info_put(rinfo);
+	rfs_info_read_unlock(idx);
 	return rargs.rv.rv_int;
 }
 
@@ -976,16 +1210,23 @@ int rfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	struct rfs_context rcont_old;
 	struct rfs_context rcont_new;
 	struct redirfs_args rargs;
+	int idx;
+
+	/*
+	 * The rinfos are not referenced, rfs_fsrename may replace them but
+	 * they stay valid until the srcu read side section is left.
+	 */
+	idx = rfs_info_read_lock();
 
 	rfs_context_init(&rcont_old, 0);
 	rinode_old = rfs_inode_find(old_dir);
-	rinfo_old = rfs_inode_get_rinfo(rinode_old);
+	rinfo_old = rfs_inode_rcu_rinfo(rinode_old);
 
 	rfs_context_init(&rcont_new, 0);
 	rinode_new = rfs_inode_find(new_dir);
 
 	if (rinode_new)
-		rinfo_new = rfs_inode_get_rinfo(rinode_new);
+		rinfo_new = rfs_inode_rcu_rinfo(rinode_new);
 	else
 		rinfo_new = NULL;
 
@@ -998,6 +1239,8 @@ int rfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	rargs.args.i_rename.old_dentry = old_dentry;
 	rargs.args.i_rename.new_dir = new_dir;
 	rargs.args.i_rename.new_dentry = new_dentry;
+	rargs.args.i_rename.old_name = &old_dentry->d_name;
+	rargs.args.i_rename.new_name = &new_dentry->d_name;
 
 	if (rfs_precall_flts(rinfo_old->rchain, &rcont_old, &rargs))
 		goto skip;
@@ -1005,6 +1248,12 @@ int rfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	if (rfs_precall_flts_rename(rinfo_new, &rcont_new, &rargs))
 		goto skip;
 
+	if (old_dir != new_dir && old_dentry->d_inode &&
+	    S_ISDIR(old_dentry->d_inode->i_mode))
+		atomic_inc(&rfs_dcache_rename_seq);
+
+	rfs_name_rename(old_dentry);
+
 	if (rinode_old->op_old && rinode_old->op_old->rename)
 		rargs.rv.rv_int = rinode_old->op_old->rename(
 				rargs.args.i_rename.old_dir,
@@ -1029,96 +1278,348 @@ skip:
 	rfs_context_deinit(&rcont_new);
 	rfs_inode_put(rinode_old);
 	rfs_inode_put(rinode_new);
-	rfs_info_put(rinfo_old);
-	rfs_info_put(rinfo_new);
+	rfs_info_read_unlock(idx);
 	return rargs.rv.rv_int;
 }
 
 
-static void rfs_inode_set_ops_reg(struct rfs_inode *rinode)
+static void rfs_inode_set_ops_reg(struct rfs_inode *rinode,
+		struct inode_operations *op_new)
 {
-	RFS_SET_IOP(rinode, REDIRFS_REG_IOP_PERMISSION, permission);
-	RFS_SET_IOP(rinode, REDIRFS_REG_IOP_SETATTR, setattr);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_REG_IOP_PERMISSION, permission);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_REG_IOP_SETATTR, setattr);
 }
 
-static void rfs_inode_set_ops_dir(struct rfs_inode *rinode)
+static void rfs_inode_set_ops_dir(struct rfs_inode *rinode,
+		struct inode_operations *op_new)
 {
-	RFS_SET_IOP(rinode, REDIRFS_DIR_IOP_UNLINK, unlink);
-	RFS_SET_IOP(rinode, REDIRFS_DIR_IOP_RMDIR, rmdir);
-	RFS_SET_IOP(rinode, REDIRFS_DIR_IOP_PERMISSION, permission);
-	RFS_SET_IOP(rinode, REDIRFS_DIR_IOP_SETATTR, setattr);
-
-	RFS_SET_IOP_MGT(rinode, create);
-	RFS_SET_IOP_MGT(rinode, link);
-	RFS_SET_IOP_MGT(rinode, mknod);
-	RFS_SET_IOP_MGT(rinode, symlink);
-
-	rinode->op_new.lookup = rfs_lookup;
-	rinode->op_new.mkdir = rfs_mkdir;
+	RFS_SET_IOP(rinode, op_new, REDIRFS_DIR_IOP_UNLINK, unlink);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_DIR_IOP_RMDIR, rmdir);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_DIR_IOP_PERMISSION, permission);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_DIR_IOP_SETATTR, setattr);
+
+	RFS_SET_IOP_MGT(rinode, op_new, create);
+	RFS_SET_IOP_MGT(rinode, op_new, link);
+	RFS_SET_IOP_MGT(rinode, op_new, mknod);
+	RFS_SET_IOP_MGT(rinode, op_new, symlink);
+
+	op_new->lookup = rfs_lookup;
+	op_new->mkdir = rfs_mkdir;
+
+	if (atomic_read(&rinode->lazy))
+		op_new->permission = rfs_permission;
 }
 
-static void rfs_inode_set_ops_lnk(struct rfs_inode *rinode)
+static void rfs_inode_set_ops_lnk(struct rfs_inode *rinode,
+		struct inode_operations *op_new)
 {
-	RFS_SET_IOP(rinode, REDIRFS_LNK_IOP_PERMISSION, permission);
-	RFS_SET_IOP(rinode, REDIRFS_LNK_IOP_SETATTR, setattr);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_LNK_IOP_PERMISSION, permission);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_LNK_IOP_SETATTR, setattr);
 }
 
-static void rfs_inode_set_ops_chr(struct rfs_inode *rinode)
+static void rfs_inode_set_ops_chr(struct rfs_inode *rinode,
+		struct inode_operations *op_new)
 {
-	RFS_SET_IOP(rinode, REDIRFS_CHR_IOP_PERMISSION, permission);
-	RFS_SET_IOP(rinode, REDIRFS_CHR_IOP_SETATTR, setattr);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_CHR_IOP_PERMISSION, permission);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_CHR_IOP_SETATTR, setattr);
 }
 
-static void rfs_inode_set_ops_blk(struct rfs_inode *rinode)
+static void rfs_inode_set_ops_blk(struct rfs_inode *rinode,
+		struct inode_operations *op_new)
 {
-	RFS_SET_IOP(rinode, REDIRFS_BLK_IOP_PERMISSION, permission);
-	RFS_SET_IOP(rinode, REDIRFS_BLK_IOP_SETATTR, setattr);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_BLK_IOP_PERMISSION, permission);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_BLK_IOP_SETATTR, setattr);
 }
 
-static void rfs_inode_set_ops_fifo(struct rfs_inode *rinode)
+static void rfs_inode_set_ops_fifo(struct rfs_inode *rinode,
+		struct inode_operations *op_new)
 {
-	RFS_SET_IOP(rinode, REDIRFS_FIFO_IOP_PERMISSION, permission);
-	RFS_SET_IOP(rinode, REDIRFS_FIFO_IOP_SETATTR, setattr);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_FIFO_IOP_PERMISSION, permission);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_FIFO_IOP_SETATTR, setattr);
 }
 
-static void rfs_inode_set_ops_sock(struct rfs_inode *rinode)
+static void rfs_inode_set_ops_sock(struct rfs_inode *rinode,
+		struct inode_operations *op_new)
 {
-	RFS_SET_IOP(rinode, REDIRFS_SOCK_IOP_PERMISSION, permission);
-	RFS_SET_IOP(rinode, REDIRFS_SOCK_IOP_SETATTR, setattr);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_SOCK_IOP_PERMISSION, permission);
+	RFS_SET_IOP(rinode, op_new, REDIRFS_SOCK_IOP_SETATTR, setattr);
+}
+
+static int rfs_readpage(struct file *file, struct page *page)
+{
+	const struct address_space_operations *aop;
+	struct rfs_inode *rinode;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	int idx;
+
+	rinode = rfs_inode_find(page->mapping->host);
+	if (!rinode) {
+		aop = ACCESS_ONCE(page->mapping->a_ops);
+		if (aop->readpage && aop->readpage != rfs_readpage)
+			return aop->readpage(file, page);
+
+		return -EINVAL;
+	}
+
+	idx = rfs_info_read_lock();
+	rinfo = rfs_inode_rcu_rinfo(rinode);
+	rfs_context_init(&rcont, 0);
+
+	rargs.type.id = REDIRFS_REG_AOP_READPAGE;
+	rargs.args.a_readpage.file = file;
+	rargs.args.a_readpage.page = page;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
+		if (rinode->aop_old && rinode->aop_old->readpage)
+			rargs.rv.rv_int = rinode->aop_old->readpage(
+					rargs.args.a_readpage.file,
+					rargs.args.a_readpage.page);
+		else
+			rargs.rv.rv_int = -EINVAL;
+	}
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+
+	rfs_inode_put(rinode);
+	rfs_info_read_unlock(idx);
+	return rargs.rv.rv_int;
+}
+
+static int rfs_readpages(struct file *file, struct address_space *mapping,
+		struct list_head *pages, unsigned nr_pages)
+{
+	const struct address_space_operations *aop;
+	struct rfs_inode *rinode;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	int idx;
+
+	rinode = rfs_inode_find(mapping->host);
+	if (!rinode) {
+		aop = ACCESS_ONCE(mapping->a_ops);
+		if (aop->readpages && aop->readpages != rfs_readpages)
+			return aop->readpages(file, mapping, pages, nr_pages);
+
+		if (aop->readpage && aop->readpage != rfs_readpage)
+			return read_cache_pages(mapping, pages,
+					(filler_t *)aop->readpage, file);
+
+		return -EINVAL;
+	}
+
+	idx = rfs_info_read_lock();
+	rinfo = rfs_inode_rcu_rinfo(rinode);
+	rfs_context_init(&rcont, 0);
+
+	rargs.type.id = REDIRFS_REG_AOP_READPAGES;
+	rargs.args.a_readpages.file = file;
+	rargs.args.a_readpages.mapping = mapping;
+	rargs.args.a_readpages.pages = pages;
+	rargs.args.a_readpages.nr_pages = nr_pages;
+
+	/*
+	 * Without readpages the VM falls back to readpage for every page in
+	 * the readahead window. Emulate it here so filters always see the
+	 * whole window in one call.
+	 */
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
+		if (rinode->aop_old && rinode->aop_old->readpages)
+			rargs.rv.rv_int = rinode->aop_old->readpages(
+					rargs.args.a_readpages.file,
+					rargs.args.a_readpages.mapping,
+					rargs.args.a_readpages.pages,
+					rargs.args.a_readpages.nr_pages);
+		else if (rinode->aop_old && rinode->aop_old->readpage)
+			rargs.rv.rv_int = read_cache_pages(
+					rargs.args.a_readpages.mapping,
+					rargs.args.a_readpages.pages,
+					(filler_t *)rinode->aop_old->readpage,
+					rargs.args.a_readpages.file);
+		else
+			rargs.rv.rv_int = -EINVAL;
+	}
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+
+	rfs_inode_put(rinode);
+	rfs_info_read_unlock(idx);
+	return rargs.rv.rv_int;
+}
+
+static int rfs_writepage(struct page *page, struct writeback_control *wbc)
+{
+	const struct address_space_operations *aop;
+	struct rfs_inode *rinode;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	int idx;
+
+	rinode = rfs_inode_find(page->mapping->host);
+	if (!rinode) {
+		aop = ACCESS_ONCE(page->mapping->a_ops);
+		if (aop->writepage && aop->writepage != rfs_writepage)
+			return aop->writepage(page, wbc);
+
+		return -EINVAL;
+	}
+
+	idx = rfs_info_read_lock();
+	rinfo = rfs_inode_rcu_rinfo(rinode);
+	rfs_context_init(&rcont, 0);
+
+	rargs.type.id = REDIRFS_REG_AOP_WRITEPAGE;
+	rargs.args.a_writepage.page = page;
+	rargs.args.a_writepage.wbc = wbc;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
+		if (rinode->aop_old && rinode->aop_old->writepage)
+			rargs.rv.rv_int = rinode->aop_old->writepage(
+					rargs.args.a_writepage.page,
+					rargs.args.a_writepage.wbc);
+		else
+			rargs.rv.rv_int = -EINVAL;
+	}
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+
+	rfs_inode_put(rinode);
+	rfs_info_read_unlock(idx);
+	return rargs.rv.rv_int;
+}
+
+static int rfs_writepages(struct address_space *mapping,
+		struct writeback_control *wbc)
+{
+	const struct address_space_operations *aop;
+	struct rfs_inode *rinode;
+	struct rfs_info *rinfo;
+	struct rfs_context rcont;
+	struct redirfs_args rargs;
+	int idx;
+
+	rinode = rfs_inode_find(mapping->host);
+	if (!rinode) {
+		aop = ACCESS_ONCE(mapping->a_ops);
+		if (aop->writepages && aop->writepages != rfs_writepages)
+			return aop->writepages(mapping, wbc);
+
+		return generic_writepages(mapping, wbc);
+	}
+
+	idx = rfs_info_read_lock();
+	rinfo = rfs_inode_rcu_rinfo(rinode);
+	rfs_context_init(&rcont, 0);
+
+	rargs.type.id = REDIRFS_REG_AOP_WRITEPAGES;
+	rargs.args.a_writepages.mapping = mapping;
+	rargs.args.a_writepages.wbc = wbc;
+
+	if (!rfs_precall_flts(rinfo->rchain, &rcont, &rargs)) {
+		if (rinode->aop_old && rinode->aop_old->writepages)
+			rargs.rv.rv_int = rinode->aop_old->writepages(
+					rargs.args.a_writepages.mapping,
+					rargs.args.a_writepages.wbc);
+		else
+			rargs.rv.rv_int = generic_writepages(
+					rargs.args.a_writepages.mapping,
+					rargs.args.a_writepages.wbc);
+	}
+
+	rfs_postcall_flts(rinfo->rchain, &rcont, &rargs);
+	rfs_context_deinit(&rcont);
+
+	rfs_inode_put(rinode);
+	rfs_info_read_unlock(idx);
+	return rargs.rv.rv_int;
+}
+
+static void rfs_inode_swap_aops(struct rfs_inode *rinode,
+		struct address_space_operations *aop_new)
+{
+	const struct address_space_operations *aop_old;
+	const struct address_space_operations *aop;
+	struct address_space *mapping = rinode->inode->i_mapping;
+
+	aop = rfs_optab_get(rinode->aop_old, aop_new,
+			sizeof(struct address_space_operations));
+	if (!aop) {
+		printk(KERN_ERR "redirfs: cannot allocate address space "
+				"operations\n");
+		return;
+	}
+
+	aop_old = rinode->aop_new;
+	rinode->aop_new = aop;
+	cmpxchg(&mapping->a_ops, aop_old ? aop_old : rinode->aop_old, aop);
+	rfs_optab_put(aop_old);
 }
 
 static void rfs_inode_set_aops_reg(struct rfs_inode *rinode)
 {
+	struct address_space_operations aop_new;
+
+	if (!rinode->aop_new && !rinode->rinfo->rops)
+		return;
+
+	if (rinode->aop_new)
+		aop_new = *rinode->aop_new;
+	else if (rinode->aop_old)
+		aop_new = *rinode->aop_old;
+	else
+		memset(&aop_new, 0, sizeof(struct address_space_operations));
+
+	RFS_SET_AOP(rinode, &aop_new, REDIRFS_REG_AOP_READPAGE, readpage);
+	RFS_SET_AOP(rinode, &aop_new, REDIRFS_REG_AOP_READPAGES, readpages);
+	RFS_SET_AOP(rinode, &aop_new, REDIRFS_REG_AOP_WRITEPAGE, writepage);
+	RFS_SET_AOP(rinode, &aop_new, REDIRFS_REG_AOP_WRITEPAGES, writepages);
+
+	if (!rinode->aop_new && rinode->aop_old &&
+	    !memcmp(&aop_new, rinode->aop_old,
+		    sizeof(struct address_space_operations)))
+		return;
+
+	rfs_inode_swap_aops(rinode, &aop_new);
 }
 
 void rfs_inode_set_ops(struct rfs_inode *rinode)
 {
+	struct inode_operations op_new;
 	umode_t mode = rinode->inode->i_mode;
 
 	spin_lock(&rinode->lock);
 
+	op_new = *rinode->op_new;
+
 	if (S_ISREG(mode)) {
-		rfs_inode_set_ops_reg(rinode);
+		rfs_inode_set_ops_reg(rinode, &op_new);
 		rfs_inode_set_aops_reg(rinode);
 
 	} else if (S_ISDIR(mode))
-		rfs_inode_set_ops_dir(rinode);
+		rfs_inode_set_ops_dir(rinode, &op_new);
 
 	else if (S_ISLNK(mode))
-		rfs_inode_set_ops_lnk(rinode);
+		rfs_inode_set_ops_lnk(rinode, &op_new);
 
 	else if (S_ISCHR(mode))
-		rfs_inode_set_ops_chr(rinode);
+		rfs_inode_set_ops_chr(rinode, &op_new);
 
 	else if (S_ISBLK(mode))
-		rfs_inode_set_ops_blk(rinode);
+		rfs_inode_set_ops_blk(rinode, &op_new);
 
 	else if (S_ISFIFO(mode))
-		rfs_inode_set_ops_fifo(rinode);
+		rfs_inode_set_ops_fifo(rinode, &op_new);
 
 	else if (S_ISSOCK(mode))
-		rfs_inode_set_ops_sock(rinode);
+		rfs_inode_set_ops_sock(rinode, &op_new);
 
+	rfs_inode_swap_ops(rinode, &op_new);
 	spin_unlock(&rinode->lock);
 }
 
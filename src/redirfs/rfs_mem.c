@@ -0,0 +1,111 @@
+/*
+ * RedirFS: Redirecting File System
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rfs.h"
+
+/*
+ * Counts and sizes of objects allocated by redirfs. The counters are per
+ * cpu, objects are often freed on a different cpu than they were allocated
+ * on, so only the sum over all cpus makes sense. The rcu callbacks free
+ * objects from the softirq context, hence the counters are updated with
+ * interrupts disabled.
+ */
+struct rfs_mem_stat {
+	long nr[RFS_MEM_END];
+	long bytes[RFS_MEM_END];
+};
+
+static DEFINE_PER_CPU(struct rfs_mem_stat, rfs_mem_stats);
+
+static const char *rfs_mem_names[RFS_MEM_END] = {
+	"dentry",
+	"inode",
+	"file",
+	"info",
+	"chain",
+	"data"
+};
+
+void rfs_mem_account(enum rfs_mem_type type, int nr, long bytes)
+{
+	struct rfs_mem_stat *stat;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	stat = &__get_cpu_var(rfs_mem_stats);
+	stat->nr[type] += nr;
+	stat->bytes[type] += bytes;
+	local_irq_restore(flags);
+}
+
+void rfs_mem_root_inc(struct rfs_info *rinfo)
+{
+	if (rinfo && rinfo->rroot)
+		atomic_inc(&rinfo->rroot->rdentries_nr);
+}
+
+void rfs_mem_root_dec(struct rfs_info *rinfo)
+{
+	if (rinfo && rinfo->rroot)
+		atomic_dec(&rinfo->rroot->rdentries_nr);
+}
+
+/*
+ * One "name:nr:bytes" record per object type. The filter data are embedded
+ * in the filters' objects of unknown size, their record is only "data:nr",
+ * the per filter numbers are in the filters' memory attributes.
+ */
+int rfs_mem_get_info(char *buf, int size)
+{
+	struct rfs_mem_stat *stat;
+	long nr;
+	long bytes;
+	int len = 0;
+	int type;
+	int cpu;
+
+	for (type = 0; type < RFS_MEM_END; type++) {
+		nr = 0;
+		bytes = 0;
+
+		for_each_possible_cpu(cpu) {
+			stat = &per_cpu(rfs_mem_stats, cpu);
+			nr += stat->nr[type];
+			bytes += stat->bytes[type];
+		}
+
+		if (type == RFS_MEM_DATA)
+			len += snprintf(buf + len, size - len, "%s:%ld",
+					rfs_mem_names[type], nr) + 1;
+		else
+			len += snprintf(buf + len, size - len, "%s:%ld:%ld",
+					rfs_mem_names[type], nr, bytes) + 1;
+
+		if (len >= size) {
+			len = size;
+			break;
+		}
+	}
+
+	return len;
+}
@@ -0,0 +1,247 @@
+/*
+ * RedirFS: Redirecting File System
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rfs.h"
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38))
+
+static unsigned long name_cache = 0;
+static atomic_t rfs_name_size = ATOMIC_INIT(0);
+static atomic_t rfs_name_dirs = ATOMIC_INIT(0);
+
+struct rfs_name {
+	struct work_struct work;
+	struct vfsmount *mnt;
+	int dirs;
+	int size;
+	int len;
+	char name[0];
+};
+
+static void rfs_name_free_work(struct work_struct *work)
+{
+	struct rfs_name *rname = container_of(work, struct rfs_name, work);
+
+	mntput(rname->mnt);
+	atomic_sub(rname->size, &rfs_name_size);
+	kfree(rname);
+}
+
+/*
+ * The mount reference is dropped from the rfs_info workqueue, the last
+ * rdentry reference may go away in the middle of a dput on the same
+ * super block.
+ */
+static void rfs_name_free(struct rfs_name *rname)
+{
+	if (!rname)
+		return;
+
+	INIT_WORK(&rname->work, rfs_name_free_work);
+	queue_work(rfs_info_wq, &rname->work);
+}
+
+/*
+ * A cached name stays valid till the dentry itself or one of the
+ * directories above it is renamed. Renames of the dentry bump its own
+ * sequence in rfs_name_rename, renames of directories bump rfs_name_dirs,
+ * so renames of unrelated files do not flush the cache. The rename_lock
+ * sequence only tells rfs_name_set whether a d_move raced with d_path. An
+ * unhashed dentry gets the " (deleted)" suffix from d_path, so it is never
+ * served from the cache.
+ */
+int rfs_name_get(struct rfs_dentry *rdentry, struct vfsmount *mnt, char *buf,
+		int size, struct rfs_name_seq *seq)
+{
+	struct rfs_name *rname;
+	int rv = -ENOENT;
+
+	seq->rename = read_seqbegin(&rename_lock);
+	seq->dirs = atomic_read(&rfs_name_dirs);
+
+	if (!name_cache)
+		return -ENOENT;
+
+	spin_lock(&rdentry->lock);
+
+	seq->own = rdentry->name_seq;
+	rname = rdentry->name;
+
+	if (!rname || rname->mnt != mnt || rname->dirs != seq->dirs)
+		goto exit;
+
+	if (d_unhashed(rdentry->dentry))
+		goto exit;
+
+	if (rname->len >= size) {
+		rv = -ENAMETOOLONG;
+		goto exit;
+	}
+
+	memcpy(buf, rname->name, rname->len + 1);
+	rv = 0;
+exit:
+	spin_unlock(&rdentry->lock);
+	return rv;
+}
+
+/*
+ * The d_move of a rename is done by the VFS after the rename operation
+ * returns, so the name computed in between is already stale. The parent
+ * directory's i_mutex is held over the whole rename, a name is not cached
+ * while any directory above the dentry is locked.
+ */
+static int rfs_name_busy(struct dentry *dentry)
+{
+	struct dentry *parent;
+	int busy = 0;
+
+	rcu_read_lock();
+
+	parent = dentry;
+	while (!IS_ROOT(parent)) {
+		parent = ACCESS_ONCE(parent->d_parent);
+		if (parent->d_inode &&
+		    mutex_is_locked(&parent->d_inode->i_mutex)) {
+			busy = 1;
+			break;
+		}
+	}
+
+	rcu_read_unlock();
+
+	return busy;
+}
+
+void rfs_name_set(struct rfs_dentry *rdentry, struct vfsmount *mnt,
+		const char *name, struct rfs_name_seq *seq)
+{
+	struct rfs_name *rname;
+	int len;
+	int size;
+
+	if (!name_cache)
+		return;
+
+	if (d_unhashed(rdentry->dentry))
+		return;
+
+	if (rfs_name_busy(rdentry->dentry))
+		return;
+
+	smp_rmb();
+
+	if (read_seqretry(&rename_lock, seq->rename))
+		return;
+
+	if (atomic_read(&rfs_name_dirs) != seq->dirs)
+		return;
+
+	len = strlen(name);
+	size = sizeof(struct rfs_name) + len + 1;
+
+	if (atomic_add_return(size, &rfs_name_size) > name_cache) {
+		atomic_sub(size, &rfs_name_size);
+		return;
+	}
+
+	rname = kmalloc(size, GFP_ATOMIC);
+	if (!rname) {
+		atomic_sub(size, &rfs_name_size);
+		return;
+	}
+
+	rname->mnt = mntget(mnt);
+	rname->dirs = seq->dirs;
+	rname->size = size;
+	rname->len = len;
+	memcpy(rname->name, name, len + 1);
+
+	spin_lock(&rdentry->lock);
+	if (rdentry->name_seq == seq->own)
+		swap(rdentry->name, rname);
+	spin_unlock(&rdentry->lock);
+
+	rfs_name_free(rname);
+}
+
+void rfs_name_rem(struct rfs_dentry *rdentry)
+{
+	rfs_name_free(rdentry->name);
+	rdentry->name = NULL;
+}
+
+/*
+ * Called from rfs_rename with the parent directories locked, before the
+ * rename operation.
+ */
+void rfs_name_rename(struct dentry *dentry)
+{
+	struct rfs_dentry *rdentry;
+	struct rfs_name *rname;
+
+	if (dentry->d_inode && S_ISDIR(dentry->d_inode->i_mode)) {
+		atomic_inc(&rfs_name_dirs);
+		smp_mb__after_atomic_inc();
+		return;
+	}
+
+	rdentry = rfs_dentry_find(dentry);
+	if (!rdentry)
+		return;
+
+	spin_lock(&rdentry->lock);
+	rdentry->name_seq++;
+	rname = rdentry->name;
+	rdentry->name = NULL;
+	spin_unlock(&rdentry->lock);
+
+	rfs_name_free(rname);
+	rfs_dentry_put(rdentry);
+}
+
+module_param(name_cache, ulong, 0644);
+MODULE_PARM_DESC(name_cache, "memory limit in bytes for cached file names, 0 disables the cache, a cached name holds a reference to its mount");
+
+#else
+
+int rfs_name_get(struct rfs_dentry *rdentry, struct vfsmount *mnt, char *buf,
+		int size, struct rfs_name_seq *seq)
+{
+	return -ENOENT;
+}
+
+void rfs_name_set(struct rfs_dentry *rdentry, struct vfsmount *mnt,
+		const char *name, struct rfs_name_seq *seq)
+{
+}
+
+void rfs_name_rem(struct rfs_dentry *rdentry)
+{
+}
+
+void rfs_name_rename(struct dentry *dentry)
+{
+}
+
+#endif
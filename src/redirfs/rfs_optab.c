@@ -0,0 +1,354 @@
+/*
+ * RedirFS: Redirecting File System
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rfs.h"
+
+/*
+ * Operation tables are interned here. All rdentries, rinodes and rfiles
+ * with the same original operations and the same set of redirected
+ * operations share one table. The tables are hashed by the original
+ * operations, so only tables created for the same filesystem share a
+ * bucket and its lock. The VFS loads the operations pointer and calls
+ * through it without sleeping in between, so a table which is no longer
+ * referenced is freed after a rcu grace period.
+ */
+
+#define RFS_OPTAB_BITS 8
+
+struct rfs_optab {
+	struct hlist_node hash;
+	struct rcu_head rcu;
+	const void *op_old;
+	atomic_t count;
+	size_t size;
+	unsigned long ops[0];
+};
+
+static struct rfs_hash rfs_optab_hash;
+
+#define rfs_optab_entry(ops) \
+	((struct rfs_optab *)((char *)(ops) - offsetof(struct rfs_optab, ops)))
+
+const void *rfs_optab_get(const void *op_old, const void *ops, size_t size)
+{
+	struct rfs_optab *optab;
+	struct rfs_optab *loop;
+	struct hlist_head *head;
+	struct hlist_node *pos;
+	spinlock_t *lock;
+
+	lock = rfs_hash_lock(&rfs_optab_hash, op_old);
+	spin_lock(lock);
+	head = rfs_hash_head(&rfs_optab_hash, op_old);
+
+	hlist_for_each_entry(loop, pos, head, hash) {
+		if (loop->op_old != op_old || loop->size != size)
+			continue;
+
+		if (memcmp(loop->ops, ops, size))
+			continue;
+
+		atomic_inc(&loop->count);
+		spin_unlock(lock);
+		return loop->ops;
+	}
+
+	optab = kmalloc(sizeof(struct rfs_optab) + size, GFP_ATOMIC);
+	if (!optab) {
+		spin_unlock(lock);
+		return NULL;
+	}
+
+	optab->op_old = op_old;
+	optab->size = size;
+	atomic_set(&optab->count, 1);
+	memcpy(optab->ops, ops, size);
+	hlist_add_head(&optab->hash, head);
+
+	spin_unlock(lock);
+
+	return optab->ops;
+}
+
+static void rfs_optab_free(struct rcu_head *head)
+{
+	kfree(container_of(head, struct rfs_optab, rcu));
+}
+
+void rfs_optab_put(const void *ops)
+{
+	struct rfs_optab *optab;
+	spinlock_t *lock;
+
+	if (!ops)
+		return;
+
+	optab = rfs_optab_entry(ops);
+	lock = rfs_hash_lock(&rfs_optab_hash, optab->op_old);
+
+	BUG_ON(!atomic_read(&optab->count));
+	if (!atomic_dec_and_lock(&optab->count, lock))
+		return;
+
+	hlist_del(&optab->hash);
+	spin_unlock(lock);
+
+	call_rcu(&optab->rcu, rfs_optab_free);
+}
+
+const void *rfs_optab_old(const void *ops)
+{
+	return rfs_optab_entry(ops)->op_old;
+}
+
+int rfs_optab_create(void)
+{
+	return rfs_hash_init(&rfs_optab_hash, RFS_OPTAB_BITS, RFS_OPTAB_BITS,
+			NULL);
+}
+
+void rfs_optab_destroy(void)
+{
+	rcu_barrier();
+	rfs_hash_destroy(&rfs_optab_hash);
+}
+
+/*
+ * The rdentry, rinode and rfile hashes start with a bucket per 128 pages of
+ * memory and they are resized on the rfs_info workqueue as the number of
+ * objects changes. The keys are moved to the new table one lock at a time,
+ * writers holding the lock of a moved part already use the new table.
+ */
+static struct rfs_hash_table *rfs_hash_table_alloc(unsigned int bits)
+{
+	struct rfs_hash_table *table;
+	unsigned int i;
+
+	table = vmalloc(sizeof(struct rfs_hash_table) +
+			(sizeof(struct hlist_head) << bits));
+	if (!table)
+		return NULL;
+
+	for (i = 0; i < (1 << bits); i++)
+		INIT_HLIST_HEAD(&table->heads[i]);
+
+	table->bits = bits;
+
+	return table;
+}
+
+unsigned int rfs_hash_mem_bits(unsigned int shift)
+{
+	struct sysinfo info;
+	unsigned int bits = RFS_HASH_LOCK_BITS;
+
+	si_meminfo(&info);
+
+	while (bits < RFS_HASH_MAX_BITS &&
+	       (1UL << bits) < (info.totalram >> shift))
+		bits++;
+
+	return bits;
+}
+
+static unsigned int rfs_hash_new_bits(struct rfs_hash *rhash)
+{
+	unsigned int nr = atomic_read(&rhash->nr);
+	unsigned int bits = rhash->bits;
+
+	while (bits < rhash->max_bits && nr > (2U << bits))
+		bits++;
+
+	while (bits > rhash->min_bits && nr < ((1U << bits) >> 3))
+		bits--;
+
+	return bits;
+}
+
+static void rfs_hash_resize(struct rfs_hash *rhash)
+{
+	struct rfs_hash_table *table = rhash->table;
+	struct rfs_hash_table *new;
+	struct hlist_node *pos;
+	struct hlist_node *n;
+	unsigned int shift;
+	unsigned int bits;
+	unsigned int i;
+	unsigned int j;
+
+	bits = rfs_hash_new_bits(rhash);
+	if (bits == table->bits)
+		return;
+
+	new = rfs_hash_table_alloc(bits);
+	if (!new)
+		return;
+
+	preempt_disable();
+	write_seqcount_begin(&rhash->seq);
+	rcu_assign_pointer(rhash->new, new);
+	write_seqcount_end(&rhash->seq);
+	preempt_enable();
+
+	shift = table->bits - RFS_HASH_LOCK_BITS;
+
+	for (i = 0; i < RFS_HASH_LOCKS; i++) {
+		spin_lock(&rhash->locks[i]);
+		write_seqcount_begin(&rhash->seq);
+
+		for (j = i << shift; j < (i + 1) << shift; j++) {
+			hlist_for_each_safe(pos, n, &table->heads[j]) {
+				hlist_del_rcu(pos);
+				hlist_add_head_rcu(pos, &new->heads[hash_ptr(
+						(void *)rhash->key(pos), bits)]);
+			}
+		}
+
+		rhash->moved[i] = 1;
+		write_seqcount_end(&rhash->seq);
+		spin_unlock(&rhash->locks[i]);
+		cond_resched();
+	}
+
+	preempt_disable();
+	write_seqcount_begin(&rhash->seq);
+	rcu_assign_pointer(rhash->table, new);
+	write_seqcount_end(&rhash->seq);
+	preempt_enable();
+
+	for (i = 0; i < RFS_HASH_LOCKS; i++) {
+		spin_lock(&rhash->locks[i]);
+		rhash->moved[i] = 0;
+		spin_unlock(&rhash->locks[i]);
+	}
+
+	preempt_disable();
+	write_seqcount_begin(&rhash->seq);
+	rhash->new = NULL;
+	write_seqcount_end(&rhash->seq);
+	preempt_enable();
+
+	rhash->bits = bits;
+
+	synchronize_rcu();
+	vfree(table);
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20))
+static void rfs_hash_work_fn(void *data)
+{
+	rfs_hash_resize(data);
+}
+#else
+static void rfs_hash_work_fn(struct work_struct *work)
+{
+	rfs_hash_resize(container_of(work, struct rfs_hash, work));
+}
+#endif
+
+/*
+ * Called with the lock of the key held, the entries are added to the new
+ * table once the part of the lock has been moved.
+ */
+struct hlist_head *rfs_hash_head(struct rfs_hash *rhash, const void *key)
+{
+	struct rfs_hash_table *table;
+
+	if (rhash->moved[hash_ptr((void *)key, RFS_HASH_LOCK_BITS)])
+		table = rhash->new;
+	else
+		table = rhash->table;
+
+	return &table->heads[hash_ptr((void *)key, table->bits)];
+}
+
+void rfs_hash_add(struct rfs_hash *rhash, const void *key,
+		struct hlist_node *node)
+{
+	spinlock_t *lock;
+
+	lock = rfs_hash_lock(rhash, key);
+	spin_lock(lock);
+	hlist_add_head_rcu(node, rfs_hash_head(rhash, key));
+	spin_unlock(lock);
+
+	if (atomic_inc_return(&rhash->nr) > (2U << rhash->bits) &&
+	    rhash->bits < rhash->max_bits)
+		queue_work(rfs_info_wq, &rhash->work);
+}
+
+void rfs_hash_rem(struct rfs_hash *rhash, const void *key,
+		struct hlist_node *node)
+{
+	spinlock_t *lock;
+
+	lock = rfs_hash_lock(rhash, key);
+	spin_lock(lock);
+	if (hlist_unhashed(node)) {
+		spin_unlock(lock);
+		return;
+	}
+	hlist_del_init_rcu(node);
+	spin_unlock(lock);
+
+	if (atomic_dec_return(&rhash->nr) < ((1U << rhash->bits) >> 3) &&
+	    rhash->bits > rhash->min_bits)
+		queue_work(rfs_info_wq, &rhash->work);
+}
+
+int rfs_hash_init(struct rfs_hash *rhash, unsigned int bits,
+		unsigned int max_bits, const void *(*key)(struct hlist_node *))
+{
+	int i;
+
+	rhash->table = rfs_hash_table_alloc(bits);
+	if (!rhash->table)
+		return -ENOMEM;
+
+	for (i = 0; i < RFS_HASH_LOCKS; i++) {
+		spin_lock_init(&rhash->locks[i]);
+		rhash->moved[i] = 0;
+	}
+
+	rhash->new = NULL;
+	seqcount_init(&rhash->seq);
+	atomic_set(&rhash->nr, 0);
+	rhash->bits = bits;
+	rhash->min_bits = bits;
+	rhash->max_bits = max_bits < bits ? bits : max_bits;
+	rhash->key = key;
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20))
+	INIT_WORK(&rhash->work, rfs_hash_work_fn, rhash);
+#else
+	INIT_WORK(&rhash->work, rfs_hash_work_fn);
+#endif
+
+	return 0;
+}
+
+void rfs_hash_destroy(struct rfs_hash *rhash)
+{
+	flush_workqueue(rfs_info_wq);
+	vfree(rhash->table);
+	rhash->table = NULL;
+}
@@ -24,6 +24,8 @@
 #include "rfs.h"
 
 static LIST_HEAD(rfs_path_list);
+static struct hlist_head rfs_path_table[1 << RFS_PATH_HASH_BITS];
+static DEFINE_IDR(rfs_path_idr);
 RFS_DEFINE_MUTEX(rfs_path_mutex);
 
 static struct rfs_path *rfs_path_alloc(struct vfsmount *mnt,
@@ -36,6 +38,7 @@ static struct rfs_path *rfs_path_alloc(struct vfsmount *mnt,
 		return ERR_PTR(-ENOMEM);
 
 	INIT_LIST_HEAD(&rpath->list);
+	INIT_HLIST_NODE(&rpath->hash);
 	INIT_LIST_HEAD(&rpath->rroot_list);
 	rpath->mnt = mntget(mnt);
 	rpath->dentry = dget(dentry);
@@ -74,8 +77,10 @@ struct rfs_path *rfs_path_find(struct vfsmount *mnt,
 {
 	struct rfs_path *rpath = NULL;
 	struct rfs_path *found = NULL;
+	struct hlist_node *pos;
 
-	list_for_each_entry(rpath, &rfs_path_list, list) {
+	hlist_for_each_entry(rpath, pos,
+			&rfs_path_table[rfs_path_hashfn(dentry)], hash) {
 		if (rpath->mnt != mnt) 
 			continue;
 
@@ -91,18 +96,14 @@ struct rfs_path *rfs_path_find(struct vfsmount *mnt,
 
 struct rfs_path *rfs_path_find_id(int id)
 {
-	struct rfs_path *rpath = NULL;
-	struct rfs_path *found = NULL;
+	struct rfs_path *rpath;
 
-	list_for_each_entry(rpath, &rfs_path_list, list) {
-		if (rpath->id != id)
-			continue;
+	if (id < 0)
+		return NULL;
 
-		found = rfs_path_get(rpath);
-		break;
-	}
+	rpath = idr_find(&rfs_path_idr, id);
 
-	return found;
+	return rfs_path_get(rpath);
 }
 
 static int rfs_path_add_rroot(struct rfs_path *rpath)
@@ -129,32 +130,43 @@ static void rfs_path_rem_rroot(struct rfs_path *rpath)
 static void rfs_path_list_add(struct rfs_path *rpath)
 {
 	list_add_tail(&rpath->list, &rfs_path_list);
+	hlist_add_head(&rpath->hash,
+			&rfs_path_table[rfs_path_hashfn(rpath->dentry)]);
 	rfs_path_get(rpath);
 }
 
 static void rfs_path_list_rem(struct rfs_path *rpath)
 {
 	list_del_init(&rpath->list);
+	hlist_del_init(&rpath->hash);
+	idr_remove(&rfs_path_idr, rpath->id);
 	rfs_path_put(rpath);
 }
 
-static int rfs_path_get_id(void)
+/*
+ * The idr hands out the lowest free id, the same one the old linear scan
+ * of rfs_path_list used to find.
+ */
+static int rfs_path_get_id(struct rfs_path *rpath)
 {
-	struct rfs_path *rpath = NULL;
-	int i = 0;
+	int id;
+	int rv;
 
-mainloop:
-	while (i < INT_MAX) {
-		list_for_each_entry(rpath, &rfs_path_list, list) {
-			if (rpath->id == i) {
-				i++;
-				goto mainloop;
-			}
-		}
-		return i;
-	}
+	do {
+		if (!idr_pre_get(&rfs_path_idr, GFP_KERNEL))
+			return -ENOMEM;
 
-	return -1;
+		rv = idr_get_new(&rfs_path_idr, rpath, &id);
+
+	} while (rv == -EAGAIN);
+
+	if (rv == -ENOSPC)
+		return -EBUSY;
+
+	if (rv)
+		return rv;
+
+	return id;
 }
 
 static struct rfs_path *rfs_path_add(struct vfsmount *mnt,
@@ -168,18 +180,21 @@ static struct rfs_path *rfs_path_add(struct vfsmount *mnt,
 	if (rpath)
 		return rpath;
 
-	id = rfs_path_get_id();
-	if (id < 0)
-		return ERR_PTR(-EBUSY);
-
 	rpath = rfs_path_alloc(mnt, dentry);
 	if (IS_ERR(rpath))
 		return rpath;
 
+	id = rfs_path_get_id(rpath);
+	if (id < 0) {
+		rfs_path_put(rpath);
+		return ERR_PTR(id);
+	}
+
 	rpath->id = id;
 
 	rv = rfs_path_add_rroot(rpath);
 	if (rv) {
+		idr_remove(&rfs_path_idr, id);
 		rfs_path_put(rpath);
 		return ERR_PTR(rv);
 	}
@@ -198,7 +213,7 @@ static void rfs_path_rem(struct rfs_path *rpath)
 	rfs_path_list_rem(rpath);
 }
 
-static int rfs_path_add_dirs(struct dentry *dentry)
+static int rfs_path_add_dirs(struct dentry *dentry, int lazy)
 {
 	struct rfs_inode *rinode;
 
@@ -208,6 +223,9 @@ static int rfs_path_add_dirs(struct dentry *dentry)
 		return 0;
 	}
 
+	if (lazy)
+		return rfs_dcache_add_dir(dentry, NULL);
+
 	return rfs_dcache_walk(dentry, rfs_dcache_add_dir, NULL);
 }
 
@@ -223,8 +241,10 @@ notsup:
 	return -1;
 }
 
-static int rfs_path_add_include(struct rfs_path *rpath, struct rfs_flt *rflt)
+static int rfs_path_add_include(struct rfs_path *rpath, struct rfs_flt *rflt,
+		int lazy)
 {
+	struct rfs_root_ids *rids;
 	struct rfs_chain *rinch;
 	int rv;
 
@@ -234,25 +254,38 @@ static int rfs_path_add_include(struct rfs_path *rpath, struct rfs_flt *rflt)
 	if (rfs_chain_find(rpath->rexch, rflt) != -1)
 		return -EEXIST;
 
-	rv = rfs_path_add_dirs(rpath->dentry->d_sb->s_root);
+	rids = rfs_root_ids_alloc(rpath->rroot);
+	if (IS_ERR(rids))
+		return PTR_ERR(rids);
+
+	if (lazy)
+		rfs_root_lazy_begin(rpath->rroot);
+
+	rv = rfs_path_add_dirs(rpath->dentry->d_sb->s_root, lazy);
 	if (rv)
-		return rv;
+		goto exit;
 
 	rinch = rfs_chain_add(rpath->rinch, rflt);
-	if (IS_ERR(rinch))
-		return PTR_ERR(rinch);
+	if (IS_ERR(rinch)) {
+		rv = PTR_ERR(rinch);
+		goto exit;
+	}
 
 	rv = rfs_root_add_include(rpath->rroot, rflt);
 	if (rv) {
 		rfs_chain_put(rinch);
-		return rv;
+		goto exit;
 	}
 
 	rfs_chain_put(rpath->rinch);
 	rpath->rinch = rinch;
 	rflt->paths_nr++;
-
-	return 0;
+	rfs_root_ids_set(rpath->rroot, rids);
+	rids = NULL;
+exit:
+	kfree(rids);
+	rfs_root_lazy_queue(rpath->rroot);
+	return rv;
 }
 	
 static int rfs_path_add_exclude(struct rfs_path *rpath, struct rfs_flt *rflt)
@@ -285,25 +318,34 @@ static int rfs_path_add_exclude(struct rfs_path *rpath, struct rfs_flt *rflt)
 
 static int rfs_path_rem_include(struct rfs_path *rpath, struct rfs_flt *rflt)
 {
+	struct rfs_root_ids *rids;
 	struct rfs_chain *rinch;
 	int rv;
 
 	if (rfs_chain_find(rpath->rinch, rflt) == -1)
 		return 0;
 
+	rids = rfs_root_ids_alloc(rpath->rroot);
+	if (IS_ERR(rids))
+		return PTR_ERR(rids);
+
 	rinch = rfs_chain_rem(rpath->rinch, rflt);
-	if (IS_ERR(rinch))
+	if (IS_ERR(rinch)) {
+		kfree(rids);
 		return PTR_ERR(rinch);
+	}
 
 	rv = rfs_root_rem_include(rpath->rroot, rflt);
 	if (rv) {
 		rfs_chain_put(rinch);
+		kfree(rids);
 		return rv;
 	}
 
 	rfs_chain_put(rpath->rinch);
 	rpath->rinch = rinch;
 	rflt->paths_nr--;
+	rfs_root_ids_set(rpath->rroot, rids);
 
 	return 0;
 }
@@ -333,51 +375,251 @@ static int rfs_path_rem_exclude(struct rfs_path *rpath, struct rfs_flt *rflt)
 	return 0;
 }
 
-redirfs_path redirfs_add_path(redirfs_filter filter,
-		struct redirfs_path_info *info)
+static int rfs_path_check_info(struct redirfs_path_info *info)
 {
-	struct rfs_path *rpath;
-	int rv;
+	int flags;
+	int lazy;
 
-	might_sleep();
+	if (!info)
+		return -EINVAL;
 
-	if (!filter || IS_ERR(filter) || !info)
-		return ERR_PTR(-EINVAL);
+	flags = info->flags & ~REDIRFS_PATH_LAZY;
+	lazy = info->flags & REDIRFS_PATH_LAZY;
 
-	if (!info->mnt || !info->dentry || !info->flags)
-		return ERR_PTR(-EINVAL);
+	if (!info->mnt || !info->dentry || !flags)
+		return -EINVAL;
+
+	if (lazy && flags != REDIRFS_PATH_INCLUDE)
+		return -EINVAL;
+
+	if (flags != REDIRFS_PATH_INCLUDE && flags != REDIRFS_PATH_EXCLUDE)
+		return -EINVAL;
 
 	if (rfs_path_check_fs(info->dentry->d_inode->i_sb->s_type))
-		return ERR_PTR(-EPERM);
+		return -EPERM;
 
-	rfs_rename_lock(info->dentry->d_inode->i_sb);
-	rfs_mutex_lock(&rfs_path_mutex);
+	return 0;
+}
+
+/*
+ * Called with the rename lock of the path's super block and rfs_path_mutex
+ * held. The added flag tells whether the filter was really added to the
+ * path or if it was already there.
+ */
+static struct rfs_path *rfs_path_add_info(struct rfs_flt *rflt,
+		struct redirfs_path_info *info, int *added)
+{
+	struct rfs_path *rpath;
+	int flags;
+	int lazy;
+	int rv;
+
+	flags = info->flags & ~REDIRFS_PATH_LAZY;
+	lazy = info->flags & REDIRFS_PATH_LAZY;
 
 	rpath = rfs_path_add(info->mnt, info->dentry);
 	if (IS_ERR(rpath))
-		goto exit;
-
-	if (info->flags == REDIRFS_PATH_INCLUDE)
-		rv = rfs_path_add_include(rpath, filter);
+		return rpath;
 
-	else if (info->flags == REDIRFS_PATH_EXCLUDE)
-		rv = rfs_path_add_exclude(rpath, filter);
+	*added = rfs_chain_find(rpath->rinch, rflt) == -1 &&
+		rfs_chain_find(rpath->rexch, rflt) == -1;
 
+	if (flags == REDIRFS_PATH_INCLUDE)
+		rv = rfs_path_add_include(rpath, rflt, lazy);
 	else
-		rv = -EINVAL;
+		rv = rfs_path_add_exclude(rpath, rflt);
 
 	rfs_path_rem(rpath);
 
 	if (rv) {
 		rfs_path_put(rpath);
-		rpath = ERR_PTR(rv);
+		return ERR_PTR(rv);
 	}
-exit:
+
+	return rpath;
+}
+
+redirfs_path redirfs_add_path(redirfs_filter filter,
+		struct redirfs_path_info *info)
+{
+	struct rfs_path *rpath;
+	int added;
+	int rv;
+
+	might_sleep();
+
+	if (!filter || IS_ERR(filter))
+		return ERR_PTR(-EINVAL);
+
+	rv = rfs_path_check_info(info);
+	if (rv)
+		return ERR_PTR(rv);
+
+	rfs_rename_lock(info->dentry->d_inode->i_sb);
+	rfs_mutex_lock(&rfs_path_mutex);
+
+	rpath = rfs_path_add_info(filter, info, &added);
+
 	rfs_mutex_unlock(&rfs_path_mutex);
 	rfs_rename_unlock(info->dentry->d_inode->i_sb);
 	return rpath;
 }
 
+struct rfs_path_batch {
+	struct redirfs_path_info *info;
+	struct rfs_path *rpath;
+	int depth;
+	int added;
+	int idx;
+};
+
+#define rfs_path_batch_sb(pb) ((pb)->info->dentry->d_inode->i_sb)
+
+static int rfs_path_batch_cmp_sb(const void *a, const void *b)
+{
+	const struct rfs_path_batch *pba = a;
+	const struct rfs_path_batch *pbb = b;
+
+	if (rfs_path_batch_sb(pba) < rfs_path_batch_sb(pbb))
+		return -1;
+
+	if (rfs_path_batch_sb(pba) > rfs_path_batch_sb(pbb))
+		return 1;
+
+	return 0;
+}
+
+static int rfs_path_batch_cmp_depth(const void *a, const void *b)
+{
+	const struct rfs_path_batch *pba = a;
+	const struct rfs_path_batch *pbb = b;
+
+	return pbb->depth - pba->depth;
+}
+
+/*
+ * Directory moves between parents are serialized by the rename lock held
+ * by the caller, so the d_parent chain can be followed safely here.
+ */
+static int rfs_path_depth(struct dentry *dentry)
+{
+	int depth = 0;
+
+	while (!IS_ROOT(dentry)) {
+		dentry = dentry->d_parent;
+		depth++;
+	}
+
+	return depth;
+}
+
+static int rfs_path_add_batch(struct rfs_flt *rflt,
+		struct rfs_path_batch *batch, int nr)
+{
+	struct rfs_path *rpath;
+	int rv = 0;
+	int i;
+
+	for (i = 0; i < nr; i++)
+		batch[i].depth = rfs_path_depth(batch[i].info->dentry);
+
+	sort(batch, nr, sizeof(struct rfs_path_batch),
+			rfs_path_batch_cmp_depth, NULL);
+
+	for (i = 0; i < nr; i++) {
+		rpath = rfs_path_add_info(rflt, batch[i].info, &batch[i].added);
+		if (IS_ERR(rpath)) {
+			rv = PTR_ERR(rpath);
+			break;
+		}
+
+		batch[i].rpath = rpath;
+	}
+
+	return rv;
+}
+
+/*
+ * Add several paths at once. Paths are grouped by super block and each
+ * group is added under one rename lock, deepest paths first. This way a
+ * path nested in another one from the same batch is already a root when
+ * its parent's subtree is walked, so the walk skips it and every dentry
+ * is visited only once, no matter how the paths are nested. Either all
+ * paths are added or, on error, the ones added by this call are removed.
+ * References to the added paths are stored in paths in the order of
+ * infos, if paths is not NULL.
+ */
+int redirfs_add_paths(redirfs_filter filter, struct redirfs_path_info *infos,
+		int nr, redirfs_path *paths)
+{
+	struct rfs_path_batch *batch;
+	struct super_block *sb;
+	int rv = 0;
+	int i, j;
+
+	might_sleep();
+
+	if (!filter || IS_ERR(filter) || !infos || nr <= 0)
+		return -EINVAL;
+
+	for (i = 0; i < nr; i++) {
+		rv = rfs_path_check_info(&infos[i]);
+		if (rv)
+			return rv;
+	}
+
+	batch = kzalloc(sizeof(struct rfs_path_batch) * nr, GFP_KERNEL);
+	if (!batch)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		batch[i].info = &infos[i];
+		batch[i].idx = i;
+	}
+
+	sort(batch, nr, sizeof(struct rfs_path_batch), rfs_path_batch_cmp_sb,
+			NULL);
+
+	for (i = 0; i < nr; i = j) {
+		sb = rfs_path_batch_sb(&batch[i]);
+
+		for (j = i; j < nr; j++) {
+			if (rfs_path_batch_sb(&batch[j]) != sb)
+				break;
+		}
+
+		rfs_rename_lock(sb);
+		rfs_mutex_lock(&rfs_path_mutex);
+
+		rv = rfs_path_add_batch(filter, batch + i, j - i);
+
+		rfs_mutex_unlock(&rfs_path_mutex);
+		rfs_rename_unlock(sb);
+
+		if (rv)
+			break;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (!batch[i].rpath)
+			continue;
+
+		if (!rv && paths) {
+			paths[batch[i].idx] = batch[i].rpath;
+			continue;
+		}
+
+		if (rv && batch[i].added)
+			redirfs_rem_path(filter, batch[i].rpath);
+
+		rfs_path_put(batch[i].rpath);
+	}
+
+	kfree(batch);
+
+	return rv;
+}
+
 int redirfs_rem_path(redirfs_filter filter, redirfs_path path)
 {
 	struct rfs_path *rpath = (struct rfs_path *)path;
@@ -643,10 +885,155 @@ int rfs_path_get_info(struct rfs_flt *rflt, char *buf, int size)
 	return len;
 }
 
+int rfs_path_get_lazy_info(struct rfs_flt *rflt, char *buf, int size)
+{
+	struct rfs_path *rpath;
+	char state;
+	int len = 0;
+
+	rfs_mutex_lock(&rfs_path_mutex);
+
+	list_for_each_entry(rpath, &rfs_path_list, list) {
+		if (rfs_chain_find(rpath->rinch, rflt) == -1)
+			continue;
+
+		if (rpath->rroot->lazy == RFS_ROOT_LAZY_PENDING)
+			state = 'p';
+
+		else if (rpath->rroot->lazy == RFS_ROOT_LAZY_DONE)
+			state = 'd';
+
+		else
+			continue;
+
+		len += snprintf(buf + len, size - len, "%d:%c:%lu",
+				rpath->id, state, rpath->rroot->lazy_nr) + 1;
+
+		if (len >= size) {
+			len = size;
+			break;
+		}
+	}
+
+	rfs_mutex_unlock(&rfs_path_mutex);
+
+	return len;
+}
+
+/*
+ * The first record holds the number of data attached by the filter, the
+ * following ones the number of rdentries and their size for the roots of
+ * the filter's included paths. Paths in the same root share its numbers.
+ */
+int rfs_path_get_mem_info(struct rfs_flt *rflt, char *buf, int size)
+{
+	struct rfs_path *rpath;
+	int nr;
+	int len;
+
+	len = snprintf(buf, size, "data:%d", atomic_read(&rflt->data_nr)) + 1;
+	if (len >= size)
+		return size;
+
+	rfs_mutex_lock(&rfs_path_mutex);
+
+	list_for_each_entry(rpath, &rfs_path_list, list) {
+		if (rfs_chain_find(rpath->rinch, rflt) == -1)
+			continue;
+
+		nr = atomic_read(&rpath->rroot->rdentries_nr);
+		len += snprintf(buf + len, size - len, "%d:%d:%lu", rpath->id,
+				nr, (unsigned long)nr *
+				sizeof(struct rfs_dentry)) + 1;
+
+		if (len >= size) {
+			len = size;
+			break;
+		}
+	}
+
+	rfs_mutex_unlock(&rfs_path_mutex);
+
+	return len;
+}
+
+/*
+ * Everything a control tool needs about the filter in one read. The first
+ * record holds the priority and the active state, the following ones the
+ * type, id, number of rdentries in the root, lazy walk state and number of
+ * dentries attached by the lazy walk and the name of each path. The name
+ * goes last so it may contain any character except the NUL. A snapshot
+ * which does not fit into the buffer is refused with -EFBIG, a cut one
+ * would silently miss paths.
+ */
+int rfs_path_get_snapshot_info(struct rfs_flt *rflt, char *buf, int size)
+{
+	struct rfs_path *rpath;
+	char *path;
+	char state;
+	char type;
+	int len;
+	int rv = 0;
+
+	len = snprintf(buf, size, "%d:%d", rflt->priority,
+			atomic_read(&rflt->active)) + 1;
+	if (len > size)
+		return -EFBIG;
+
+	path = kzalloc(sizeof(char) * PAGE_SIZE, GFP_KERNEL);
+	if (!path)
+		return -ENOMEM;
+
+	rfs_mutex_lock(&rfs_path_mutex);
+
+	list_for_each_entry(rpath, &rfs_path_list, list) {
+		if (rfs_chain_find(rpath->rinch, rflt) != -1)
+			type = 'i';
+
+		else if (rfs_chain_find(rpath->rexch, rflt) != -1)
+			type = 'e';
+
+		else
+			continue;
+
+		if (rpath->rroot->lazy == RFS_ROOT_LAZY_PENDING)
+			state = 'p';
+
+		else if (rpath->rroot->lazy == RFS_ROOT_LAZY_DONE)
+			state = 'd';
+
+		else
+			state = 'n';
+
+		rv = redirfs_get_filename(rpath->mnt, rpath->dentry, path,
+				PAGE_SIZE);
+		if (rv)
+			break;
+
+		len += snprintf(buf + len, size - len, "%c:%d:%d:%c:%lu:%s",
+				type, rpath->id,
+				atomic_read(&rpath->rroot->rdentries_nr),
+				state, rpath->rroot->lazy_nr, path) + 1;
+
+		if (len > size) {
+			rv = -EFBIG;
+			break;
+		}
+	}
+
+	rfs_mutex_unlock(&rfs_path_mutex);
+	kfree(path);
+
+	if (rv)
+		return rv;
+
+	return len;
+}
+
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,25))
 
-int redirfs_get_filename(struct vfsmount *mnt, struct dentry *dentry, char *buf,
-		int size)
+static int rfs_get_filename(struct vfsmount *mnt, struct dentry *dentry,
+		char *buf, int size)
 {
 	char *fn;
 	size_t len;
@@ -663,8 +1050,8 @@ int redirfs_get_filename(struct vfsmount *mnt, struct dentry *dentry, char *buf,
 
 #else
 
-int redirfs_get_filename(struct vfsmount *mnt, struct dentry *dentry, char *buf,
-		int size)
+static int rfs_get_filename(struct vfsmount *mnt, struct dentry *dentry,
+		char *buf, int size)
 {
 	struct path path;
 	char *fn;	
@@ -684,6 +1071,29 @@ int redirfs_get_filename(struct vfsmount *mnt, struct dentry *dentry, char *buf,
 
 #endif
 
+int redirfs_get_filename(struct vfsmount *mnt, struct dentry *dentry, char *buf,
+		int size)
+{
+	struct rfs_dentry *rdentry;
+	struct rfs_name_seq seq;
+	int rv;
+
+	rdentry = rfs_dentry_find(dentry);
+	if (!rdentry)
+		return rfs_get_filename(mnt, dentry, buf, size);
+
+	rv = rfs_name_get(rdentry, mnt, buf, size, &seq);
+	if (rv != -ENOENT)
+		goto exit;
+
+	rv = rfs_get_filename(mnt, dentry, buf, size);
+	if (!rv)
+		rfs_name_set(rdentry, mnt, buf, &seq);
+exit:
+	rfs_dentry_put(rdentry);
+	return rv;
+}
+
 static int rfs_fsrename_rem_rroot(struct rfs_root *rroot,
 		struct rfs_chain *rchain)
 {
@@ -909,6 +1319,43 @@ exit:
 	return rv;
 }
 
+/*
+ * Cross-directory renames are done with the s_vfs_rename_mutex of the super
+ * block held, so no path on it can be added or removed meanwhile. If both
+ * sides resolve to the same root there is nothing to change and the
+ * rename does not have to serialize on rfs_path_mutex at all.
+ */
+static int rfs_fsrename_same_rroot(struct dentry *old_dentry,
+		struct inode *new_dir)
+{
+	struct rfs_root *rroot_src = NULL;
+	struct rfs_root *rroot_dst = NULL;
+	struct rfs_inode *rinode;
+	struct rfs_dentry *rdentry;
+	struct rfs_info *rinfo;
+	int idx;
+
+	rinode = rfs_inode_find(new_dir);
+	rdentry = rfs_dentry_find(old_dentry);
+	idx = rfs_info_read_lock();
+
+	rinfo = rfs_inode_rcu_rinfo(rinode);
+	if (rinfo->rchain)
+		rroot_dst = rinfo->rroot;
+
+	if (rdentry) {
+		rinfo = rfs_dentry_rcu_rinfo(rdentry);
+		if (rinfo->rchain)
+			rroot_src = rinfo->rroot;
+	}
+
+	rfs_info_read_unlock(idx);
+	rfs_dentry_put(rdentry);
+	rfs_inode_put(rinode);
+
+	return rroot_src == rroot_dst;
+}
+
 int rfs_fsrename(struct inode *old_dir, struct dentry *old_dentry,
 		struct inode *new_dir, struct dentry *new_dentry)
 {
@@ -921,6 +1368,9 @@ int rfs_fsrename(struct inode *old_dir, struct dentry *old_dentry,
 	if (old_dir == new_dir)
 		return 0;
 
+	if (rfs_fsrename_same_rroot(old_dentry, new_dir))
+		return 0;
+
 	rfs_mutex_lock(&rfs_path_mutex);
 
 	rinode = rfs_inode_find(new_dir);
@@ -961,6 +1411,7 @@ EXPORT_SYMBOL(redirfs_put_paths);
 EXPORT_SYMBOL(redirfs_get_path_info);
 EXPORT_SYMBOL(redirfs_put_path_info);
 EXPORT_SYMBOL(redirfs_add_path);
+EXPORT_SYMBOL(redirfs_add_paths);
 EXPORT_SYMBOL(redirfs_rem_path);
 EXPORT_SYMBOL(redirfs_rem_paths);
 EXPORT_SYMBOL(redirfs_get_filename);
@@ -0,0 +1,101 @@
+/*
+ * RedirFS: Redirecting File System
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rfs.h"
+
+#define RFS_PCOUNT_BIAS (1 << 30)
+
+/*
+ * Reference counter for long living, read mostly objects (filters and
+ * roots). While the object is alive the references are counted in per cpu
+ * counters and the atomic part holds only the initial reference of the
+ * owner. Before the owner drops its reference the counter has to be
+ * switched to the atomic mode by rfs_pcount_atomic. Only in the atomic mode
+ * the counter can reach zero and its value can be read.
+ */
+
+int rfs_pcount_init(struct rfs_pcount *pc)
+{
+	int cpu;
+
+	pc->pcpu = alloc_percpu(int);
+	if (!pc->pcpu)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(pc->pcpu, cpu) = 0;
+
+	atomic_set(&pc->count, 1);
+	pc->state = RFS_PCOUNT_PERCPU;
+
+	return 0;
+}
+
+void rfs_pcount_free(struct rfs_pcount *pc)
+{
+	free_percpu(pc->pcpu);
+	pc->pcpu = NULL;
+}
+
+void rfs_pcount_atomic(struct rfs_pcount *pc)
+{
+	int sum = 0;
+	int cpu;
+
+	might_sleep();
+
+	if (pc->state != RFS_PCOUNT_PERCPU)
+		return;
+
+	/*
+	 * References taken in the per cpu mode can be dropped in the atomic
+	 * part before the per cpu counters are summed up. The bias keeps the
+	 * atomic part from reaching zero meanwhile.
+	 */
+	atomic_add(RFS_PCOUNT_BIAS, &pc->count);
+	smp_wmb();
+	pc->state = RFS_PCOUNT_DRAIN;
+	smp_wmb();
+
+	/*
+	 * Wait until all rfs_pcount_get and rfs_pcount_put calls which still
+	 * see the per cpu mode are done.
+	 */
+	synchronize_sched();
+
+	for_each_possible_cpu(cpu) {
+		sum += *per_cpu_ptr(pc->pcpu, cpu);
+		*per_cpu_ptr(pc->pcpu, cpu) = 0;
+	}
+
+	atomic_add(sum - RFS_PCOUNT_BIAS, &pc->count);
+	smp_wmb();
+	pc->state = RFS_PCOUNT_ATOMIC;
+}
+
+void rfs_pcount_percpu(struct rfs_pcount *pc)
+{
+	BUG_ON(!atomic_read(&pc->count));
+	smp_wmb();
+	pc->state = RFS_PCOUNT_PERCPU;
+}
@@ -24,7 +24,70 @@
 #include "rfs.h"
 
 LIST_HEAD(rfs_root_list);
+static struct hlist_head rfs_root_table[1 << RFS_PATH_HASH_BITS];
 LIST_HEAD(rfs_root_walk_list);
+atomic_t rfs_root_lazy_nr = ATOMIC_INIT(0);
+
+/*
+ * Lazy include path. Only the root dentry is attached when the path is
+ * added and the rest of the cached subtree is attached on demand by
+ * rfs_dcache_lazy_subs. The remaining cached dentries are attached in
+ * the background in RFS_ROOT_LAZY_CHUNK steps, rfs_path_mutex is dropped
+ * between the steps.
+ */
+static void rfs_root_lazy_walk(struct rfs_root *rroot)
+{
+	struct super_block *sb = rroot->dentry->d_sb;
+	struct rfs_dcache_data *rdata;
+	struct rfs_info *rinfo;
+	int rv;
+
+	rfs_rename_lock(sb);
+	rfs_mutex_lock(&rfs_path_mutex);
+
+	do {
+		if (rroot->lazy != RFS_ROOT_LAZY_PENDING)
+			break;
+
+		rinfo = rfs_info_get(rroot->rinfo);
+		if (!rinfo)
+			break;
+
+		rdata = rfs_dcache_data_alloc(rroot->dentry, rinfo, NULL);
+		if (IS_ERR(rdata)) {
+			rfs_info_put(rinfo);
+			break;
+		}
+
+		rroot->lazy_nr = 0;
+		rv = rfs_dcache_walk(rroot->dentry, rfs_dcache_lazy, rdata);
+
+		rfs_dcache_data_free(rdata);
+		rfs_info_put(rinfo);
+
+	} while (rv == -EAGAIN);
+
+	if (rroot->lazy == RFS_ROOT_LAZY_PENDING) {
+		rroot->lazy = RFS_ROOT_LAZY_DONE;
+		atomic_dec(&rfs_root_lazy_nr);
+	}
+
+	rfs_mutex_unlock(&rfs_path_mutex);
+	rfs_rename_unlock(sb);
+	rfs_root_put(rroot);
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20))
+static void rfs_root_lazy_work_fn(void *data)
+{
+	rfs_root_lazy_walk(data);
+}
+#else
+static void rfs_root_lazy_work_fn(struct work_struct *work)
+{
+	rfs_root_lazy_walk(container_of(work, struct rfs_root, lazy_work));
+}
+#endif
 
 static struct rfs_root *rfs_root_alloc(struct dentry *dentry)
 {
@@ -34,14 +97,25 @@ static struct rfs_root *rfs_root_alloc(struct dentry *dentry)
 	if (!rroot)
 		return ERR_PTR(-ENOMEM);
 
+	if (rfs_pcount_init(&rroot->count)) {
+		kfree(rroot);
+		return ERR_PTR(-ENOMEM);
+	}
+
 	INIT_LIST_HEAD(&rroot->list);
+	INIT_HLIST_NODE(&rroot->hash);
 	INIT_LIST_HEAD(&rroot->walk_list);
 	INIT_LIST_HEAD(&rroot->rpaths);
 	INIT_LIST_HEAD(&rroot->data);
 	rroot->dentry = dentry;
 	rroot->paths_nr = 0;
+	atomic_set(&rroot->rdentries_nr, 0);
 	spin_lock_init(&rroot->lock);
-	atomic_set(&rroot->count, 1);
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20))
+	INIT_WORK(&rroot->lazy_work, rfs_root_lazy_work_fn, rroot);
+#else
+	INIT_WORK(&rroot->lazy_work, rfs_root_lazy_work_fn);
+#endif
 
 	return rroot;
 }
@@ -51,8 +125,7 @@ struct rfs_root *rfs_root_get(struct rfs_root *rroot)
 	if (!rroot || IS_ERR(rroot))
 		return NULL;
 
-	BUG_ON(!atomic_read(&rroot->count));
-	atomic_inc(&rroot->count);
+	rfs_pcount_get(&rroot->count);
 
 	return rroot;
 }
@@ -62,13 +135,14 @@ void rfs_root_put(struct rfs_root *rroot)
 	if (!rroot || IS_ERR(rroot))
 		return;
 
-	BUG_ON(!atomic_read(&rroot->count));
-	if (!atomic_dec_and_test(&rroot->count))
+	if (!rfs_pcount_put(&rroot->count))
 		return;
 
+	rfs_pcount_free(&rroot->count);
 	rfs_chain_put(rroot->rinch);
 	rfs_chain_put(rroot->rexch);
 	rfs_data_remove(&rroot->data);
+	kfree(rroot->ids);
 	kfree(rroot);
 }
 
@@ -76,8 +150,10 @@ static struct rfs_root *rfs_root_find(struct dentry *dentry)
 {
 	struct rfs_root *rroot = NULL;
 	struct rfs_root *found = NULL;
+	struct hlist_node *pos;
 
-	list_for_each_entry(rroot, &rfs_root_list, list) {
+	hlist_for_each_entry(rroot, pos,
+			&rfs_root_table[rfs_path_hashfn(dentry)], hash) {
 		if (rroot->dentry != dentry)
 			continue;
 
@@ -91,12 +167,16 @@ static struct rfs_root *rfs_root_find(struct dentry *dentry)
 static void rfs_root_list_add(struct rfs_root *rroot)
 {
 	list_add_tail(&rroot->list, &rfs_root_list);
+	hlist_add_head(&rroot->hash,
+			&rfs_root_table[rfs_path_hashfn(rroot->dentry)]);
 	rfs_root_get(rroot);
 }
 
 static void rfs_root_list_rem(struct rfs_root *rroot)
 {
 	list_del_init(&rroot->list);
+	hlist_del_init(&rroot->hash);
+	rfs_pcount_atomic(&rroot->count);
 	rfs_root_put(rroot);
 }
 
@@ -138,6 +218,86 @@ struct rfs_root *rfs_root_add(struct dentry *dentry)
 	return rroot;
 }
 
+/*
+ * The ids are allocated before the rinch is changed, with one spare entry
+ * for a filter being included.
+ */
+struct rfs_root_ids *rfs_root_ids_alloc(struct rfs_root *rroot)
+{
+	struct rfs_root_ids *rids;
+	int nr = 1;
+
+	if (rroot->rinch)
+		nr += rroot->rinch->rflts_nr;
+
+	rids = kzalloc(sizeof(struct rfs_root_ids) + nr * sizeof(rids->ids[0]),
+			GFP_KERNEL);
+	if (!rids)
+		return ERR_PTR(-ENOMEM);
+
+	return rids;
+}
+
+static void rfs_root_ids_free(struct rcu_head *head)
+{
+	kfree(container_of(head, struct rfs_root_ids, rcu));
+}
+
+/*
+ * Called with the rfs_path_mutex held after the rinch of the root and of its
+ * paths were updated. Paths sharing the root (bind mounts) are not told
+ * apart, the first one added is used.
+ */
+void rfs_root_ids_set(struct rfs_root *rroot, struct rfs_root_ids *rids)
+{
+	struct rfs_root_ids *rids_old;
+	struct rfs_path *rpath;
+	struct rfs_flt *rflt;
+	int i;
+
+	for (i = 0; rroot->rinch && i < rroot->rinch->rflts_nr; i++) {
+		rflt = rroot->rinch->rflts[i];
+
+		list_for_each_entry(rpath, &rroot->rpaths, rroot_list) {
+			if (rfs_chain_find(rpath->rinch, rflt) == -1)
+				continue;
+
+			rids->ids[rids->nr].rflt = rflt;
+			rids->ids[rids->nr].id = rpath->id;
+			rids->nr++;
+			break;
+		}
+	}
+
+	rids_old = rroot->ids;
+	rcu_assign_pointer(rroot->ids, rids);
+
+	if (rids_old)
+		call_rcu(&rids_old->rcu, rfs_root_ids_free);
+}
+
+static int rfs_root_get_id(struct rfs_root *rroot, struct rfs_flt *rflt)
+{
+	struct rfs_root_ids *rids;
+	int id = -ENOENT;
+	int i;
+
+	rcu_read_lock();
+
+	rids = rcu_dereference(rroot->ids);
+
+	for (i = 0; rids && i < rids->nr; i++) {
+		if (rids->ids[i].rflt == rflt) {
+			id = rids->ids[i].id;
+			break;
+		}
+	}
+
+	rcu_read_unlock();
+
+	return id;
+}
+
 static int rfs_root_flt_num(struct rfs_root *rroot, struct rfs_flt *rflt,
 		int type)
 {
@@ -408,40 +568,61 @@ error:
 	return;
 }
 
+void rfs_root_lazy_begin(struct rfs_root *rroot)
+{
+	if (rroot->lazy == RFS_ROOT_LAZY_PENDING)
+		return;
+
+	rroot->lazy = RFS_ROOT_LAZY_PENDING;
+	rroot->lazy_nr = 0;
+	atomic_inc(&rfs_root_lazy_nr);
+}
+
+void rfs_root_lazy_queue(struct rfs_root *rroot)
+{
+	if (rroot->lazy != RFS_ROOT_LAZY_PENDING)
+		return;
+
+	rfs_root_get(rroot);
+	if (!schedule_work(&rroot->lazy_work))
+		rfs_root_put(rroot);
+}
+
+/*
+ * Called within the rfs_info srcu read side section, so no reference to the
+ * starting rinfo has to be taken.
+ */
 static struct rfs_root *rfs_get_root_flt(struct rfs_flt *rflt,
-		struct rfs_info *rinfo_start)
+		struct rfs_info *rinfo)
 {
+	struct rfs_info *prinfo = NULL;
 	struct rfs_root *rroot = NULL;
-	struct rfs_info *rinfo;
-
-	rinfo = rfs_info_get(rinfo_start);
 
 	while (rinfo) {
 		if (rfs_chain_find(rinfo->rchain, rflt) == -1)
-			goto exit;
+			break;
 
 		rroot = rfs_root_get(rinfo->rroot);
 		if (!rroot)
-			goto exit;
+			break;
 
 		spin_lock(&rroot->lock);
 
 		if (rfs_chain_find(rroot->rinch, rflt) != -1) {
 			spin_unlock(&rroot->lock);
-			goto exit;
-
+			break;
 		}
 
 		spin_unlock(&rroot->lock);
 
-		rfs_info_put(rinfo);
 		rinfo = rfs_info_parent(rroot->dentry);
+		rfs_info_put(prinfo);
+		prinfo = rinfo;
 		rfs_root_put(rroot);
 		rroot = NULL;
 	}
 
-exit:
-	rfs_info_put(rinfo);
+	rfs_info_put(prinfo);
 	return rroot;
 }
 
@@ -449,7 +630,7 @@ redirfs_root redirfs_get_root_file(redirfs_filter filter, struct file *file)
 {
 	struct rfs_root *rroot;
 	struct rfs_file *rfile;
-	struct rfs_info *rinfo;
+	int idx;
 
 	if (!filter || IS_ERR(filter) || !file)
 		return NULL;
@@ -458,11 +639,10 @@ redirfs_root redirfs_get_root_file(redirfs_filter filter, struct file *file)
 	if (!rfile)
 		return NULL;
 
-	rinfo = rfs_dentry_get_rinfo(rfile->rdentry);
-
-	rroot = rfs_get_root_flt(filter, rinfo);
+	idx = rfs_info_read_lock();
+	rroot = rfs_get_root_flt(filter, rfs_dentry_rcu_rinfo(rfile->rdentry));
+	rfs_info_read_unlock(idx);
 
-	rfs_info_put(rinfo);
 	rfs_file_put(rfile);
 	return rroot;
 }
@@ -472,7 +652,7 @@ redirfs_root redirfs_get_root_dentry(redirfs_filter filter,
 {
 	struct rfs_root *rroot;
 	struct rfs_dentry *rdentry;
-	struct rfs_info *rinfo;
+	int idx;
 
 	if (!filter || IS_ERR(filter) || !dentry)
 		return NULL;
@@ -481,20 +661,69 @@ redirfs_root redirfs_get_root_dentry(redirfs_filter filter,
 	if (!rdentry)
 		return NULL;
 
-	rinfo = rfs_dentry_get_rinfo(rdentry);
+	idx = rfs_info_read_lock();
+	rroot = rfs_get_root_flt(filter, rfs_dentry_rcu_rinfo(rdentry));
+	rfs_info_read_unlock(idx);
 
-	rroot = rfs_get_root_flt(filter, rinfo);
-
-	rfs_info_put(rinfo);
 	rfs_dentry_put(rdentry);
 	return rroot;
 }
 
+/*
+ * Id of the filter's path covering the dentry, taken from the ids cached in
+ * the root of its rdentry. Only the rfs_info srcu read lock is taken, so it
+ * is cheap enough for the hot paths like rename. Returns -ENOENT if the
+ * dentry is not under any of the filter's included paths.
+ */
+int redirfs_get_id_dentry(redirfs_filter filter, struct dentry *dentry)
+{
+	struct rfs_dentry *rdentry;
+	struct rfs_info *prinfo = NULL;
+	struct rfs_info *rinfo;
+	int id = -ENOENT;
+	int idx;
+
+	might_sleep();
+
+	if (!filter || IS_ERR(filter) || !dentry)
+		return -EINVAL;
+
+	rdentry = rfs_dentry_find(dentry);
+	if (!rdentry)
+		return -ENOENT;
+
+	idx = rfs_info_read_lock();
+	rinfo = rfs_dentry_rcu_rinfo(rdentry);
+
+	/*
+	 * The filter is inherited from a parent root if it is not included
+	 * in the root of the rdentry itself.
+	 */
+	while (rinfo && rinfo->rroot) {
+		if (rfs_chain_find(rinfo->rchain, filter) == -1)
+			break;
+
+		id = rfs_root_get_id(rinfo->rroot, filter);
+		if (id != -ENOENT)
+			break;
+
+		rinfo = rfs_info_parent(rinfo->rroot->dentry);
+		rfs_info_put(prinfo);
+		prinfo = rinfo;
+	}
+
+	rfs_info_put(prinfo);
+	rfs_info_read_unlock(idx);
+	rfs_dentry_put(rdentry);
+
+	return id;
+}
+
 redirfs_root redirfs_get_root_inode(redirfs_filter filter, struct inode *inode)
 {
 	struct rfs_root *rroot;
 	struct rfs_inode *rinode;
-	struct rfs_info *rinfo;
+	int idx;
 
 	if (!filter || IS_ERR(filter) || !inode)
 		return NULL;
@@ -503,11 +732,10 @@ redirfs_root redirfs_get_root_inode(redirfs_filter filter, struct inode *inode)
 	if (!rinode)
 		return NULL;
 
-	rinfo = rfs_inode_get_rinfo(rinode);
-
-	rroot = rfs_get_root_flt(filter, rinfo);
+	idx = rfs_info_read_lock();
+	rroot = rfs_get_root_flt(filter, rfs_inode_rcu_rinfo(rinode));
+	rfs_info_read_unlock(idx);
 
-	rfs_info_put(rinfo);
 	rfs_inode_put(rinode);
 	return rroot;
 }
@@ -540,6 +768,7 @@ void rfs_root_set_rinfo(struct rfs_root *rroot, struct rfs_info *rinfo)
 
 EXPORT_SYMBOL(redirfs_get_root_file);
 EXPORT_SYMBOL(redirfs_get_root_dentry);
+EXPORT_SYMBOL(redirfs_get_id_dentry);
 EXPORT_SYMBOL(redirfs_get_root_inode);
 EXPORT_SYMBOL(redirfs_get_root_path);
 EXPORT_SYMBOL(redirfs_get_root);
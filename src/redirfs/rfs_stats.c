@@ -0,0 +1,290 @@
+/*
+ * RedirFS: Redirecting File System
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rfs.h"
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32))
+#define CREATE_TRACE_POINTS
+#include "rfs_trace.h"
+#endif
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0))
+struct jump_label_key rfs_stats_key;
+#else
+atomic_t rfs_stats_key = ATOMIC_INIT(0);
+#endif
+
+static atomic_t rfs_trace_nr = ATOMIC_INIT(0);
+
+static RFS_DEFINE_MUTEX(rfs_stats_mutex);
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,16))
+static inline u64 rfs_stats_clock(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+#else
+static inline u64 rfs_stats_clock(void)
+{
+	struct timeval tv;
+
+	do_gettimeofday(&tv);
+
+	return (u64)tv.tv_sec * NSEC_PER_SEC + tv.tv_usec * NSEC_PER_USEC;
+}
+#endif
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0))
+static inline void rfs_stats_key_inc(void)
+{
+	jump_label_inc(&rfs_stats_key);
+}
+
+static inline void rfs_stats_key_dec(void)
+{
+	jump_label_dec(&rfs_stats_key);
+}
+#else
+static inline void rfs_stats_key_inc(void)
+{
+	atomic_inc(&rfs_stats_key);
+}
+
+static inline void rfs_stats_key_dec(void)
+{
+	atomic_dec(&rfs_stats_key);
+}
+#endif
+
+/*
+ * Enabling any redirfs trace event also turns on the stats branch in the
+ * filter chain, so callbacks and operations get timed only while someone
+ * is actually listening.
+ */
+void rfs_trace_reg(void)
+{
+	atomic_inc(&rfs_trace_nr);
+	rfs_stats_key_inc();
+}
+
+void rfs_trace_unreg(void)
+{
+	rfs_stats_key_dec();
+	atomic_dec(&rfs_trace_nr);
+}
+
+void rfs_stats_op_enter(struct rfs_context *rcont, struct redirfs_args *rargs)
+{
+	if (!atomic_read(&rfs_trace_nr))
+		return;
+
+	rcont->start = rfs_stats_clock();
+	trace_redirfs_op_enter(rargs);
+}
+
+void rfs_stats_op_exit(struct rfs_context *rcont, struct redirfs_args *rargs)
+{
+	u64 duration = 0;
+
+	if (!atomic_read(&rfs_trace_nr))
+		return;
+
+	if (rcont->start)
+		duration = rfs_stats_clock() - rcont->start;
+
+	trace_redirfs_op_exit(rargs, duration);
+}
+
+static inline int rfs_stats_bucket(u64 delta)
+{
+	int bucket = 0;
+
+	delta >>= 10;
+
+	while (delta && bucket < RFS_STATS_BUCKETS - 1) {
+		delta >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+enum redirfs_rv rfs_stats_call(struct rfs_flt *rflt,
+		enum redirfs_rv (*cb)(redirfs_context, struct redirfs_args *),
+		struct rfs_context *rcont, struct redirfs_args *rargs)
+{
+	struct rfs_flt_stats *stats;
+	enum redirfs_rv rv;
+	u64 start;
+	u64 delta;
+	int call;
+	int id;
+
+	if (!rflt->stats_on && !atomic_read(&rfs_trace_nr))
+		return cb(rcont, rargs);
+
+	id = rargs->type.id;
+	call = rargs->type.call == REDIRFS_PRECALL ? 0 : 1;
+
+	start = rfs_stats_clock();
+	rv = cb(rcont, rargs);
+	delta = rfs_stats_clock() - start;
+
+	trace_redirfs_flt_call(rflt, rargs, rv, delta);
+
+	if (!rflt->stats_on)
+		return rv;
+
+	smp_rmb();
+
+	stats = per_cpu_ptr(rflt->stats, get_cpu());
+	stats->total[id][call] += delta;
+	stats->hist[id][call][rfs_stats_bucket(delta)]++;
+	put_cpu();
+
+	return rv;
+}
+
+static void rfs_stats_clear(struct rfs_flt_stats *stats)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(stats, cpu), 0,
+				sizeof(struct rfs_flt_stats));
+}
+
+/*
+ * The stats are allocated the first time they are turned on and kept until
+ * the filter is freed, so rfs_stats_call never sees them disappear.
+ */
+int rfs_stats_set(struct rfs_flt *rflt, int on)
+{
+	struct rfs_flt_stats *stats;
+
+	rfs_mutex_lock(&rfs_stats_mutex);
+
+	if (on == rflt->stats_on)
+		goto exit;
+
+	if (on && !rflt->stats) {
+		stats = alloc_percpu(struct rfs_flt_stats);
+		if (!stats) {
+			rfs_mutex_unlock(&rfs_stats_mutex);
+			return -ENOMEM;
+		}
+
+		rfs_stats_clear(stats);
+		rflt->stats = stats;
+		smp_wmb();
+	}
+
+	rflt->stats_on = on;
+
+	if (on)
+		rfs_stats_key_inc();
+	else
+		rfs_stats_key_dec();
+exit:
+	rfs_mutex_unlock(&rfs_stats_mutex);
+
+	return 0;
+}
+
+void rfs_stats_reset(struct rfs_flt *rflt)
+{
+	rfs_mutex_lock(&rfs_stats_mutex);
+
+	if (rflt->stats)
+		rfs_stats_clear(rflt->stats);
+
+	rfs_mutex_unlock(&rfs_stats_mutex);
+}
+
+void rfs_stats_free(struct rfs_flt *rflt)
+{
+	if (rflt->stats_on)
+		rfs_stats_key_dec();
+
+	if (rflt->stats)
+		free_percpu(rflt->stats);
+}
+
+int rfs_stats_get_info(struct rfs_flt *rflt, char *buf, int size)
+{
+	struct rfs_flt_stats *stats;
+	u32 hist[RFS_STATS_BUCKETS];
+	u64 total;
+	u64 nr;
+	int len = 0;
+	int id;
+	int call;
+	int cpu;
+	int i;
+
+	rfs_mutex_lock(&rfs_stats_mutex);
+
+	if (!rflt->stats)
+		goto exit;
+
+	for (id = 0; id < REDIRFS_OP_END; id++) {
+		for (call = 0; call < 2; call++) {
+			memset(hist, 0, sizeof(hist));
+			total = 0;
+			nr = 0;
+
+			for_each_possible_cpu(cpu) {
+				stats = per_cpu_ptr(rflt->stats, cpu);
+				total += stats->total[id][call];
+				for (i = 0; i < RFS_STATS_BUCKETS; i++)
+					hist[i] += stats->hist[id][call][i];
+			}
+
+			for (i = 0; i < RFS_STATS_BUCKETS; i++)
+				nr += hist[i];
+
+			if (!nr)
+				continue;
+
+			len += snprintf(buf + len, size - len, "%d:%c:%llu:%llu",
+					id, call ? 'o' : 'p',
+					(unsigned long long)nr,
+					(unsigned long long)total);
+
+			for (i = 0; i < RFS_STATS_BUCKETS && len < size; i++)
+				len += snprintf(buf + len, size - len, ":%u",
+						hist[i]);
+
+			len++;
+
+			if (len >= size) {
+				len = size;
+				goto exit;
+			}
+		}
+	}
+exit:
+	rfs_mutex_unlock(&rfs_stats_mutex);
+
+	return len;
+}
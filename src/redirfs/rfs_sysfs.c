@@ -30,7 +30,8 @@ static struct rfs_flt *rfs_sysfs_flt_get(struct rfs_flt *rflt)
 {
 	spin_lock(&rflt->lock);
 
-	if (atomic_read(&rflt->count) < 3) {
+	if (rfs_pcount_read(&rflt->count) != -1 &&
+			rfs_pcount_read(&rflt->count) < 3) {
 		spin_unlock(&rflt->lock);
 		return ERR_PTR(-ENOENT);
 	}
@@ -136,6 +137,88 @@ static ssize_t rfs_flt_paths_show(redirfs_filter filter,
 	return rfs_path_get_info(rflt, buf, PAGE_SIZE);
 }
 
+static ssize_t rfs_flt_lazy_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	struct rfs_flt *rflt = filter;
+
+	return rfs_path_get_lazy_info(rflt, buf, PAGE_SIZE);
+}
+
+static ssize_t rfs_flt_memory_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	struct rfs_flt *rflt = filter;
+
+	return rfs_path_get_mem_info(rflt, buf, PAGE_SIZE);
+}
+
+static ssize_t rfs_flt_snapshot_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	struct rfs_flt *rflt = filter;
+
+	return rfs_path_get_snapshot_info(rflt, buf, PAGE_SIZE);
+}
+
+static ssize_t rfs_flt_stats_show(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, char *buf)
+{
+	struct rfs_flt *rflt = filter;
+
+	return rfs_stats_get_info(rflt, buf, PAGE_SIZE);
+}
+
+static ssize_t rfs_flt_stats_store(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, const char *buf,
+		size_t count)
+{
+	struct rfs_flt *rflt = filter;
+	int on;
+	int rv;
+
+	if (sscanf(buf, "%d", &on) != 1)
+		return -EINVAL;
+
+	rv = rfs_stats_set(rflt, on ? 1 : 0);
+	if (rv)
+		return rv;
+
+	return count;
+}
+
+static ssize_t rfs_flt_stats_reset_store(redirfs_filter filter,
+		struct redirfs_filter_attribute *attr, const char *buf,
+		size_t count)
+{
+	struct rfs_flt *rflt = filter;
+	int reset;
+
+	if (sscanf(buf, "%d", &reset) != 1)
+		return -EINVAL;
+
+	if (reset != 1)
+		return -EINVAL;
+
+	rfs_stats_reset(rflt);
+
+	return count;
+}
+
+static int rfs_flt_paths_type(char type)
+{
+	if (type == 'i')
+		return REDIRFS_PATH_INCLUDE;
+
+	if (type == 'l')
+		return REDIRFS_PATH_INCLUDE | REDIRFS_PATH_LAZY;
+
+	if (type == 'e')
+		return REDIRFS_PATH_EXCLUDE;
+
+	return 0;
+}
+
 static int rfs_flt_paths_add(redirfs_filter filter, const char *buf,
 		size_t count)
 {
@@ -156,13 +239,8 @@ static int rfs_flt_paths_add(redirfs_filter filter, const char *buf,
 		return -EINVAL;
 	}
 
-	if (type == 'i')
-		info.flags = REDIRFS_PATH_INCLUDE;
-
-	else if (type == 'e')
-		info.flags = REDIRFS_PATH_EXCLUDE;
-
-	else {
+	info.flags = rfs_flt_paths_type(type);
+	if (!info.flags) {
 		kfree(path);
 		return -EINVAL;
 	}
@@ -191,6 +269,96 @@ static int rfs_flt_paths_add(redirfs_filter filter, const char *buf,
 	return rv;
 }
 
+/*
+ * Batch of paths in the "b\n<type>:<path>\n<type>:<path>..." format added
+ * at once by redirfs_add_paths. Filters with their own add_path operation
+ * still get the paths one by one.
+ */
+static int rfs_flt_paths_add_batch(redirfs_filter filter, const char *buf,
+		size_t count)
+{
+	struct rfs_flt *rflt = filter;
+	struct redirfs_path_info *infos;
+	struct nameidata *nds;
+	char *paths;
+	char *path;
+	char *next;
+	int nr = 0;
+	int i = 0;
+	int rv = 0;
+
+	paths = kzalloc(sizeof(char) * (count + 1), GFP_KERNEL);
+	if (!paths)
+		return -ENOMEM;
+
+	memcpy(paths, buf, count);
+	next = paths;
+
+	if (*next++ != 'b' || *next++ != '\n') {
+		kfree(paths);
+		return -EINVAL;
+	}
+
+	for (path = next; *path; path++) {
+		if (*path == '\n')
+			nr++;
+	}
+	nr++;
+
+	infos = kzalloc(sizeof(struct redirfs_path_info) * nr, GFP_KERNEL);
+	nds = kzalloc(sizeof(struct nameidata) * nr, GFP_KERNEL);
+	if (!infos || !nds) {
+		rv = -ENOMEM;
+		goto exit;
+	}
+
+	while ((path = strsep(&next, "\n"))) {
+		if (!*path)
+			continue;
+
+		if (strlen(path) < 3 || path[1] != ':') {
+			rv = -EINVAL;
+			goto exit;
+		}
+
+		infos[i].flags = rfs_flt_paths_type(path[0]);
+		if (!infos[i].flags) {
+			rv = -EINVAL;
+			goto exit;
+		}
+
+		rv = rfs_path_lookup(path + 2, &nds[i]);
+		if (rv)
+			goto exit;
+
+		infos[i].dentry = rfs_nameidata_dentry(&nds[i]);
+		infos[i].mnt = rfs_nameidata_mnt(&nds[i]);
+		i++;
+	}
+
+	if (!i) {
+		rv = -EINVAL;
+		goto exit;
+	}
+
+	if (!rflt->ops || !rflt->ops->add_path) {
+		rv = redirfs_add_paths(filter, infos, i, NULL);
+		goto exit;
+	}
+
+	for (nr = 0; nr < i && !rv; nr++)
+		rv = rflt->ops->add_path(&infos[nr]);
+exit:
+	while (i--)
+		rfs_nameidata_put(&nds[i]);
+
+	kfree(nds);
+	kfree(infos);
+	kfree(paths);
+
+	return rv;
+}
+
 static int rfs_flt_paths_rem(redirfs_filter filter, const char *buf,
 		size_t count)
 {
@@ -305,6 +473,9 @@ static ssize_t rfs_flt_paths_store(redirfs_filter filter,
 	if (*buf == 'a')
 		rv = rfs_flt_paths_add(filter, buf, count);
 
+	else if (*buf == 'b')
+		rv = rfs_flt_paths_add_batch(filter, buf, count);
+
 	else if (*buf == 'r')
 		rv = rfs_flt_paths_rem(filter, buf, count);
 
@@ -359,6 +530,23 @@ static struct redirfs_filter_attribute rfs_flt_paths_attr =
 	REDIRFS_FILTER_ATTRIBUTE(paths, 0644, rfs_flt_paths_show,
 			rfs_flt_paths_store);
 
+static struct redirfs_filter_attribute rfs_flt_lazy_attr =
+	REDIRFS_FILTER_ATTRIBUTE(lazy, 0444, rfs_flt_lazy_show, NULL);
+
+static struct redirfs_filter_attribute rfs_flt_memory_attr =
+	REDIRFS_FILTER_ATTRIBUTE(memory, 0444, rfs_flt_memory_show, NULL);
+
+static struct redirfs_filter_attribute rfs_flt_snapshot_attr =
+	REDIRFS_FILTER_ATTRIBUTE(snapshot, 0444, rfs_flt_snapshot_show, NULL);
+
+static struct redirfs_filter_attribute rfs_flt_stats_attr =
+	REDIRFS_FILTER_ATTRIBUTE(stats, 0644, rfs_flt_stats_show,
+			rfs_flt_stats_store);
+
+static struct redirfs_filter_attribute rfs_flt_stats_reset_attr =
+	REDIRFS_FILTER_ATTRIBUTE(stats_reset, 0200, NULL,
+			rfs_flt_stats_reset_store);
+
 static struct redirfs_filter_attribute rfs_flt_unregister_attr = 
 	REDIRFS_FILTER_ATTRIBUTE(unregister, 0200, NULL,
 			rfs_flt_unregister_store);
@@ -367,6 +555,11 @@ static struct attribute *rfs_flt_attrs[] = {
 	&rfs_flt_priority_attr.attr,
 	&rfs_flt_active_attr.attr,
 	&rfs_flt_paths_attr.attr,
+	&rfs_flt_lazy_attr.attr,
+	&rfs_flt_memory_attr.attr,
+	&rfs_flt_snapshot_attr.attr,
+	&rfs_flt_stats_attr.attr,
+	&rfs_flt_stats_reset_attr.attr,
 	&rfs_flt_unregister_attr.attr,
 	NULL
 };
@@ -586,8 +779,19 @@ err_kobj:
 #else
 static struct kobject *rfs_kobj;
 
+static ssize_t rfs_memory_show(struct kobject *kobj,
+		struct kobj_attribute *attr, char *buf)
+{
+	return rfs_mem_get_info(buf, PAGE_SIZE);
+}
+
+static struct kobj_attribute rfs_memory_attr =
+	__ATTR(memory, 0444, rfs_memory_show, NULL);
+
 int rfs_sysfs_create(void)
 {
+	int rv;
+
 	rfs_kobj = kobject_create_and_add("redirfs", fs_kobj);
 	if (!rfs_kobj)
 		return -ENOMEM;
@@ -598,6 +802,13 @@ int rfs_sysfs_create(void)
 		return -ENOMEM;
 	}
 
+	rv = sysfs_create_file(rfs_kobj, &rfs_memory_attr.attr);
+	if (rv) {
+		kset_unregister(rfs_flt_kset);
+		kobject_put(rfs_kobj);
+		return rv;
+	}
+
 	return 0;
 }
 #endif
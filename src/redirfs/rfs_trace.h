@@ -0,0 +1,117 @@
+/*
+ * RedirFS: Redirecting File System
+ * Written by Frantisek Hrbata <frantisek.hrbata@redirfs.org>
+ *
+ * Copyright 2008 - 2010 Frantisek Hrbata
+ * All rights reserved.
+ *
+ * This file is part of RedirFS.
+ *
+ * RedirFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RedirFS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RedirFS. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM redirfs
+
+#if !defined(_RFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _RFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT_FN(redirfs_op_enter,
+
+	TP_PROTO(struct redirfs_args *rargs),
+
+	TP_ARGS(rargs),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(unsigned long, ino)
+	),
+
+	TP_fast_assign(
+		__entry->id = rargs->type.id;
+		__entry->ino = rfs_args_ino(rargs);
+	),
+
+	TP_printk("op=%d ino=%lu", __entry->id, __entry->ino),
+
+	rfs_trace_reg, rfs_trace_unreg
+);
+
+TRACE_EVENT_FN(redirfs_op_exit,
+
+	TP_PROTO(struct redirfs_args *rargs, u64 duration),
+
+	TP_ARGS(rargs, duration),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(unsigned long, ino)
+		__field(u64, duration)
+	),
+
+	TP_fast_assign(
+		__entry->id = rargs->type.id;
+		__entry->ino = rfs_args_ino(rargs);
+		__entry->duration = duration;
+	),
+
+	TP_printk("op=%d ino=%lu duration=%llu", __entry->id, __entry->ino,
+		(unsigned long long)__entry->duration),
+
+	rfs_trace_reg, rfs_trace_unreg
+);
+
+TRACE_EVENT_FN(redirfs_flt_call,
+
+	TP_PROTO(struct rfs_flt *rflt, struct redirfs_args *rargs,
+		enum redirfs_rv rv, u64 duration),
+
+	TP_ARGS(rflt, rargs, rv, duration),
+
+	TP_STRUCT__entry(
+		__string(name, rflt->name)
+		__field(int, id)
+		__field(int, call)
+		__field(unsigned long, ino)
+		__field(int, rv)
+		__field(u64, duration)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, rflt->name);
+		__entry->id = rargs->type.id;
+		__entry->call = rargs->type.call;
+		__entry->ino = rfs_args_ino(rargs);
+		__entry->rv = rv;
+		__entry->duration = duration;
+	),
+
+	TP_printk("filter=%s op=%d call=%s ino=%lu rv=%s duration=%llu",
+		__get_str(name), __entry->id,
+		__entry->call == REDIRFS_PRECALL ? "pre" : "post",
+		__entry->ino,
+		__entry->rv == REDIRFS_STOP ? "stop" : "continue",
+		(unsigned long long)__entry->duration),
+
+	rfs_trace_reg, rfs_trace_unreg
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE rfs_trace
+#include <trace/define_trace.h>
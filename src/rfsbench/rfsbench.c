@@ -0,0 +1,430 @@
+/*
+ *          Copyright Frantisek Hrbata 2008 - 2012.
+ * Distributed under the Boost Software License, Version 1.0.
+ *    (See accompanying file LICENSE_1_0.txt or copy at
+ *          http://www.boost.org/LICENSE_1_0.txt)
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+static const char *version = "0.1";
+
+struct bench_thread {
+	pthread_t thread;
+	int idx;
+	char dir[PATH_MAX];
+	char **files;
+	char **misses;
+	char ren[2][PATH_MAX];
+	unsigned long *lat;
+	unsigned long long start;
+	unsigned long long end;
+	int err;
+};
+
+struct bench_op {
+	const char *name;
+	int (*run)(struct bench_thread *bt, int i);
+};
+
+static const char *root;
+static int nr_files = 64;
+static int nr_iters = 100000;
+static struct bench_op *op;
+static pthread_barrier_t barrier;
+
+static unsigned long long bench_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_open(struct bench_thread *bt, int i)
+{
+	int fd;
+
+	fd = open(bt->files[i % nr_files], O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	return close(fd);
+}
+
+static int bench_stat(struct bench_thread *bt, int i)
+{
+	struct stat st;
+
+	return stat(bt->files[i % nr_files], &st);
+}
+
+static int bench_lookupmiss(struct bench_thread *bt, int i)
+{
+	struct stat st;
+
+	if (!stat(bt->misses[i % nr_files], &st)) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	return errno == ENOENT ? 0 : -1;
+}
+
+static int bench_readdir(struct bench_thread *bt, int i)
+{
+	struct dirent *de;
+	DIR *dir;
+
+	dir = opendir(bt->dir);
+	if (!dir)
+		return -1;
+
+	errno = 0;
+	do {
+		de = readdir(dir);
+	} while (de);
+
+	if (errno) {
+		closedir(dir);
+		return -1;
+	}
+
+	return closedir(dir);
+}
+
+static int bench_rename(struct bench_thread *bt, int i)
+{
+	/* moves the file between two directories to exercise the root
+	 * lookups redirfs does when a dentry changes its parent */
+	return rename(bt->ren[i & 1], bt->ren[!(i & 1)]);
+}
+
+static struct bench_op bench_ops[] = {
+	{"open", bench_open},
+	{"stat", bench_stat},
+	{"lookupmiss", bench_lookupmiss},
+	{"readdir", bench_readdir},
+	{"rename", bench_rename},
+	{NULL, NULL}
+};
+
+static char *bench_path(const char *dir, const char *fmt, int i)
+{
+	char *path;
+
+	int len;
+
+	path = malloc(PATH_MAX);
+	if (!path)
+		return NULL;
+
+	len = snprintf(path, PATH_MAX, "%s/", dir);
+	if (len < PATH_MAX)
+		len += snprintf(path + len, PATH_MAX - len, fmt, i);
+
+	if (len >= PATH_MAX) {
+		free(path);
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	return path;
+}
+
+static int bench_name(char *path, const char *dir, const char *name)
+{
+	if (snprintf(path, PATH_MAX, "%s/%s", dir, name) < PATH_MAX)
+		return 0;
+
+	errno = ENAMETOOLONG;
+	return -1;
+}
+
+static int bench_setup(struct bench_thread *bt)
+{
+	char sub[PATH_MAX];
+	int fd;
+	int i;
+
+	if (snprintf(bt->dir, PATH_MAX, "%s/rfsbench.%d", root,
+				bt->idx) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if (bench_name(sub, bt->dir, "sub") ||
+	    bench_name(bt->ren[0], bt->dir, "ren") ||
+	    bench_name(bt->ren[1], sub, "ren"))
+		return -1;
+
+	if (mkdir(bt->dir, 0755) && errno != EEXIST)
+		return -1;
+
+	if (mkdir(sub, 0755) && errno != EEXIST)
+		return -1;
+
+	unlink(bt->ren[1]);
+	fd = open(bt->ren[0], O_RDONLY | O_CREAT, 0644);
+	if (fd == -1)
+		return -1;
+
+	close(fd);
+
+	bt->files = calloc(nr_files, sizeof(char *));
+	bt->misses = calloc(nr_files, sizeof(char *));
+	bt->lat = calloc(nr_iters, sizeof(unsigned long));
+	if (!bt->files || !bt->misses || !bt->lat)
+		return -1;
+
+	for (i = 0; i < nr_files; i++) {
+		bt->files[i] = bench_path(bt->dir, "file%d", i);
+		bt->misses[i] = bench_path(bt->dir, "miss%d", i);
+		if (!bt->files[i] || !bt->misses[i])
+			return -1;
+
+		fd = open(bt->files[i], O_RDONLY | O_CREAT, 0644);
+		if (fd == -1)
+			return -1;
+
+		close(fd);
+	}
+
+	return 0;
+}
+
+static void *bench_thread(void *data)
+{
+	struct bench_thread *bt = data;
+	unsigned long long t;
+	int i;
+
+	pthread_barrier_wait(&barrier);
+
+	bt->start = bench_clock();
+
+	for (i = 0; i < nr_iters; i++) {
+		t = bench_clock();
+		if (op->run(bt, i)) {
+			bt->err = errno;
+			break;
+		}
+		bt->lat[i] = bench_clock() - t;
+	}
+
+	bt->end = bench_clock();
+
+	return NULL;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int bench_run(struct bench_thread *bts, int nr)
+{
+	unsigned long long start = ~0ULL;
+	unsigned long long end = 0;
+	unsigned long *lat;
+	double secs;
+	size_t total;
+	int rv;
+	int i;
+
+	rv = pthread_barrier_init(&barrier, NULL, nr);
+	if (rv) {
+		fprintf(stderr, "pthread_barrier_init failed: %d\n", rv);
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		bts[i].err = 0;
+		rv = pthread_create(&bts[i].thread, NULL, bench_thread,
+				&bts[i]);
+		if (rv) {
+			fprintf(stderr, "pthread_create failed: %d\n", rv);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		rv = pthread_join(bts[i].thread, NULL);
+		if (rv) {
+			fprintf(stderr, "pthread_join failed: %d\n", rv);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pthread_barrier_destroy(&barrier);
+
+	total = (size_t)nr * nr_iters;
+	lat = malloc(total * sizeof(unsigned long));
+	if (!lat) {
+		perror("malloc failed");
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (bts[i].err) {
+			fprintf(stderr, "%s failed in thread %d: %s\n",
+					op->name, i, strerror(bts[i].err));
+			free(lat);
+			return -1;
+		}
+
+		if (bts[i].start < start)
+			start = bts[i].start;
+
+		if (bts[i].end > end)
+			end = bts[i].end;
+
+		memcpy(lat + (size_t)i * nr_iters, bts[i].lat,
+				nr_iters * sizeof(unsigned long));
+	}
+
+	qsort(lat, total, sizeof(unsigned long), bench_cmp);
+
+	secs = (double)(end - start) / 1000000000.0;
+	printf("%-10s %4d %14.0f %10lu %10lu\n", op->name, nr,
+			secs > 0 ? total / secs : 0, lat[total / 2],
+			lat[total * 99 / 100]);
+	fflush(stdout);
+
+	free(lat);
+
+	return 0;
+}
+
+static void usage(void)
+{
+	printf("usage: rfsbench [-t threads] [-s] [-n iterations] "
+			"[-f files] [-o op[,op...]] <dir>\n");
+	printf("	-t maximum number of threads (default: online cpus)\n");
+	printf("	-s scale threads from 1 to the maximum in powers of 2\n");
+	printf("	-n operations per thread (default: %d)\n", nr_iters);
+	printf("	-f files per thread directory (default: %d)\n",
+			nr_files);
+	printf("	-o operations to run: open, stat, lookupmiss, "
+			"readdir, rename (default: all)\n");
+}
+
+static int bench_selected(const char *ops, const char *name)
+{
+	size_t len = strlen(name);
+	const char *s = ops;
+
+	if (!ops)
+		return 1;
+
+	while ((s = strstr(s, name))) {
+		if ((s == ops || s[-1] == ',') &&
+		    (s[len] == ',' || s[len] == '\0'))
+			return 1;
+		s += len;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_thread *bts;
+	const char *ops = NULL;
+	int threads;
+	int scale = 0;
+	int nr;
+	int c;
+	int i;
+
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1)
+		threads = 1;
+
+	while ((c = getopt(argc, argv, "t:sn:f:o:h")) != -1) {
+		switch (c) {
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 's':
+			scale = 1;
+			break;
+		case 'n':
+			nr_iters = atoi(optarg);
+			break;
+		case 'f':
+			nr_files = atoi(optarg);
+			break;
+		case 'o':
+			ops = optarg;
+			break;
+		case 'h':
+			usage();
+			exit(EXIT_SUCCESS);
+		default:
+			usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc - 1 || threads < 1 || nr_iters < 1 ||
+	    nr_files < 1) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
+	root = argv[optind];
+
+	bts = calloc(threads, sizeof(struct bench_thread));
+	if (!bts) {
+		perror("calloc failed");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < threads; i++) {
+		bts[i].idx = i;
+		if (bench_setup(&bts[i])) {
+			fprintf(stderr, "setup of %s/rfsbench.%d failed: %s\n",
+					root, i, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	printf("rfsbench: version %s, dir %s, %d iterations\n", version,
+			root, nr_iters);
+	printf("%-10s %4s %14s %10s %10s\n", "op", "thr", "ops/s",
+			"p50(ns)", "p99(ns)");
+
+	for (op = bench_ops; op->name; op++) {
+		if (!bench_selected(ops, op->name))
+			continue;
+
+		nr = scale ? 1 : threads;
+		for (;;) {
+			if (bench_run(bts, nr))
+				exit(EXIT_FAILURE);
+
+			if (nr == threads)
+				break;
+
+			nr = nr * 2 > threads ? threads : nr * 2;
+		}
+	}
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+#          Copyright Frantisek Hrbata 2008 - 2012.
+# Distributed under the Boost Software License, Version 1.0.
+#    (See accompanying file LICENSE_1_0.txt or copy at
+#          http://www.boost.org/LICENSE_1_0.txt)
+#
+# Runs rfsbench on a tmpfs mount without redirfs filters and then with
+# stacks of benchflt no-op filters attached to it.
+#
+# usage: rfsbench.sh <benchflt.ko> [mount point] [rfsbench options]
+#
+# NRS and MODES environment variables select the filter stacks, e.g.
+#	NRS="0 1 8" MODES="pre both" rfsbench.sh ./benchflt.ko
+
+BENCHFLT=$1
+MNT=${2:-/mnt/rfsbench}
+RFSBENCH=${RFSBENCH:-rfsbench}
+NRS=${NRS:-"0 1 2 4 8 16"}
+MODES=${MODES:-"pre post both"}
+FLT_DIR=/sys/fs/redirfs/filters
+
+if [ -z "$BENCHFLT" ] || [ ! -f "$BENCHFLT" ]; then
+	echo "usage: $0 <benchflt.ko> [mount point] [rfsbench options]"
+	exit 1
+fi
+
+shift
+[ $# -gt 0 ] && shift
+
+ARGS=${*:--s}
+
+mkdir -p $MNT || exit 1
+mount -t tmpfs rfsbench $MNT || exit 1
+trap "umount $MNT" EXIT
+
+echo "=== baseline"
+$RFSBENCH $ARGS $MNT || exit 1
+
+for MODE in $MODES; do
+	for NR in $NRS; do
+		insmod $BENCHFLT nr=$NR mode=$MODE || exit 1
+
+		i=0
+		while [ $i -lt $NR ]; do
+			echo "a:i:$MNT" > $FLT_DIR/benchflt$i/paths || exit 1
+			i=$((i + 1))
+		done
+
+		echo "=== benchflt nr=$NR mode=$MODE"
+		$RFSBENCH $ARGS $MNT
+
+		i=0
+		while [ $i -lt $NR ]; do
+			echo 1 > $FLT_DIR/benchflt$i/unregister
+			i=$((i + 1))
+		done
+
+		rmmod benchflt || exit 1
+	done
+done
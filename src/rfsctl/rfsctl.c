@@ -196,6 +196,7 @@ static int cmd_list(void)
 
 static int cmd_show(void)
 {
+	static const char *lazy[] = {"none", "pending", "done"};
 	struct rfsctl_filter *flt;
 	char *type;
 	int i = 0;
@@ -216,7 +217,15 @@ static int cmd_show(void)
 		else
 			type = "exclude";
 
-		printf("          type : %s\n\n", type);
+		printf("          type : %s\n", type);
+		if (flt->paths[i]->rdentries != -1)
+			printf("          rdentries : %d\n",
+					flt->paths[i]->rdentries);
+		if (flt->paths[i]->lazy != -1)
+			printf("          lazy : %s, %ld attached\n",
+					lazy[flt->paths[i]->lazy],
+					flt->paths[i]->lazy_nr);
+		printf("\n");
 		i++;
 	}
 
@@ -34,43 +34,24 @@ static struct redirfs_filter_info roflt_info = {
 	.active = 1
 };
 
-static enum redirfs_rv roflt_pre_open(redirfs_context context,
-		struct redirfs_args *args)
-{
-	struct file *file = args->args.f_open.file;
-
-	if (file->f_mode & FMODE_WRITE) {
-		args->rv.rv_int = -EROFS;
-		return REDIRFS_STOP;
-	}
-
-	return REDIRFS_CONTINUE;
-}
-
-static enum redirfs_rv roflt_rofs(redirfs_context context,
-		struct redirfs_args *args)
-{
-	args->rv.rv_int = -EROFS;
-	return REDIRFS_STOP;
-}
-
 static struct redirfs_op_info roflt_op_info[] = {
-	{REDIRFS_REG_FOP_OPEN, roflt_pre_open, NULL},
-	{REDIRFS_DIR_IOP_CREATE, roflt_rofs, NULL},
-	{REDIRFS_DIR_IOP_LINK, roflt_rofs, NULL},
-	{REDIRFS_DIR_IOP_UNLINK, roflt_rofs, NULL},
-	{REDIRFS_DIR_IOP_SYMLINK, roflt_rofs, NULL},
-	{REDIRFS_DIR_IOP_MKDIR, roflt_rofs, NULL},
-	{REDIRFS_DIR_IOP_RMDIR, roflt_rofs, NULL},
-	{REDIRFS_DIR_IOP_MKNOD, roflt_rofs, NULL},
-	{REDIRFS_DIR_IOP_RENAME, roflt_rofs, NULL},
-	{REDIRFS_REG_IOP_SETATTR, roflt_rofs, NULL},
-	{REDIRFS_DIR_IOP_SETATTR, roflt_rofs, NULL},
-	{REDIRFS_LNK_IOP_SETATTR, roflt_rofs, NULL},
-	{REDIRFS_CHR_IOP_SETATTR, roflt_rofs, NULL},
-	{REDIRFS_BLK_IOP_SETATTR, roflt_rofs, NULL},
-	{REDIRFS_FIFO_IOP_SETATTR, roflt_rofs, NULL},
-	{REDIRFS_SOCK_IOP_SETATTR, roflt_rofs, NULL},
+	{REDIRFS_REG_FOP_OPEN, NULL, NULL,
+		REDIRFS_RULE_STOP | REDIRFS_RULE_FMODE_WRITE, -EROFS},
+	{REDIRFS_DIR_IOP_CREATE, NULL, NULL, REDIRFS_RULE_STOP, -EROFS},
+	{REDIRFS_DIR_IOP_LINK, NULL, NULL, REDIRFS_RULE_STOP, -EROFS},
+	{REDIRFS_DIR_IOP_UNLINK, NULL, NULL, REDIRFS_RULE_STOP, -EROFS},
+	{REDIRFS_DIR_IOP_SYMLINK, NULL, NULL, REDIRFS_RULE_STOP, -EROFS},
+	{REDIRFS_DIR_IOP_MKDIR, NULL, NULL, REDIRFS_RULE_STOP, -EROFS},
+	{REDIRFS_DIR_IOP_RMDIR, NULL, NULL, REDIRFS_RULE_STOP, -EROFS},
+	{REDIRFS_DIR_IOP_MKNOD, NULL, NULL, REDIRFS_RULE_STOP, -EROFS},
+	{REDIRFS_DIR_IOP_RENAME, NULL, NULL, REDIRFS_RULE_STOP, -EROFS},
+	{REDIRFS_REG_IOP_SETATTR, NULL, NULL, REDIRFS_RULE_STOP, -EROFS},
+	{REDIRFS_DIR_IOP_SETATTR, NULL, NULL, REDIRFS_RULE_STOP, -EROFS},
+	{REDIRFS_LNK_IOP_SETATTR, NULL, NULL, REDIRFS_RULE_STOP, -EROFS},
+	{REDIRFS_CHR_IOP_SETATTR, NULL, NULL, REDIRFS_RULE_STOP, -EROFS},
+	{REDIRFS_BLK_IOP_SETATTR, NULL, NULL, REDIRFS_RULE_STOP, -EROFS},
+	{REDIRFS_FIFO_IOP_SETATTR, NULL, NULL, REDIRFS_RULE_STOP, -EROFS},
+	{REDIRFS_SOCK_IOP_SETATTR, NULL, NULL, REDIRFS_RULE_STOP, -EROFS},
 	{REDIRFS_OP_END, NULL, NULL}
 };
 